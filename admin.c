@@ -0,0 +1,292 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "admin.h"
+#include "stats.h"
+#include "log.h"
+
+#define ADMIN_TOP_TOPICS    20
+#define ADMIN_REQUEST_MAX   1024
+
+// Histogram bucket bounds exported, in ns. The recorded histogram is much
+// finer; each bound counts the samples of every bucket at or below it.
+static const uint64_t latencyBounds[] = {
+    1000, 2000, 5000, 10000, 20000, 50000, 100000, 250000, 500000,
+    1000000, 2500000, 5000000, 10000000, 25000000, 50000000, 100000000,
+    250000000, 500000000, 1000000000ULL, 2500000000ULL, 5000000000ULL, 10000000000ULL
+};
+
+typedef struct adminState_st {
+    int socket;
+    REGISTRY *reg;
+} ADMIN_STATE;
+
+typedef struct textBuf_st {
+    char *data;
+    size_t len;
+    size_t cap;
+    int failed;
+} TEXT_BUF;
+
+static void text_append(TEXT_BUF *t, const char *fmt, ...)
+{
+    if (t->failed)
+        return;
+
+    for (;;)
+    {
+        va_list ap;
+        va_start(ap, fmt);
+        int n = vsnprintf(t->data + t->len, t->cap - t->len, fmt, ap);
+        va_end(ap);
+
+        if (n < 0)
+        {
+            t->failed = 1;
+            return;
+        }
+        if ((size_t)n < t->cap - t->len)
+        {
+            t->len += (size_t)n;
+            return;
+        }
+
+        size_t newCap = t->cap * 2 + (size_t)n;
+        char *data = realloc(t->data, newCap);
+        if (data == NULL)
+        {
+            perror("realloc admin dump");
+            t->failed = 1;
+            return;
+        }
+        t->data = data;
+        t->cap = newCap;
+    }
+}
+
+// Topic names go into label values, which escape '\', '"' and newlines
+static void append_label(TEXT_BUF *t, const char *value)
+{
+    for (const char *p = value; *p; p++)
+    {
+        if (*p == '\\')
+            text_append(t, "\\\\");
+        else if (*p == '"')
+            text_append(t, "\\\"");
+        else if (*p == '\n')
+            text_append(t, "\\n");
+        else
+            text_append(t, "%c", *p);
+    }
+}
+
+static void append_counter(TEXT_BUF *t, const char *name, const char *help, unsigned long long value)
+{
+    text_append(t, "# HELP pubsub_%s_total %s\n# TYPE pubsub_%s_total counter\npubsub_%s_total %llu\n", name, help, name, name, value);
+}
+
+// Adding a counter to stat_counter_t means adding its help text here
+_Static_assert(STAT_COUNT == 21, "every stat_counter_t needs an entry in counterHelp");
+
+static const char *counterHelp[STAT_COUNT] = {
+    [STAT_PUBLISHED]        = "Messages received from publishers.",
+    [STAT_PUBLISHED_BYTES]  = "Payload bytes received from publishers.",
+    [STAT_DELIVERIES]       = "Messages queued for subscribers.",
+    [STAT_DELIVERY_BYTES]   = "Bytes queued for subscribers.",
+    [STAT_FILTERED]         = "Deliveries skipped by a subscription's content filter.",
+    [STAT_DROPPED]          = "New messages dropped on a full subscriber queue.",
+    [STAT_EVICTED]          = "Queued messages dropped to make room for newer ones.",
+    [STAT_BLOCKED]          = "Publishes that waited for room in a full subscriber queue.",
+    [STAT_BLOCKED_NS]       = "Nanoseconds publishes spent waiting for room.",
+    [STAT_OVERFLOW_DISCONNECTS] = "Subscribers disconnected for a full queue.",
+    [STAT_CONFLATED]        = "Queued messages of a conflated topic replaced by a newer one.",
+    [STAT_PARALLEL_FANOUTS] = "Publishes fanned out by the fan-out worker pool.",
+    [STAT_FANOUT_STEALS]    = "Fan-out tasks a worker stole from another worker's deque.",
+    [STAT_SENT_MSGS]        = "Messages completely written to sockets.",
+    [STAT_SENT_BYTES]       = "Bytes written to sockets.",
+    [STAT_SEND_ERRORS]      = "Failed socket writes.",
+    [STAT_CONNECTIONS]      = "Accepted connections.",
+    [STAT_DISCONNECTS]      = "Closed connections.",
+    [STAT_HANDSHAKE_TIMEOUTS] = "Connections closed for not sending their role within --handshake-ms.",
+    [STAT_LOCK_WAITS]       = "Registry shard lock acquisitions that had to wait.",
+    [STAT_LOCK_WAIT_NS]     = "Nanoseconds spent waiting for registry shard locks.",
+};
+
+static void build_dump(TEXT_BUF *t, REGISTRY *reg)
+{
+    STATS_SNAPSHOT *stats = malloc(sizeof(STATS_SNAPSHOT));
+    if (stats == NULL)
+    {
+        perror("malloc stats snapshot");
+        t->failed = 1;
+        return;
+    }
+    stats_collect(stats);
+
+    text_append(t, "# HELP pubsub_uptime_seconds Seconds since the server started.\n# TYPE pubsub_uptime_seconds gauge\npubsub_uptime_seconds %.3f\n", stats->uptime);
+
+    for (int i = 0; i < STAT_COUNT; i++)
+        append_counter(t, stats_name(i), counterHelp[i] ? counterHelp[i] : "Undocumented counter.", stats->counters[i]);
+
+    text_append(t, "# HELP pubsub_fanout_latency_seconds Publish received to last subscriber write.\n# TYPE pubsub_fanout_latency_seconds histogram\n");
+
+    unsigned long long cumulative = 0;
+    size_t bucket = 0;
+    for (size_t b = 0; b < sizeof(latencyBounds) / sizeof(latencyBounds[0]); b++)
+    {
+        while (bucket < STATS_BUCKETS && stats_bucket_value(bucket) <= latencyBounds[b])
+            cumulative += stats->latency[bucket++];
+        text_append(t, "pubsub_fanout_latency_seconds_bucket{le=\"%g\"} %llu\n", latencyBounds[b] / 1e9, cumulative);
+    }
+    while (bucket < STATS_BUCKETS)
+        cumulative += stats->latency[bucket++];
+    text_append(t, "pubsub_fanout_latency_seconds_bucket{le=\"+Inf\"} %llu\n", cumulative);
+    text_append(t, "pubsub_fanout_latency_seconds_sum %.9f\npubsub_fanout_latency_seconds_count %llu\n", stats->latencySum / 1e9, cumulative);
+    free(stats);
+
+    TOPIC *top[ADMIN_TOP_TOPICS];
+    size_t n = registry_top_topics(reg, top, ADMIN_TOP_TOPICS);
+
+    text_append(t, "# HELP pubsub_topic_published_total Messages published per topic (busiest %d topics).\n# TYPE pubsub_topic_published_total counter\n", ADMIN_TOP_TOPICS);
+    for (size_t i = 0; i < n; i++)
+    {
+        text_append(t, "pubsub_topic_published_total{topic=\"");
+        append_label(t, top[i]->name);
+        text_append(t, "\"} %llu\n", atomic_load_explicit(&top[i]->published, memory_order_relaxed));
+    }
+
+    text_append(t, "# HELP pubsub_topic_published_bytes_total Payload bytes published per topic (busiest %d topics).\n# TYPE pubsub_topic_published_bytes_total counter\n", ADMIN_TOP_TOPICS);
+    for (size_t i = 0; i < n; i++)
+    {
+        text_append(t, "pubsub_topic_published_bytes_total{topic=\"");
+        append_label(t, top[i]->name);
+        text_append(t, "\"} %llu\n", atomic_load_explicit(&top[i]->publishedBytes, memory_order_relaxed));
+    }
+}
+
+static int write_all(int socket, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = send(socket, data, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static void serve_request(int conn, REGISTRY *reg)
+{
+    // Tools like "nc -U" may send nothing at all, so only wait briefly
+    struct timeval tv = { 0, 200000 };
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    char request[ADMIN_REQUEST_MAX];
+    ssize_t got = recv(conn, request, sizeof(request), 0);
+    int http = got >= 3 && strncmp(request, "GET", 3) == 0;
+
+    TEXT_BUF dump = { NULL, 0, 0, 0 };
+    dump.cap = 16384;
+    dump.data = malloc(dump.cap);
+    if (dump.data == NULL)
+    {
+        perror("malloc admin dump");
+        return;
+    }
+
+    build_dump(&dump, reg);
+
+    if (!dump.failed)
+    {
+        if (http)
+        {
+            char header[256];
+            int len = snprintf(header, sizeof(header),
+                               "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+                               dump.len);
+            if (write_all(conn, header, (size_t)len) < 0)
+                dump.len = 0;
+        }
+        write_all(conn, dump.data, dump.len);
+    }
+
+    free(dump.data);
+}
+
+static void *admin_thread(void *arg)
+{
+    ADMIN_STATE *state = (ADMIN_STATE *)arg;
+
+    while (1)
+    {
+        int conn = accept(state->socket, NULL, NULL);
+        if (conn < 0)
+        {
+            if (errno != EINTR)
+                perror("accept admin");
+            continue;
+        }
+
+        serve_request(conn, state->reg);
+        close(conn);
+    }
+
+    return NULL;
+}
+
+int admin_start(const char *path, REGISTRY *reg)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Admin socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0)
+    {
+        perror("socket admin");
+        return -1;
+    }
+
+    // A stale socket file of an earlier run would make bind() fail
+    unlink(path);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock, 16) < 0)
+    {
+        perror("bind admin socket");
+        close(sock);
+        return -1;
+    }
+
+    static ADMIN_STATE state;
+    state.socket = sock;
+    state.reg = reg;
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, admin_thread, &state) != 0)
+    {
+        perror("pthread_create admin");
+        close(sock);
+        unlink(path);
+        return -1;
+    }
+    pthread_detach(tid);
+
+    LOG(LOG_INFO, "[INFO] Admin socket listening on %s\n", path);
+    return 0;
+}
@@ -0,0 +1,16 @@
+#ifndef ADMIN_H
+#define ADMIN_H
+
+#include "registry.h"
+
+// Local admin socket (--admin PATH). Every connection to the unix socket
+// gets one dump of the server metrics in the Prometheus text format and is
+// closed. A request starting with "GET" is answered with an HTTP header
+// first, so the socket can be scraped through an HTTP client as well.
+//
+// The dump is built by a thread of its own from the per-thread stats
+// records and the registry, without holding anything the hot path needs.
+
+int admin_start(const char *path, REGISTRY *reg);
+
+#endif // ADMIN_H
@@ -0,0 +1,101 @@
+// Topic lookup benchmark: findTopic() cost as the registry grows.
+// For comparison it also times the linear strcmp walk over the topic list
+// that the registry used before it was hash indexed.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "list.h"
+
+#define LOOKUPS         1000000
+#define LINEAR_MAX      20000       // linear scan gets too slow beyond this
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static TOPIC* linearFind(TOPIC_HEAD *head, const char *name)
+{
+    for (TOPIC *t = head->firstNode; t != NULL; t = t->nextTopic)
+        if (strcmp(t->name, name) == 0)
+            return t;
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t counts[] = { 100, 1000, 10000, 50000, 100000, 500000 };
+    size_t ncounts = sizeof(counts) / sizeof(counts[0]);
+    size_t lookups = argc > 1 ? (size_t)atol(argv[1]) : LOOKUPS;
+
+    printf("%10s %14s %14s %14s\n", "topics", "insert ns/op", "find ns/op", "linear ns/op");
+
+    for (size_t c = 0; c < ncounts; c++)
+    {
+        size_t n = counts[c];
+        TOPIC_HEAD head;
+        initTopic(&head);
+
+        char **names = malloc(n * sizeof(char *));
+        if (!names)
+        {
+            perror("malloc names");
+            return EXIT_FAILURE;
+        }
+
+        char name[64];
+        for (size_t i = 0; i < n; i++)
+        {
+            snprintf(name, sizeof(name), "bench/topic/%zu", i);
+            names[i] = strdup(name);
+        }
+
+        double t0 = now_ns();
+        for (size_t i = 0; i < n; i++)
+            addTopic(&head, createTopic(names[i]));
+        double insert_ns = (now_ns() - t0) / n;
+
+        // Random order so the benchmark is not just walking the cache
+        size_t *order = malloc(lookups * sizeof(size_t));
+        if (!order)
+        {
+            perror("malloc order");
+            return EXIT_FAILURE;
+        }
+        srand(42);
+        for (size_t i = 0; i < lookups; i++)
+            order[i] = (size_t)rand() % n;
+
+        size_t found = 0;
+        t0 = now_ns();
+        for (size_t i = 0; i < lookups; i++)
+            found += findTopic(&head, names[order[i]]) != NULL;
+        double find_ns = (now_ns() - t0) / lookups;
+
+        if (found != lookups)
+            fprintf(stderr, "lookup error: found %zu of %zu\n", found, lookups);
+
+        if (n <= LINEAR_MAX)
+        {
+            size_t linear = lookups / 100;
+            t0 = now_ns();
+            for (size_t i = 0; i < linear; i++)
+                found += linearFind(&head, names[order[i]]) != NULL;
+            double linear_ns = (now_ns() - t0) / linear;
+            printf("%10zu %14.1f %14.1f %14.1f\n", n, insert_ns, find_ns, linear_ns);
+        }
+        else
+            printf("%10zu %14.1f %14.1f %14s\n", n, insert_ns, find_ns, "-");
+
+        destroyTopics(&head);
+        for (size_t i = 0; i < n; i++)
+            free(names[i]);
+        free(names);
+        free(order);
+    }
+
+    return 0;
+}
@@ -0,0 +1,312 @@
+// Registry microbenchmark: the list.c operations on the publish and
+// subscribe paths, driven in isolation with synthetic workloads.
+//
+// For every combination of topic count, subscribers per topic and topic
+// name length it times addTopic(), findTopic(), addSubscriberToTopic(),
+// removeSubscriberFromTopic() and the per-connection cleanup done on
+// disconnect, and reports ns/op, last-level cache misses per op (through
+// perf_event_open, when the kernel allows it) and the peak RSS.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "list.h"
+#include "rcu.h"
+
+#define LOOKUPS         1000000
+#define CONNECTIONS     256
+#define MAX_MEMBERSHIPS (4 * 1000 * 1000)  // bigger workloads are skipped
+
+typedef struct workload_st {
+    size_t topics;
+    size_t subsPerTopic;
+    size_t nameLen;
+} WORKLOAD;
+
+// Cache miss counter for this thread, -1 if perf events are unavailable
+static int perf_fd = -1;
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void perf_open(void)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    perf_fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (perf_fd < 0)
+        fprintf(stderr, "perf_event_open unavailable, cache misses not measured\n");
+}
+
+// Timing and cache misses of one phase
+typedef struct measure_st {
+    double start;
+    double ns;
+    long long misses;
+} MEASURE;
+
+static void measure_start(MEASURE *m)
+{
+    if (perf_fd >= 0)
+    {
+        ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    m->start = now_ns();
+}
+
+static void measure_stop(MEASURE *m)
+{
+    m->ns = now_ns() - m->start;
+    m->misses = -1;
+
+    if (perf_fd >= 0)
+    {
+        uint64_t count;
+        ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(perf_fd, &count, sizeof(count)) == sizeof(count))
+            m->misses = (long long)count;
+    }
+}
+
+static void report(const char *op, const MEASURE *m, size_t ops)
+{
+    if (ops == 0)
+        return;
+    if (m->misses >= 0)
+        printf("  %-26s %10.1f ns/op %10.2f misses/op\n", op, m->ns / ops, (double)m->misses / ops);
+    else
+        printf("  %-26s %10.1f ns/op %10s misses/op\n", op, m->ns / ops, "-");
+}
+
+// Reset the peak RSS to the current RSS (Linux 4.0+); -1 if not possible
+static int rss_reset(void)
+{
+    int fd = open("/proc/self/clear_refs", O_WRONLY);
+    if (fd < 0)
+        return -1;
+    int res = write(fd, "5", 1) == 1 ? 0 : -1;
+    close(fd);
+    return res;
+}
+
+// Peak RSS in KiB since the last reset, from VmHWM
+static long rss_peak_kb(void)
+{
+    FILE *f = fopen("/proc/self/status", "r");
+    if (!f)
+        return -1;
+
+    char line[256];
+    long kb = -1;
+    while (fgets(line, sizeof(line), f))
+    {
+        if (sscanf(line, "VmHWM: %ld kB", &kb) == 1)
+            break;
+    }
+    fclose(f);
+    return kb;
+}
+
+// Unique names of exactly len bytes: the index, then padding
+static char** make_names(size_t n, size_t len)
+{
+    char **names = malloc(n * sizeof(char *));
+    if (!names)
+    {
+        perror("malloc names");
+        return NULL;
+    }
+
+    for (size_t i = 0; i < n; i++)
+    {
+        names[i] = malloc(len + 1);
+        if (!names[i])
+        {
+            perror("malloc name");
+            exit(EXIT_FAILURE);
+        }
+        int prefix = snprintf(names[i], len + 1, "bench/%zu/", i);
+        memset(names[i] + prefix, 'x', len - (size_t)prefix);
+        names[i][len] = '\0';
+    }
+    return names;
+}
+
+static size_t* shuffled(size_t n)
+{
+    size_t *order = malloc(n * sizeof(size_t));
+    if (!order)
+    {
+        perror("malloc order");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < n; i++)
+        order[i] = i;
+    for (size_t i = n; i > 1; i--)
+    {
+        size_t j = (size_t)rand() % i;
+        size_t tmp = order[i - 1];
+        order[i - 1] = order[j];
+        order[j] = tmp;
+    }
+    return order;
+}
+
+static void run_workload(const WORKLOAD *w, size_t lookups)
+{
+    size_t memberships = w->topics * w->subsPerTopic;
+    MEASURE m;
+
+    char **names = make_names(w->topics, w->nameLen);
+    if (!names)
+        return;
+    size_t *order = shuffled(w->topics);
+    TOPIC **topics = malloc(w->topics * sizeof(TOPIC *));
+    SUBSCRIPTIONS *conns = malloc(CONNECTIONS * sizeof(SUBSCRIPTIONS));
+    if (!topics || !conns)
+    {
+        perror("malloc workload");
+        exit(EXIT_FAILURE);
+    }
+    for (int c = 0; c < CONNECTIONS; c++)
+        initSubscriptions(&conns[c], c, NULL);
+
+    int rss_ok = rss_reset() == 0;
+
+    TOPIC_HEAD head;
+    initTopic(&head);
+
+    measure_start(&m);
+    for (size_t i = 0; i < w->topics; i++)
+    {
+        topics[i] = createTopic(names[i]);
+        addTopic(&head, topics[i]);
+    }
+    measure_stop(&m);
+
+    printf("topics %zu, subscribers/topic %zu, name %zu bytes, %zu memberships over %d connections\n",
+           w->topics, w->subsPerTopic, w->nameLen, memberships, CONNECTIONS);
+    report("createTopic+addTopic", &m, w->topics);
+
+    size_t found = 0;
+    measure_start(&m);
+    for (size_t i = 0; i < lookups; i++)
+        found += findTopic(&head, names[order[i % w->topics]]) != NULL;
+    measure_stop(&m);
+    if (found != lookups)
+        fprintf(stderr, "lookup error: found %zu of %zu\n", found, lookups);
+    report("findTopic", &m, lookups);
+
+    // Topic t goes to subs-per-topic consecutive connections starting at
+    // t * subsPerTopic, so every connection ends up with the same share
+    measure_start(&m);
+    for (size_t i = 0; i < w->topics; i++)
+    {
+        size_t t = order[i];
+        for (size_t j = 0; j < w->subsPerTopic; j++)
+            addSubscriberToTopic(&head, names[t], &conns[(t * w->subsPerTopic + j) % CONNECTIONS], NULL);
+    }
+    measure_stop(&m);
+    report("addSubscriberToTopic", &m, memberships);
+
+    // Single unsubscribes from the first half of the topics, random order
+    size_t removed = 0;
+    measure_start(&m);
+    for (size_t i = 0; i < w->topics; i++)
+    {
+        size_t t = order[i];
+        if (t >= w->topics / 2)
+            continue;
+        for (size_t j = 0; j < w->subsPerTopic; j++)
+            removed += removeSubscriberFromTopic(topics[t], &conns[(t * w->subsPerTopic + j) % CONNECTIONS]) == 0;
+    }
+    measure_stop(&m);
+    report("removeSubscriberFromTopic", &m, removed);
+
+    // What a disconnect does: drop every remaining membership of each
+    // connection (registry_unsubscribe_all() without the shard locks)
+    removed = 0;
+    measure_start(&m);
+    for (int c = 0; c < CONNECTIONS; c++)
+    {
+        while (conns[c].firstNode)
+        {
+            removeSubscriberFromTopic(conns[c].firstNode->topic, &conns[c]);
+            removed++;
+        }
+    }
+    measure_stop(&m);
+    report("unsubscribe all", &m, removed);
+
+    long peak = rss_peak_kb();
+    if (peak >= 0)
+        printf("  %-26s %10.1f MiB%s\n", "peak RSS", peak / 1024.0, rss_ok ? "" : " (process peak, could not reset)");
+    printf("\n");
+
+    for (int c = 0; c < CONNECTIONS; c++)
+        destroySubscriptions(&conns[c]);
+    destroyTopics(&head);
+    rcu_reclaim();
+
+    for (size_t i = 0; i < w->topics; i++)
+        free(names[i]);
+    free(names);
+    free(order);
+    free(topics);
+    free(conns);
+}
+
+int main(int argc, char *argv[])
+{
+    size_t topicCounts[] = { 1000, 10000, 100000 };
+    size_t subsPerTopic[] = { 1, 16, 128 };
+    size_t nameLens[] = { 16, 64, 200 };
+    size_t lookups = argc > 1 ? (size_t)atol(argv[1]) : LOOKUPS;
+
+    if (lookups == 0)
+    {
+        fprintf(stderr, "Usage: %s [lookups]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    srand(42);
+    perf_open();
+
+    for (size_t t = 0; t < sizeof(topicCounts) / sizeof(topicCounts[0]); t++)
+    {
+        for (size_t s = 0; s < sizeof(subsPerTopic) / sizeof(subsPerTopic[0]); s++)
+        {
+            for (size_t l = 0; l < sizeof(nameLens) / sizeof(nameLens[0]); l++)
+            {
+                WORKLOAD w = { topicCounts[t], subsPerTopic[s], nameLens[l] };
+                if (w.topics * w.subsPerTopic > MAX_MEMBERSHIPS)
+                    continue;
+                run_workload(&w, lookups);
+            }
+        }
+    }
+
+    rcu_shutdown();
+    if (perf_fd >= 0)
+        close(perf_fd);
+    return 0;
+}
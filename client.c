@@ -0,0 +1,1165 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "server.h"
+#include "rcu.h"
+#include "slab.h"
+#include "reactor.h"
+#include "stats.h"
+#include "log.h"
+#include "shm.h"
+
+size_t queue_max_msgs = DEFAULT_QUEUE_MAX_MSGS;
+size_t queue_max_bytes = DEFAULT_QUEUE_MAX_BYTES;
+overflow_policy_t overflow_policy = OVERFLOW_DROP_NEWEST;
+unsigned block_ms = DEFAULT_BLOCK_MS;
+
+static const char *overflowNames[] = {
+    [OVERFLOW_UNSET]       = "default",
+    [OVERFLOW_DROP_NEWEST] = "drop-newest",
+    [OVERFLOW_DROP_OLDEST] = "drop-oldest",
+    [OVERFLOW_DISCONNECT]  = "disconnect",
+    [OVERFLOW_BLOCK]       = "block",
+};
+
+static SLAB_CACHE clientCache = SLAB_CACHE_INIT("client", sizeof(CLIENT));
+static SLAB_CACHE outqItemCache = SLAB_CACHE_INIT("queue item", sizeof(OUTQ_ITEM));
+
+// All live clients, used for the /queues report
+static pthread_mutex_t clients_mtx = PTHREAD_MUTEX_INITIALIZER;
+static CLIENT *clientList = NULL;
+
+// Allocate a message buffer of len bytes with one reference held by the
+// caller, who fills it in before queuing it anywhere
+MSGBUF* msgbuf_create(size_t len)
+{
+    MSGBUF *buf = malloc(sizeof(MSGBUF) + len);
+    if (buf == NULL)
+    {
+        perror("malloc message buffer");
+        return NULL;
+    }
+    atomic_init(&buf->refs, 1);
+    atomic_init(&buf->pending, 1);
+    buf->received = 0;
+    atomic_init(&buf->sent, 0);
+    buf->len = len;
+    return buf;
+}
+
+MSGBUF* msgbuf_copy(const char *data, size_t len)
+{
+    MSGBUF *buf = msgbuf_create(len);
+    if (buf)
+        memcpy(buf->data, data, len);
+    return buf;
+}
+
+static void msgbuf_hold(MSGBUF *buf)
+{
+    atomic_fetch_add_explicit(&buf->refs, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&buf->pending, 1, memory_order_relaxed);
+}
+
+// Every queue is done with the message: record its fan-out latency if it
+// was written. Only the first time, a later replay is not a fan-out.
+static void msgbuf_fanout_done(MSGBUF *buf)
+{
+    int sent = atomic_exchange_explicit(&buf->sent, MSGBUF_RECORDED, memory_order_relaxed);
+    if (sent == MSGBUF_SENT && buf->received)
+        stats_latency(stats_now() - buf->received);
+}
+
+// The pending count drops first, while this reference still keeps the
+// buffer alive
+void msgbuf_release(MSGBUF *buf)
+{
+    if (!buf)
+        return;
+
+    if (atomic_fetch_sub_explicit(&buf->pending, 1, memory_order_acq_rel) == 1)
+        msgbuf_fanout_done(buf);
+    if (atomic_fetch_sub_explicit(&buf->refs, 1, memory_order_acq_rel) == 1)
+        free(buf);
+}
+
+// Take a long-lived reference (the message history) that does not keep
+// the fan-out from counting as done
+void msgbuf_retain(MSGBUF *buf)
+{
+    atomic_fetch_add_explicit(&buf->refs, 1, memory_order_relaxed);
+}
+
+void msgbuf_release_retained(MSGBUF *buf)
+{
+    if (atomic_fetch_sub_explicit(&buf->refs, 1, memory_order_acq_rel) == 1)
+        free(buf);
+}
+
+// Create new client for an accepted socket
+CLIENT* createClient(int socket, const struct sockaddr_in *addr)
+{
+    CLIENT *client = slab_alloc(&clientCache);
+    if (client == NULL)
+    {
+        perror("malloc client");
+        return NULL;
+    }
+
+    client->socket = socket;
+    client->type = SUBSCRIBER_TYPE;
+    client->state = CLIENT_HANDSHAKE;
+    if (addr)
+        client->addr = *addr;
+    else
+        memset(&client->addr, 0, sizeof(client->addr));
+    client->handshakeDeadline = 0;
+    client->handshakePrev = NULL;
+    client->handshakeNext = NULL;
+    client->handshakeListed = 0;
+
+    client->binary = 0;
+    inbuf_init(&client->in);
+    initSubscriptions(&client->subs, socket, client);
+
+    client->nonblocking = 0;
+    client->loop = NULL;
+    client->inboxNext = NULL;
+    atomic_init(&client->inboxQueued, 0);
+    client->ring = NULL;
+    client->local = 0;
+    client->loopClosed = 0;
+    client->shm = NULL;
+    atomic_init(&client->topicIds, 0);
+    client->knownIds = NULL;
+    client->knownWords = 0;
+    pthread_mutex_init(&client->out_mtx, NULL);
+    pthread_cond_init(&client->out_cond, NULL);
+    memset(&client->outq, 0, sizeof(client->outq));
+    client->policy = OVERFLOW_UNSET;
+    client->closed = 0;
+    client->hasWriter = 0;
+    atomic_init(&client->refs, 1);
+    stats_add(STAT_CONNECTIONS, 1);
+
+    pthread_mutex_lock(&clients_mtx);
+    {
+        client->prevClient = NULL;
+        client->nextClient = clientList;
+        if (clientList)
+            clientList->prevClient = client;
+        clientList = client;
+    }
+    pthread_mutex_unlock(&clients_mtx);
+
+    return client;
+}
+
+#define PENDING_INDEX_MIN   8
+
+static void pending_insert(OUTQ_ITEM **index, size_t size, OUTQ_ITEM *item)
+{
+    size_t mask = size - 1;
+    size_t i = (size_t)item->conflate->hash & mask;
+
+    while (index[i] != NULL)
+        i = (i + 1) & mask;
+
+    index[i] = item;
+}
+
+// Slot of the newest queued item of a conflated topic, or NULL
+static OUTQ_ITEM** pending_find(OUTQ *q, TOPIC *topic)
+{
+    if (q->pending == NULL)
+        return NULL;
+
+    size_t mask = q->pendingSize - 1;
+    for (size_t i = (size_t)topic->hash & mask; q->pending[i] != NULL; i = (i + 1) & mask)
+    {
+        if (q->pending[i]->conflate == topic)
+            return &q->pending[i];
+    }
+    return NULL;
+}
+
+// Make item the newest queued item of its topic
+static void pending_set(OUTQ *q, OUTQ_ITEM *item)
+{
+    OUTQ_ITEM **slot = pending_find(q, item->conflate);
+    if (slot)
+    {
+        *slot = item;
+        return;
+    }
+
+    // Keep the load factor under 3/4
+    if ((q->pendingCount + 1) * 4 > q->pendingSize * 3)
+    {
+        size_t newSize = q->pendingSize ? q->pendingSize * 2 : PENDING_INDEX_MIN;
+        OUTQ_ITEM **index = calloc(newSize, sizeof(OUTQ_ITEM *));
+        if (index == NULL)
+        {
+            // The topic's next message is queued behind this one instead
+            perror("calloc pending index");
+            item->conflate = NULL;
+            return;
+        }
+
+        for (size_t i = 0; i < q->pendingSize; i++)
+            if (q->pending[i])
+                pending_insert(index, newSize, q->pending[i]);
+
+        free(q->pending);
+        q->pending = index;
+        q->pendingSize = newSize;
+    }
+
+    pending_insert(q->pending, q->pendingSize, item);
+    q->pendingCount++;
+}
+
+// Forget an item leaving the queue, if it is still the newest of its
+// topic. Deletes by shifting the rest of the probe run back, like the
+// membership index in list.c.
+static void pending_remove(OUTQ *q, OUTQ_ITEM *item)
+{
+    OUTQ_ITEM **slot = pending_find(q, item->conflate);
+    if (slot == NULL || *slot != item)
+        return;
+
+    size_t mask = q->pendingSize - 1;
+    size_t hole = (size_t)(slot - q->pending);
+    for (size_t i = (hole + 1) & mask; q->pending[i] != NULL; i = (i + 1) & mask)
+    {
+        size_t home = (size_t)q->pending[i]->conflate->hash & mask;
+
+        // Move the entry into the hole unless its home lies in (hole, i]
+        if (((i - home) & mask) >= ((i - hole) & mask))
+        {
+            q->pending[hole] = q->pending[i];
+            hole = i;
+        }
+    }
+    q->pending[hole] = NULL;
+    q->pendingCount--;
+}
+
+// Unlink-time bookkeeping shared by everything that takes items off the
+// queue. Caller holds out_mtx.
+static void free_item(OUTQ *q, OUTQ_ITEM *item)
+{
+    if (item->conflate)
+        pending_remove(q, item);
+    msgbuf_release(item->buf);
+    slab_free(&outqItemCache, item);
+}
+
+// Free every queued item. Caller holds out_mtx.
+static void clear_queue(OUTQ *q)
+{
+    OUTQ_ITEM *item = q->head;
+    while (item)
+    {
+        OUTQ_ITEM *next = item->next;
+        msgbuf_release(item->buf);
+        slab_free(&outqItemCache, item);
+        item = next;
+    }
+    q->head = q->tail = NULL;
+    q->depth = 0;
+    q->bytes = 0;
+
+    free(q->pending);
+    q->pending = NULL;
+    q->pendingSize = 0;
+    q->pendingCount = 0;
+}
+
+void client_hold(CLIENT *client)
+{
+    atomic_fetch_add_explicit(&client->refs, 1, memory_order_relaxed);
+}
+
+static void free_client(void *arg)
+{
+    CLIENT *client = (CLIENT *)arg;
+    pthread_cond_destroy(&client->out_cond);
+    pthread_mutex_destroy(&client->out_mtx);
+    slab_free(&clientCache, client);
+}
+
+// Drop a reference; the last one closes the socket and frees the client.
+// The memory itself goes through RCU because a fan-out reading an older
+// subscriber snapshot may still look at the (closed) client.
+void client_release(CLIENT *client)
+{
+    if (atomic_fetch_sub_explicit(&client->refs, 1, memory_order_acq_rel) != 1)
+        return;
+
+    pthread_mutex_lock(&clients_mtx);
+    {
+        if (client->prevClient)
+            client->prevClient->nextClient = client->nextClient;
+        else
+            clientList = client->nextClient;
+        if (client->nextClient)
+            client->nextClient->prevClient = client->prevClient;
+    }
+    pthread_mutex_unlock(&clients_mtx);
+
+    if (client->socket != -1)
+        close(client->socket);
+
+    pthread_mutex_lock(&client->out_mtx);
+    clear_queue(&client->outq);
+    free(client->knownIds);
+    client->knownIds = NULL;
+    client->knownWords = 0;
+    pthread_mutex_unlock(&client->out_mtx);
+    inbuf_free(&client->in);
+    destroySubscriptions(&client->subs);
+    free(client->ring);
+    shm_close(client->shm);
+    client->shm = NULL;
+
+    rcu_retire(client, free_client);
+}
+
+// The connection is gone: stop writing, discard the queue and drop the
+// owner's reference. Fan-outs still holding the client only see it closed.
+void destroyClient(CLIENT *client)
+{
+    if (!client) return;
+    stats_add(STAT_DISCONNECTS, 1);
+
+    pthread_mutex_lock(&client->out_mtx);
+    {
+        client->closed = 1;
+        pthread_cond_broadcast(&client->out_cond);
+    }
+    pthread_mutex_unlock(&client->out_mtx);
+
+    if (client->hasWriter)
+    {
+        // Wake the writer if it is blocked in send(). The queue is only
+        // cleared after it is gone, as it may be sending queued buffers.
+        shutdown(client->socket, SHUT_RDWR);
+        pthread_join(client->writer, NULL);
+    }
+
+    pthread_mutex_lock(&client->out_mtx);
+    clear_queue(&client->outq);
+    pthread_mutex_unlock(&client->out_mtx);
+
+    client_release(client);
+}
+
+// Point iov at the unwritten part of up to WRITE_BATCH queued messages.
+// Caller holds out_mtx. Returns the number of entries used.
+static int fill_iov(OUTQ *q, struct iovec *iov, size_t *total)
+{
+    int cnt = 0;
+    *total = 0;
+
+    for (OUTQ_ITEM *item = q->head; item != NULL && cnt < WRITE_BATCH; item = item->next)
+    {
+        iov[cnt].iov_base = item->buf->data + item->off;
+        iov[cnt].iov_len = item->buf->len - item->off;
+        *total += iov[cnt].iov_len;
+        cnt++;
+    }
+    return cnt;
+}
+
+// Account for n written bytes: advance the head item and drop every
+// message that went out completely. Caller holds out_mtx.
+static void consume_sent(CLIENT *client, size_t n)
+{
+    OUTQ *q = &client->outq;
+    unsigned long long done = 0;
+
+    q->bytes -= n;
+    q->sentBytes += n;
+    stats_add(STAT_SENT_BYTES, n);
+
+    while (n > 0 && q->head)
+    {
+        OUTQ_ITEM *item = q->head;
+        size_t left = item->buf->len - item->off;
+
+        if (n < left)
+        {
+            item->off += n;
+            break;
+        }
+
+        n -= left;
+        q->head = item->next;
+        if (q->head == NULL)
+            q->tail = NULL;
+        q->depth--;
+        q->sentMsgs++;
+        done++;
+        int unsent = 0;
+        atomic_compare_exchange_strong_explicit(&item->buf->sent, &unsent, MSGBUF_SENT, memory_order_relaxed, memory_order_relaxed);
+        free_item(q, item);
+    }
+
+    stats_add(STAT_SENT_MSGS, done);
+
+    // Publishers blocked on a full queue may fit now
+    if (done && q->waiters)
+        pthread_cond_broadcast(&client->out_cond);
+}
+
+static ssize_t send_iov(int socket, struct iovec *iov, int cnt, int flags)
+{
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = (size_t)cnt;
+    return sendmsg(socket, &msg, flags | MSG_NOSIGNAL);
+}
+
+// Writer thread of a subscriber in thread-per-client mode.
+// It drains the queue so a blocked send() only ever stalls this thread.
+// Every sendmsg() takes as many queued messages as fit in one batch.
+static void *writer_thread(void *arg)
+{
+    CLIENT *client = (CLIENT *)arg;
+    OUTQ *q = &client->outq;
+    struct iovec iov[WRITE_BATCH];
+
+    pthread_mutex_lock(&client->out_mtx);
+    while (!client->closed)
+    {
+        if (q->head == NULL)
+        {
+            pthread_cond_wait(&client->out_cond, &client->out_mtx);
+            continue;
+        }
+
+        // Only this thread removes the batched items, so they stay valid
+        // unlocked; fan-outs append behind them and drop-oldest skips them
+        size_t total;
+        int cnt = fill_iov(q, iov, &total);
+
+        q->inflight = (size_t)cnt;
+        pthread_mutex_unlock(&client->out_mtx);
+        ssize_t n = send_iov(client->socket, iov, cnt, 0);
+        pthread_mutex_lock(&client->out_mtx);
+        q->inflight = 0;
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && !client->closed)
+            stats_add(STAT_SEND_ERRORS, 1);
+        if (n < 0 || client->closed)
+            break;
+
+        consume_sent(client, (size_t)n);
+    }
+    pthread_mutex_unlock(&client->out_mtx);
+
+    return NULL;
+}
+
+int client_start_writer(CLIENT *client)
+{
+    if (pthread_create(&client->writer, NULL, writer_thread, client) != 0)
+    {
+        perror("pthread_create writer failed");
+        return -1;
+    }
+    client->hasWriter = 1;
+    return 0;
+}
+
+static int flush_pending(CLIENT *client);
+
+int overflow_parse(const char *name)
+{
+    for (int i = OVERFLOW_UNSET; i <= OVERFLOW_BLOCK; i++)
+        if (strcmp(name, overflowNames[i]) == 0)
+            return i;
+    return -1;
+}
+
+const char* overflow_name(int policy)
+{
+    return policy >= OVERFLOW_UNSET && policy <= OVERFLOW_BLOCK ? overflowNames[policy] : "none";
+}
+
+// Whether an item can still be swapped for a newer message: not partly
+// written and not in the batch a writer thread is sending
+static int replaceable(const OUTQ *q, const OUTQ_ITEM *item)
+{
+    if (item->off > 0)
+        return 0;
+
+    const OUTQ_ITEM *it = q->head;
+    for (size_t i = 0; i < q->inflight && it != NULL; i++, it = it->next)
+        if (it == item)
+            return 0;
+    return 1;
+}
+
+static int over_limit(const OUTQ *q, size_t len)
+{
+    return q->depth >= queue_max_msgs || q->bytes + len > queue_max_bytes;
+}
+
+// Drop queued messages, oldest first, until one more of len bytes fits.
+// Messages being written (a partly written head, the batch a writer thread
+// is sending) and server replies are kept. Caller holds out_mtx.
+// Returns 0 if the message fits now.
+static int drop_oldest(OUTQ *q, size_t len)
+{
+    OUTQ_ITEM *prev = NULL;
+    OUTQ_ITEM *item = q->head;
+    size_t skip = q->inflight;
+    unsigned long long evicted = 0;
+
+    while (item && over_limit(q, len))
+    {
+        OUTQ_ITEM *next = item->next;
+
+        if (skip > 0 || item->off > 0 || !item->bounded)
+        {
+            if (skip > 0)
+                skip--;
+            prev = item;
+        }
+        else
+        {
+            if (prev)
+                prev->next = next;
+            else
+                q->head = next;
+            if (q->tail == item)
+                q->tail = prev;
+            q->depth--;
+            q->bytes -= item->buf->len;
+            evicted++;
+            free_item(q, item);
+        }
+        item = next;
+    }
+
+    q->evicted += evicted;
+    stats_add(STAT_EVICTED, evicted);
+    return over_limit(q, len) ? -1 : 0;
+}
+
+// Make the publisher wait up to block_ms for the subscriber to read. An
+// epoll loop client's socket is written right here and polled, and so is
+// a shared-memory client's ring when its loop is the calling thread; the
+// writer thread of a thread-per-client subscriber, the io_uring loop and
+// the loop of a shared-memory client signal out_cond as they send.
+// Caller holds out_mtx and a reference on the client, which keeps the
+// socket open while out_mtx is released. Returns 0 if the message fits now.
+static int wait_for_room(CLIENT *client, size_t len)
+{
+    OUTQ *q = &client->outq;
+    uint64_t start = stats_now();
+    uint64_t deadline = start + (uint64_t)block_ms * 1000000ULL;
+    int res = -1;
+
+    // A ring client is written by its loop; if that is the calling
+    // thread, nothing is sent while it waits
+    int owner = client->ring && reactor_owner(client);
+    int shmOwner = client->shm && reactor_owner(client);
+
+    while (!client->closed)
+    {
+        if (client->nonblocking && flush_pending(client) < 0)
+            break;
+        if (!over_limit(q, len))
+        {
+            res = 0;
+            break;
+        }
+
+        uint64_t now = stats_now();
+        if (now >= deadline || (!client->nonblocking && !client->hasWriter) || owner)
+            break;
+
+        if (client->nonblocking && !client->ring && !client->shm)
+        {
+            struct pollfd pfd = { client->socket, POLLOUT, 0 };
+            pthread_mutex_unlock(&client->out_mtx);
+            poll(&pfd, 1, (int)((deadline - now + 999999) / 1000000));
+            pthread_mutex_lock(&client->out_mtx);
+        }
+        else if (shmOwner)
+        {
+            // The full ring asked the subscriber to report room on the
+            // eventfd this loop would otherwise be woken by
+            struct pollfd pfd = { client->shm->down.spaceFd, POLLIN, 0 };
+            pthread_mutex_unlock(&client->out_mtx);
+            if (poll(&pfd, 1, (int)((deadline - now + 999999) / 1000000)) > 0)
+                shm_clear(pfd.fd);
+            pthread_mutex_lock(&client->out_mtx);
+        }
+        else
+        {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            uint64_t wake = (uint64_t)ts.tv_nsec + (deadline - now);
+            ts.tv_sec += (time_t)(wake / 1000000000ULL);
+            ts.tv_nsec = (long)(wake % 1000000000ULL);
+
+            q->waiters++;
+            pthread_cond_timedwait(&client->out_cond, &client->out_mtx, &ts);
+            q->waiters--;
+        }
+    }
+
+    uint64_t waited = stats_now() - start;
+    q->blocked++;
+    q->blockedNs += waited;
+    stats_add(STAT_BLOCKED, 1);
+    stats_add(STAT_BLOCKED_NS, waited);
+    return res;
+}
+
+// Close a subscriber that cannot keep up. Its owner sees the shut down
+// socket like any other disconnect and cleans up. Caller holds out_mtx.
+static void overflow_disconnect(CLIENT *client)
+{
+    client->closed = 1;
+    pthread_cond_broadcast(&client->out_cond);
+    shutdown(client->socket, SHUT_RDWR);
+    stats_add(STAT_OVERFLOW_DISCONNECTS, 1);
+    LOG_LIMITED(LOG_WARN, "[INFO] Subscriber (socket = %d) disconnected: outbound queue over its limit.\n", client->socket);
+}
+
+// Append a message to the queue. Caller holds out_mtx.
+static int queue_item(OUTQ *q, MSGBUF *buf, int bounded, TOPIC *conflate)
+{
+    OUTQ_ITEM *item = slab_alloc(&outqItemCache);
+    if (item == NULL)
+    {
+        perror("malloc queue item");
+        return -1;
+    }
+
+    item->next = NULL;
+    item->buf = buf;
+    item->off = 0;
+    item->bounded = bounded;
+    item->conflate = conflate;
+    msgbuf_hold(buf);
+    if (conflate)
+        pending_set(q, item);
+
+    if (q->tail)
+        q->tail->next = item;
+    else
+        q->head = item;
+    q->tail = item;
+
+    q->depth++;
+    q->bytes += buf->len;
+    if (q->depth > q->peakDepth)
+        q->peakDepth = q->depth;
+    if (q->bytes > q->peakBytes)
+        q->peakBytes = q->bytes;
+    return 0;
+}
+
+// The FRAME_TOPIC_ID frame announcing a topic's ID. Built once and kept by
+// the topic for good, like the topic itself.
+MSGBUF* topic_announcement(TOPIC *topic)
+{
+    MSGBUF *buf = atomic_load_explicit(&topic->announce, memory_order_acquire);
+    if (buf || topic->id == 0)
+        return buf;
+
+    buf = msgbuf_create(FRAME_HEADER_LEN + topic->nameLen + FRAME_TOPIC_ID_LEN);
+    if (buf == NULL)
+        return NULL;
+    frame_header((unsigned char *)buf->data, FRAME_TOPIC_ID, 0, topic->nameLen, FRAME_TOPIC_ID_LEN);
+    memcpy(buf->data + FRAME_HEADER_LEN, topic->name, topic->nameLen);
+    frame_topic_id((unsigned char *)buf->data + FRAME_HEADER_LEN + topic->nameLen, topic->id);
+
+    MSGBUF *expected = NULL;
+    if (!atomic_compare_exchange_strong_explicit(&topic->announce, &expected, buf, memory_order_acq_rel, memory_order_acquire))
+    {
+        msgbuf_release(buf);
+        buf = expected;
+    }
+    return buf;
+}
+
+// Queue the announcement of the topic's ID unless the client already has
+// it. Caller holds out_mtx. Returns 1 if it was queued, 0 if the client
+// has it and -1 if it could not be queued.
+static int announce_topic(CLIENT *client, TOPIC *topic)
+{
+    size_t word = topic->id / 64;
+    uint64_t bit = 1ULL << (topic->id % 64);
+
+    if (word < client->knownWords && (client->knownIds[word] & bit))
+        return 0;
+
+    if (word >= client->knownWords)
+    {
+        size_t words = client->knownWords ? client->knownWords : 4;
+        while (words <= word)
+            words *= 2;
+        uint64_t *known = realloc(client->knownIds, words * sizeof(uint64_t));
+        if (known == NULL)
+        {
+            perror("realloc known topic IDs");
+            return -1;
+        }
+        memset(known + client->knownWords, 0, (words - client->knownWords) * sizeof(uint64_t));
+        client->knownIds = known;
+        client->knownWords = words;
+    }
+
+    MSGBUF *buf = topic_announcement(topic);
+    if (buf == NULL || queue_item(&client->outq, buf, 0, NULL) < 0)
+        return -1;
+    client->knownIds[word] |= bit;
+    return 1;
+}
+
+static int enqueue(CLIENT *client, MSGBUF *buf, TOPIC *announce, int policy, TOPIC *conflate, CLIENT_VEC *kick)
+{
+    if (!client || !buf)
+        return -1;
+
+    size_t len = buf->len;
+    int bounded = policy != OVERFLOW_UNBOUNDED;
+    int held = 0;
+    int wake = 0;
+    int res;
+    pthread_mutex_lock(&client->out_mtx);
+    {
+        OUTQ *q = &client->outq;
+        OUTQ_ITEM *older = NULL;
+
+        // A new announcement goes first. The message then never replaces
+        // an older one in place, which would put it before the announcement.
+        int wasEmpty = q->head == NULL;
+        int announced = announce && !client->closed ? announce_topic(client, announce) : 0;
+        if (announced < 0)
+        {
+            // Never queue an ID the client cannot resolve
+            pthread_mutex_unlock(&client->out_mtx);
+            return -2;
+        }
+
+        if (conflate && !announced && !client->closed)
+        {
+            OUTQ_ITEM **slot = pending_find(q, conflate);
+            if (slot && replaceable(q, *slot))
+                older = *slot;
+        }
+        int full = !older && bounded && !client->closed && over_limit(q, len);
+
+        if (full)
+        {
+            if (client->policy != OVERFLOW_UNSET)
+                policy = client->policy;
+            else if (policy == OVERFLOW_UNSET)
+                policy = overflow_policy;
+
+            if (policy == OVERFLOW_DROP_OLDEST)
+                full = drop_oldest(q, len) < 0;
+            else if (policy == OVERFLOW_DISCONNECT)
+                overflow_disconnect(client);
+            else if (policy == OVERFLOW_BLOCK)
+            {
+                // Taken while closed is known to be unset, like below
+                client_hold(client);
+                held = 1;
+                full = wait_for_room(client, len) < 0;
+            }
+        }
+
+        if (client->closed)
+            res = -1;
+        else if (older)
+        {
+            // Replaced in place: the queue keeps its position and length
+            q->bytes = q->bytes - older->buf->len + len;
+            if (q->bytes > q->peakBytes)
+                q->peakBytes = q->bytes;
+            msgbuf_release(older->buf);
+            older->buf = buf;
+            msgbuf_hold(buf);
+
+            q->conflated++;
+            stats_add(STAT_CONFLATED, 1);
+            res = 0;
+        }
+        else if (full || queue_item(q, buf, bounded, conflate) < 0)
+        {
+            q->dropped++;
+            stats_add(STAT_DROPPED, 1);
+            res = -1;
+        }
+        else
+            res = q->head == q->tail ? 1 : 0;
+
+        // An announcement this call put into an empty queue needs the
+        // kick as well, even if the message itself was dropped
+        if (announced && wasEmpty && res == 0)
+            res = 1;
+        wake = !client->closed && (res == 1 || (announced && wasEmpty));
+
+        // Taken while closed is known to be unset, so the owner's final
+        // release cannot have happened yet
+        if (wake && kick)
+            client_hold(client);
+    }
+    pthread_mutex_unlock(&client->out_mtx);
+
+    if (held)
+        client_release(client);
+    if (wake && kick)
+        clientVecPush(kick, client);
+
+    return res;
+}
+
+// Append a message to the client's outbound queue without writing it.
+// The queue takes its own reference on buf; the data is not copied.
+// policy is OVERFLOW_UNBOUNDED for messages that are never dropped,
+// otherwise the policy of the message's topic (OVERFLOW_UNSET if it has
+// none), applied when the queue is over its message or byte limit unless
+// the client has a policy of its own.
+// conflate is the message's topic if only its latest message matters: an
+// older one still waiting in the queue is replaced in place, so the queue
+// holds at most one unsent message per conflated topic.
+// Returns 1 if the queue was empty, 0 if a drain is already pending and
+// -1 if the message was dropped. When the queue was empty and kick is
+// given, the client is added to kick with a reference held, otherwise the
+// caller must kick it itself.
+int client_enqueue(CLIENT *client, MSGBUF *buf, int policy, TOPIC *conflate, CLIENT_VEC *kick)
+{
+    return enqueue(client, buf, NULL, policy, conflate, kick);
+}
+
+// Like client_enqueue(), for a message that names its topic by ID: unless
+// the client already has the ID, its announcement is queued first.
+// Returns -2, with nothing queued, if the announcement could not be; the
+// caller then sends the message by name instead.
+int client_enqueue_topic(CLIENT *client, MSGBUF *buf, TOPIC *topic, int policy, TOPIC *conflate, CLIENT_VEC *kick)
+{
+    return enqueue(client, buf, topic, policy, conflate, kick);
+}
+
+// Copy as much of the queue as fits into a shared-memory client's ring.
+// When the ring is full the client's loop is woken once it has read some.
+// out_mtx makes whichever thread holds it the ring's single producer.
+static int flush_shm(CLIENT *client)
+{
+    OUTQ *q = &client->outq;
+    SHM_RING *ring = &client->shm->down;
+
+    while (q->head && !client->closed)
+    {
+        char *dst;
+        ssize_t room = shm_writable(ring, &dst);
+        if (room < 0)
+            return -1;
+
+        size_t n = 0;
+        for (OUTQ_ITEM *item = q->head; item != NULL && n < (size_t)room; item = item->next)
+        {
+            size_t len = item->buf->len - item->off;
+            if (len > (size_t)room - n)
+                len = (size_t)room - n;
+            memcpy(dst + n, item->buf->data + item->off, len);
+            n += len;
+        }
+
+        if (n > 0)
+        {
+            consume_sent(client, n);
+            shm_produce(ring, n);
+        }
+        else if (shm_producer_idle(ring, 0))
+            return 0;
+    }
+    return 0;
+}
+
+// Write as much of the queue as the socket accepts without blocking.
+// Caller holds out_mtx.
+static int flush_pending(CLIENT *client)
+{
+    OUTQ *q = &client->outq;
+    struct iovec iov[WRITE_BATCH];
+
+    // Clients of an io_uring loop are written through its ring
+    if (client->ring)
+        return reactor_ring_send(client);
+    if (client->shm)
+        return flush_shm(client);
+
+    while (q->head && !client->closed)
+    {
+        size_t total;
+        int cnt = fill_iov(q, iov, &total);
+
+        ssize_t n = send_iov(client->socket, iov, cnt, MSG_DONTWAIT);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            stats_add(STAT_SEND_ERRORS, 1);
+            return -1;
+        }
+
+        consume_sent(client, (size_t)n);
+
+        // A short write means the socket buffer is full; EPOLLOUT resumes
+        if ((size_t)n < total)
+            return 0;
+    }
+    return 0;
+}
+
+// Start draining a client's queue after new messages were appended.
+// Event loop: the owning loop writes now without blocking, the rest goes
+// out on EPOLLOUT. Any other thread posts the client to that loop.
+// Shared memory: any thread copies into the ring right away.
+// Thread-per-client: wake the client's writer thread.
+void client_kick(CLIENT *client)
+{
+    if (client->shm)
+    {
+        client_flush(client);
+        return;
+    }
+
+    if (client->nonblocking)
+    {
+        if (reactor_post(client) < 0)
+            client_flush(client);
+        return;
+    }
+
+    // Publishers blocked on a full queue wait on the same condition
+    pthread_mutex_lock(&client->out_mtx);
+    if (client->outq.waiters)
+        pthread_cond_broadcast(&client->out_cond);
+    else
+        pthread_cond_signal(&client->out_cond);
+    pthread_mutex_unlock(&client->out_mtx);
+}
+
+// Queue a server reply without writing it. Binary clients get it wrapped
+// in a FRAME_REPLY, text clients get the bare text. Replies are never dropped.
+int client_queue_reply(CLIENT *client, const char *text, size_t len)
+{
+    size_t hdr = client->binary ? FRAME_HEADER_LEN : 0;
+
+    MSGBUF *buf = msgbuf_create(hdr + len);
+    if (buf == NULL)
+        return -1;
+    if (hdr)
+        frame_header((unsigned char *)buf->data, FRAME_REPLY, 0, 0, len);
+    memcpy(buf->data + hdr, text, len);
+
+    int res = client_enqueue(client, buf, OVERFLOW_UNBOUNDED, NULL, NULL);
+    msgbuf_release(buf);
+    return res;
+}
+
+// Start writing what is queued for a client
+static int send_queued(CLIENT *client)
+{
+    int res = 0;
+
+    if (!client->hasWriter && !client->nonblocking)
+    {
+        // Clients without a writer thread (publishers, or a subscriber
+        // still in its handshake) are written directly
+        struct iovec iov[WRITE_BATCH];
+
+        pthread_mutex_lock(&client->out_mtx);
+        while (client->outq.head && !client->closed)
+        {
+            size_t total;
+            int cnt = fill_iov(&client->outq, iov, &total);
+            ssize_t n = send_iov(client->socket, iov, cnt, 0);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+            {
+                stats_add(STAT_SEND_ERRORS, 1);
+                clear_queue(&client->outq);
+                res = -1;
+                break;
+            }
+            consume_sent(client, (size_t)n);
+        }
+        pthread_mutex_unlock(&client->out_mtx);
+        return res;
+    }
+
+    client_kick(client);
+    return 0;
+}
+
+// Queue a reply for a client and start writing it
+int client_send(CLIENT *client, const char *text, size_t len)
+{
+    if (client_queue_reply(client, text, len) < 0)
+        return -1;
+    return send_queued(client);
+}
+
+// Send a binary client the ID of a topic it asked for. Like replies,
+// announcements are never dropped.
+int client_send_topic_id(CLIENT *client, TOPIC *topic)
+{
+    MSGBUF *buf = topic_announcement(topic);
+    if (buf == NULL || client_enqueue(client, buf, OVERFLOW_UNBOUNDED, NULL, NULL) < 0)
+        return -1;
+    return send_queued(client);
+}
+
+int client_flush(CLIENT *client)
+{
+    int res;
+    pthread_mutex_lock(&client->out_mtx);
+    res = flush_pending(client);
+    pthread_mutex_unlock(&client->out_mtx);
+    return res;
+}
+
+// io_uring: take the head of the queue for a send the loop submits. Like
+// a writer thread's batch, it stays queued until client_batch_sent() and
+// drop-oldest and conflation leave it alone. Caller holds out_mtx.
+// Returns the number of iovecs filled, 0 if there is nothing to send.
+int client_fill_batch(CLIENT *client, struct iovec *iov)
+{
+    OUTQ *q = &client->outq;
+    if (client->closed || q->head == NULL)
+        return 0;
+
+    size_t total;
+    int cnt = fill_iov(q, iov, &total);
+    q->inflight = (size_t)cnt;
+    return cnt;
+}
+
+// io_uring: the send of a batch completed with n bytes written.
+// Caller holds out_mtx.
+void client_batch_sent(CLIENT *client, size_t n)
+{
+    client->outq.inflight = 0;
+    if (n > 0)
+        consume_sent(client, n);
+}
+
+// Where a client connected from, for logs and reports
+const char* client_peer(const CLIENT *client, char *buf, size_t len)
+{
+    if (client->local)
+        snprintf(buf, len, "local");
+    else
+        snprintf(buf, len, "%s:%d", inet_ntoa(client->addr.sin_addr), ntohs(client->addr.sin_port));
+    return buf;
+}
+
+// Send per-subscriber queue depth, bytes and drop counters to a client
+void client_queue_report(CLIENT *requester)
+{
+    char line[DEFAULT_BUFLEN];
+    char peer[64];
+
+    snprintf(line, DEFAULT_BUFLEN, "Outbound queues (limit %zu messages / %zu bytes, overflow %s, block %u ms):\n",
+             queue_max_msgs, queue_max_bytes, overflow_name(overflow_policy), block_ms);
+    client_queue_reply(requester, line, strlen(line));
+
+    pthread_mutex_lock(&clients_mtx);
+    {
+        for (CLIENT *c = clientList; c != NULL; c = c->nextClient)
+        {
+            if (c->state != CLIENT_ACTIVE || c->type != SUBSCRIBER_TYPE)
+                continue;
+
+            OUTQ q;
+            int policy;
+            pthread_mutex_lock(&c->out_mtx);
+            q = c->outq;
+            policy = c->policy;
+            pthread_mutex_unlock(&c->out_mtx);
+
+            snprintf(line, DEFAULT_BUFLEN,
+                     "  - socket %d (%s, %s): depth %zu, bytes %zu, peak %zu / %zu bytes, sent %llu (%llu bytes), dropped %llu, "
+                     "overflow %s, evicted %llu, blocked %llu (%.1f ms), conflated %llu\n",
+                     c->socket, client_peer(c, peer, sizeof(peer)), c->shm ? "shm" : c->binary ? "binary" : "text",
+                     q.depth, q.bytes, q.peakDepth, q.peakBytes, q.sentMsgs, q.sentBytes, q.dropped,
+                     overflow_name(policy), q.evicted, q.blocked, q.blockedNs / 1e6, q.conflated);
+            client_queue_reply(requester, line, strlen(line));
+        }
+    }
+    pthread_mutex_unlock(&clients_mtx);
+
+    client_kick(requester);
+}
+
+void initClientVec(CLIENT_VEC *vec)
+{
+    vec->items = vec->inlineItems;
+    vec->count = 0;
+    vec->cap = sizeof(vec->inlineItems) / sizeof(vec->inlineItems[0]);
+}
+
+// Remember a client to kick later. The caller hands over a reference
+// that kickClientVec() drops.
+void clientVecPush(CLIENT_VEC *vec, CLIENT *client)
+{
+    if (vec->count == vec->cap)
+    {
+        size_t newcap = vec->cap * 2;
+        CLIENT **items = malloc(newcap * sizeof(CLIENT *));
+        if (items == NULL)
+        {
+            // Cannot remember it, so kick right away
+            client_kick(client);
+            client_release(client);
+            return;
+        }
+        memcpy(items, vec->items, vec->count * sizeof(CLIENT *));
+        if (vec->items != vec->inlineItems)
+            free(vec->items);
+        vec->items = items;
+        vec->cap = newcap;
+    }
+
+    vec->items[vec->count++] = client;
+}
+
+// Kick and release every collected client. Call without any registry lock.
+void kickClientVec(CLIENT_VEC *vec)
+{
+    for (size_t i = 0; i < vec->count; i++)
+    {
+        client_kick(vec->items[i]);
+        client_release(vec->items[i]);
+    }
+
+    if (vec->items != vec->inlineItems)
+        free(vec->items);
+    initClientVec(vec);
+}
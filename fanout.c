@@ -0,0 +1,360 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "fanout.h"
+#include "stats.h"
+
+#define DEQUE_SLOTS     1024    // power of two; a worker whose deque is full stops splitting
+
+unsigned fanout_workers = 0;
+size_t fanout_threshold = DEFAULT_FANOUT_THRESHOLD;
+
+// One fan-out. It lives on the publisher's stack until every index is done.
+typedef struct fanoutJob_st {
+    void (*fn)(void *arg, size_t lo, size_t hi);
+    void *arg;
+    atomic_size_t remaining;        // indexes not delivered yet
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int done;
+
+    // The range handed to the pool, while in the injection queue
+    size_t lo;
+    size_t hi;
+    struct fanoutJob_st *next;
+} FANOUT_JOB;
+
+typedef struct fanoutTask_st {
+    FANOUT_JOB *job;
+    size_t lo;
+    size_t hi;
+} FANOUT_TASK;
+
+// A thief may read a slot while its owner reuses it; it then loses the
+// race for top and drops what it read. Hence relaxed atomics, not plain
+// fields.
+typedef struct dequeSlot_st {
+    _Atomic(FANOUT_JOB *) job;
+    atomic_size_t lo;
+    atomic_size_t hi;
+} DEQUE_SLOT;
+
+typedef struct fanoutWorker_st {
+    // Chase-Lev deque: the owner pushes and pops at bottom, thieves take
+    // from top. The two ends are on separate cache lines.
+    atomic_long top __attribute__((aligned(64)));
+    atomic_long bottom __attribute__((aligned(64)));
+    DEQUE_SLOT slots[DEQUE_SLOTS];
+
+    unsigned index;
+    unsigned seed;                  // picks the first victim to steal from
+    pthread_t tid;
+} __attribute__((aligned(64))) FANOUT_WORKER;
+
+static FANOUT_WORKER *workers = NULL;
+static unsigned workerCount = 0;
+
+// Injection queue of fan-outs from publishers, and the idle workers
+static pthread_mutex_t pool_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static FANOUT_JOB *injectHead = NULL;
+static FANOUT_JOB *injectTail = NULL;
+static atomic_int injected = 0;
+static atomic_int sleepers = 0;
+static atomic_int stopping = 0;
+
+static void slot_read(DEQUE_SLOT *slot, FANOUT_TASK *task)
+{
+    task->job = atomic_load_explicit(&slot->job, memory_order_relaxed);
+    task->lo = atomic_load_explicit(&slot->lo, memory_order_relaxed);
+    task->hi = atomic_load_explicit(&slot->hi, memory_order_relaxed);
+}
+
+// Owner only. Returns -1 if the deque is full.
+static int deque_push(FANOUT_WORKER *w, FANOUT_JOB *job, size_t lo, size_t hi)
+{
+    long b = atomic_load_explicit(&w->bottom, memory_order_relaxed);
+    long t = atomic_load_explicit(&w->top, memory_order_acquire);
+    if (b - t >= DEQUE_SLOTS)
+        return -1;
+
+    DEQUE_SLOT *slot = &w->slots[b & (DEQUE_SLOTS - 1)];
+    atomic_store_explicit(&slot->job, job, memory_order_relaxed);
+    atomic_store_explicit(&slot->lo, lo, memory_order_relaxed);
+    atomic_store_explicit(&slot->hi, hi, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&w->bottom, b + 1, memory_order_relaxed);
+    return 0;
+}
+
+// Owner only: take the newest task. Returns 0 if the deque is empty.
+static int deque_pop(FANOUT_WORKER *w, FANOUT_TASK *task)
+{
+    long b = atomic_load_explicit(&w->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&w->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long t = atomic_load_explicit(&w->top, memory_order_relaxed);
+
+    if (t > b)
+    {
+        atomic_store_explicit(&w->bottom, b + 1, memory_order_relaxed);
+        return 0;
+    }
+
+    slot_read(&w->slots[b & (DEQUE_SLOTS - 1)], task);
+    if (t < b)
+        return 1;
+
+    // The last task: thieves may be after it too
+    int won = atomic_compare_exchange_strong_explicit(&w->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed);
+    atomic_store_explicit(&w->bottom, b + 1, memory_order_relaxed);
+    return won;
+}
+
+// Any thread: take the oldest task. Returns 0 if the deque is empty or
+// another thread got the task first.
+static int deque_steal(FANOUT_WORKER *w, FANOUT_TASK *task)
+{
+    long t = atomic_load_explicit(&w->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long b = atomic_load_explicit(&w->bottom, memory_order_acquire);
+    if (t >= b)
+        return 0;
+
+    slot_read(&w->slots[t & (DEQUE_SLOTS - 1)], task);
+    return atomic_compare_exchange_strong_explicit(&w->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed);
+}
+
+static int deque_empty(FANOUT_WORKER *w)
+{
+    return atomic_load_explicit(&w->top, memory_order_acquire) >= atomic_load_explicit(&w->bottom, memory_order_acquire);
+}
+
+// Wake an idle worker for a task just pushed. Pairs with the sleeper
+// announcing itself before it looks at the deques one last time.
+static void wake_one(void)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&sleepers, memory_order_relaxed) == 0)
+        return;
+
+    pthread_mutex_lock(&pool_mtx);
+    pthread_cond_signal(&pool_cond);
+    pthread_mutex_unlock(&pool_mtx);
+}
+
+static void job_finish(FANOUT_JOB *job, size_t count)
+{
+    if (atomic_fetch_sub_explicit(&job->remaining, count, memory_order_acq_rel) != count)
+        return;
+
+    pthread_mutex_lock(&job->lock);
+    job->done = 1;
+    pthread_cond_signal(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+}
+
+// Run a task, leaving its upper halves to thieves until one chunk is left
+static void run_task(FANOUT_WORKER *w, FANOUT_TASK task)
+{
+    while (task.hi - task.lo > FANOUT_CHUNK)
+    {
+        size_t mid = task.lo + (task.hi - task.lo) / 2;
+        if (deque_push(w, task.job, mid, task.hi) < 0)
+            break;
+        task.hi = mid;
+        wake_one();
+    }
+
+    task.job->fn(task.job->arg, task.lo, task.hi);
+    job_finish(task.job, task.hi - task.lo);
+}
+
+static int find_task(FANOUT_WORKER *w, FANOUT_TASK *task)
+{
+    if (deque_pop(w, task))
+        return 1;
+
+    unsigned start = rand_r(&w->seed) % workerCount;
+    for (unsigned i = 0; i < workerCount; i++)
+    {
+        FANOUT_WORKER *victim = &workers[(start + i) % workerCount];
+        if (victim != w && deque_steal(victim, task))
+        {
+            stats_add(STAT_FANOUT_STEALS, 1);
+            return 1;
+        }
+    }
+
+    if (atomic_load_explicit(&injected, memory_order_acquire) == 0)
+        return 0;
+
+    int found = 0;
+    pthread_mutex_lock(&pool_mtx);
+    {
+        FANOUT_JOB *job = injectHead;
+        if (job)
+        {
+            injectHead = job->next;
+            if (injectHead == NULL)
+                injectTail = NULL;
+            atomic_fetch_sub_explicit(&injected, 1, memory_order_relaxed);
+
+            task->job = job;
+            task->lo = job->lo;
+            task->hi = job->hi;
+            found = 1;
+        }
+    }
+    pthread_mutex_unlock(&pool_mtx);
+    return found;
+}
+
+// Anything left to do for an idle worker? Called under pool_mtx.
+static int work_visible(void)
+{
+    if (injectHead)
+        return 1;
+    for (unsigned i = 0; i < workerCount; i++)
+        if (!deque_empty(&workers[i]))
+            return 1;
+    return 0;
+}
+
+static void *worker_main(void *arg)
+{
+    FANOUT_WORKER *w = (FANOUT_WORKER *)arg;
+    FANOUT_TASK task;
+
+    while (!atomic_load(&stopping))
+    {
+        if (find_task(w, &task))
+        {
+            run_task(w, task);
+            continue;
+        }
+
+        // Announce the sleep before the last look, so a push either sees
+        // a sleeper to wake or is seen here
+        pthread_mutex_lock(&pool_mtx);
+        atomic_fetch_add(&sleepers, 1);
+        if (!work_visible() && !atomic_load(&stopping))
+            pthread_cond_wait(&pool_cond, &pool_mtx);
+        atomic_fetch_sub(&sleepers, 1);
+        pthread_mutex_unlock(&pool_mtx);
+    }
+
+    return NULL;
+}
+
+int fanout_start(unsigned count)
+{
+    if (count == 0)
+        return 0;
+
+    workers = aligned_alloc(64, count * sizeof(FANOUT_WORKER));
+    if (workers == NULL)
+    {
+        perror("aligned_alloc fan-out workers");
+        return -1;
+    }
+    memset(workers, 0, count * sizeof(FANOUT_WORKER));
+
+    for (unsigned i = 0; i < count; i++)
+    {
+        FANOUT_WORKER *w = &workers[i];
+        atomic_init(&w->top, 0);
+        atomic_init(&w->bottom, 0);
+        w->index = i;
+        w->seed = i + 1;
+    }
+
+    // Workers steal from every deque, so all exist before the first starts
+    workerCount = count;
+    for (unsigned i = 0; i < count; i++)
+    {
+        if (pthread_create(&workers[i].tid, NULL, worker_main, &workers[i]) != 0)
+        {
+            perror("pthread_create fan-out worker");
+            workerCount = i;
+            fanout_stop();
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int fanout_parallel(size_t count)
+{
+    return workerCount > 0 && count > fanout_threshold && count > FANOUT_CHUNK;
+}
+
+void fanout_run(void (*fn)(void *arg, size_t lo, size_t hi), void *arg, size_t count)
+{
+    if (workerCount == 0 || count <= FANOUT_CHUNK)
+    {
+        fn(arg, 0, count);
+        return;
+    }
+
+    FANOUT_JOB job;
+    job.fn = fn;
+    job.arg = arg;
+    atomic_init(&job.remaining, count);
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.cond, NULL);
+    job.done = 0;
+
+    // Everything after the first chunk goes to the pool
+    job.lo = FANOUT_CHUNK;
+    job.hi = count;
+    job.next = NULL;
+
+    pthread_mutex_lock(&pool_mtx);
+    {
+        if (injectTail)
+            injectTail->next = &job;
+        else
+            injectHead = &job;
+        injectTail = &job;
+        atomic_fetch_add_explicit(&injected, 1, memory_order_release);
+        pthread_cond_signal(&pool_cond);
+    }
+    pthread_mutex_unlock(&pool_mtx);
+    stats_add(STAT_PARALLEL_FANOUTS, 1);
+
+    // The first chunk is the publisher's own, delivered while the pool
+    // picks up the rest
+    fn(arg, 0, FANOUT_CHUNK);
+    job_finish(&job, FANOUT_CHUNK);
+
+    pthread_mutex_lock(&job.lock);
+    while (!job.done)
+        pthread_cond_wait(&job.cond, &job.lock);
+    pthread_mutex_unlock(&job.lock);
+
+    pthread_mutex_destroy(&job.lock);
+    pthread_cond_destroy(&job.cond);
+}
+
+void fanout_stop(void)
+{
+    if (workers == NULL)
+        return;
+
+    pthread_mutex_lock(&pool_mtx);
+    atomic_store(&stopping, 1);
+    pthread_cond_broadcast(&pool_cond);
+    pthread_mutex_unlock(&pool_mtx);
+
+    for (unsigned i = 0; i < workerCount; i++)
+        pthread_join(workers[i].tid, NULL);
+
+    free(workers);
+    workers = NULL;
+    workerCount = 0;
+}
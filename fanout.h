@@ -0,0 +1,44 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+
+#include <stddef.h>
+
+// Parallel fan-out (--fanout-workers N).
+//
+// A publish to a topic with more than --fanout-threshold subscribers is
+// spread over a pool of worker threads instead of being queued one
+// subscriber after the other on the publisher's thread. fanout_run() covers
+// a range of subscriber indexes and returns only once all of them are done,
+// so a topic's messages still reach every subscriber in publish order, and
+// whatever the caller holds (the RCU read section protecting the subscriber
+// snapshot, the topic's history lock) protects the workers too.
+//
+// Work is balanced by stealing. Every worker owns a Chase-Lev deque: it
+// splits a range larger than FANOUT_CHUNK in halves, pushes the upper half
+// to the bottom of its deque and goes on with the lower one, popping its
+// own deque from the bottom when done. Idle workers steal from the top of
+// the other deques, where the largest ranges are. Publishers are not pool
+// threads: they hand the range to the pool through a shared injection
+// queue and deliver the first chunk themselves meanwhile.
+
+#define DEFAULT_FANOUT_THRESHOLD    1024
+#define FANOUT_CHUNK                256     // subscribers one task delivers to
+#define FANOUT_MAX_WORKERS          256
+
+extern unsigned fanout_workers;
+extern size_t fanout_threshold;
+
+// Start the workers; with 0 every fan-out runs on the publisher's thread
+int fanout_start(unsigned workers);
+
+// True if a fan-out to count subscribers should go to the pool
+int fanout_parallel(size_t count);
+
+// Call fn for consecutive subranges of [0, count), at most FANOUT_CHUNK
+// long, on the pool and the calling thread. Returns when all have run.
+void fanout_run(void (*fn)(void *arg, size_t lo, size_t hi), void *arg, size_t count);
+
+// Stop and join the workers
+void fanout_stop(void);
+
+#endif // FANOUT_H
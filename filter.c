@@ -0,0 +1,190 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "filter.h"
+
+#define FILTER_BUCKETS  256     // power of two
+
+static pthread_mutex_t filters_mtx = PTHREAD_MUTEX_INITIALIZER;
+static FILTER *buckets[FILTER_BUCKETS];
+static size_t filters = 0;
+
+// FNV-1a
+static uint64_t spec_hash(const char *spec, size_t len)
+{
+    uint64_t h = 1469598103934665603ULL;
+    for (size_t i = 0; i < len; i++)
+    {
+        h ^= (unsigned char)spec[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// Parse a spec into its kind and needle, without allocating
+static int parse_spec(const char *spec, size_t len, filter_kind_t *kind, size_t *needleStart, const char **error)
+{
+    if (len == 0)
+    {
+        *error = "empty filter";
+        return -1;
+    }
+    if (len > FILTER_MAX_SPEC)
+    {
+        *error = "filter longer than 256 bytes";
+        return -1;
+    }
+
+    if (len >= 7 && memcmp(spec, "prefix:", 7) == 0)
+    {
+        *kind = FILTER_PREFIX;
+        *needleStart = 7;
+    }
+    else if (len >= 9 && memcmp(spec, "contains:", 9) == 0)
+    {
+        *kind = FILTER_CONTAINS;
+        *needleStart = 9;
+    }
+    else
+    {
+        const char *eq = memchr(spec, '=', len);
+        if (eq == NULL || eq == spec)
+        {
+            *error = "expected prefix:TEXT, contains:TEXT or KEY=VALUE";
+            return -1;
+        }
+        *kind = FILTER_FIELD;
+        *needleStart = 0;
+    }
+
+    if (*needleStart == len)
+    {
+        *error = "empty filter text";
+        return -1;
+    }
+    return 0;
+}
+
+FILTER* filter_compile(const char *spec, size_t len, const char **error)
+{
+    filter_kind_t kind;
+    size_t needleStart;
+    if (parse_spec(spec, len, &kind, &needleStart, error) < 0)
+        return NULL;
+
+    uint64_t hash = spec_hash(spec, len);
+    FILTER **bucket = &buckets[hash & (FILTER_BUCKETS - 1)];
+    FILTER *filter;
+
+    pthread_mutex_lock(&filters_mtx);
+    for (filter = *bucket; filter != NULL; filter = filter->next)
+    {
+        if (filter->hash == hash && filter->specLen == len && memcmp(filter->spec, spec, len) == 0)
+        {
+            filter->refs++;
+            break;
+        }
+    }
+
+    if (filter == NULL)
+    {
+        filter = malloc(sizeof(FILTER) + len + 1);
+        if (filter == NULL)
+        {
+            perror("malloc FILTER");
+            *error = "out of memory";
+        }
+        else
+        {
+            filter->kind = kind;
+            filter->hash = hash;
+            filter->refs = 1;
+            memcpy(filter->spec, spec, len);
+            filter->spec[len] = '\0';
+            filter->specLen = len;
+            filter->needle = filter->spec + needleStart;
+            filter->needleLen = len - needleStart;
+
+            filter->next = *bucket;
+            *bucket = filter;
+            filters++;
+        }
+    }
+    pthread_mutex_unlock(&filters_mtx);
+
+    return filter;
+}
+
+void filter_retain(FILTER *filter)
+{
+    pthread_mutex_lock(&filters_mtx);
+    filter->refs++;
+    pthread_mutex_unlock(&filters_mtx);
+}
+
+void filter_release(FILTER *filter)
+{
+    if (filter == NULL)
+        return;
+
+    pthread_mutex_lock(&filters_mtx);
+    if (--filter->refs > 0)
+        filter = NULL;
+    else
+    {
+        FILTER **link = &buckets[filter->hash & (FILTER_BUCKETS - 1)];
+        while (*link != filter)
+            link = &(*link)->next;
+        *link = filter->next;
+        filters--;
+    }
+    pthread_mutex_unlock(&filters_mtx);
+
+    free(filter);
+}
+
+// The delimiters listed in filter.h
+static int field_delimiter(char c)
+{
+    return c == ' ' || c == ',' || c == ';' || c == '&' || c == '\t' || c == '\r' || c == '\n';
+}
+
+int filter_match(const FILTER *filter, const char *payload, size_t len)
+{
+    const char *needle = filter->needle;
+    size_t n = filter->needleLen;
+
+    switch (filter->kind)
+    {
+        case FILTER_PREFIX:
+            return len >= n && memcmp(payload, needle, n) == 0;
+
+        case FILTER_CONTAINS:
+            return memmem(payload, len, needle, n) != NULL;
+
+        case FILTER_FIELD:
+        {
+            // Every occurrence of KEY=VALUE, until one is a whole field
+            const char *p = payload;
+            const char *end = payload + len;
+            while ((p = memmem(p, (size_t)(end - p), needle, n)) != NULL)
+            {
+                if ((p == payload || field_delimiter(p[-1])) && (p + n == end || field_delimiter(p[n])))
+                    return 1;
+                p++;
+            }
+            return 0;
+        }
+    }
+    return 0;
+}
+
+size_t filter_count(void)
+{
+    pthread_mutex_lock(&filters_mtx);
+    size_t count = filters;
+    pthread_mutex_unlock(&filters_mtx);
+    return count;
+}
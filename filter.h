@@ -0,0 +1,60 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Content filters on subscriptions (/subscribe --filter SPEC "topic").
+//
+// A subscription with a filter only gets the messages whose payload the
+// filter matches:
+//   prefix:TEXT     the payload starts with TEXT
+//   contains:TEXT   TEXT occurs anywhere in the payload
+//   KEY=VALUE       the payload has the field KEY=VALUE, delimited by the
+//                   start or end of the payload or by one of " ,;&\t\r\n"
+//
+// A spec is compiled once, at subscribe time, and interned: every
+// subscription with the same spec shares one FILTER. The subscriber
+// snapshots group their clients by FILTER, so a publish evaluates each
+// distinct filter once, however many subscribers use it.
+//
+// Subscriptions and snapshots each hold a reference. A snapshot is only
+// freed once no reader can use it any more, so the last release can free
+// the filter right away.
+
+#define FILTER_MAX_SPEC     256
+
+typedef enum
+{
+    FILTER_PREFIX = 1,
+    FILTER_CONTAINS,
+    FILTER_FIELD
+} filter_kind_t;
+
+typedef struct filter_st {
+    filter_kind_t kind;
+    uint64_t hash;              // of the spec, for the intern table
+    unsigned long refs;         // changed under the intern table lock
+    struct filter_st *next;     // intern table chain
+
+    const char *needle;         // what is searched for, inside spec
+    size_t needleLen;
+    size_t specLen;
+    char spec[];                // as subscribed, NUL-terminated
+} FILTER;
+
+// Compile a spec, or return the interned filter with the same spec, with
+// a new reference. NULL if the spec is invalid or on allocation failure;
+// error then says why.
+FILTER* filter_compile(const char *spec, size_t len, const char **error);
+
+void filter_retain(FILTER *filter);
+void filter_release(FILTER *filter);
+
+// 1 if the payload passes the filter
+int filter_match(const FILTER *filter, const char *payload, size_t len);
+
+// Distinct filters currently in use
+size_t filter_count(void);
+
+#endif // FILTER_H
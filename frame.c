@@ -0,0 +1,231 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "frame.h"
+
+void frame_header(unsigned char *hdr, uint8_t type, uint8_t flags, size_t topicLen, size_t payloadLen)
+{
+    uint16_t tlen = htons((uint16_t)topicLen);
+    uint16_t reserved = 0;
+    uint32_t plen = htonl((uint32_t)payloadLen);
+
+    hdr[0] = FRAME_MAGIC;
+    hdr[1] = FRAME_VERSION;
+    hdr[2] = type;
+    hdr[3] = flags;
+    memcpy(hdr + 4, &tlen, 2);
+    memcpy(hdr + 6, &reserved, 2);
+    memcpy(hdr + 8, &plen, 4);
+}
+
+void frame_seq(unsigned char *p, uint64_t seq)
+{
+    uint64_t be = htobe64(seq);
+    memcpy(p, &be, FRAME_SEQ_LEN);
+}
+
+void frame_topic_id(unsigned char *p, uint32_t id)
+{
+    uint32_t be = htonl(id);
+    memcpy(p, &be, FRAME_TOPIC_ID_LEN);
+}
+
+static uint32_t read_topic_id(const char *p)
+{
+    uint32_t be;
+    memcpy(&be, p, FRAME_TOPIC_ID_LEN);
+    return ntohl(be);
+}
+
+ssize_t frame_parse(const char *buf, size_t len, FRAME *frame)
+{
+    const unsigned char *hdr = (const unsigned char *)buf;
+
+    // Reject garbage as soon as the first bytes are in
+    if (len >= 1 && hdr[0] != FRAME_MAGIC)
+        return -1;
+    if (len >= 2 && hdr[1] != FRAME_VERSION)
+        return -1;
+    if (len < FRAME_HEADER_LEN)
+        return 0;
+
+    uint16_t tlen;
+    uint32_t plen;
+    memcpy(&tlen, hdr + 4, 2);
+    memcpy(&plen, hdr + 8, 4);
+    tlen = ntohs(tlen);
+    plen = ntohl(plen);
+
+    if (tlen > FRAME_MAX_TOPIC || plen > FRAME_MAX_PAYLOAD)
+        return -1;
+    if ((hdr[3] & FRAME_FLAG_TOPIC_ID) && tlen != FRAME_TOPIC_ID_LEN)
+        return -1;
+    if (hdr[2] == FRAME_TOPIC_ID && plen != FRAME_TOPIC_ID_LEN)
+        return -1;
+
+    size_t header = FRAME_HEADER_LEN + (hdr[3] & FRAME_FLAG_SEQ ? FRAME_SEQ_LEN : 0);
+    size_t total = header + (size_t)tlen + (size_t)plen;
+    if (len < total)
+        return 0;
+
+    frame->type = hdr[2];
+    frame->flags = hdr[3];
+    frame->topic = buf + header;
+    frame->topicLen = tlen;
+    frame->payload = buf + header + tlen;
+    frame->payloadLen = plen;
+    frame->seq = 0;
+    if (hdr[3] & FRAME_FLAG_SEQ)
+    {
+        uint64_t be;
+        memcpy(&be, buf + FRAME_HEADER_LEN, FRAME_SEQ_LEN);
+        frame->seq = be64toh(be);
+    }
+    frame->topicId = 0;
+    if (hdr[3] & FRAME_FLAG_TOPIC_ID)
+        frame->topicId = read_topic_id(frame->topic);
+    else if (hdr[2] == FRAME_TOPIC_ID)
+        frame->topicId = read_topic_id(frame->payload);
+
+    return (ssize_t)total;
+}
+
+int frame_send(int socket, uint8_t type, uint8_t flags, const char *topic, size_t topicLen, const char *payload, size_t payloadLen)
+{
+    if (topicLen > FRAME_MAX_TOPIC || payloadLen > FRAME_MAX_PAYLOAD)
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    unsigned char hdr[FRAME_HEADER_LEN];
+    frame_header(hdr, type, flags, topicLen, payloadLen);
+
+    struct iovec iov[3];
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = FRAME_HEADER_LEN;
+    iov[1].iov_base = (void *)topic;
+    iov[1].iov_len = topicLen;
+    iov[2].iov_base = (void *)payload;
+    iov[2].iov_len = payloadLen;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 3;
+
+    size_t left = FRAME_HEADER_LEN + topicLen + payloadLen;
+    while (left > 0)
+    {
+        ssize_t n = sendmsg(socket, &msg, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        left -= (size_t)n;
+
+        // Skip what was written
+        while (n > 0 && msg.msg_iovlen > 0)
+        {
+            if ((size_t)n >= msg.msg_iov->iov_len)
+            {
+                n -= (ssize_t)msg.msg_iov->iov_len;
+                msg.msg_iov++;
+                msg.msg_iovlen--;
+            }
+            else
+            {
+                msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + n;
+                msg.msg_iov->iov_len -= (size_t)n;
+                n = 0;
+            }
+        }
+    }
+
+    return 0;
+}
+
+int frame_handshake(int socket, const char *role)
+{
+    char line[HANDSHAKE_MAX];
+    int len = snprintf(line, sizeof(line), "%s %s\n", role, HANDSHAKE_BINARY);
+
+    if (send(socket, line, (size_t)len, MSG_NOSIGNAL) != len)
+        return -1;
+
+    // Read the answer one byte at a time so nothing after it is consumed
+    size_t n = 0;
+    while (n < sizeof(line) - 1)
+    {
+        ssize_t r = recv(socket, line + n, 1, 0);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return -1;
+        if (line[n++] == '\n')
+            break;
+    }
+    line[n] = '\0';
+
+    if (strcmp(line, HANDSHAKE_OK_BINARY) == 0)
+        return 1;
+    if (strcmp(line, HANDSHAKE_OK_TEXT) == 0)
+        return 0;
+    return -1;
+}
+
+void inbuf_init(INBUF *in)
+{
+    in->data = NULL;
+    in->len = 0;
+    in->cap = 0;
+}
+
+int inbuf_append(INBUF *in, const char *data, size_t len)
+{
+    if (in->len + len > in->cap)
+    {
+        size_t newcap = in->cap ? in->cap : 4096;
+        while (newcap < in->len + len)
+            newcap *= 2;
+
+        char *newdata = realloc(in->data, newcap);
+        if (newdata == NULL)
+        {
+            perror("realloc input buffer");
+            return -1;
+        }
+        in->data = newdata;
+        in->cap = newcap;
+    }
+
+    memcpy(in->data + in->len, data, len);
+    in->len += len;
+    return 0;
+}
+
+// Drop the first len bytes
+void inbuf_consume(INBUF *in, size_t len)
+{
+    if (len >= in->len)
+    {
+        in->len = 0;
+        return;
+    }
+
+    memmove(in->data, in->data + len, in->len - len);
+    in->len -= len;
+}
+
+void inbuf_free(INBUF *in)
+{
+    free(in->data);
+    inbuf_init(in);
+}
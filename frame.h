@@ -0,0 +1,108 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Binary framing protocol, version 1.
+//
+// A client asks for it in the role handshake by sending a line such as
+//     "PUBLISHER BIN/1\n"   or   "SUBSCRIBER BIN/1\n"
+// and the server answers "OK BIN/1\n" (or "OK TEXT\n" to fall back to the
+// text protocol). Clients that send the bare role word ("PUBLISHER") keep
+// using the text protocol.
+//
+// Every frame is a 12 byte header followed by the topic and the payload.
+// Multi-byte fields are in network byte order.
+//
+//   0       1        2      3       4           6          8
+//   +-------+--------+------+-------+-----------+----------+-------------+
+//   | magic | version| type | flags | topic_len | reserved | payload_len |
+//   +-------+--------+------+-------+-----------+----------+-------------+
+//   | topic (topic_len bytes) | payload (payload_len bytes)              |
+//
+// A FRAME_MESSAGE from a server that logs messages (--wal) has the
+// FRAME_FLAG_SEQ flag set and the message's sequence number, 8 bytes,
+// between the header and the topic. /subscribe --from takes it to resume.
+//
+// Topic IDs. The server numbers every topic when it creates it. A client
+// that sets FRAME_FLAG_WANT_ID on a PUBLISH (or on any COMMAND, for a
+// subscriber) gets a FRAME_TOPIC_ID frame: the topic's name as topic and
+// its ID, 4 bytes, as payload. Frames with FRAME_FLAG_TOPIC_ID then carry
+// the 4 byte ID instead of the name in the topic field: a publisher's
+// PUBLISH frames, and the MESSAGE frames the server sends a subscriber
+// that asked, each announced by a FRAME_TOPIC_ID first. IDs are only valid
+// on the connection they were learned on while the server runs.
+
+#define FRAME_MAGIC         0xB5
+#define FRAME_VERSION       1
+#define FRAME_HEADER_LEN    12
+#define FRAME_MAX_TOPIC     1024
+#define FRAME_MAX_PAYLOAD   (1024 * 1024)
+#define FRAME_SEQ_LEN       8
+#define FRAME_TOPIC_ID_LEN  4
+
+#define FRAME_FLAG_SEQ      0x01
+#define FRAME_FLAG_TOPIC_ID 0x02    // topic field is a topic ID
+#define FRAME_FLAG_WANT_ID  0x04    // client asks for topic IDs
+
+#define HANDSHAKE_BINARY    "BIN/1"
+#define HANDSHAKE_OK_BINARY "OK BIN/1\n"
+#define HANDSHAKE_OK_TEXT   "OK TEXT\n"
+#define HANDSHAKE_MAX       64
+
+typedef enum
+{
+    FRAME_PUBLISH = 1,      // publisher -> server: topic + payload
+    FRAME_MESSAGE = 2,      // server -> subscriber: topic + payload
+    FRAME_COMMAND = 3,      // subscriber -> server: command text as payload
+    FRAME_REPLY   = 4,      // server -> client: informational text as payload
+    FRAME_TOPIC_ID = 5      // server -> client: topic name + its ID as payload
+} frame_type_t;
+
+typedef struct frame_st {
+    uint8_t type;
+    uint8_t flags;
+    const char *topic;      // points into the parsed buffer
+    size_t topicLen;
+    const char *payload;
+    size_t payloadLen;
+    uint64_t seq;           // 0 unless FRAME_FLAG_SEQ is set
+    uint32_t topicId;       // 0 unless FRAME_FLAG_TOPIC_ID is set or a FRAME_TOPIC_ID
+} FRAME;
+
+// Growable receive buffer for the streaming parsers
+typedef struct inbuf_st {
+    char *data;
+    size_t len;
+    size_t cap;
+} INBUF;
+
+void frame_header(unsigned char *hdr, uint8_t type, uint8_t flags, size_t topicLen, size_t payloadLen);
+
+// Store a FRAME_FLAG_SEQ sequence number right after the header
+void frame_seq(unsigned char *p, uint64_t seq);
+
+// Store a topic ID, for the topic field or a FRAME_TOPIC_ID payload
+void frame_topic_id(unsigned char *p, uint32_t id);
+
+// Parse one frame from the start of buf.
+// Returns the number of bytes it occupies, 0 if buf does not hold a whole
+// frame yet, or -1 if the data is not a valid frame.
+ssize_t frame_parse(const char *buf, size_t len, FRAME *frame);
+
+// Blocking write of a whole frame (used by the clients)
+int frame_send(int socket, uint8_t type, uint8_t flags, const char *topic, size_t topicLen, const char *payload, size_t payloadLen);
+
+// Client side of the handshake: ask for the binary protocol for the given
+// role and wait for the answer.
+// Returns 1 for binary, 0 if the server wants text, -1 on error.
+int frame_handshake(int socket, const char *role);
+
+void inbuf_init(INBUF *in);
+int inbuf_append(INBUF *in, const char *data, size_t len);
+void inbuf_consume(INBUF *in, size_t len);
+void inbuf_free(INBUF *in);
+
+#endif // FRAME_H
@@ -0,0 +1,277 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "history.h"
+#include "stats.h"
+#include "wal.h"
+#include "frame.h"
+#include "filter.h"
+
+#define HISTORY_MIN_SIZE    16
+
+size_t history_max_msgs = 0;
+unsigned history_max_age = 0;
+size_t history_max_bytes = DEFAULT_HISTORY_MAX_BYTES;
+
+// Every history, for eviction and shutdown. Only creation, eviction and
+// shutdown take this lock, never a plain append.
+static pthread_mutex_t histories_mtx = PTHREAD_MUTEX_INITIALIZER;
+static TOPIC_HISTORY *histories = NULL;
+static size_t historyCount = 0;
+
+static atomic_size_t totalBytes = 0;
+static atomic_ullong evicted = 0;
+
+static size_t entry_bytes(const HISTORY_ENTRY *e)
+{
+    return 2 * sizeof(MSGBUF) + e->text->len + e->frame->len;
+}
+
+TOPIC_HISTORY* history_lock(TOPIC *topic)
+{
+    // The message log needs the lock, not the history, to order replays
+    if (history_max_msgs == 0 && !wal_enabled())
+        return NULL;
+
+    TOPIC_HISTORY *history = atomic_load_explicit(&topic->history, memory_order_acquire);
+    if (history == NULL)
+    {
+        TOPIC_HISTORY *created = calloc(1, sizeof(TOPIC_HISTORY));
+        if (created == NULL)
+        {
+            perror("calloc topic history");
+            return NULL;
+        }
+        pthread_mutex_init(&created->lock, NULL);
+        atomic_init(&created->lastUsed, stats_now());
+
+        // Another thread may have created it in the meantime
+        if (atomic_compare_exchange_strong(&topic->history, &history, created))
+        {
+            history = created;
+
+            pthread_mutex_lock(&histories_mtx);
+            history->next = histories;
+            histories = history;
+            historyCount++;
+            pthread_mutex_unlock(&histories_mtx);
+        }
+        else
+        {
+            pthread_mutex_destroy(&created->lock);
+            free(created);
+        }
+    }
+
+    pthread_mutex_lock(&history->lock);
+    return history;
+}
+
+void history_unlock(TOPIC_HISTORY *history)
+{
+    pthread_mutex_unlock(&history->lock);
+}
+
+// Drop the oldest entry. Caller holds the history lock.
+static void drop_oldest(TOPIC_HISTORY *history)
+{
+    HISTORY_ENTRY *e = &history->ring[history->first];
+    size_t bytes = entry_bytes(e);
+
+    msgbuf_release_retained(e->text);
+    msgbuf_release_retained(e->frame);
+
+    history->first = (history->first + 1) & (history->size - 1);
+    history->count--;
+    atomic_fetch_sub_explicit(&history->bytes, bytes, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&totalBytes, bytes, memory_order_relaxed);
+}
+
+static int expired(const HISTORY_ENTRY *e, uint64_t now)
+{
+    return history_max_age && now - e->time > (uint64_t)history_max_age * 1000000000ULL;
+}
+
+// Make room for one more entry, growing the ring up to the message limit
+static int reserve(TOPIC_HISTORY *history)
+{
+    if (history->count < history->size)
+        return 0;
+
+    if (history->size >= history_max_msgs)
+    {
+        drop_oldest(history);
+        return 0;
+    }
+
+    size_t newSize = history->size ? history->size * 2 : HISTORY_MIN_SIZE;
+    HISTORY_ENTRY *ring = malloc(newSize * sizeof(HISTORY_ENTRY));
+    if (ring == NULL)
+    {
+        perror("malloc history ring");
+        if (history->count == 0)
+            return -1;
+        drop_oldest(history);
+        return 0;
+    }
+
+    for (size_t i = 0; i < history->count; i++)
+        ring[i] = history->ring[(history->first + i) & (history->size - 1)];
+
+    free(history->ring);
+    history->ring = ring;
+    history->size = newSize;
+    history->first = 0;
+    return 0;
+}
+
+void history_append(TOPIC_HISTORY *history, MSGBUF *text, MSGBUF *frame, uint64_t now)
+{
+    if (text == NULL || frame == NULL || history_max_msgs == 0)
+        return;
+
+    while (history->count && expired(&history->ring[history->first], now))
+        drop_oldest(history);
+
+    // The ring may be a power of two larger than the limit
+    while (history->count >= history_max_msgs)
+        drop_oldest(history);
+
+    if (reserve(history) < 0)
+        return;
+
+    HISTORY_ENTRY *e = &history->ring[(history->first + history->count) & (history->size - 1)];
+    e->text = text;
+    e->frame = frame;
+    e->time = now;
+    msgbuf_retain(text);
+    msgbuf_retain(frame);
+
+    size_t bytes = entry_bytes(e);
+    history->count++;
+    atomic_fetch_add_explicit(&history->bytes, bytes, memory_order_relaxed);
+    atomic_fetch_add_explicit(&totalBytes, bytes, memory_order_relaxed);
+    atomic_store_explicit(&history->lastUsed, now, memory_order_relaxed);
+}
+
+// Does a kept message pass the filter? Its payload is in the frame.
+static int entry_passes(HISTORY_ENTRY *e, const FILTER *filter)
+{
+    FRAME frame;
+    if (filter == NULL)
+        return 1;
+    if (frame_parse(e->frame->data, e->frame->len, &frame) <= 0)
+        return 0;
+    return filter_match(filter, frame.payload, frame.payloadLen);
+}
+
+size_t history_count(TOPIC_HISTORY *history, uint64_t now, const FILTER *filter)
+{
+    size_t n = 0;
+    for (size_t i = 0; i < history->count; i++)
+    {
+        HISTORY_ENTRY *e = &history->ring[(history->first + i) & (history->size - 1)];
+        n += !expired(e, now) && entry_passes(e, filter);
+    }
+    return n;
+}
+
+size_t history_replay(TOPIC_HISTORY *history, CLIENT *client, uint64_t now, const FILTER *filter)
+{
+    size_t n = 0;
+
+    for (size_t i = 0; i < history->count; i++)
+    {
+        HISTORY_ENTRY *e = &history->ring[(history->first + i) & (history->size - 1)];
+        if (expired(e, now) || !entry_passes(e, filter))
+            continue;
+        if (client_enqueue(client, client->binary ? e->frame : e->text, OVERFLOW_UNSET, NULL, NULL) >= 0)
+            n++;
+    }
+    return n;
+}
+
+// Least recently published history that still holds messages
+static TOPIC_HISTORY* lru_victim(void)
+{
+    TOPIC_HISTORY *victim = NULL;
+    unsigned long long oldest = 0;
+
+    for (TOPIC_HISTORY *h = histories; h != NULL; h = h->next)
+    {
+        unsigned long long used = atomic_load_explicit(&h->lastUsed, memory_order_relaxed);
+        if (atomic_load_explicit(&h->bytes, memory_order_relaxed) && (victim == NULL || used < oldest))
+        {
+            victim = h;
+            oldest = used;
+        }
+    }
+    return victim;
+}
+
+void history_evict(void)
+{
+    if (atomic_load_explicit(&totalBytes, memory_order_relaxed) <= history_max_bytes)
+        return;
+
+    // One evicting thread is enough; the others go on publishing
+    if (pthread_mutex_trylock(&histories_mtx) != 0)
+        return;
+
+    // Evict down to 7/8 of the cap so the scan is not repeated on every
+    // publish once the cap is reached
+    size_t target = history_max_bytes - history_max_bytes / 8;
+
+    while (atomic_load_explicit(&totalBytes, memory_order_relaxed) > target)
+    {
+        TOPIC_HISTORY *victim = lru_victim();
+        if (victim == NULL)
+            break;
+
+        pthread_mutex_lock(&victim->lock);
+        while (victim->count && atomic_load_explicit(&totalBytes, memory_order_relaxed) > target)
+        {
+            drop_oldest(victim);
+            atomic_fetch_add_explicit(&evicted, 1, memory_order_relaxed);
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+
+    pthread_mutex_unlock(&histories_mtx);
+}
+
+void history_stats(HISTORY_STATS *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+
+    pthread_mutex_lock(&histories_mtx);
+    stats->topics = historyCount;
+    for (TOPIC_HISTORY *h = histories; h != NULL; h = h->next)
+    {
+        pthread_mutex_lock(&h->lock);
+        stats->messages += h->count;
+        stats->bytes += atomic_load_explicit(&h->bytes, memory_order_relaxed);
+        pthread_mutex_unlock(&h->lock);
+    }
+    pthread_mutex_unlock(&histories_mtx);
+
+    stats->evicted = atomic_load_explicit(&evicted, memory_order_relaxed);
+}
+
+void history_shutdown(void)
+{
+    pthread_mutex_lock(&histories_mtx);
+    while (histories)
+    {
+        TOPIC_HISTORY *h = histories;
+        histories = h->next;
+
+        while (h->count)
+            drop_oldest(h);
+        free(h->ring);
+        pthread_mutex_destroy(&h->lock);
+        free(h);
+    }
+    historyCount = 0;
+    pthread_mutex_unlock(&histories_mtx);
+}
@@ -0,0 +1,81 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "server.h"
+
+struct filter_st;
+
+// Per-topic message history (--history N). Every topic keeps its last N
+// messages, optionally only those younger than --history-age seconds, so a
+// subscriber can ask for them with /subscribe --replay.
+//
+// Entries hold references to the same encoded buffers the fan-out queued,
+// so keeping and replaying history never copies a payload. All histories
+// together are capped at --history-bytes; over the cap, the oldest
+// messages of the least recently published topic are evicted first.
+//
+// A topic's history lock is held across appending a message and fanning it
+// out, and across subscribing and replaying, so a replaying subscriber
+// gets every message exactly once: either from the history or live.
+// With a message log (wal.h) the lock exists even without --history, and
+// also covers logging the message, so /subscribe --from works the same way.
+// Lock order: history lock, then registry shard locks and client queues.
+
+#define DEFAULT_HISTORY_MAX_BYTES   (64 * 1024 * 1024)
+
+typedef struct historyEntry_st {
+    MSGBUF *text;               // one encoding per protocol
+    MSGBUF *frame;
+    uint64_t time;              // stats_now() of the publish
+} HISTORY_ENTRY;
+
+typedef struct topicHistory_st {
+    pthread_mutex_t lock;
+    HISTORY_ENTRY *ring;        // power-of-two sized, grows up to the limit
+    size_t size;
+    size_t first;               // index of the oldest entry
+    size_t count;
+    atomic_size_t bytes;        // read unlocked when picking an LRU victim
+    atomic_ullong lastUsed;     // stats_now() of the last append, for LRU
+    struct topicHistory_st *next;   // all histories, under the global lock
+} TOPIC_HISTORY;
+
+typedef struct historyStats_st {
+    size_t topics;
+    size_t messages;
+    size_t bytes;
+    unsigned long long evicted;     // dropped by the global byte cap
+} HISTORY_STATS;
+
+extern size_t history_max_msgs;     // 0 disables the history
+extern unsigned history_max_age;    // seconds, 0 for no age limit
+extern size_t history_max_bytes;
+
+// Lock the history of a topic, creating it on first use. NULL when both
+// the history and the message log are disabled, or on allocation failure.
+TOPIC_HISTORY* history_lock(TOPIC *topic);
+void history_unlock(TOPIC_HISTORY *history);
+
+// Keep a published message; takes its own references on both buffers.
+// Caller holds the history lock.
+void history_append(TOPIC_HISTORY *history, MSGBUF *text, MSGBUF *frame, uint64_t now);
+
+// Messages that would be replayed now, only those filter passes unless it
+// is NULL. Caller holds the history lock.
+size_t history_count(TOPIC_HISTORY *history, uint64_t now, const struct filter_st *filter);
+
+// Queue the kept messages, oldest first, for a client without writing
+// them; with a filter only those it passes. Caller holds the history lock.
+// Returns the number queued.
+size_t history_replay(TOPIC_HISTORY *history, CLIENT *client, uint64_t now, const struct filter_st *filter);
+
+// Enforce the global byte cap. Call without any history lock held.
+void history_evict(void);
+
+void history_stats(HISTORY_STATS *stats);
+void history_shutdown(void);
+
+#endif // HISTORY_H
@@ -2,6 +2,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include "list.h"
+#include "filter.h"
+#include "rcu.h"
+#include "slab.h"
+
+static SLAB_CACHE topicCache = SLAB_CACHE_INIT("topic", sizeof(TOPIC));
+static SLAB_CACHE subscriberCache = SLAB_CACHE_INIT("subscriber", sizeof(SUBSCRIBER));
 
 void initSubscriber(SUBSCRIBER_HEAD *head)
 {
@@ -11,7 +17,7 @@ void initSubscriber(SUBSCRIBER_HEAD *head)
 // Create new subscriber
 SUBSCRIBER* createSubscriber(int socket) 
 {
-    SUBSCRIBER* newSubscriber = malloc(sizeof(SUBSCRIBER));
+    SUBSCRIBER* newSubscriber = slab_alloc(&subscriberCache);
     if(newSubscriber == NULL)
     {
         perror("malloc SUBSCRIBER");
@@ -19,7 +25,13 @@ SUBSCRIBER* createSubscriber(int socket)
     }
 
     newSubscriber->socket = socket;
+    newSubscriber->client = NULL;
+    newSubscriber->topic = NULL;
+    newSubscriber->filter = NULL;
     newSubscriber->next = NULL;
+    newSubscriber->prev = NULL;
+    newSubscriber->nextMembership = NULL;
+    newSubscriber->prevMembership = NULL;
 
     return newSubscriber;
 }
@@ -37,6 +49,7 @@ void addSubscriber(SUBSCRIBER_HEAD* head, SUBSCRIBER* newSubscriber)
             current = current->next;
 
         current->next = newSubscriber;
+        newSubscriber->prev = current;
     }
 }
 
@@ -49,53 +62,215 @@ void destroySubscribers(SUBSCRIBER_HEAD* head)
         current = head->firstNode;
         head->firstNode = current->next;
         current->next = NULL;
-        free(current);
+        filter_release(current->filter);
+        slab_free(&subscriberCache, current);
+    }
+}
+
+#define TOPIC_TABLE_MIN       64
+#define TOPIC_MIGRATE_STEP    16    // old slots moved per addTopic()
+
+// FNV-1a hash of a topic name
+uint64_t topicHash(const char *name)
+{
+    uint64_t h = 14695981039346656037ULL;
+    while (*name)
+    {
+        h ^= (unsigned char)*name++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// 0 for a concrete topic name, 1 for a wildcard pattern (a level that is
+// exactly "+" or "#"), -1 for an invalid pattern ("#" not the last level).
+// '+' and '#' inside a longer level are ordinary characters.
+int topicPattern(const char *name)
+{
+    int pattern = 0;
+
+    while (1)
+    {
+        const char *end = strchr(name, '/');
+        size_t len = end ? (size_t)(end - name) : strlen(name);
+
+        if (len == 1 && (name[0] == '+' || name[0] == '#'))
+        {
+            if (name[0] == '#' && end != NULL)
+                return -1;
+            pattern = 1;
+        }
+
+        if (end == NULL)
+            return pattern;
+        name = end + 1;
     }
 }
 
 void initTopic(TOPIC_HEAD *head)
 {
     head->firstNode = NULL;
+    head->lastNode = NULL;
+    head->count = 0;
+    head->table = NULL;
+    head->tableSize = 0;
+    head->oldTable = NULL;
+    head->oldSize = 0;
+    head->migrated = 0;
 } 
 
 // Create new topic
 TOPIC* createTopic(const char *name) 
 {
-    TOPIC* newTopic = malloc(sizeof(TOPIC));
+    TOPIC* newTopic = slab_alloc(&topicCache);
     if (newTopic == NULL)
     {
         perror("malloc TOPIC");
         return NULL;
     }
 
-    newTopic->name = strdup(name);
+    newTopic->name = slab_strdup(name);
     if (!newTopic->name)
     {
         perror("strdup topic name");
-        free(newTopic);
+        slab_free(&topicCache, newTopic);
         return NULL;
     }
 
+    newTopic->nameLen = strlen(name);
+    newTopic->hash = topicHash(name);
+    newTopic->id = 0;
+    newTopic->pattern = topicPattern(name) > 0;
     newTopic->subscribers = NULL;
+    newTopic->subscriberCount = 0;
+    newTopic->filteredCount = 0;
+    atomic_init(&newTopic->snapshot, NULL);
+    atomic_init(&newTopic->version, 0);
+    atomic_init(&newTopic->stale, 0);
+    atomic_init(&newTopic->resolved, NULL);
+    atomic_init(&newTopic->published, 0);
+    atomic_init(&newTopic->publishedBytes, 0);
+    newTopic->created = 0;
+    atomic_init(&newTopic->history, NULL);
+    atomic_init(&newTopic->overflow, 0);
+    atomic_init(&newTopic->conflate, 0);
+    atomic_init(&newTopic->announce, NULL);
     newTopic->nextTopic = NULL;
 
     return newTopic;
 }
 
-// Add new topic
-void addTopic(TOPIC_HEAD* head, TOPIC* newTopic)
+// Put a topic into a table, linear probing from its home slot
+static void tableInsert(TOPIC **table, size_t size, TOPIC *topic)
 {
-    if(head->firstNode == NULL) 
-        head->firstNode = newTopic;
-    else 
+    size_t mask = size - 1;
+    size_t i = (size_t)topic->hash & mask;
+
+    while (table[i] != NULL)
+        i = (i + 1) & mask;
+
+    table[i] = topic;
+}
+
+static TOPIC* tableFind(TOPIC **table, size_t size, const char *name, uint64_t hash)
+{
+    size_t mask = size - 1;
+    size_t i = (size_t)hash & mask;
+
+    while (table[i] != NULL)
+    {
+        if (table[i]->hash == hash && strcmp(table[i]->name, name) == 0)
+            return table[i];
+        i = (i + 1) & mask;
+    }
+    return NULL;
+}
+
+// Move up to 'steps' slots of the old table into the current one.
+// Old slots are left in place so probe chains in the old table stay intact.
+static void migrateTopics(TOPIC_HEAD *head, size_t steps)
+{
+    while (head->oldTable && steps-- > 0)
+    {
+        TOPIC *t = head->oldTable[head->migrated++];
+        if (t != NULL)
+            tableInsert(head->table, head->tableSize, t);
+
+        if (head->migrated == head->oldSize)
+        {
+            free(head->oldTable);
+            head->oldTable = NULL;
+            head->oldSize = 0;
+            head->migrated = 0;
+        }
+    }
+}
+
+// Make room for one more topic, starting an incremental resize if needed
+static int reserveTopic(TOPIC_HEAD *head)
+{
+    if (head->table == NULL)
     {
-        TOPIC* current = head->firstNode;
+        head->table = calloc(TOPIC_TABLE_MIN, sizeof(TOPIC *));
+        if (head->table == NULL)
+        {
+            perror("calloc topic table");
+            return -1;
+        }
+        head->tableSize = TOPIC_TABLE_MIN;
+        return 0;
+    }
+
+    // Keep the load factor under 3/4
+    if ((head->count + 1) * 4 <= head->tableSize * 3)
+        return 0;
 
-        while (current->nextTopic != NULL)
-            current = current->nextTopic;
+    // A previous resize must be finished before starting the next one
+    migrateTopics(head, head->oldSize);
 
-        current->nextTopic = newTopic;
+    TOPIC **newTable = calloc(head->tableSize * 2, sizeof(TOPIC *));
+    if (newTable == NULL)
+    {
+        perror("calloc topic table");
+        return -1;
     }
+
+    head->oldTable = head->table;
+    head->oldSize = head->tableSize;
+    head->migrated = 0;
+    head->table = newTable;
+    head->tableSize *= 2;
+    return 0;
+}
+
+// Add new topic. Returns -1 if the table could not grow; the topic is
+// then not added and still the caller's.
+int addTopic(TOPIC_HEAD* head, TOPIC* newTopic)
+{
+    if (newTopic == NULL)
+        return -1;
+
+    if (reserveTopic(head) < 0)
+        return -1;
+
+    migrateTopics(head, TOPIC_MIGRATE_STEP);
+    tableInsert(head->table, head->tableSize, newTopic);
+    head->count++;
+
+    // Keep insertion order for listing
+    if(head->firstNode == NULL) 
+        head->firstNode = newTopic;
+    else 
+        head->lastNode->nextTopic = newTopic;
+    head->lastNode = newTopic;
+    return 0;
+}
+
+// Free a topic that was never added to a table
+void freeTopic(TOPIC *topic)
+{
+    slab_strfree(topic->name);
+    slab_free(&topicCache, topic);
 }
 
 // Destroy all topics
@@ -111,155 +286,380 @@ void destroyTopics(TOPIC_HEAD* head)
         SUBSCRIBER_HEAD tempHead;
         tempHead.firstNode = current->subscribers;
         destroySubscribers(&tempHead);
+        freeSnapshot(atomic_load(&current->snapshot));
+        freeSnapshot(atomic_load(&current->resolved));
 
         // Free topic name
-        free(current->name);
+        slab_strfree(current->name);
 
         // Free topic
-        free(current);
+        slab_free(&topicCache, current);
     }
+
+    free(head->table);
+    free(head->oldTable);
+    initTopic(head);
+}
+
+// Find topic by name and its precomputed topicHash()
+TOPIC* findTopicHashed(TOPIC_HEAD *head, const char *name, uint64_t hash)
+{
+    if (head->table == NULL)
+        return NULL;
+
+    TOPIC *t = tableFind(head->table, head->tableSize, name, hash);
+    if (t == NULL && head->oldTable != NULL)
+        t = tableFind(head->oldTable, head->oldSize, name, hash);
+
+    // topic not found
+    return t;
 }
 
 // Find topic by name
 TOPIC* findTopic(TOPIC_HEAD *head, const char *name)
 {
-    TOPIC *current = head->firstNode;
+    return findTopicHashed(head, name, topicHash(name));
+}
 
-    while (current != NULL)
-    {
-        if (strcmp(current->name, name) == 0)
-            return current;
+#define MEMBERSHIP_INDEX_MIN  8
 
-        current = current->nextTopic;
-    }
+void initSubscriptions(SUBSCRIPTIONS *subs, int socket, struct client_st *client)
+{
+    subs->socket = socket;
+    subs->client = client;
+    subs->firstNode = NULL;
+    subs->count = 0;
+    subs->index = NULL;
+    subs->indexSize = 0;
+}
 
-    // topic not found
-    return NULL; 
+// Free the index. The memberships must have been removed already.
+void destroySubscriptions(SUBSCRIPTIONS *subs)
+{
+    free(subs->index);
+    subs->index = NULL;
+    subs->indexSize = 0;
 }
 
-// Add subscriber to topic he wants to subscribe to  
-int addSubscriberToTopic(TOPIC_HEAD *topics, const char *topicName, int socket)
+static void indexInsert(SUBSCRIBER **index, size_t size, SUBSCRIBER *sub)
 {
-    TOPIC *topic = findTopic(topics, topicName);
-    if (topic == NULL)
+    size_t mask = size - 1;
+    size_t i = (size_t)sub->topic->hash & mask;
+
+    while (index[i] != NULL)
+        i = (i + 1) & mask;
+
+    index[i] = sub;
+}
+
+// Membership of this connection in a topic, or NULL
+static SUBSCRIBER* findMembership(SUBSCRIPTIONS *subs, TOPIC *topic)
+{
+    if (subs->index == NULL)
+        return NULL;
+
+    size_t mask = subs->indexSize - 1;
+    for (size_t i = (size_t)topic->hash & mask; subs->index[i] != NULL; i = (i + 1) & mask)
     {
-        printf("Client %d wanted to connect to '%s', which is not in the registry\n", socket, topicName);        return -1;
+        if (subs->index[i]->topic == topic)
+            return subs->index[i];
     }
+    return NULL;
+}
 
-    // Check if the subscriber is already in topic
-    SUBSCRIBER *current = topic->subscribers;
-    while (current)
+// Make room for one more membership, keeping the load factor under 3/4
+static int reserveMembership(SUBSCRIPTIONS *subs)
+{
+    if ((subs->count + 1) * 4 <= subs->indexSize * 3)
+        return 0;
+
+    size_t newSize = subs->indexSize ? subs->indexSize * 2 : MEMBERSHIP_INDEX_MIN;
+    SUBSCRIBER **newIndex = calloc(newSize, sizeof(SUBSCRIBER *));
+    if (newIndex == NULL)
+    {
+        perror("calloc membership index");
+        return -1;
+    }
+
+    for (SUBSCRIBER *sub = subs->firstNode; sub != NULL; sub = sub->nextMembership)
+        indexInsert(newIndex, newSize, sub);
+
+    free(subs->index);
+    subs->index = newIndex;
+    subs->indexSize = newSize;
+    return 0;
+}
+
+// Delete from the index by shifting the rest of the probe run back, so
+// lookups never need tombstones
+static void indexRemove(SUBSCRIPTIONS *subs, SUBSCRIBER *sub)
+{
+    size_t mask = subs->indexSize - 1;
+    size_t i = (size_t)sub->topic->hash & mask;
+
+    while (subs->index[i] != sub)
+        i = (i + 1) & mask;
+
+    size_t hole = i;
+    for (i = (hole + 1) & mask; subs->index[i] != NULL; i = (i + 1) & mask)
     {
-        if (current->socket == socket)
+        size_t home = (size_t)subs->index[i]->topic->hash & mask;
+
+        // Move the entry into the hole unless its home lies in (hole, i]
+        if (((i - home) & mask) >= ((i - hole) & mask))
         {
-            printf("Subscriber %d already subscribed to '%s'\n", socket, topicName);
-            return 1;  
+            subs->index[hole] = subs->index[i];
+            hole = i;
         }
-        current = current->next;
     }
+    subs->index[hole] = NULL;
+}
+
+// Add subscriber to topic he wants to subscribe to. The membership takes
+// its own reference to filter. Returns -1 if the topic does not exist and
+// 1 if the subscriber already has it; the caller reports either, since
+// this runs under the registry lock.
+int addSubscriberToTopic(TOPIC_HEAD *topics, const char *topicName, SUBSCRIPTIONS *subs, struct filter_st *filter)
+{
+    TOPIC *topic = findTopic(topics, topicName);
+    if (topic == NULL)
+        return -1;
+
+    // Check if the subscriber is already in topic
+    if (findMembership(subs, topic) != NULL)
+        return 1;
 
     // If not
-    SUBSCRIBER *sub = createSubscriber(socket);
+    if (reserveMembership(subs) < 0)
+        return -1;
+
+    SUBSCRIBER *sub = createSubscriber(subs->socket);
     if (sub == NULL)
         return -1;
 
+    sub->client = subs->client;
+    sub->topic = topic;
+    if (filter)
+    {
+        filter_retain(filter);
+        sub->filter = filter;
+        topic->filteredCount++;
+    }
+
     sub->next = topic->subscribers;
+    if (topic->subscribers)
+        topic->subscribers->prev = sub;
     topic->subscribers = sub;
+    topic->subscriberCount++;
 
+    sub->nextMembership = subs->firstNode;
+    if (subs->firstNode)
+        subs->firstNode->prevMembership = sub;
+    subs->firstNode = sub;
+    indexInsert(subs->index, subs->indexSize, sub);
+    subs->count++;
+
+    publishSnapshot(topic);
     return 0;  
 }
 
+// Unlink a membership from its topic and its connection and free it
+static void removeMembership(SUBSCRIPTIONS *subs, SUBSCRIBER *sub)
+{
+    TOPIC *topic = sub->topic;
+
+    if (sub->prev)
+        sub->prev->next = sub->next;
+    else
+        topic->subscribers = sub->next; // it was the first element
+    if (sub->next)
+        sub->next->prev = sub->prev;
+    topic->subscriberCount--;
+    if (sub->filter)
+        topic->filteredCount--;
+
+    if (sub->prevMembership)
+        sub->prevMembership->nextMembership = sub->nextMembership;
+    else
+        subs->firstNode = sub->nextMembership;
+    if (sub->nextMembership)
+        sub->nextMembership->prevMembership = sub->prevMembership;
+    indexRemove(subs, sub);
+    subs->count--;
+
+    // Snapshots still holding the filter have references of their own
+    filter_release(sub->filter);
+    slab_free(&subscriberCache, sub);
+}
 
 // Remove subscriber for specific topic
-int removeSubscriberFromTopic(TOPIC *topic, int socket)
+int removeSubscriberFromTopic(TOPIC *topic, SUBSCRIPTIONS *subs)
 {
-    if (!topic || !topic->subscribers)
+    if (!topic)
         return -1; // nothing to remove
 
-    SUBSCRIBER *current = topic->subscribers;
-    SUBSCRIBER *prev = NULL;
+    SUBSCRIBER *sub = findMembership(subs, topic);
+    if (sub == NULL)
+        return -1; // subscriber not found
 
-    while (current)
+    removeMembership(subs, sub);
+    publishSnapshot(topic);
+    return 0; 
+}
+
+static SUBSCRIBER_SNAPSHOT* allocSnapshot(size_t count, size_t groups)
+{
+    SUBSCRIBER_SNAPSHOT *snap = malloc(sizeof(SUBSCRIBER_SNAPSHOT) + count * sizeof(struct client_st *) + groups * sizeof(SUBSCRIBER_GROUP));
+    if (snap == NULL)
     {
-        if (current->socket == socket)
-        {
-            
-            if (prev == NULL)
-                topic->subscribers = current->next; // it was the first element
-            else
-                prev->next = current->next;
+        perror("malloc SUBSCRIBER_SNAPSHOT");
+        return NULL;
+    }
 
-            free(current);
-            return 0; 
-        }
+    snap->generation = 0;
+    snap->version = 0;
+    snap->count = 0;
+    snap->plain = 0;
+    snap->groupCount = 0;
+    snap->groups = groups ? (SUBSCRIBER_GROUP *)&snap->clients[count] : NULL;
+    return snap;
+}
 
-        prev = current;
-        current = current->next;
-    }
+void freeSnapshot(void *ptr)
+{
+    SUBSCRIBER_SNAPSHOT *snap = (SUBSCRIBER_SNAPSHOT *)ptr;
+    if (snap == NULL)
+        return;
 
-    // subscriber not found
-    return -1; 
+    for (size_t i = 0; i < snap->groupCount; i++)
+        filter_release(snap->groups[i].filter);
+    free(snap);
 }
 
-// Remove subscriber from all of the topics he's in
-void removeSubscriberFromAllTopics(TOPIC_HEAD *head, int socket)
+static int compareEntryClients(const void *a, const void *b)
 {
-    TOPIC *currentTopic = head->firstNode;
-    while (currentTopic)
-    {
-        removeSubscriberFromTopic(currentTopic, socket);
-        currentTopic = currentTopic->nextTopic;
-    }
+    const SNAPSHOT_ENTRY *x = (const SNAPSHOT_ENTRY *)a;
+    const SNAPSHOT_ENTRY *y = (const SNAPSHOT_ENTRY *)b;
+    uintptr_t cx = (uintptr_t)x->client, cy = (uintptr_t)y->client;
+    return cx < cy ? -1 : cx > cy;
 }
 
-// Print topics and subscribers in a clean format
-void printTopicsAndSubscribers(TOPIC_HEAD *head)
+// Unfiltered entries first, then one run per filter
+static int compareEntryFilters(const void *a, const void *b)
 {
-    printf("[TOPICS] Current topics and subscribers:\n");
+    const SNAPSHOT_ENTRY *x = (const SNAPSHOT_ENTRY *)a;
+    const SNAPSHOT_ENTRY *y = (const SNAPSHOT_ENTRY *)b;
+    uintptr_t fx = (uintptr_t)x->filter, fy = (uintptr_t)y->filter;
+    if (fx != fy)
+        return fx < fy ? -1 : 1;
+    return compareEntryClients(a, b);
+}
 
-    TOPIC *t = head->firstNode;
-    if (!t)
+SUBSCRIBER_SNAPSHOT* buildSnapshot(SNAPSHOT_ENTRY *entries, size_t count, int merge)
+{
+    if (merge && count > 1)
     {
-        printf("  No topics available.\n\n");
-        return;
+        qsort(entries, count, sizeof(SNAPSHOT_ENTRY), compareEntryClients);
+
+        // A client gets the message once. With different filters on its
+        // subscriptions it gets every message, as no single filter covers
+        // what it asked for.
+        size_t unique = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            if (unique > 0 && entries[unique - 1].client == entries[i].client)
+            {
+                if (entries[unique - 1].filter != entries[i].filter)
+                    entries[unique - 1].filter = NULL;
+            }
+            else
+                entries[unique++] = entries[i];
+        }
+        count = unique;
     }
 
-    while (t)
-    {
-        printf("  - %s\n", t->name);  // Topic name
+    qsort(entries, count, sizeof(SNAPSHOT_ENTRY), compareEntryFilters);
+
+    size_t groups = 0;
+    for (size_t i = 0; i < count; i++)
+        if (entries[i].filter && (i == 0 || entries[i - 1].filter != entries[i].filter))
+            groups++;
 
-        SUBSCRIBER *s = t->subscribers;
-        if (!s)
+    SUBSCRIBER_SNAPSHOT *snap = allocSnapshot(count, groups);
+    if (snap == NULL)
+        return NULL;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        snap->clients[i] = entries[i].client;
+        if (entries[i].filter == NULL)
+            snap->plain++;
+        else if (i == 0 || entries[i - 1].filter != entries[i].filter)
         {
-            printf("      Subscribers: none\n");
+            SUBSCRIBER_GROUP *group = &snap->groups[snap->groupCount++];
+            group->filter = entries[i].filter;
+            group->start = i;
+            filter_retain(group->filter);
         }
+        if (entries[i].filter)
+            snap->groups[snap->groupCount - 1].end = i + 1;
+    }
+    snap->count = count;
+    return snap;
+}
+
+// Rebuild the topic's subscriber snapshot from its list and swap it in.
+// Caller holds the registry write lock.
+// If the new snapshot cannot be built, the old one is unpublished all the
+// same: it may hold clients that have just left and will be freed. The
+// topic is marked stale instead, and the next publish tries again.
+void publishSnapshot(TOPIC *topic)
+{
+    size_t count = topic->subscriberCount;
+    int failed = 0;
+
+    SUBSCRIBER_SNAPSHOT *snap = NULL;
+    if (count > 0 && topic->filteredCount > 0)
+    {
+        SNAPSHOT_ENTRY *entries = malloc(count * sizeof(SNAPSHOT_ENTRY));
+        if (entries == NULL)
+            perror("malloc SNAPSHOT_ENTRY");
         else
         {
-            printf("      Subscribers: ");
-            while (s)
+            size_t n = 0;
+            for (SUBSCRIBER *s = topic->subscribers; s != NULL; s = s->next)
             {
-                printf("%d", s->socket);
-                if (s->next) 
-                    printf(", "); // separate multiple subscribers
-                s = s->next;
+                entries[n].client = s->client;
+                entries[n].filter = s->filter;
+                n++;
             }
-            printf("\n");
+            snap = buildSnapshot(entries, n, 0);
+            free(entries);
         }
-
-        t = t->nextTopic;
+        failed = snap == NULL;
+    }
+    else if (count > 0)
+    {
+        snap = allocSnapshot(count, 0);
+        if (snap != NULL)
+        {
+            for (SUBSCRIBER *s = topic->subscribers; s != NULL; s = s->next)
+                snap->clients[snap->count++] = s->client;
+            snap->plain = snap->count;
+        }
+        failed = snap == NULL;
     }
 
-    printf("\n"); // extra line for readability
+    atomic_store_explicit(&topic->stale, failed, memory_order_release);
+    SUBSCRIBER_SNAPSHOT *old = atomic_exchange_explicit(&topic->snapshot, snap, memory_order_acq_rel);
+    rcu_retire(old, freeSnapshot);
+
+    // Any resolved set cached for this topic is stale now
+    atomic_fetch_add_explicit(&topic->version, 1, memory_order_acq_rel);
 }
 
-// Print topics
-void printTopics(TOPIC_HEAD *head)
+// Current subscriber snapshot; only valid inside rcu_read_lock()
+SUBSCRIBER_SNAPSHOT* topicSnapshot(TOPIC *topic)
 {
-    TOPIC *t = head->firstNode;
-    while (t)
-    {
-        printf("Topic: %s\n", t->name);
-        t = t->nextTopic;
-    }
+    return atomic_load_explicit(&topic->snapshot, memory_order_acquire);
 }
-
@@ -2,44 +2,147 @@
 #define LIST_H
 
 #include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
 
-// Subscriber
+struct client_st;
+struct topic_st;
+struct topicHistory_st;
+struct filter_st;
+struct msgbuf_st;
+
+// Subscriber: one membership of a connection in a topic. The node is on
+// two intrusive doubly-linked lists, the topic's subscribers and the
+// connection's subscriptions, so it can be unlinked from both in O(1).
 typedef struct subscriber_st {
     int socket;
-    struct subscriber_st *next;
+    struct client_st *client;
+    struct topic_st *topic;
+    struct filter_st *filter;               // content filter, NULL for every message
+    struct subscriber_st *next;             // topic's subscriber list
+    struct subscriber_st *prev;
+    struct subscriber_st *nextMembership;   // connection's subscription list
+    struct subscriber_st *prevMembership;
 } SUBSCRIBER;
 
 typedef struct subscriberHead_st {
     SUBSCRIBER *firstNode;
 } SUBSCRIBER_HEAD;
 
+// Immutable copy of a topic's subscriber set used by the lock-free fan-out.
+// Writers build a new snapshot after every change and swap it in; the old
+// one is freed through rcu_retire() once no reader can still use it.
+// A resolved snapshot (exact plus wildcard subscribers) also records the
+// versions it was built from, to tell when it is stale.
+// Clients without a content filter come first; the filtered ones follow,
+// grouped by filter, so a publish evaluates every distinct filter once.
+typedef struct subscriberGroup_st {
+    struct filter_st *filter;
+    size_t start;                   // clients[start] to clients[end - 1]
+    size_t end;
+} SUBSCRIBER_GROUP;
+
+typedef struct subscriberSnapshot_st {
+    unsigned long long generation;  // wildcard trie generation
+    unsigned long version;          // topic version
+    size_t count;
+    size_t plain;                   // clients[0] to clients[plain - 1] get every message
+    size_t groupCount;
+    SUBSCRIBER_GROUP *groups;       // in the same allocation, after clients
+    struct client_st *clients[];
+} SUBSCRIBER_SNAPSHOT;
+
+// One client and its filter, as gathered to build a snapshot
+typedef struct snapshotEntry_st {
+    struct client_st *client;
+    struct filter_st *filter;
+} SNAPSHOT_ENTRY;
+
+// Topics one connection is subscribed to, with a hash index keyed by topic
+// for O(1) duplicate checks. Changed only under the registry write lock.
+typedef struct subscriptions_st {
+    int socket;
+    struct client_st *client;
+    SUBSCRIBER *firstNode;
+    size_t count;
+
+    SUBSCRIBER **index;         // open addressing on topic->hash, power of two
+    size_t indexSize;
+} SUBSCRIPTIONS;
+
 void initSubscriber(SUBSCRIBER_HEAD *head);
 SUBSCRIBER* createSubscriber(int socket);
 void addSubscriber(SUBSCRIBER_HEAD* head, SUBSCRIBER* newSubscriber);
 void destroySubscribers(SUBSCRIBER_HEAD* head);
 
-// Topic
+// Topic. Names are '/'-separated levels; a name with a "+" or "#" level is
+// a wildcard pattern that can be subscribed to but not published to.
 typedef struct topic_st {
     char *name;
-    SUBSCRIBER *subscribers;
+    size_t nameLen;
+    uint64_t hash;              // topicHash(name), computed once at creation
+    uint32_t id;                // numeric topic ID (registry_topic_by_id()), 0 if none
+    int pattern;                // topicPattern(name) > 0
+    SUBSCRIBER *subscribers;    // changed only under the registry write lock
+    size_t subscriberCount;
+    size_t filteredCount;       // subscribers with a content filter
+    _Atomic(SUBSCRIBER_SNAPSHOT *) snapshot;    // NULL when nobody is subscribed
+    atomic_ulong version;       // bumped with every new snapshot
+    atomic_int stale;           // the last snapshot could not be built (none is
+                                // published); the next publish rebuilds it
+    _Atomic(SUBSCRIBER_SNAPSHOT *) resolved;    // cached exact + wildcard set
+    atomic_ullong published;    // messages and payload bytes published here
+    atomic_ullong publishedBytes;
+    uint64_t created;           // stats_now() when the registry added it
+    _Atomic(struct topicHistory_st *) history;  // NULL until history is kept
+    atomic_int overflow;        // overflow_policy_t set with /policy, 0 if none
+    atomic_int conflate;        // subscribers only get the latest message (/conflate)
+    _Atomic(struct msgbuf_st *) announce;   // FRAME_TOPIC_ID of the ID, built on first use
     struct topic_st *nextTopic;
 } TOPIC;
 
+// Topics are kept in insertion order in a linked list (for listing) and
+// indexed by an open-addressing hash table with linear probing (for lookup).
+// The table grows incrementally: on resize the old table stays readable and
+// every addTopic() moves a few of its slots, so no single insert pays for
+// rehashing the whole registry.
 typedef struct topicHead_st {
     TOPIC *firstNode;
+    TOPIC *lastNode;
+    size_t count;
+
+    TOPIC **table;              // power-of-two sized
+    size_t tableSize;
+
+    TOPIC **oldTable;           // table being migrated, NULL when idle
+    size_t oldSize;
+    size_t migrated;            // old slots already moved
 } TOPIC_HEAD;
 
+uint64_t topicHash(const char *name);
+int topicPattern(const char *name);
+
 void initTopic(TOPIC_HEAD *head);
 TOPIC* createTopic(const char *name);
-void addTopic(TOPIC_HEAD* head, TOPIC* newTopic);
+int addTopic(TOPIC_HEAD* head, TOPIC* newTopic);
+void freeTopic(TOPIC *topic);
 void destroyTopics(TOPIC_HEAD* head);
 TOPIC* findTopic(TOPIC_HEAD *head, const char *name);
+TOPIC* findTopicHashed(TOPIC_HEAD *head, const char *name, uint64_t hash);
 
-int addSubscriberToTopic(TOPIC_HEAD *topics, const char *topicName, int socket);
-int removeSubscriberFromTopic(TOPIC *topic, int socket);
-void removeSubscriberFromAllTopics(TOPIC_HEAD *head, int socket);
+void initSubscriptions(SUBSCRIPTIONS *subs, int socket, struct client_st *client);
+void destroySubscriptions(SUBSCRIPTIONS *subs);
+int addSubscriberToTopic(TOPIC_HEAD *topics, const char *topicName, SUBSCRIPTIONS *subs, struct filter_st *filter);
+int removeSubscriberFromTopic(TOPIC *topic, SUBSCRIPTIONS *subs);
+void publishSnapshot(TOPIC *topic);
+SUBSCRIBER_SNAPSHOT* topicSnapshot(TOPIC *topic);
 
-void printTopicsAndSubscribers(TOPIC_HEAD *head);
-void printTopics(TOPIC_HEAD *head);
+// Build a snapshot from count entries, reordering them. With merge, a
+// client listed more than once is kept once: filtered only if all its
+// entries have the same filter. NULL on allocation failure.
+SUBSCRIBER_SNAPSHOT* buildSnapshot(SNAPSHOT_ENTRY *entries, size_t count, int merge);
+// Free a snapshot and drop its filter references (an rcu_retire() callback)
+void freeSnapshot(void *snap);
 
 #endif // LIST_H
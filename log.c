@@ -0,0 +1,241 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
+#include "log.h"
+
+// One line of the ring. seq tells whose turn the slot is: a producer may
+// claim it at position pos when seq == pos, the consumer may read it when
+// seq == pos + 1 (Vyukov's bounded queue).
+typedef struct logSlot_st {
+    atomic_size_t seq;
+    size_t len;
+    char text[LOG_LINE_MAX];
+} LOG_SLOT;
+
+log_level_t log_level = LOG_INFO;
+
+static LOG_SLOT *ring = NULL;
+static atomic_size_t tail;                  // next position to claim
+static size_t head;                         // next position to read, consumer only
+static atomic_ullong dropped;
+
+static pthread_t log_thread;
+static atomic_int running = 0;
+static atomic_int stopping = 0;
+
+// The consumer sleeps on cond only after announcing it in sleeping, so
+// producers take the mutex just to wake it, never on the common path
+static pthread_mutex_t wake_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake_cond = PTHREAD_COND_INITIALIZER;
+static atomic_int sleeping = 0;
+
+static const char *levelNames[] = { "error", "warn", "info", "debug" };
+
+int log_parse_level(const char *name, log_level_t *level)
+{
+    for (size_t i = 0; i < sizeof(levelNames) / sizeof(levelNames[0]); i++)
+    {
+        if (strcmp(name, levelNames[i]) == 0)
+        {
+            *level = (log_level_t)i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Write every line that is ready. Returns the number written.
+static size_t drain(void)
+{
+    size_t n = 0;
+
+    while (1)
+    {
+        LOG_SLOT *slot = &ring[head & (LOG_RING_SLOTS - 1)];
+        if (atomic_load_explicit(&slot->seq, memory_order_acquire) != head + 1)
+            break;
+
+        fwrite(slot->text, 1, slot->len, stdout);
+        atomic_store_explicit(&slot->seq, head + LOG_RING_SLOTS, memory_order_release);
+        head++;
+        n++;
+    }
+
+    unsigned long long lost = atomic_exchange_explicit(&dropped, 0, memory_order_relaxed);
+    if (lost)
+        printf("[LOG] log ring full, %llu lines dropped\n", lost);
+
+    if (n || lost)
+        fflush(stdout);
+    return n;
+}
+
+static int ring_empty(void)
+{
+    LOG_SLOT *slot = &ring[head & (LOG_RING_SLOTS - 1)];
+    return atomic_load(&slot->seq) != head + 1;
+}
+
+static void *log_main(void *arg)
+{
+    (void)arg;
+
+    while (1)
+    {
+        if (drain())
+            continue;
+        if (atomic_load(&stopping))
+            break;
+
+        pthread_mutex_lock(&wake_mtx);
+        atomic_store(&sleeping, 1);
+        if (ring_empty() && !atomic_load(&stopping))
+        {
+            // The timeout also flushes lines whose producer was preempted
+            // between claiming and filling the slot
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += 100 * 1000000L;
+            if (ts.tv_nsec >= 1000000000L)
+            {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&wake_cond, &wake_mtx, &ts);
+        }
+        atomic_store(&sleeping, 0);
+        pthread_mutex_unlock(&wake_mtx);
+    }
+
+    drain();
+    return NULL;
+}
+
+int log_init(log_level_t level)
+{
+    log_level = level;
+
+    ring = malloc(LOG_RING_SLOTS * sizeof(LOG_SLOT));
+    if (ring == NULL)
+    {
+        perror("malloc log ring");
+        return -1;
+    }
+    for (size_t i = 0; i < LOG_RING_SLOTS; i++)
+        atomic_init(&ring[i].seq, i);
+    atomic_init(&tail, 0);
+    head = 0;
+
+    if (pthread_create(&log_thread, NULL, log_main, NULL) != 0)
+    {
+        perror("pthread_create log thread");
+        free(ring);
+        ring = NULL;
+        return -1;
+    }
+
+    atomic_store(&running, 1);
+    return 0;
+}
+
+// Stop the log thread after it wrote everything queued so far
+void log_shutdown(void)
+{
+    if (!atomic_exchange(&running, 0))
+        return;
+
+    pthread_mutex_lock(&wake_mtx);
+    atomic_store(&stopping, 1);
+    pthread_cond_signal(&wake_cond);
+    pthread_mutex_unlock(&wake_mtx);
+
+    pthread_join(log_thread, NULL);
+}
+
+void log_write(log_level_t level, const char *fmt, ...)
+{
+    va_list ap;
+
+    if (level > log_level)
+        return;
+
+    // Before log_init() and after log_shutdown() lines go out directly
+    if (!atomic_load_explicit(&running, memory_order_acquire))
+    {
+        va_start(ap, fmt);
+        vprintf(fmt, ap);
+        va_end(ap);
+        return;
+    }
+
+    size_t pos = atomic_load_explicit(&tail, memory_order_relaxed);
+    LOG_SLOT *slot;
+    while (1)
+    {
+        slot = &ring[pos & (LOG_RING_SLOTS - 1)];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+
+        if (seq == pos)
+        {
+            if (atomic_compare_exchange_weak_explicit(&tail, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if ((ptrdiff_t)(seq - pos) < 0)
+        {
+            // The consumer has not freed this slot yet: the ring is full
+            atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+            return;
+        }
+        else
+            pos = atomic_load_explicit(&tail, memory_order_relaxed);
+    }
+
+    va_start(ap, fmt);
+    int n = vsnprintf(slot->text, LOG_LINE_MAX, fmt, ap);
+    va_end(ap);
+
+    if (n < 0)
+        n = 0;
+    if (n >= LOG_LINE_MAX)
+    {
+        // Truncated; keep the line terminated
+        n = LOG_LINE_MAX - 1;
+        slot->text[n - 1] = '\n';
+    }
+    slot->len = (size_t)n;
+
+    atomic_store(&slot->seq, pos + 1);
+
+    // Only the first line after the consumer went to sleep wakes it
+    if (atomic_load(&sleeping) && atomic_exchange(&sleeping, 0))
+    {
+        pthread_mutex_lock(&wake_mtx);
+        pthread_cond_signal(&wake_cond);
+        pthread_mutex_unlock(&wake_mtx);
+    }
+}
+
+unsigned log_limit(LOG_LIMIT *limit)
+{
+    unsigned long long now = (unsigned long long)time(NULL);
+
+    if (atomic_load_explicit(&limit->window, memory_order_relaxed) != now)
+    {
+        // First line of a new second; a racing thread may reset it too,
+        // which only lets a few more lines through
+        atomic_store_explicit(&limit->window, now, memory_order_relaxed);
+        atomic_store_explicit(&limit->count, 0, memory_order_relaxed);
+    }
+
+    if (atomic_fetch_add_explicit(&limit->count, 1, memory_order_relaxed) >= LOG_LIMIT_BURST)
+    {
+        atomic_fetch_add_explicit(&limit->suppressed, 1, memory_order_relaxed);
+        return 0;
+    }
+
+    return atomic_exchange_explicit(&limit->suppressed, 0, memory_order_relaxed) + 1;
+}
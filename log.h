@@ -0,0 +1,65 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdatomic.h>
+
+// Asynchronous server log.
+//
+// log_write() formats the line straight into a slot of a bounded lock-free
+// ring (any number of producer threads) and returns; a background thread
+// drains the ring to stdout. Nothing on the calling thread waits for I/O.
+// When the ring is full the line is dropped and counted, never blocked on.
+//
+// LOG() checks the level before any argument is evaluated. LOG_LIMITED()
+// additionally lets through at most LOG_LIMIT_BURST lines per second from
+// its call site and reports how many were suppressed; use it for events
+// that can fire once per message.
+
+typedef enum
+{
+    LOG_ERROR,
+    LOG_WARN,
+    LOG_INFO,
+    LOG_DEBUG
+} log_level_t;
+
+#define LOG_RING_SLOTS      4096    // power of two
+#define LOG_LINE_MAX        512     // longer lines are truncated
+#define LOG_LIMIT_BURST     10      // lines per second per LOG_LIMITED() site
+
+// Rate limit state of one call site
+typedef struct logLimit_st {
+    atomic_ullong window;       // current second
+    atomic_uint count;          // lines in that second
+    atomic_uint suppressed;     // lines dropped since the last one written
+} LOG_LIMIT;
+
+extern log_level_t log_level;
+
+int log_init(log_level_t level);
+void log_shutdown(void);
+int log_parse_level(const char *name, log_level_t *level);
+
+void log_write(log_level_t level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+// Returns the number of suppressed lines to report plus one if this line
+// may be written, 0 if it must be dropped
+unsigned log_limit(LOG_LIMIT *limit);
+
+#define LOG(level, ...) \
+    do { if ((level) <= log_level) log_write((level), __VA_ARGS__); } while (0)
+
+#define LOG_LIMITED(level, fmt, ...) \
+    do { \
+        if ((level) <= log_level) \
+        { \
+            static LOG_LIMIT log_site_limit; \
+            unsigned log_pass = log_limit(&log_site_limit); \
+            if (log_pass > 1) \
+                log_write((level), "[LOG] %u similar messages suppressed\n", log_pass - 1); \
+            if (log_pass) \
+                log_write((level), fmt, __VA_ARGS__); \
+        } \
+    } while (0)
+
+#endif // LOG_H
@@ -8,6 +8,8 @@
 #include <signal.h>
 #include <errno.h>
 #include <stdbool.h>
+#include "frame.h"
+#include "shm.h"
 
 #define IP_ADDRESS "127.0.0.1"
 #define PORT 12345
@@ -16,6 +18,12 @@
 // Command types
 #define CMD_EXIT        "/exit\n"
 
+// Rings shared with the server when connected with --shm, else NULL
+SHM_CONN *shm = NULL;
+
+// Binary frames (also over shared memory) rather than text lines
+bool binary = false;
+
 bool server_disconnected = false;
 pthread_mutex_t server_disconnected_mutex = PTHREAD_MUTEX_INITIALIZER;
 
@@ -35,14 +43,105 @@ bool should_exit(void)
     return val;
 }
 
+// Topic IDs the server announced, filled in by the monitor thread. A
+// topic is published by name, asking for its ID, until the ID arrives;
+// from then on by ID.
+typedef struct topic_id_st {
+    char *name;
+    uint32_t id;                // 0 while asked for
+    struct topic_id_st *next;
+} TOPIC_ID;
+
+TOPIC_ID *topic_ids = NULL;
+pthread_mutex_t topic_ids_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Find a topic's entry, adding it if asked to; call with topic_ids_mutex held
+TOPIC_ID *find_topic_id(const char *name, size_t len, bool add)
+{
+    TOPIC_ID *t;
+    for (t = topic_ids; t != NULL; t = t->next)
+    {
+        if (strlen(t->name) == len && memcmp(t->name, name, len) == 0)
+            return t;
+    }
+    if (!add || (t = malloc(sizeof(TOPIC_ID))) == NULL)
+        return NULL;
+    if ((t->name = strndup(name, len)) == NULL)
+    {
+        free(t);
+        return NULL;
+    }
+    t->id = 0;
+    t->next = topic_ids;
+    topic_ids = t;
+    return t;
+}
+
+// Take note of the topic IDs among the frames in data.
+// Returns the bytes read, -1 if they are not frames.
+ssize_t read_frames(const char *data, size_t len)
+{
+    size_t off = 0;
+    FRAME frame;
+    ssize_t n;
+
+    while ((n = frame_parse(data + off, len - off, &frame)) > 0)
+    {
+        off += (size_t)n;
+        if (frame.type != FRAME_TOPIC_ID)
+            continue;
+
+        pthread_mutex_lock(&topic_ids_mutex);
+        TOPIC_ID *t = find_topic_id(frame.topic, frame.topicLen, true);
+        if (t)
+            t->id = frame.topicId;
+        pthread_mutex_unlock(&topic_ids_mutex);
+    }
+
+    return n < 0 ? -1 : (ssize_t)off;
+}
+
 void *monitor_server_disconnect(void *arg)
 {
     int sock = *(int *)arg;
     char buf[DEFAULT_BUFLEN];
 
+    // Server replies arrive through the ring; like those on the socket
+    // they are read for topic IDs and to notice when the server goes away
+    if (shm)
+    {
+        const char *data;
+        size_t have = 0;
+
+        while (!should_exit() && shm_wait_readable(&shm->down, have, sock) == 0)
+        {
+            ssize_t len = shm_readable(&shm->down, &data);
+            ssize_t n = len < 0 ? -1 : read_frames(data, (size_t)len);
+            if (n < 0)
+                break;
+            shm_consume(&shm->down, (size_t)n);
+            have = (size_t)(len - n);
+        }
+        if (!should_exit())
+        {
+            set_exit_flag();
+            fprintf(stderr, "Server disconnected. Press Enter to exit, any other input will be ignored.\n");
+            fflush(stderr);
+        }
+        return NULL;
+    }
+
+    INBUF in;
+    inbuf_init(&in);
     while (!should_exit())
     {
         int n = recv(sock, buf, sizeof(buf), 0);
+        ssize_t used;
+        if (n > 0 && binary && (inbuf_append(&in, buf, n) < 0 || (used = read_frames(in.data, in.len)) < 0))
+            n = -1;
+        else if (n > 0 && binary)
+            inbuf_consume(&in, (size_t)used);
+
         if (n <= 0)
         {
             set_exit_flag();
@@ -50,6 +149,7 @@ void *monitor_server_disconnect(void *arg)
             fflush(stderr);
         }
     }
+    inbuf_free(&in);
 
     return NULL;
 }
@@ -100,61 +200,142 @@ int valid_message_format(const char *msg)
     return 1;
 }
 
-int main(int argc, char *argv[])
+// Send a validated "[topic] "text"" line as a PUBLISH frame: by topic ID
+// once the server told it, else by name asking for the ID (once)
+int send_publish_frame(int sock, const char *msg)
 {
+    const char *topic = msg + 1;
+    const char *topic_end = strchr(topic, ']');
+    const char *text = strchr(topic_end, '"') + 1;
+    const char *text_end = strrchr(msg, '"');
+    size_t topic_len = (size_t)(topic_end - topic);
+    uint8_t flags = 0;
+    unsigned char id[FRAME_TOPIC_ID_LEN];
+
+    pthread_mutex_lock(&topic_ids_mutex);
+    TOPIC_ID *t = find_topic_id(topic, topic_len, false);
+    if (t && t->id)
+    {
+        frame_topic_id(id, t->id);
+        topic = (const char *)id;
+        topic_len = FRAME_TOPIC_ID_LEN;
+        flags = FRAME_FLAG_TOPIC_ID;
+    }
+    else if (t == NULL && find_topic_id(topic, topic_len, true))
+        flags = FRAME_FLAG_WANT_ID;
+    pthread_mutex_unlock(&topic_ids_mutex);
+
+    // Over shared memory the frame is built right in the ring
+    if (shm)
+        return shm_send_frame(&shm->up, sock, FRAME_PUBLISH, flags, topic, topic_len, text, (size_t)(text_end - text));
+    return frame_send(sock, FRAME_PUBLISH, flags, topic, topic_len, text, (size_t)(text_end - text));
+}
 
-    if(argc != 3)
+int main(int argc, char *argv[])
+{
+    // --text keeps the original line based protocol
+    bool text_protocol = false;
+    if (argc == 4 && strcmp(argv[1], "--text") == 0)
     {
-        fprintf(stderr, "Correct usage: %s <server_ip> <server_port>\n", argv[0]);
-        return EXIT_FAILURE;
+        text_protocol = true;
+        argv++;
+        argc--;
     }
 
-    const char *server_ip = argv[1];
-    int server_port = atoi(argv[2]);
+    // --shm connects to the server's --local socket and publishes through
+    // shared memory
+    const char *shm_path = NULL;
+    if (argc == 3 && !text_protocol && strcmp(argv[1], "--shm") == 0)
+        shm_path = argv[2];
 
-    if(server_port <= 0 || server_port > 65535)
+    if(argc != 3)
     {
-        fprintf(stderr, "Invalid port number.\n");
+        fprintf(stderr, "Correct usage: %s [--text] <server_ip> <server_port>\n", argv[0]);
+        fprintf(stderr, "               %s --shm <socket_path>\n", argv[0]);
         return EXIT_FAILURE;
     }
 
     int client_socket_fd;
     char message[DEFAULT_BUFLEN];
 
-    // Socket creation
-    client_socket_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (client_socket_fd < 0)
+    if (shm_path)
     {
-        perror("socket creation failed");
-        return EXIT_FAILURE;
+        client_socket_fd = shm_connect(shm_path);
+        if (client_socket_fd < 0)
+            return EXIT_FAILURE;
+
+        printf("Connected to server [%s]\n", shm_path);
     }
+    else
+    {
+        const char *server_ip = argv[1];
+        int server_port = atoi(argv[2]);
 
-    struct sockaddr_in server_address;
+        if(server_port <= 0 || server_port > 65535)
+        {
+            fprintf(stderr, "Invalid port number.\n");
+            return EXIT_FAILURE;
+        }
 
-    // Set up the server address structure
-    server_address.sin_family = AF_INET;
-    server_address.sin_port = htons(server_port);
-    server_address.sin_addr.s_addr = inet_addr(server_ip);
+        // Socket creation
+        client_socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (client_socket_fd < 0)
+        {
+            perror("socket creation failed");
+            return EXIT_FAILURE;
+        }
 
-    // Connect to server
-    if (connect(client_socket_fd, (struct sockaddr *)&server_address, sizeof(server_address)) < 0)
-    {
-        perror("failed to connect");
-        return EXIT_FAILURE;
-    }
+        struct sockaddr_in server_address;
+
+        // Set up the server address structure
+        server_address.sin_family = AF_INET;
+        server_address.sin_port = htons(server_port);
+        server_address.sin_addr.s_addr = inet_addr(server_ip);
+
+        // Connect to server
+        if (connect(client_socket_fd, (struct sockaddr *)&server_address, sizeof(server_address)) < 0)
+        {
+            perror("failed to connect");
+            return EXIT_FAILURE;
+        }
 
-    printf("Connected to server [%s:%d]\n", server_ip, server_port);
+        printf("Connected to server [%s:%d]\n", server_ip, server_port);
+    }
     printf("Type /exit to quit\n");
     printf("Publish format: [topic] \"text\" \n\n");
 
     // Send a message to the server to indicate whether this client is a publisher or subscriber
-    const char *role_msg = "PUBLISHER";
-    if (send(client_socket_fd, role_msg, strlen(role_msg), 0) < 0) 
+    if (shm_path)
     {
-        perror("failed to send client role to server");
-        if(client_socket_fd != -1)
+        if (shm_handshake(client_socket_fd, "PUBLISHER", &shm) < 0)
+        {
+            fprintf(stderr, "handshake with server failed\n");
             close(client_socket_fd);
-        return EXIT_FAILURE;
+            return EXIT_FAILURE;
+        }
+        binary = true;
+    }
+    else if (text_protocol)
+    {
+        const char *role_msg = "PUBLISHER";
+        if (send(client_socket_fd, role_msg, strlen(role_msg), 0) < 0) 
+        {
+            perror("failed to send client role to server");
+            if(client_socket_fd != -1)
+                close(client_socket_fd);
+            return EXIT_FAILURE;
+        }
+    }
+    else
+    {
+        int res = frame_handshake(client_socket_fd, "PUBLISHER");
+        if (res < 0)
+        {
+            fprintf(stderr, "handshake with server failed\n");
+            close(client_socket_fd);
+            return EXIT_FAILURE;
+        }
+        binary = res == 1;
     }
 
     pthread_t monitor_tid;
@@ -198,7 +379,9 @@ int main(int argc, char *argv[])
         }
         else
         {
-            if(send(client_socket_fd, message, strlen(message), 0) < 0) 
+            int res = binary ? send_publish_frame(client_socket_fd, message)
+                             : (int)send(client_socket_fd, message, strlen(message), 0);
+            if(res < 0) 
             {
                 if (errno == EPIPE || errno == ECONNRESET)
                 {
@@ -0,0 +1,943 @@
+// Load generator and end-to-end latency benchmark for the pub/sub server.
+//
+// Starts N publisher and M subscriber connections to a running server.
+// Every published payload starts with its send time (CLOCK_MONOTONIC, in
+// hex), so a subscriber on the same host measures the end-to-end latency
+// of each delivery. Results go to stdout and, with --json, as one JSON
+// object to a file (or "-" for stdout) for tracking across server changes.
+//
+// Topic t is subscribed by the subscribers (t * fanout + k) % M for
+// k < fanout, so every publish is delivered fanout times.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "frame.h"
+
+#define DEFAULT_HOST        "127.0.0.1"
+#define DEFAULT_PORT        12345
+#define READ_CHUNK          65536
+#define TIMESTAMP_LEN       16          // hex digits of the send time
+#define SUBSCRIBE_RETRIES   50
+#define DRAIN_NS            1000000000ULL
+
+// Latency histogram: 32 linear sub-buckets per power of two, so every
+// bucket is within about 3% of the values it holds
+#define HIST_SUB_BITS       5
+#define HIST_SUB            (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS        (64 * HIST_SUB)
+
+typedef struct bench_config_st {
+    const char *host;
+    int port;
+    int publishers;
+    int subscribers;
+    int topics;
+    int fanout;             // subscribers per topic
+    size_t size;            // payload bytes
+    double rate;            // messages per second per publisher, 0 = unthrottled
+    double duration;        // measured seconds
+    double warmup;          // seconds before measuring
+    int receivers;          // subscriber receive threads
+    int text;               // use the text protocol
+    int topicIds;           // publish and receive by topic ID
+    const char *json;       // JSON output path, "-" for stdout
+} BENCH_CONFIG;
+
+typedef struct histogram_st {
+    unsigned long long counts[HIST_BUCKETS];
+    unsigned long long total;
+    unsigned long long max;
+    double sum;
+} HISTOGRAM;
+
+typedef struct connection_st {
+    int socket;
+    int binary;
+    INBUF in;
+    unsigned long long received;
+} CONNECTION;
+
+typedef struct receiver_st {
+    pthread_t tid;
+    int epfd;
+    HISTOGRAM hist;
+    unsigned long long received;    // deliveries sent inside the window
+    unsigned long long bytes;
+} RECEIVER;
+
+typedef struct publisher_st {
+    pthread_t tid;
+    int index;
+    CONNECTION conn;
+    unsigned long long sent;        // publishes sent inside the window
+    unsigned long long errors;
+} PUBLISHER_STATE;
+
+static BENCH_CONFIG config = {
+    .host = DEFAULT_HOST,
+    .port = DEFAULT_PORT,
+    .publishers = 1,
+    .subscribers = 4,
+    .topics = 1,
+    .fanout = 4,
+    .size = 64,
+    .rate = 1000,
+    .duration = 5,
+    .warmup = 1,
+    .receivers = 1,
+    .text = 0,
+    .topicIds = 0,
+    .json = NULL,
+};
+
+static uint64_t window_start;       // measuring starts here
+static uint64_t window_end;         // publishers stop here
+static atomic_int receivers_stop = 0;
+static unsigned char (*topic_ids)[FRAME_TOPIC_ID_LEN];     // with --topic-ids, per topic
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t t)
+{
+    struct timespec ts = { (time_t)(t / 1000000000ULL), (long)(t % 1000000000ULL) };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+static size_t hist_index(uint64_t v)
+{
+    if (v < HIST_SUB)
+        return (size_t)v;
+
+    int shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    return ((size_t)(shift + 1) << HIST_SUB_BITS) + (size_t)((v >> shift) & (HIST_SUB - 1));
+}
+
+// Highest value that falls into bucket i
+static uint64_t hist_value(size_t i)
+{
+    if (i < HIST_SUB)
+        return i;
+
+    int shift = (int)(i >> HIST_SUB_BITS) - 1;
+    uint64_t low = i & (HIST_SUB - 1);
+    return ((HIST_SUB + low + 1) << shift) - 1;
+}
+
+static void hist_record(HISTOGRAM *h, uint64_t v)
+{
+    h->counts[hist_index(v)]++;
+    h->total++;
+    h->sum += (double)v;
+    if (v > h->max)
+        h->max = v;
+}
+
+static void hist_merge(HISTOGRAM *into, const HISTOGRAM *h)
+{
+    for (size_t i = 0; i < HIST_BUCKETS; i++)
+        into->counts[i] += h->counts[i];
+    into->total += h->total;
+    into->sum += h->sum;
+    if (h->max > into->max)
+        into->max = h->max;
+}
+
+static uint64_t hist_percentile(const HISTOGRAM *h, double p)
+{
+    if (h->total == 0)
+        return 0;
+
+    unsigned long long rank = (unsigned long long)(p / 100.0 * (double)h->total + 0.5);
+    if (rank < 1)
+        rank = 1;
+
+    unsigned long long seen = 0;
+    for (size_t i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += h->counts[i];
+        if (seen >= rank)
+            return hist_value(i) < h->max ? hist_value(i) : h->max;
+    }
+    return h->max;
+}
+
+// Connect and do the role handshake. Returns -1 on failure.
+static int bench_connect(CONNECTION *conn, const char *role)
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(config.port);
+    if (inet_pton(AF_INET, config.host, &addr.sin_addr) != 1)
+    {
+        fprintf(stderr, "Invalid server address '%s'.\n", config.host);
+        return -1;
+    }
+
+    conn->socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (conn->socket < 0)
+    {
+        perror("socket failed");
+        return -1;
+    }
+    if (connect(conn->socket, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        perror("connect failed");
+        close(conn->socket);
+        return -1;
+    }
+
+    int one = 1;
+    setsockopt(conn->socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (config.text)
+    {
+        conn->binary = 0;
+        if (send(conn->socket, role, strlen(role), MSG_NOSIGNAL) < 0)
+        {
+            perror("send role failed");
+            close(conn->socket);
+            return -1;
+        }
+        // The server reads the bare role word by itself only if nothing
+        // follows it in the same segment
+        usleep(20000);
+    }
+    else
+    {
+        conn->binary = frame_handshake(conn->socket, role);
+        if (conn->binary < 0)
+        {
+            fprintf(stderr, "handshake with server failed\n");
+            close(conn->socket);
+            return -1;
+        }
+    }
+
+    inbuf_init(&conn->in);
+    conn->received = 0;
+    return 0;
+}
+
+static int send_all(int socket, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = send(socket, data, len, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int publish(CONNECTION *conn, const char *topic, const char *payload, size_t len, char *line)
+{
+    if (conn->binary)
+        return frame_send(conn->socket, FRAME_PUBLISH, 0, topic, strlen(topic), payload, len);
+
+    int n = sprintf(line, "[%s] \"%.*s\"\n", topic, (int)len, payload);
+    return send_all(conn->socket, line, (size_t)n);
+}
+
+// One message from the server, topic and payload pointing into conn->in.
+// Returns 1 and consumes it later via *used, 0 if more data is needed and
+// -1 on a protocol error.
+static int next_message(CONNECTION *conn, size_t off, FRAME *msg, size_t *used)
+{
+    const char *data = conn->in.data + off;
+    size_t len = conn->in.len - off;
+
+    if (conn->binary)
+    {
+        ssize_t n = frame_parse(data, len, msg);
+        if (n <= 0)
+            return (int)n;
+        *used = (size_t)n;
+        return 1;
+    }
+
+    const char *nl = memchr(data, '\n', len);
+    if (nl == NULL)
+        return 0;
+    *used = (size_t)(nl - data) + 1;
+
+    // [topic] "payload"  or a reply line
+    memset(msg, 0, sizeof(*msg));
+    const char *bracket = memchr(data, ']', (size_t)(nl - data));
+    const char *quote = bracket ? memchr(bracket, '"', (size_t)(nl - bracket)) : NULL;
+    if (data[0] == '[' && bracket && quote)
+    {
+        const char *end = nl;
+        while (end > quote + 1 && end[-1] != '"')
+            end--;
+        msg->type = FRAME_MESSAGE;
+        msg->topic = data + 1;
+        msg->topicLen = (size_t)(bracket - data - 1);
+        msg->payload = quote + 1;
+        msg->payloadLen = end > quote + 1 ? (size_t)(end - quote - 2) : 0;
+    }
+    else
+    {
+        msg->type = FRAME_REPLY;
+        msg->payload = data;
+        msg->payloadLen = *used;
+    }
+    return 1;
+}
+
+static int parse_timestamp(const char *payload, size_t len, uint64_t *ts)
+{
+    if (len < TIMESTAMP_LEN)
+        return -1;
+
+    uint64_t v = 0;
+    for (int i = 0; i < TIMESTAMP_LEN; i++)
+    {
+        char c = payload[i];
+        int d = (c >= '0' && c <= '9') ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+        if (d < 0)
+            return -1;
+        v = (v << 4) | (uint64_t)d;
+    }
+    *ts = v;
+    return 0;
+}
+
+// Subscribe one connection to its topics with a single command and wait
+// for every reply. Topics the server does not know yet are retried.
+static int subscribe_topics(CONNECTION *conn, int *topics, int count)
+{
+    size_t cap = 32 + (size_t)count * 24;
+    char *cmd = malloc(cap);
+    char *pending = calloc((size_t)count, 1);
+    if (!cmd || !pending)
+    {
+        perror("malloc subscribe command");
+        free(cmd);
+        free(pending);
+        return -1;
+    }
+    memset(pending, 1, (size_t)count);
+
+    int left = count;
+    for (int attempt = 0; left > 0 && attempt < SUBSCRIBE_RETRIES; attempt++)
+    {
+        size_t len = (size_t)sprintf(cmd, "/subscribe");
+        int asked = 0;
+        for (int i = 0; i < count; i++)
+        {
+            if (pending[i])
+            {
+                len += (size_t)sprintf(cmd + len, " \"bench/%d\"", topics[i]);
+                asked++;
+            }
+        }
+
+        int res;
+        if (conn->binary)
+            res = frame_send(conn->socket, FRAME_COMMAND, config.topicIds ? FRAME_FLAG_WANT_ID : 0, NULL, 0, cmd, len);
+        else
+        {
+            cmd[len++] = '\n';
+            res = send_all(conn->socket, cmd, len);
+        }
+        if (res < 0)
+        {
+            perror("send subscribe failed");
+            break;
+        }
+
+        // One reply per topic asked for
+        while (asked > 0)
+        {
+            char buf[READ_CHUNK];
+            ssize_t n = recv(conn->socket, buf, sizeof(buf), 0);
+            if (n <= 0)
+            {
+                fprintf(stderr, "server closed a subscriber during setup\n");
+                asked = -1;
+                break;
+            }
+            inbuf_append(&conn->in, buf, (size_t)n);
+
+            size_t off = 0, used;
+            FRAME msg;
+            while (asked > 0 && next_message(conn, off, &msg, &used) > 0)
+            {
+                off += used;
+                if (msg.type != FRAME_REPLY)
+                    continue;
+                asked--;
+
+                char reply[256];
+                size_t rlen = msg.payloadLen < sizeof(reply) - 1 ? msg.payloadLen : sizeof(reply) - 1;
+                memcpy(reply, msg.payload, rlen);
+                reply[rlen] = '\0';
+
+                int topic;
+                if (sscanf(reply, "[INFO] Subscribed to 'bench/%d'", &topic) == 1 ||
+                    sscanf(reply, "[INFO] Already subscribed to 'bench/%d'", &topic) == 1)
+                {
+                    for (int i = 0; i < count; i++)
+                        if (topics[i] == topic && pending[i])
+                        {
+                            pending[i] = 0;
+                            left--;
+                        }
+                }
+            }
+            inbuf_consume(&conn->in, off);
+        }
+        if (asked < 0)
+            break;
+        if (left > 0)
+            usleep(50000);
+    }
+
+    free(cmd);
+    free(pending);
+    return left == 0 ? 0 : -1;
+}
+
+// Ask for the ID of every topic with a message by name and wait for the
+// announcements
+static int learn_topic_ids(CONNECTION *conn)
+{
+    topic_ids = calloc((size_t)config.topics, FRAME_TOPIC_ID_LEN);
+    if (!topic_ids)
+    {
+        perror("calloc topic IDs");
+        return -1;
+    }
+
+    for (int t = 0; t < config.topics; t++)
+    {
+        char name[32];
+        int len = snprintf(name, sizeof(name), "bench/%d", t);
+        if (frame_send(conn->socket, FRAME_PUBLISH, FRAME_FLAG_WANT_ID, name, (size_t)len, "setup", 5) < 0)
+        {
+            perror("publish setup message failed");
+            return -1;
+        }
+    }
+
+    int left = config.topics;
+    while (left > 0)
+    {
+        char buf[READ_CHUNK];
+        ssize_t n = recv(conn->socket, buf, sizeof(buf), 0);
+        if (n <= 0)
+        {
+            fprintf(stderr, "server closed the setup publisher before sending topic IDs\n");
+            return -1;
+        }
+        inbuf_append(&conn->in, buf, (size_t)n);
+
+        size_t off = 0, used;
+        FRAME msg;
+        int res;
+        while ((res = next_message(conn, off, &msg, &used)) > 0)
+        {
+            off += used;
+
+            int topic;
+            char name[32];
+            size_t len = msg.topicLen < sizeof(name) - 1 ? msg.topicLen : sizeof(name) - 1;
+            memcpy(name, msg.topic, len);
+            name[len] = '\0';
+            if (msg.type != FRAME_TOPIC_ID || sscanf(name, "bench/%d", &topic) != 1 || topic < 0 || topic >= config.topics)
+                continue;
+
+            if (memcmp(topic_ids[topic], "\0\0\0\0", FRAME_TOPIC_ID_LEN) == 0)
+                left--;
+            frame_topic_id(topic_ids[topic], msg.topicId);
+        }
+        inbuf_consume(&conn->in, off);
+
+        if (res < 0)
+        {
+            fprintf(stderr, "invalid data from server\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void *publisher_thread(void *arg)
+{
+    PUBLISHER_STATE *pub = (PUBLISHER_STATE *)arg;
+    size_t size = config.size < TIMESTAMP_LEN ? TIMESTAMP_LEN : config.size;
+    char *payload = malloc(size + 1);
+    char *line = malloc(size + 64);
+    if (!payload || !line)
+    {
+        perror("malloc payload");
+        free(payload);
+        free(line);
+        return NULL;
+    }
+    memset(payload, 'x', size);
+
+    uint64_t interval = config.rate > 0 ? (uint64_t)(1e9 / config.rate) : 0;
+    // Spread the publishers over one interval so they do not send in lockstep
+    uint64_t next = now_ns() + (interval ? interval * (uint64_t)pub->index / (uint64_t)config.publishers : 0);
+    int topic = pub->index % config.topics;
+    char name[32];
+
+    while (1)
+    {
+        uint64_t ts;
+        if (interval)
+        {
+            if (next >= window_end)
+                break;
+            sleep_until(next);
+            // Stamped with the scheduled time, so a stall in the server
+            // shows up as latency instead of as fewer samples
+            ts = next;
+            next += interval;
+        }
+        else
+        {
+            ts = now_ns();
+            if (ts >= window_end)
+                break;
+        }
+
+        char hex[TIMESTAMP_LEN + 1];
+        snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)ts);
+        memcpy(payload, hex, TIMESTAMP_LEN);
+
+        int res;
+        if (topic_ids)
+            res = frame_send(pub->conn.socket, FRAME_PUBLISH, FRAME_FLAG_TOPIC_ID, (const char *)topic_ids[topic], FRAME_TOPIC_ID_LEN, payload, size);
+        else
+        {
+            snprintf(name, sizeof(name), "bench/%d", topic);
+            res = publish(&pub->conn, name, payload, size, line);
+        }
+        topic = (topic + 1) % config.topics;
+
+        if (res < 0)
+        {
+            pub->errors++;
+            perror("publish failed");
+            break;
+        }
+        if (ts >= window_start)
+            pub->sent++;
+    }
+
+    free(payload);
+    free(line);
+    return NULL;
+}
+
+static void receive_connection(RECEIVER *rx, CONNECTION *conn)
+{
+    char buf[READ_CHUNK];
+
+    while (1)
+    {
+        ssize_t n = recv(conn->socket, buf, sizeof(buf), 0);
+        if (n <= 0)
+        {
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+            {
+                epoll_ctl(rx->epfd, EPOLL_CTL_DEL, conn->socket, NULL);
+                fprintf(stderr, "server closed a subscriber connection\n");
+            }
+            return;
+        }
+
+        uint64_t now = now_ns();
+        inbuf_append(&conn->in, buf, (size_t)n);
+
+        size_t off = 0, used;
+        FRAME msg;
+        int res;
+        while ((res = next_message(conn, off, &msg, &used)) > 0)
+        {
+            off += used;
+
+            uint64_t ts;
+            if (msg.type != FRAME_MESSAGE || parse_timestamp(msg.payload, msg.payloadLen, &ts) < 0)
+                continue;
+
+            conn->received++;
+            if (ts >= window_start && ts < window_end)
+            {
+                rx->received++;
+                rx->bytes += msg.payloadLen;
+                hist_record(&rx->hist, now > ts ? now - ts : 0);
+            }
+        }
+        inbuf_consume(&conn->in, off);
+
+        if (res < 0)
+        {
+            fprintf(stderr, "invalid data from server\n");
+            epoll_ctl(rx->epfd, EPOLL_CTL_DEL, conn->socket, NULL);
+            return;
+        }
+    }
+}
+
+static void *receiver_thread(void *arg)
+{
+    RECEIVER *rx = (RECEIVER *)arg;
+    struct epoll_event events[64];
+
+    while (!atomic_load(&receivers_stop))
+    {
+        int n = epoll_wait(rx->epfd, events, 64, 100);
+        for (int i = 0; i < n; i++)
+            receive_connection(rx, (CONNECTION *)events[i].data.ptr);
+    }
+    return NULL;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [options]\n", prog);
+    fprintf(stderr, "  --host ADDR        server address (default %s)\n", DEFAULT_HOST);
+    fprintf(stderr, "  --port PORT        server port (default %d)\n", DEFAULT_PORT);
+    fprintf(stderr, "  --publishers N     publisher connections (default 1)\n");
+    fprintf(stderr, "  --subscribers M    subscriber connections (default 4)\n");
+    fprintf(stderr, "  --topics T         topics, published round-robin (default 1)\n");
+    fprintf(stderr, "  --fanout F         subscribers per topic, at most M (default 4)\n");
+    fprintf(stderr, "  --size BYTES       payload size, at least %d (default 64)\n", TIMESTAMP_LEN);
+    fprintf(stderr, "  --rate R           messages/s per publisher, 0 for as fast as possible (default 1000)\n");
+    fprintf(stderr, "  --duration S       measured seconds (default 5)\n");
+    fprintf(stderr, "  --warmup S         seconds before measuring (default 1)\n");
+    fprintf(stderr, "  --receivers K      subscriber receive threads (default 1)\n");
+    fprintf(stderr, "  --text             use the text protocol instead of binary frames\n");
+    fprintf(stderr, "  --topic-ids        publish and deliver by numeric topic ID instead of by name\n");
+    fprintf(stderr, "  --json FILE        also write the results as JSON (\"-\" for stdout)\n");
+}
+
+static int parse_args(int argc, char *argv[])
+{
+    static const struct option long_opts[] = {
+        { "host",        required_argument, NULL, 'H' },
+        { "port",        required_argument, NULL, 'p' },
+        { "publishers",  required_argument, NULL, 'n' },
+        { "subscribers", required_argument, NULL, 'm' },
+        { "topics",      required_argument, NULL, 't' },
+        { "fanout",      required_argument, NULL, 'f' },
+        { "size",        required_argument, NULL, 's' },
+        { "rate",        required_argument, NULL, 'r' },
+        { "duration",    required_argument, NULL, 'd' },
+        { "warmup",      required_argument, NULL, 'w' },
+        { "receivers",   required_argument, NULL, 'k' },
+        { "text",        no_argument,       NULL, 'T' },
+        { "topic-ids",   no_argument,       NULL, 'I' },
+        { "json",        required_argument, NULL, 'j' },
+        { "help",        no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "H:p:n:m:t:f:s:r:d:w:k:TIj:h", long_opts, NULL)) != -1)
+    {
+        switch (opt)
+        {
+            case 'H': config.host = optarg; break;
+            case 'p': config.port = atoi(optarg); break;
+            case 'n': config.publishers = atoi(optarg); break;
+            case 'm': config.subscribers = atoi(optarg); break;
+            case 't': config.topics = atoi(optarg); break;
+            case 'f': config.fanout = atoi(optarg); break;
+            case 's': config.size = (size_t)atol(optarg); break;
+            case 'r': config.rate = atof(optarg); break;
+            case 'd': config.duration = atof(optarg); break;
+            case 'w': config.warmup = atof(optarg); break;
+            case 'k': config.receivers = atoi(optarg); break;
+            case 'T': config.text = 1; break;
+            case 'I': config.topicIds = 1; break;
+            case 'j': config.json = optarg; break;
+            case 'h': usage(argv[0]); exit(0);
+            default:  usage(argv[0]); return -1;
+        }
+    }
+
+    if (config.port <= 0 || config.port > 65535 || config.publishers < 1 || config.subscribers < 0 ||
+        config.topics < 1 || config.fanout < 0 || config.rate < 0 || config.duration <= 0 ||
+        config.warmup < 0 || config.receivers < 1 || config.size > FRAME_MAX_PAYLOAD ||
+        (config.text && config.topicIds))
+    {
+        fprintf(stderr, "Invalid option value.\n");
+        usage(argv[0]);
+        return -1;
+    }
+
+    if (config.fanout > config.subscribers)
+        config.fanout = config.subscribers;
+    if (config.size < TIMESTAMP_LEN)
+        config.size = TIMESTAMP_LEN;
+    if (config.receivers > config.subscribers && config.subscribers > 0)
+        config.receivers = config.subscribers;
+    return 0;
+}
+
+static void write_json(FILE *out, const HISTOGRAM *h, unsigned long long published, unsigned long long delivered,
+                       unsigned long long bytes, unsigned long long expected, double seconds)
+{
+    fprintf(out, "{\n");
+    fprintf(out, "  \"config\": {\"publishers\": %d, \"subscribers\": %d, \"topics\": %d, \"fanout\": %d, "
+                 "\"size\": %zu, \"rate\": %.1f, \"duration\": %.3f, \"warmup\": %.3f, \"protocol\": \"%s\", "
+                 "\"topic_ids\": %s},\n",
+            config.publishers, config.subscribers, config.topics, config.fanout, config.size, config.rate,
+            config.duration, config.warmup, config.text ? "text" : "binary", config.topicIds ? "true" : "false");
+    fprintf(out, "  \"published\": %llu,\n", published);
+    fprintf(out, "  \"expected\": %llu,\n", expected);
+    fprintf(out, "  \"delivered\": %llu,\n", delivered);
+    fprintf(out, "  \"lost\": %llu,\n", expected > delivered ? expected - delivered : 0);
+    fprintf(out, "  \"publish_rate\": %.1f,\n", published / seconds);
+    fprintf(out, "  \"delivery_rate\": %.1f,\n", delivered / seconds);
+    fprintf(out, "  \"delivery_mbps\": %.3f,\n", bytes / seconds / 1e6);
+    fprintf(out, "  \"latency_us\": {\"p50\": %.1f, \"p99\": %.1f, \"p99_9\": %.1f, \"max\": %.1f, \"mean\": %.1f}\n",
+            hist_percentile(h, 50) / 1e3, hist_percentile(h, 99) / 1e3, hist_percentile(h, 99.9) / 1e3,
+            h->max / 1e3, h->total ? h->sum / h->total / 1e3 : 0.0);
+    fprintf(out, "}\n");
+}
+
+int main(int argc, char *argv[])
+{
+    if (parse_args(argc, argv) < 0)
+        return EXIT_FAILURE;
+
+    // Every topic must exist before anyone can subscribe to it; with
+    // --topic-ids the setup messages also fetch the topic IDs
+    CONNECTION setup;
+    if (bench_connect(&setup, "PUBLISHER") < 0)
+        return EXIT_FAILURE;
+    if (config.topicIds)
+    {
+        if (setup.binary == 0)
+        {
+            fprintf(stderr, "the server does not speak binary frames, so it has no topic IDs\n");
+            return EXIT_FAILURE;
+        }
+        if (learn_topic_ids(&setup) < 0)
+            return EXIT_FAILURE;
+    }
+    char line[64];
+    for (int t = 0; t < config.topics && !topic_ids; t++)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "bench/%d", t);
+        if (publish(&setup, name, "setup", 5, line) < 0)
+        {
+            perror("publish setup message failed");
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Subscribers and their topics
+    CONNECTION *subs = calloc((size_t)config.subscribers + 1, sizeof(CONNECTION));
+    int **sub_topics = calloc((size_t)config.subscribers + 1, sizeof(int *));
+    int *sub_counts = calloc((size_t)config.subscribers + 1, sizeof(int));
+    if (!subs || !sub_topics || !sub_counts)
+    {
+        perror("calloc subscribers");
+        return EXIT_FAILURE;
+    }
+
+    for (int t = 0; t < config.topics; t++)
+    {
+        for (int k = 0; k < config.fanout; k++)
+        {
+            int s = (int)(((long long)t * config.fanout + k) % config.subscribers);
+            int *grown = realloc(sub_topics[s], (size_t)(sub_counts[s] + 1) * sizeof(int));
+            if (!grown)
+            {
+                perror("realloc subscriber topics");
+                return EXIT_FAILURE;
+            }
+            sub_topics[s] = grown;
+            sub_topics[s][sub_counts[s]++] = t;
+        }
+    }
+
+    for (int s = 0; s < config.subscribers; s++)
+    {
+        if (bench_connect(&subs[s], "SUBSCRIBER") < 0)
+            return EXIT_FAILURE;
+        if (sub_counts[s] > 0 && subscribe_topics(&subs[s], sub_topics[s], sub_counts[s]) < 0)
+        {
+            fprintf(stderr, "subscriber %d could not subscribe to its topics\n", s);
+            return EXIT_FAILURE;
+        }
+        inbuf_consume(&subs[s].in, subs[s].in.len);
+        fcntl(subs[s].socket, F_SETFL, fcntl(subs[s].socket, F_GETFL, 0) | O_NONBLOCK);
+    }
+
+    // Receive threads, subscribers dealt round-robin
+    RECEIVER *rxs = calloc((size_t)config.receivers, sizeof(RECEIVER));
+    if (!rxs)
+    {
+        perror("calloc receivers");
+        return EXIT_FAILURE;
+    }
+    for (int r = 0; r < config.receivers; r++)
+    {
+        rxs[r].epfd = epoll_create1(0);
+        if (rxs[r].epfd < 0)
+        {
+            perror("epoll_create1 failed");
+            return EXIT_FAILURE;
+        }
+    }
+    for (int s = 0; s < config.subscribers; s++)
+    {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = &subs[s];
+        if (epoll_ctl(rxs[s % config.receivers].epfd, EPOLL_CTL_ADD, subs[s].socket, &ev) < 0)
+        {
+            perror("epoll_ctl add subscriber failed");
+            return EXIT_FAILURE;
+        }
+    }
+
+    PUBLISHER_STATE *pubs = calloc((size_t)config.publishers, sizeof(PUBLISHER_STATE));
+    if (!pubs)
+    {
+        perror("calloc publishers");
+        return EXIT_FAILURE;
+    }
+    for (int p = 0; p < config.publishers; p++)
+    {
+        pubs[p].index = p;
+        if (bench_connect(&pubs[p].conn, "PUBLISHER") < 0)
+            return EXIT_FAILURE;
+    }
+
+    fprintf(stderr, "%d publishers, %d subscribers, %d topics, fanout %d, %zu byte payloads, %s%s, %.1f s warmup + %.1f s\n",
+            config.publishers, config.subscribers, config.topics, config.fanout, config.size,
+            config.text ? "text" : "binary", config.topicIds ? " by topic ID" : "", config.warmup, config.duration);
+
+    uint64_t start = now_ns();
+    window_start = start + (uint64_t)(config.warmup * 1e9);
+    window_end = window_start + (uint64_t)(config.duration * 1e9);
+
+    for (int r = 0; r < config.receivers; r++)
+    {
+        if (pthread_create(&rxs[r].tid, NULL, receiver_thread, &rxs[r]) != 0)
+        {
+            perror("pthread_create receiver failed");
+            return EXIT_FAILURE;
+        }
+    }
+    for (int p = 0; p < config.publishers; p++)
+    {
+        if (pthread_create(&pubs[p].tid, NULL, publisher_thread, &pubs[p]) != 0)
+        {
+            perror("pthread_create publisher failed");
+            return EXIT_FAILURE;
+        }
+    }
+
+    for (int p = 0; p < config.publishers; p++)
+        pthread_join(pubs[p].tid, NULL);
+
+    // Let the queued deliveries arrive
+    sleep_until(now_ns() + DRAIN_NS);
+    atomic_store(&receivers_stop, 1);
+
+    HISTOGRAM *total = calloc(1, sizeof(HISTOGRAM));
+    if (!total)
+    {
+        perror("calloc histogram");
+        return EXIT_FAILURE;
+    }
+    unsigned long long published = 0, delivered = 0, bytes = 0, errors = 0;
+    for (int r = 0; r < config.receivers; r++)
+    {
+        pthread_join(rxs[r].tid, NULL);
+        hist_merge(total, &rxs[r].hist);
+        delivered += rxs[r].received;
+        bytes += rxs[r].bytes;
+    }
+    for (int p = 0; p < config.publishers; p++)
+    {
+        published += pubs[p].sent;
+        errors += pubs[p].errors;
+    }
+
+    unsigned long long expected = published * (unsigned long long)config.fanout;
+    double seconds = config.duration;
+
+    printf("published   %llu (%.0f msg/s)%s\n", published, published / seconds, errors ? ", with errors" : "");
+    printf("delivered   %llu of %llu (%.0f msg/s, %.2f MB/s), lost %llu\n", delivered, expected,
+           delivered / seconds, bytes / seconds / 1e6, expected > delivered ? expected - delivered : 0);
+    printf("latency us  p50 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+           hist_percentile(total, 50) / 1e3, hist_percentile(total, 99) / 1e3,
+           hist_percentile(total, 99.9) / 1e3, total->max / 1e3);
+
+    if (config.json)
+    {
+        FILE *out = strcmp(config.json, "-") == 0 ? stdout : fopen(config.json, "w");
+        if (!out)
+        {
+            perror("fopen json output");
+            return EXIT_FAILURE;
+        }
+        write_json(out, total, published, delivered, bytes, expected, seconds);
+        if (out != stdout)
+            fclose(out);
+    }
+
+    for (int p = 0; p < config.publishers; p++)
+    {
+        close(pubs[p].conn.socket);
+        inbuf_free(&pubs[p].conn.in);
+    }
+    for (int s = 0; s < config.subscribers; s++)
+    {
+        close(subs[s].socket);
+        inbuf_free(&subs[s].in);
+        free(sub_topics[s]);
+    }
+    close(setup.socket);
+    inbuf_free(&setup.in);
+    for (int r = 0; r < config.receivers; r++)
+        close(rxs[r].epfd);
+
+    free(total);
+    free(topic_ids);
+    free(pubs);
+    free(rxs);
+    free(subs);
+    free(sub_topics);
+    free(sub_counts);
+    return errors ? EXIT_FAILURE : 0;
+}
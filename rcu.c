@@ -0,0 +1,209 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "rcu.h"
+
+#define RECLAIM_EVERY   32      // retirements between reclaim attempts
+
+// One record per thread that ever entered a read-side section.
+// state is 0 when the thread is outside a section, (epoch << 1) | 1 inside.
+// Records are never freed; a record whose thread exited is reused.
+typedef struct rcuThread_st {
+    atomic_ulong state;
+    atomic_int inUse;
+    int nesting;
+    struct rcuThread_st *next;
+} RCU_THREAD;
+
+typedef struct rcuRetired_st {
+    void *ptr;
+    void (*fn)(void *);
+    unsigned long epoch;
+    struct rcuRetired_st *next;
+} RCU_RETIRED;
+
+static atomic_ulong globalEpoch = 1;
+static _Atomic(RCU_THREAD *) threadList = NULL;
+
+static pthread_mutex_t retire_mtx = PTHREAD_MUTEX_INITIALIZER;
+static RCU_RETIRED *retiredList = NULL;
+static unsigned long retiredSinceReclaim = 0;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_key;
+static __thread RCU_THREAD *self = NULL;
+
+// Thread exit: leave the record for the next thread to reuse
+static void release_record(void *arg)
+{
+    RCU_THREAD *rec = (RCU_THREAD *)arg;
+    atomic_store(&rec->state, 0);
+    atomic_store(&rec->inUse, 0);
+}
+
+static void make_key(void)
+{
+    pthread_key_create(&thread_key, release_record);
+}
+
+static RCU_THREAD* get_record(void)
+{
+    if (self)
+        return self;
+
+    pthread_once(&key_once, make_key);
+
+    // Reuse the record of a thread that has exited
+    for (RCU_THREAD *rec = atomic_load(&threadList); rec != NULL; rec = rec->next)
+    {
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&rec->inUse, &expected, 1))
+        {
+            self = rec;
+            break;
+        }
+    }
+
+    if (!self)
+    {
+        RCU_THREAD *rec = calloc(1, sizeof(RCU_THREAD));
+        if (rec == NULL)
+        {
+            perror("calloc rcu thread");
+            abort();
+        }
+        atomic_init(&rec->state, 0);
+        atomic_init(&rec->inUse, 1);
+
+        RCU_THREAD *head = atomic_load(&threadList);
+        do
+            rec->next = head;
+        while (!atomic_compare_exchange_weak(&threadList, &head, rec));
+
+        self = rec;
+    }
+
+    self->nesting = 0;
+    pthread_setspecific(thread_key, self);
+    return self;
+}
+
+void rcu_read_lock(void)
+{
+    RCU_THREAD *rec = get_record();
+    if (rec->nesting++ > 0)
+        return;
+
+    unsigned long epoch = atomic_load(&globalEpoch);
+    atomic_store(&rec->state, (epoch << 1) | 1);
+
+    // Publish "active" before any protected pointer is loaded
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+void rcu_read_unlock(void)
+{
+    RCU_THREAD *rec = self;
+    if (--rec->nesting > 0)
+        return;
+
+    atomic_store_explicit(&rec->state, 0, memory_order_release);
+}
+
+// Advance the global epoch if every active reader has observed it
+static unsigned long try_advance(void)
+{
+    unsigned long epoch = atomic_load(&globalEpoch);
+
+    for (RCU_THREAD *rec = atomic_load(&threadList); rec != NULL; rec = rec->next)
+    {
+        unsigned long state = atomic_load(&rec->state);
+        if ((state & 1) && (state >> 1) != epoch)
+            return epoch;
+    }
+
+    atomic_compare_exchange_strong(&globalEpoch, &epoch, epoch + 1);
+    return atomic_load(&globalEpoch);
+}
+
+void rcu_reclaim(void)
+{
+    RCU_RETIRED *ready = NULL;
+
+    pthread_mutex_lock(&retire_mtx);
+    {
+        unsigned long epoch = try_advance();
+        retiredSinceReclaim = 0;
+
+        // An object retired in epoch e may still be seen by readers that
+        // entered in e - 1 or e; once the epoch is e + 2 they are gone.
+        RCU_RETIRED **pp = &retiredList;
+        while (*pp)
+        {
+            RCU_RETIRED *r = *pp;
+            if (r->epoch + 2 <= epoch)
+            {
+                *pp = r->next;
+                r->next = ready;
+                ready = r;
+            }
+            else
+                pp = &r->next;
+        }
+    }
+    pthread_mutex_unlock(&retire_mtx);
+
+    while (ready)
+    {
+        RCU_RETIRED *next = ready->next;
+        ready->fn(ready->ptr);
+        free(ready);
+        ready = next;
+    }
+}
+
+void rcu_retire(void *ptr, void (*fn)(void *))
+{
+    if (ptr == NULL)
+        return;
+
+    RCU_RETIRED *r = malloc(sizeof(RCU_RETIRED));
+    if (r == NULL)
+    {
+        // Leaking is the only safe option without the bookkeeping node
+        perror("malloc rcu retire");
+        return;
+    }
+    r->ptr = ptr;
+    r->fn = fn;
+
+    int reclaim;
+    pthread_mutex_lock(&retire_mtx);
+    {
+        r->epoch = atomic_load(&globalEpoch);
+        r->next = retiredList;
+        retiredList = r;
+        reclaim = ++retiredSinceReclaim >= RECLAIM_EVERY;
+    }
+    pthread_mutex_unlock(&retire_mtx);
+
+    if (reclaim)
+        rcu_reclaim();
+}
+
+void rcu_shutdown(void)
+{
+    pthread_mutex_lock(&retire_mtx);
+    RCU_RETIRED *r = retiredList;
+    retiredList = NULL;
+    pthread_mutex_unlock(&retire_mtx);
+
+    while (r)
+    {
+        RCU_RETIRED *next = r->next;
+        r->fn(r->ptr);
+        free(r);
+        r = next;
+    }
+}
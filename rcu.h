@@ -0,0 +1,24 @@
+#ifndef RCU_H
+#define RCU_H
+
+// Epoch-based reclamation for data that is read without locks.
+//
+// Readers bracket their accesses with rcu_read_lock()/rcu_read_unlock().
+// Writers replace a shared pointer atomically and hand the old object to
+// rcu_retire(); it is freed only after every reader that could still see it
+// has left its read-side section (two epoch advances later).
+
+void rcu_read_lock(void);
+void rcu_read_unlock(void);
+
+// Free ptr with fn once no reader can reference it anymore
+void rcu_retire(void *ptr, void (*fn)(void *));
+
+// Try to advance the epoch and free what is safe to free.
+// rcu_retire() calls this every few retirements.
+void rcu_reclaim(void);
+
+// Free everything still pending. Only safe when no reader is running.
+void rcu_shutdown(void);
+
+#endif // RCU_H
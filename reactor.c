@@ -0,0 +1,1047 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include "server.h"
+#include "reactor.h"
+#include "stats.h"
+#include "log.h"
+#include "shm.h"
+#include "rcu.h"
+#ifndef PUBSUB_NO_URING
+#include "uring.h"
+#endif
+
+#define MAX_EVENTS      64
+#define ACCEPT_BATCH    64      // connections accepted per wakeup before other events get a turn
+#define SHM_READ_BUDGET (256 * 1024)    // ring bytes read from one local client before others get a turn
+
+#define RING_ENTRIES    1024    // submission queue entries per loop
+#define RING_BUFFERS    256     // provided receive buffers per loop, READ_CHUNK each
+#define RING_BGID       0
+
+typedef struct reactor_loop_st {
+    int index;
+    int epfd;
+    int listen_socket;
+    int ownSocket;          // SO_REUSEPORT socket opened for this loop
+    int local;              // serves the --local unix socket
+    int cpu;                // CPU the loop is pinned to, -1 if not pinned
+    pthread_t tid;
+
+    // Clients other threads want written, pushed lock-free and drained by
+    // this loop after the eventfd wakes it
+    int inboxfd;
+    _Atomic(CLIENT *) inbox;
+
+    // Connections still waiting for their role. They all get the same
+    // timeout, so appending keeps the list ordered by deadline.
+    CLIENT *handshakeHead;
+    CLIENT *handshakeTail;
+
+#ifndef PUBSUB_NO_URING
+    // io_uring loop; ring.fd is -1 for an epoll loop
+    URING ring;
+    URING_BUFS bufs;
+    struct __kernel_timespec timeout;   // of the handshake timeout in flight
+    int timeoutArmed;
+#endif
+} REACTOR_LOOP;
+
+// Per-client state of an io_uring loop, touched by the owning loop only
+typedef struct ring_client_st {
+    struct msghdr msg;              // the SENDMSG in flight
+    struct iovec iov[WRITE_BATCH];
+    int ops;                        // requests that will still complete
+    int sending;
+    int closing;                    // shut down, disconnected once ops is 0
+} RING_CLIENT;
+
+// Marks the inbox eventfd in epoll events; the listening socket is NULL
+static char inbox_marker;
+
+static __thread REACTOR_LOOP *current_loop = NULL;
+
+static int set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0)
+        return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// Start the handshake timeout of a new connection
+static void handshake_track(REACTOR_LOOP *loop, CLIENT *client)
+{
+    if (handshake_ms == 0)
+        return;
+
+    client->handshakeDeadline = stats_now() + (uint64_t)handshake_ms * 1000000ULL;
+    client->handshakePrev = loop->handshakeTail;
+    client->handshakeNext = NULL;
+    if (loop->handshakeTail)
+        loop->handshakeTail->handshakeNext = client;
+    else
+        loop->handshakeHead = client;
+    loop->handshakeTail = client;
+    client->handshakeListed = 1;
+}
+
+static void handshake_untrack(REACTOR_LOOP *loop, CLIENT *client)
+{
+    if (!client->handshakeListed)
+        return;
+
+    if (client->handshakePrev)
+        client->handshakePrev->handshakeNext = client->handshakeNext;
+    else
+        loop->handshakeHead = client->handshakeNext;
+    if (client->handshakeNext)
+        client->handshakeNext->handshakePrev = client->handshakePrev;
+    else
+        loop->handshakeTail = client->handshakePrev;
+    client->handshakeListed = 0;
+}
+
+// Close the connections whose handshake timed out. Returns the
+// milliseconds until the next one does, -1 if none is pending.
+static int handshake_expire(REACTOR_LOOP *loop, void (*close_fn)(REACTOR_LOOP *, CLIENT *))
+{
+    uint64_t now = stats_now();
+
+    while (loop->handshakeHead)
+    {
+        CLIENT *client = loop->handshakeHead;
+        if (client->handshakeDeadline > now)
+            return (int)((client->handshakeDeadline - now + 999999) / 1000000);
+
+        handshake_untrack(loop, client);
+        client_handshake_expired(client);
+        close_fn(loop, client);
+    }
+    return -1;
+}
+
+static void close_connection(REACTOR_LOOP *loop, CLIENT *client)
+{
+    client->loopClosed = 1;
+    handshake_untrack(loop, client);
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, client->socket, NULL);
+
+    // The client process shares these eventfds, so closing them later
+    // would not take them out of the epoll set
+    if (client->shm)
+    {
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, client->shm->up.dataFd, NULL);
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, client->shm->down.spaceFd, NULL);
+    }
+    client_disconnected(client);
+}
+
+// Accept pending connections and register them with this loop. At most
+// ACCEPT_BATCH per call: the listening socket is level-triggered, so the
+// rest are reported again after the other ready connections had their turn.
+static void accept_connections(REACTOR_LOOP *loop)
+{
+    for (int i = 0; i < ACCEPT_BATCH; i++)
+    {
+        struct sockaddr_in client_addr;
+        socklen_t addr_len = sizeof(client_addr);
+
+        // Unix socket peers have no address worth keeping
+        memset(&client_addr, 0, sizeof(client_addr));
+        int sock = accept4(loop->listen_socket, loop->local ? NULL : (struct sockaddr *)&client_addr,
+                           loop->local ? NULL : &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (sock < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("accept failed");
+            return;
+        }
+
+        CLIENT *client = createClient(sock, &client_addr);
+        if (!client)
+        {
+            close(sock);
+            continue;
+        }
+        client->nonblocking = 1;
+        client->loop = loop;
+        client->local = loop->local;
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = client;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, sock, &ev) < 0)
+        {
+            perror("epoll_ctl add client failed");
+            destroyClient(client);
+            continue;
+        }
+        handshake_track(loop, client);
+    }
+}
+
+// Drain the socket until it would block. Returns -1 if the connection is gone.
+static int read_connection(CLIENT *client)
+{
+    char buffer[READ_CHUNK];
+
+    while (1)
+    {
+        ssize_t read_size = recv(client->socket, buffer, READ_CHUNK, 0);
+        if (read_size > 0)
+        {
+            // Frames and lines may be split across reads; the client keeps
+            // whatever is incomplete until the next one
+            if (client_input(client, buffer, (size_t)read_size) < 0)
+                return -1;
+            continue;
+        }
+
+        if (read_size == 0)
+            return -1;
+        if (errno == EINTR)
+            continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        return -1;
+    }
+}
+
+// Shared-memory client: take the frames it wrote to its ring and write
+// its queue into the other one. Returns -1 if the connection is gone.
+static int service_shm(CLIENT *client)
+{
+    SHM_CONN *shm = client->shm;
+    size_t budget = SHM_READ_BUDGET;
+
+    shm_clear(shm->up.dataFd);
+    shm_clear(shm->down.spaceFd);
+
+    do
+    {
+        const char *data;
+        ssize_t len;
+        while ((len = shm_readable(&shm->up, &data)) != 0)
+        {
+            // The frames are parsed from the client's input buffer like
+            // those of a socket, so the ring space is free right away
+            if (len < 0 || client_input(client, data, (size_t)len) < 0)
+                return -1;
+            shm_consume(&shm->up, (size_t)len);
+
+            // A client that keeps writing must not starve the others;
+            // the eventfd brings the loop back to it
+            if ((size_t)len >= budget)
+            {
+                uint64_t one = 1;
+                if (write(shm->up.dataFd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+                    perror("write shared memory eventfd");
+                return client_flush(client);
+            }
+            budget -= (size_t)len;
+        }
+
+        if (client_flush(client) < 0)
+            return -1;
+    }
+    while (!shm_consumer_idle(&shm->up, 0));
+
+    return 0;
+}
+
+// Hand a client to the loop that owns it so that loop writes its queue.
+// Returns -1 if the caller is that loop (or the client has none) and
+// should write itself.
+int reactor_post(CLIENT *client)
+{
+    REACTOR_LOOP *loop = client->loop;
+    if (loop == NULL || loop == current_loop)
+        return -1;
+
+    // Queued once however many fan-outs kick it before the owner runs
+    if (atomic_exchange(&client->inboxQueued, 1))
+        return 0;
+
+    client_hold(client);
+
+    CLIENT *head = atomic_load_explicit(&loop->inbox, memory_order_relaxed);
+    do
+        client->inboxNext = head;
+    while (!atomic_compare_exchange_weak_explicit(&loop->inbox, &head, client, memory_order_release, memory_order_relaxed));
+
+    // Only the push onto an empty inbox needs to wake the loop
+    if (head == NULL)
+    {
+        uint64_t one = 1;
+        if (write(loop->inboxfd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            perror("write inbox eventfd");
+    }
+    return 0;
+}
+
+int reactor_owner(const CLIENT *client)
+{
+    return client->loop != NULL && client->loop == current_loop;
+}
+
+// Write every client posted to this loop. The eventfd is reset before the
+// inbox is taken, so a push that lands afterwards wakes the loop again.
+static void drain_inbox(REACTOR_LOOP *loop)
+{
+    uint64_t count;
+    if (read(loop->inboxfd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        perror("read inbox eventfd");
+
+    CLIENT *list = atomic_exchange_explicit(&loop->inbox, NULL, memory_order_acquire);
+
+    // The inbox is a stack; reverse it to write clients in posting order
+    CLIENT *ordered = NULL;
+    while (list)
+    {
+        CLIENT *next = list->inboxNext;
+        list->inboxNext = ordered;
+        ordered = list;
+        list = next;
+    }
+
+    while (ordered)
+    {
+        CLIENT *client = ordered;
+        ordered = client->inboxNext;
+
+        // Cleared first so a message queued during the write posts again.
+        // A failed write is noticed through EPOLLERR / EPOLLHUP.
+        atomic_store(&client->inboxQueued, 0);
+        client_flush(client);
+        client_release(client);
+    }
+}
+
+// Pin the calling thread to the loop's CPU
+static void pin_loop(REACTOR_LOOP *loop)
+{
+    if (loop->cpu < 0)
+        return;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(loop->cpu, &set);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err != 0)
+    {
+        errno = err;
+        perror("pthread_setaffinity_np failed");
+    }
+}
+
+static void *loop_thread(void *arg)
+{
+    REACTOR_LOOP *loop = (REACTOR_LOOP *)arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    current_loop = loop;
+    pin_loop(loop);
+
+    while (1)
+    {
+        // Wake up in time for the oldest pending handshake
+        int timeout = handshake_expire(loop, close_connection);
+        int n = epoll_wait(loop->epfd, events, MAX_EVENTS, timeout);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait failed");
+            break;
+        }
+
+        // A client closed by one event is freed through RCU; the read
+        // section keeps it readable for the rest of the batch
+        rcu_read_lock();
+        for (int i = 0; i < n; i++)
+        {
+            CLIENT *client = (CLIENT *)events[i].data.ptr;
+            uint32_t ev = events[i].events;
+
+            // Listening socket
+            if (client == NULL)
+            {
+                accept_connections(loop);
+                continue;
+            }
+
+            if ((void *)client == &inbox_marker)
+            {
+                drain_inbox(loop);
+                continue;
+            }
+
+            // A shared-memory client has three descriptors in the set, so
+            // it can have more events in this batch after being closed
+            if (client->loopClosed)
+                continue;
+
+            // Events of a shared-memory client's eventfds and of its
+            // socket, which only matters once it hangs up
+            if (client->shm)
+            {
+                if ((ev & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) || service_shm(client) < 0)
+                    close_connection(loop, client);
+                continue;
+            }
+
+            if (ev & (EPOLLERR | EPOLLHUP))
+            {
+                close_connection(loop, client);
+                continue;
+            }
+
+            if ((ev & EPOLLOUT) && client_flush(client) < 0)
+            {
+                close_connection(loop, client);
+                continue;
+            }
+
+            if ((ev & (EPOLLIN | EPOLLRDHUP)) && read_connection(client) < 0)
+            {
+                close_connection(loop, client);
+                continue;
+            }
+
+            if (client->state != CLIENT_HANDSHAKE)
+                handshake_untrack(loop, client);
+        }
+        rcu_read_unlock();
+    }
+
+    return NULL;
+}
+
+#ifndef PUBSUB_NO_URING
+
+// What a completion is for, in the low bits of its user_data. Loops and
+// clients are at least 8-byte aligned.
+#define RING_ACCEPT     0
+#define RING_INBOX      1
+#define RING_RECV       2
+#define RING_SEND       3
+#define RING_TIMEOUT    4
+#define RING_OP_MASK    7ULL
+
+static uint64_t ring_tag(void *ptr, int op)
+{
+    return (uint64_t)(uintptr_t)ptr | (uint64_t)op;
+}
+
+// Next SQE of the loop's ring. A full submission queue is handed to the
+// kernel first, so only a failing ring returns NULL.
+static struct io_uring_sqe* ring_sqe(REACTOR_LOOP *loop)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+    if (sqe == NULL)
+    {
+        uring_submit(&loop->ring, 0);
+        sqe = uring_get_sqe(&loop->ring);
+        if (sqe == NULL)
+            LOG_LIMITED(LOG_ERROR, "[ERROR] io_uring submission queue full (%d entries).\n", RING_ENTRIES);
+    }
+    return sqe;
+}
+
+static int ring_arm_accept(REACTOR_LOOP *loop)
+{
+    struct io_uring_sqe *sqe = ring_sqe(loop);
+    if (sqe == NULL)
+        return -1;
+
+    // The peer address is not returned per accept; it is looked up after
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = loop->listen_socket;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = ring_tag(loop, RING_ACCEPT);
+    return 0;
+}
+
+static int ring_arm_inbox(REACTOR_LOOP *loop)
+{
+    struct io_uring_sqe *sqe = ring_sqe(loop);
+    if (sqe == NULL)
+        return -1;
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = loop->inboxfd;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = ring_tag(loop, RING_INBOX);
+    return 0;
+}
+
+static int ring_arm_recv(REACTOR_LOOP *loop, CLIENT *client)
+{
+    struct io_uring_sqe *sqe = ring_sqe(loop);
+    if (sqe == NULL)
+        return -1;
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = client->socket;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = RING_BGID;
+    sqe->user_data = ring_tag(client, RING_RECV);
+    client->ring->ops++;
+    return 0;
+}
+
+// Wake the loop when the oldest pending handshake times out. Only one
+// timeout is in flight; it is set again once it fires.
+static void ring_arm_timeout(REACTOR_LOOP *loop, int ms)
+{
+    if (ms < 0 || loop->timeoutArmed)
+        return;
+
+    struct io_uring_sqe *sqe = ring_sqe(loop);
+    if (sqe == NULL)
+        return;
+
+    loop->timeout.tv_sec = ms / 1000;
+    loop->timeout.tv_nsec = (long long)(ms % 1000) * 1000000;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)(uintptr_t)&loop->timeout;
+    sqe->len = 1;
+    sqe->user_data = ring_tag(loop, RING_TIMEOUT);
+    loop->timeoutArmed = 1;
+}
+
+int reactor_ring_send(CLIENT *client)
+{
+    REACTOR_LOOP *loop = client->loop;
+    RING_CLIENT *rc = client->ring;
+
+    // Only the owning loop may touch its ring
+    if (loop != current_loop)
+    {
+        reactor_post(client);
+        return 0;
+    }
+
+    // One send at a time keeps the bytes in queue order
+    if (rc->closing || rc->sending)
+        return 0;
+
+    int cnt = client_fill_batch(client, rc->iov);
+    if (cnt == 0)
+        return 0;
+
+    struct io_uring_sqe *sqe = ring_sqe(loop);
+    if (sqe == NULL)
+    {
+        client_batch_sent(client, 0);
+        return -1;
+    }
+
+    memset(&rc->msg, 0, sizeof(rc->msg));
+    rc->msg.msg_iov = rc->iov;
+    rc->msg.msg_iovlen = (size_t)cnt;
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = client->socket;
+    sqe->addr = (uint64_t)(uintptr_t)&rc->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = ring_tag(client, RING_SEND);
+    rc->sending = 1;
+    rc->ops++;
+    return 0;
+}
+
+// Disconnect a client once none of its requests can complete any more:
+// shutting the socket down ends the multishot receive and a pending send
+static void ring_close(CLIENT *client)
+{
+    RING_CLIENT *rc = client->ring;
+    handshake_untrack(client->loop, client);
+    if (!rc->closing)
+    {
+        rc->closing = 1;
+        shutdown(client->socket, SHUT_RDWR);
+    }
+    if (rc->ops == 0)
+        client_disconnected(client);
+}
+
+static void ring_accepted(REACTOR_LOOP *loop, int sock)
+{
+    struct sockaddr_in client_addr;
+    socklen_t addr_len = sizeof(client_addr);
+
+    memset(&client_addr, 0, sizeof(client_addr));
+    if (getpeername(sock, (struct sockaddr *)&client_addr, &addr_len) < 0)
+    {
+        perror("getpeername failed");
+        close(sock);
+        return;
+    }
+
+    CLIENT *client = createClient(sock, &client_addr);
+    if (!client)
+    {
+        close(sock);
+        return;
+    }
+    client->nonblocking = 1;
+    client->loop = loop;
+
+    client->ring = calloc(1, sizeof(RING_CLIENT));
+    if (client->ring == NULL)
+    {
+        perror("calloc ring client");
+        destroyClient(client);
+        return;
+    }
+
+    if (ring_arm_recv(loop, client) < 0)
+    {
+        destroyClient(client);
+        return;
+    }
+    handshake_track(loop, client);
+}
+
+static void ring_close_expired(REACTOR_LOOP *loop, CLIENT *client)
+{
+    (void)loop;
+    ring_close(client);
+}
+
+static void ring_received(REACTOR_LOOP *loop, CLIENT *client, const struct io_uring_cqe *cqe)
+{
+    RING_CLIENT *rc = client->ring;
+    int failed = 0;
+
+    if (cqe->flags & IORING_CQE_F_BUFFER)
+    {
+        unsigned short bid = (unsigned short)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+
+        // The data is copied into the client's input buffer, so the
+        // kernel buffer goes straight back to the ring
+        if (cqe->res > 0 && !rc->closing &&
+            client_input(client, uring_buf(&loop->bufs, bid), (size_t)cqe->res) < 0)
+            failed = 1;
+        uring_buf_recycle(&loop->bufs, bid);
+
+        if (client->state != CLIENT_HANDSHAKE)
+            handshake_untrack(loop, client);
+    }
+
+    if (cqe->flags & IORING_CQE_F_MORE)
+    {
+        if (failed)
+            ring_close(client);
+        return;
+    }
+
+    // The multishot receive ended: out of buffers (re-armed), or EOF / error
+    rc->ops--;
+    if (!failed && !rc->closing && (cqe->res > 0 || cqe->res == -ENOBUFS) && ring_arm_recv(loop, client) == 0)
+        return;
+    ring_close(client);
+}
+
+static void ring_sent(CLIENT *client, const struct io_uring_cqe *cqe)
+{
+    RING_CLIENT *rc = client->ring;
+    int failed = cqe->res < 0;
+
+    rc->sending = 0;
+    rc->ops--;
+
+    pthread_mutex_lock(&client->out_mtx);
+    {
+        client_batch_sent(client, failed ? 0 : (size_t)cqe->res);
+        if (failed)
+        {
+            if (!rc->closing)
+                stats_add(STAT_SEND_ERRORS, 1);
+        }
+        else if (reactor_ring_send(client) < 0)
+            failed = 1;
+    }
+    pthread_mutex_unlock(&client->out_mtx);
+
+    if (failed || rc->closing)
+        ring_close(client);
+}
+
+static void ring_complete(REACTOR_LOOP *loop, const struct io_uring_cqe *cqe)
+{
+    int op = (int)(cqe->user_data & RING_OP_MASK);
+    void *ptr = (void *)(uintptr_t)(cqe->user_data & ~RING_OP_MASK);
+
+    switch (op)
+    {
+        case RING_ACCEPT:
+            if (cqe->res >= 0)
+                ring_accepted(loop, cqe->res);
+            else if (cqe->res != -EAGAIN && cqe->res != -EINTR)
+            {
+                errno = -cqe->res;
+                perror("accept failed");
+            }
+            if (!(cqe->flags & IORING_CQE_F_MORE))
+                ring_arm_accept(loop);
+            break;
+
+        case RING_INBOX:
+            drain_inbox(loop);
+            if (!(cqe->flags & IORING_CQE_F_MORE))
+                ring_arm_inbox(loop);
+            break;
+
+        case RING_RECV:
+            ring_received(loop, (CLIENT *)ptr, cqe);
+            break;
+
+        case RING_SEND:
+            ring_sent((CLIENT *)ptr, cqe);
+            break;
+
+        case RING_TIMEOUT:
+            loop->timeoutArmed = 0;
+            break;
+    }
+}
+
+static void *ring_loop_thread(void *arg)
+{
+    REACTOR_LOOP *loop = (REACTOR_LOOP *)arg;
+
+    current_loop = loop;
+    pin_loop(loop);
+
+    if (ring_arm_accept(loop) < 0 || ring_arm_inbox(loop) < 0)
+        return NULL;
+
+    while (1)
+    {
+        ring_arm_timeout(loop, handshake_expire(loop, ring_close_expired));
+
+        // Everything prepared since the last pass (sends of all the
+        // clients a fan-out queued for, re-armed requests) goes to the
+        // kernel in this one call
+        int n = uring_submit(&loop->ring, 1);
+        if (n < 0 && n != -EINTR && n != -EAGAIN && n != -EBUSY)
+        {
+            errno = -n;
+            perror("io_uring_enter failed");
+            break;
+        }
+
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek_cqe(&loop->ring)) != NULL)
+        {
+            struct io_uring_cqe done = *cqe;
+            uring_cqe_seen(&loop->ring);
+            ring_complete(loop, &done);
+        }
+    }
+
+    return NULL;
+}
+
+static int init_ring(REACTOR_LOOP *loop)
+{
+    if (uring_init(&loop->ring, RING_ENTRIES) < 0)
+    {
+        perror("io_uring_setup failed");
+        return -1;
+    }
+    if (uring_bufs_init(&loop->ring, &loop->bufs, RING_BGID, RING_BUFFERS, READ_CHUNK) < 0)
+    {
+        perror("io_uring provided buffers failed");
+        uring_free(&loop->ring);
+        return -1;
+    }
+    return 0;
+}
+
+#else
+
+int reactor_ring_send(CLIENT *client)
+{
+    (void)client;
+    return 0;
+}
+
+#endif // PUBSUB_NO_URING
+
+static int init_loop(REACTOR_LOOP *loop, int index, int listen_socket, const REACTOR_OPTIONS *opts, const cpu_set_t *cpus, int uring)
+{
+    loop->index = index;
+    loop->listen_socket = listen_socket;
+    loop->ownSocket = 0;
+    loop->cpu = -1;
+    atomic_init(&loop->inbox, NULL);
+    loop->handshakeHead = NULL;
+    loop->handshakeTail = NULL;
+
+    // Loop 0 keeps the socket main() opened; the others bind their own to
+    // the same port and the kernel spreads new connections across them
+    if (opts->reuseport && index > 0)
+    {
+        loop->listen_socket = open_listen_socket(opts->port, 1);
+        if (loop->listen_socket < 0)
+            return -1;
+        // io_uring accepts on a blocking socket; a non-blocking one would
+        // end the multishot accept with -EAGAIN
+        if (!uring && set_nonblocking(loop->listen_socket) < 0)
+        {
+            perror("fcntl O_NONBLOCK listen socket failed");
+            close(loop->listen_socket);
+            return -1;
+        }
+        loop->ownSocket = 1;
+    }
+
+    // Loop i goes to the i-th CPU this process may run on
+    if (opts->pin && CPU_COUNT(cpus) > 0)
+    {
+        int nth = index % CPU_COUNT(cpus);
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        {
+            if (CPU_ISSET(cpu, cpus) && nth-- == 0)
+            {
+                loop->cpu = cpu;
+                break;
+            }
+        }
+    }
+
+#ifndef PUBSUB_NO_URING
+    loop->ring.fd = -1;
+    if (uring)
+    {
+        loop->epfd = -1;
+        loop->inboxfd = eventfd(0, EFD_NONBLOCK);
+        if (loop->inboxfd < 0)
+        {
+            perror("eventfd failed");
+            goto fail_socket;
+        }
+        if (init_ring(loop) < 0)
+        {
+            close(loop->inboxfd);
+            goto fail_socket;
+        }
+        return 0;
+    }
+#endif
+
+    loop->epfd = epoll_create1(0);
+    if (loop->epfd < 0)
+    {
+        perror("epoll_create1 failed");
+        goto fail_socket;
+    }
+
+    loop->inboxfd = eventfd(0, EFD_NONBLOCK);
+    if (loop->inboxfd < 0)
+    {
+        perror("eventfd failed");
+        goto fail_epoll;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &inbox_marker;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->inboxfd, &ev) < 0)
+    {
+        perror("epoll_ctl add inbox eventfd failed");
+        goto fail_eventfd;
+    }
+
+    // Level-triggered. A shared socket is also exclusive, so one incoming
+    // connection wakes one loop.
+    ev.events = EPOLLIN | (opts->reuseport ? 0 : EPOLLEXCLUSIVE);
+    ev.data.ptr = NULL;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->listen_socket, &ev) < 0)
+    {
+        perror("epoll_ctl add listen socket failed");
+        goto fail_eventfd;
+    }
+
+    return 0;
+
+fail_eventfd:
+    close(loop->inboxfd);
+fail_epoll:
+    close(loop->epfd);
+fail_socket:
+    if (loop->ownSocket)
+        close(loop->listen_socket);
+    return -1;
+}
+
+int reactor_run(int listen_socket, const REACTOR_OPTIONS *opts)
+{
+    int loops = opts->loops;
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    if (sched_getaffinity(0, sizeof(cpus), &cpus) < 0)
+    {
+        perror("sched_getaffinity failed");
+        CPU_ZERO(&cpus);
+    }
+
+    // 0 means one loop per CPU this process may run on
+    if (loops < 1)
+        loops = CPU_COUNT(&cpus) > 0 ? CPU_COUNT(&cpus) : 1;
+
+    void *(*run)(void *) = loop_thread;
+    int uring = opts->uring;
+#ifdef PUBSUB_NO_URING
+    if (uring)
+    {
+        LOG(LOG_WARN, "[INFO] Built without io_uring support (URING=0), using epoll\n");
+        uring = 0;
+    }
+#else
+    const char *why = NULL;
+    if (uring && uring_probe(&why) < 0)
+    {
+        LOG(LOG_WARN, "[INFO] io_uring not usable: %s; using epoll\n", why);
+        uring = 0;
+    }
+    if (uring)
+        run = ring_loop_thread;
+#endif
+
+    if (!uring && set_nonblocking(listen_socket) < 0)
+    {
+        perror("fcntl O_NONBLOCK listen socket failed");
+        return -1;
+    }
+
+    REACTOR_LOOP *all = calloc((size_t)loops, sizeof(REACTOR_LOOP));
+    if (!all)
+    {
+        perror("calloc event loops");
+        return -1;
+    }
+
+    for (int i = 0; i < loops; i++)
+    {
+        if (init_loop(&all[i], i, listen_socket, opts, &cpus, uring) < 0)
+        {
+            free(all);
+            return -1;
+        }
+    }
+
+    LOG(LOG_INFO, "[INFO] %d %s event loop%s%s%s\n", loops, uring ? "io_uring" : "epoll", loops == 1 ? "" : "s",
+           opts->reuseport && loops > 1 ? ", one SO_REUSEPORT socket each" : "",
+           opts->pin ? ", pinned to CPUs" : "");
+    fflush(stdout);
+
+    // Extra loops get their own threads, loop 0 runs on the caller's thread
+    for (int i = 1; i < loops; i++)
+    {
+        if (pthread_create(&all[i].tid, NULL, run, &all[i]) != 0)
+        {
+            perror("pthread_create event loop failed");
+            return -1;
+        }
+    }
+
+    run(&all[0]);
+
+    for (int i = 1; i < loops; i++)
+        pthread_join(all[i].tid, NULL);
+
+    free(all);
+    return -1;
+}
+
+int reactor_shm_attach(CLIENT *client)
+{
+    REACTOR_LOOP *loop = client->loop;
+    if (loop == NULL || !loop->local || loop != current_loop)
+        return -1;
+
+    SHM_CONN *shm = shm_create();
+    if (shm == NULL)
+        return -1;
+
+    // Watched before the client can write anything: it waits for the answer
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = client;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, shm->up.dataFd, &ev) < 0 ||
+        epoll_ctl(loop->epfd, EPOLL_CTL_ADD, shm->down.spaceFd, &ev) < 0)
+    {
+        perror("epoll_ctl add shared memory eventfd failed");
+        goto fail;
+    }
+
+    int fds[SHM_FDS];
+    shm_fds(shm, fds);
+    if (shm_send_fds(client->socket, HANDSHAKE_OK_SHM, fds, SHM_FDS) < 0)
+    {
+        perror("send shared memory handshake failed");
+        goto fail;
+    }
+
+    client->shm = shm;
+    return 0;
+
+fail:
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, shm->up.dataFd, NULL);
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, shm->down.spaceFd, NULL);
+    shm_close(shm);
+    return -1;
+}
+
+int reactor_start_local(int local_socket)
+{
+    static REACTOR_LOOP local;
+    REACTOR_OPTIONS opts;
+    cpu_set_t cpus;
+
+    memset(&opts, 0, sizeof(opts));
+    CPU_ZERO(&cpus);
+
+    if (set_nonblocking(local_socket) < 0)
+    {
+        perror("fcntl O_NONBLOCK local socket failed");
+        return -1;
+    }
+
+    // Not one of the --loops: an epoll loop of its own, in every mode
+    if (init_loop(&local, -1, local_socket, &opts, &cpus, 0) < 0)
+        return -1;
+    local.local = 1;
+
+    if (pthread_create(&local.tid, NULL, loop_thread, &local) != 0)
+    {
+        perror("pthread_create local loop failed");
+        return -1;
+    }
+    pthread_detach(local.tid);
+    return 0;
+}
@@ -0,0 +1,51 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include "server.h"
+
+typedef struct reactor_options_st {
+    int loops;          // event loops, 0 for one per usable CPU
+    int port;           // needed to open the per-loop sockets
+    int reuseport;      // every loop listens on its own SO_REUSEPORT socket
+    int pin;            // pin loop i to the i-th usable CPU
+    int uring;          // io_uring instead of epoll, if the kernel has it
+} REACTOR_OPTIONS;
+
+// Run the edge-triggered epoll event loop(s) on an already listening socket.
+// With more than one loop every loop runs on its own thread and owns the
+// connections it accepted. The loops share the listening socket
+// (EPOLLEXCLUSIVE), or with reuseport each opens its own.
+//
+// With uring every loop runs an io_uring instead: one multishot accept on
+// the listening socket, one multishot receive per connection into a ring
+// of provided buffers, and queued messages sent as SENDMSG batches that
+// the loop submits together with one io_uring_enter() per iteration. If
+// the kernel lacks any of it (checked once at startup), or the server was
+// built with URING=0, the epoll loops run instead.
+// Only returns on a fatal setup error.
+int reactor_run(int listen_socket, const REACTOR_OPTIONS *opts);
+
+// Ask the loop owning a client to write its queue. Returns 0 if the client
+// was posted to that loop's inbox and -1 if the calling thread is the
+// owner (or the client has no loop) and must write it itself.
+int reactor_post(CLIENT *client);
+
+// Whether the calling thread is the loop owning the client
+int reactor_owner(const CLIENT *client);
+
+// Serve the --local unix socket on an epoll loop thread of its own, next
+// to whatever runs the TCP clients. Its clients may ask for the shared-
+// memory transport (shm.h); the loop then watches their ring eventfds
+// besides the socket, and other threads copy messages into their rings
+// directly instead of posting them.
+int reactor_start_local(int local_socket);
+
+// Handshake of a local client that asked for SHM/1: create its rings,
+// watch them and send them over. Called by the client's loop.
+int reactor_shm_attach(CLIENT *client);
+
+// Submit the next batch of a ring client's queue, or post the client to
+// its loop when called from another thread. Caller holds out_mtx.
+int reactor_ring_send(CLIENT *client);
+
+#endif // REACTOR_H
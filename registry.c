@@ -0,0 +1,524 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "registry.h"
+#include "rcu.h"
+#include "stats.h"
+
+int registry_init(REGISTRY *reg, size_t shards)
+{
+    size_t count = 1;
+    while (count < shards)
+        count <<= 1;
+
+    reg->shards = aligned_alloc(64, count * sizeof(REGISTRY_SHARD));
+    if (reg->shards == NULL)
+    {
+        perror("aligned_alloc registry shards");
+        return -1;
+    }
+    reg->count = count;
+
+    // Writers are preferred so a steady stream of publishes cannot starve
+    // subscribe/unsubscribe on the same shard
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        REGISTRY_SHARD *shard = &reg->shards[i];
+        pthread_rwlock_init(&shard->lock, &attr);
+        initTopic(&shard->topics);
+        atomic_init(&shard->reads, 0);
+        atomic_init(&shard->readWaits, 0);
+        atomic_init(&shard->writes, 0);
+        atomic_init(&shard->writeWaits, 0);
+    }
+
+    pthread_rwlockattr_destroy(&attr);
+
+    if (wildcard_init(&reg->wildcards) < 0)
+    {
+        free(reg->shards);
+        reg->shards = NULL;
+        return -1;
+    }
+
+    atomic_init(&reg->ids, NULL);
+    pthread_mutex_init(&reg->idLock, NULL);
+    reg->lastId = 0;
+    return 0;
+}
+
+void registry_destroy(REGISTRY *reg)
+{
+    for (size_t i = 0; i < reg->count; i++)
+    {
+        REGISTRY_SHARD *shard = &reg->shards[i];
+        shard_wrlock(shard);
+        destroyTopics(&shard->topics);
+        shard_unlock(shard);
+        pthread_rwlock_destroy(&shard->lock);
+    }
+
+    free(reg->shards);
+    reg->shards = NULL;
+    reg->count = 0;
+    wildcard_destroy(&reg->wildcards);
+
+    free(atomic_load(&reg->ids));
+    atomic_store(&reg->ids, NULL);
+    pthread_mutex_destroy(&reg->idLock);
+}
+
+// Give a new topic the next ID. Without one (the table could not grow,
+// or the IDs ran out) it is still served by name.
+static void assign_topic_id(REGISTRY *reg, TOPIC *topic)
+{
+    pthread_mutex_lock(&reg->idLock);
+    {
+        TOPIC_ID_TABLE *ids = atomic_load_explicit(&reg->ids, memory_order_relaxed);
+        uint32_t id = reg->lastId + 1;
+        size_t size = ids ? ids->size : 0;
+
+        if (id != 0 && id >= size)
+        {
+            size_t newSize = size ? size * 2 : TOPIC_ID_TABLE_MIN;
+            TOPIC_ID_TABLE *grown = malloc(sizeof(TOPIC_ID_TABLE) + newSize * sizeof(TOPIC *));
+            if (grown == NULL)
+            {
+                perror("malloc TOPIC_ID_TABLE");
+                id = 0;
+            }
+            else
+            {
+                grown->size = newSize;
+                for (size_t i = 0; i < newSize; i++)
+                    atomic_init(&grown->topics[i], i < size ? atomic_load_explicit(&ids->topics[i], memory_order_relaxed) : NULL);
+                atomic_store_explicit(&reg->ids, grown, memory_order_release);
+                rcu_retire(ids, free);
+                ids = grown;
+            }
+        }
+
+        if (id != 0)
+        {
+            topic->id = id;
+            reg->lastId = id;
+            atomic_store_explicit(&ids->topics[id], topic, memory_order_release);
+        }
+    }
+    pthread_mutex_unlock(&reg->idLock);
+}
+
+TOPIC* registry_topic_by_id(REGISTRY *reg, uint32_t id)
+{
+    TOPIC *topic = NULL;
+
+    rcu_read_lock();
+    {
+        TOPIC_ID_TABLE *ids = atomic_load_explicit(&reg->ids, memory_order_acquire);
+        if (ids && id < ids->size)
+            topic = atomic_load_explicit(&ids->topics[id], memory_order_acquire);
+    }
+    rcu_read_unlock();
+
+    return topic;
+}
+
+// The topic tables index by the low hash bits, so shards use the high ones
+REGISTRY_SHARD* registry_shard(REGISTRY *reg, uint64_t hash)
+{
+    return &reg->shards[(size_t)(hash >> 40) & (reg->count - 1)];
+}
+
+void shard_rdlock(REGISTRY_SHARD *shard)
+{
+    atomic_fetch_add_explicit(&shard->reads, 1, memory_order_relaxed);
+    if (pthread_rwlock_tryrdlock(&shard->lock) == 0)
+        return;
+
+    // Only the contended path is timed
+    uint64_t start = stats_now();
+    atomic_fetch_add_explicit(&shard->readWaits, 1, memory_order_relaxed);
+    pthread_rwlock_rdlock(&shard->lock);
+    stats_add(STAT_LOCK_WAITS, 1);
+    stats_add(STAT_LOCK_WAIT_NS, stats_now() - start);
+}
+
+void shard_wrlock(REGISTRY_SHARD *shard)
+{
+    atomic_fetch_add_explicit(&shard->writes, 1, memory_order_relaxed);
+    if (pthread_rwlock_trywrlock(&shard->lock) == 0)
+        return;
+
+    uint64_t start = stats_now();
+    atomic_fetch_add_explicit(&shard->writeWaits, 1, memory_order_relaxed);
+    pthread_rwlock_wrlock(&shard->lock);
+    stats_add(STAT_LOCK_WAITS, 1);
+    stats_add(STAT_LOCK_WAIT_NS, stats_now() - start);
+}
+
+void shard_unlock(REGISTRY_SHARD *shard)
+{
+    pthread_rwlock_unlock(&shard->lock);
+}
+
+TOPIC* registry_lookup(REGISTRY *reg, const char *name, uint64_t hash, int create)
+{
+    REGISTRY_SHARD *shard = registry_shard(reg, hash);
+    TOPIC *topic;
+
+    shard_rdlock(shard);
+    topic = findTopicHashed(&shard->topics, name, hash);
+    shard_unlock(shard);
+
+    if (topic || !create)
+        return topic;
+
+    shard_wrlock(shard);
+    {
+        // Someone may have added it in between
+        topic = findTopicHashed(&shard->topics, name, hash);
+        if (!topic)
+        {
+            topic = createTopic(name);
+            if (topic)
+            {
+                topic->created = stats_now();
+                // The ID only once the topic is reachable by name as well,
+                // and still before the shard lock lets anyone see it
+                if (addTopic(&shard->topics, topic) < 0)
+                {
+                    freeTopic(topic);
+                    topic = NULL;
+                }
+                else
+                    assign_topic_id(reg, topic);
+            }
+        }
+    }
+    shard_unlock(shard);
+
+    return topic;
+}
+
+// Cached subscriber sets that include pattern subscribers are stale now.
+// Called after the change is visible in the pattern's snapshot.
+static void wildcards_changed(REGISTRY *reg)
+{
+    atomic_fetch_add(&reg->wildcards.generation, 1);
+}
+
+int registry_subscribe(REGISTRY *reg, const char *name, SUBSCRIPTIONS *subs, struct filter_st *filter)
+{
+    int pattern = topicPattern(name);
+    if (pattern < 0)
+        return -2;
+
+    uint64_t hash = topicHash(name);
+    REGISTRY_SHARD *shard = registry_shard(reg, hash);
+    int res;
+
+    // Unlike concrete topics, which publishers create, a pattern comes
+    // into existence with its first subscription
+    if (pattern)
+    {
+        TOPIC *topic = registry_lookup(reg, name, hash, 1);
+        if (topic == NULL || wildcard_insert(&reg->wildcards, topic) < 0)
+            return -1;
+    }
+
+    shard_wrlock(shard);
+    res = addSubscriberToTopic(&shard->topics, name, subs, filter);
+    shard_unlock(shard);
+
+    if (pattern && res == 0)
+        wildcards_changed(reg);
+    return res;
+}
+
+int registry_unsubscribe(REGISTRY *reg, const char *name, SUBSCRIPTIONS *subs)
+{
+    uint64_t hash = topicHash(name);
+    REGISTRY_SHARD *shard = registry_shard(reg, hash);
+    TOPIC *topic;
+    int res;
+
+    shard_wrlock(shard);
+    topic = findTopicHashed(&shard->topics, name, hash);
+    res = removeSubscriberFromTopic(topic, subs);
+    shard_unlock(shard);
+
+    if (res == 0 && topic->pattern)
+        wildcards_changed(reg);
+    return res;
+}
+
+// The membership list belongs to the connection and is only changed by the
+// thread serving it, so it can be walked between shard locks
+void registry_unsubscribe_all(REGISTRY *reg, SUBSCRIPTIONS *subs)
+{
+    int patterns = 0;
+
+    while (subs->firstNode)
+    {
+        TOPIC *topic = subs->firstNode->topic;
+        REGISTRY_SHARD *shard = registry_shard(reg, topic->hash);
+
+        shard_wrlock(shard);
+        removeSubscriberFromTopic(topic, subs);
+        shard_unlock(shard);
+
+        patterns |= topic->pattern;
+    }
+
+    if (patterns)
+        wildcards_changed(reg);
+}
+
+// Snapshots gathered while resolving a topic's subscriber set
+typedef struct snapshotList_st {
+    REGISTRY *reg;
+    SUBSCRIBER_SNAPSHOT **items;
+    size_t count;
+    size_t cap;
+    size_t clients;
+    int filtered;               // some snapshot has filter groups
+    int failed;
+    SUBSCRIBER_SNAPSHOT *inlineItems[8];
+} SNAPSHOT_LIST;
+
+static void collect_snapshot(SNAPSHOT_LIST *list, SUBSCRIBER_SNAPSHOT *snap)
+{
+    if (snap == NULL || snap->count == 0 || list->failed)
+        return;
+
+    if (list->count == list->cap)
+    {
+        size_t newcap = list->cap * 2;
+        SUBSCRIBER_SNAPSHOT **items = malloc(newcap * sizeof(SUBSCRIBER_SNAPSHOT *));
+        if (items == NULL)
+        {
+            perror("malloc snapshot list");
+            list->failed = 1;
+            return;
+        }
+        memcpy(items, list->items, list->count * sizeof(SUBSCRIBER_SNAPSHOT *));
+        if (list->items != list->inlineItems)
+            free(list->items);
+        list->items = items;
+        list->cap = newcap;
+    }
+
+    list->items[list->count++] = snap;
+    list->clients += snap->count;
+    list->filtered |= snap->groupCount > 0;
+}
+
+// Retry building the snapshot of a topic whose last one could not be
+// built. Shard locks are never held while the wildcard trie lock is
+// taken, so this is also safe from inside wildcard_match().
+static void refresh_snapshot(REGISTRY *reg, TOPIC *topic)
+{
+    if (!atomic_load_explicit(&topic->stale, memory_order_acquire))
+        return;
+
+    REGISTRY_SHARD *shard = registry_shard(reg, topic->hash);
+    shard_wrlock(shard);
+    if (atomic_load_explicit(&topic->stale, memory_order_relaxed))
+        publishSnapshot(topic);
+    shard_unlock(shard);
+
+    if (topic->pattern)
+        wildcards_changed(reg);
+}
+
+static void collect_pattern(TOPIC *pattern, void *arg)
+{
+    SNAPSHOT_LIST *list = (SNAPSHOT_LIST *)arg;
+    refresh_snapshot(list->reg, pattern);
+    collect_snapshot(list, topicSnapshot(pattern));
+}
+
+static int compare_clients(const void *a, const void *b)
+{
+    uintptr_t x = (uintptr_t)*(struct client_st * const *)a;
+    uintptr_t y = (uintptr_t)*(struct client_st * const *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Merge snapshots with filter groups through their (client, filter) pairs
+static SUBSCRIBER_SNAPSHOT* resolve_filtered(SNAPSHOT_LIST *list)
+{
+    SNAPSHOT_ENTRY *entries = malloc(list->clients * sizeof(SNAPSHOT_ENTRY));
+    if (entries == NULL)
+    {
+        perror("malloc resolved SNAPSHOT_ENTRY");
+        return NULL;
+    }
+
+    size_t n = 0;
+    for (size_t i = 0; i < list->count; i++)
+    {
+        SUBSCRIBER_SNAPSHOT *s = list->items[i];
+        for (size_t j = 0; j < s->plain; j++)
+        {
+            entries[n].client = s->clients[j];
+            entries[n++].filter = NULL;
+        }
+        for (size_t g = 0; g < s->groupCount; g++)
+        {
+            for (size_t j = s->groups[g].start; j < s->groups[g].end; j++)
+            {
+                entries[n].client = s->clients[j];
+                entries[n++].filter = s->groups[g].filter;
+            }
+        }
+    }
+
+    SUBSCRIBER_SNAPSHOT *snap = buildSnapshot(entries, n, list->count > 1);
+    free(entries);
+    return snap;
+}
+
+SUBSCRIBER_SNAPSHOT* registry_subscribers(REGISTRY *reg, TOPIC *topic)
+{
+    WILDCARD_TRIE *trie = &reg->wildcards;
+
+    refresh_snapshot(reg, topic);
+
+    // No pattern was ever subscribed to: the topic's own set is complete
+    if (atomic_load_explicit(&trie->patterns, memory_order_acquire) == 0)
+        return topicSnapshot(topic);
+
+    // The versions are read before the sets they stand for, so a change
+    // racing with the build below leaves a result that is stale, not wrong
+    unsigned long long generation = atomic_load_explicit(&trie->generation, memory_order_acquire);
+    unsigned long version = atomic_load_explicit(&topic->version, memory_order_acquire);
+
+    SUBSCRIBER_SNAPSHOT *cached = atomic_load_explicit(&topic->resolved, memory_order_acquire);
+    if (cached && cached->generation == generation && cached->version == version)
+        return cached->count ? cached : NULL;
+
+    SNAPSHOT_LIST list;
+    list.reg = reg;
+    list.items = list.inlineItems;
+    list.count = 0;
+    list.cap = sizeof(list.inlineItems) / sizeof(list.inlineItems[0]);
+    list.clients = 0;
+    list.filtered = 0;
+    list.failed = 0;
+
+    collect_snapshot(&list, topicSnapshot(topic));
+    wildcard_match(trie, topic->name, collect_pattern, &list);
+
+    SUBSCRIBER_SNAPSHOT *snap = NULL;
+    if (!list.failed && list.filtered)
+        snap = resolve_filtered(&list);
+    else if (!list.failed)
+    {
+        snap = malloc(sizeof(SUBSCRIBER_SNAPSHOT) + list.clients * sizeof(struct client_st *));
+        if (snap == NULL)
+            perror("malloc resolved SUBSCRIBER_SNAPSHOT");
+    }
+
+    if (snap == NULL)
+    {
+        // Fall back to the exact subscribers rather than none
+        if (list.items != list.inlineItems)
+            free(list.items);
+        return topicSnapshot(topic);
+    }
+
+    snap->generation = generation;
+    snap->version = version;
+    if (!list.filtered)
+    {
+        snap->count = 0;
+        for (size_t i = 0; i < list.count; i++)
+        {
+            memcpy(&snap->clients[snap->count], list.items[i]->clients, list.items[i]->count * sizeof(struct client_st *));
+            snap->count += list.items[i]->count;
+        }
+
+        // A client subscribed to several matching topics gets the message once
+        if (list.count > 1)
+        {
+            qsort(snap->clients, snap->count, sizeof(struct client_st *), compare_clients);
+
+            size_t unique = 0;
+            for (size_t i = 0; i < snap->count; i++)
+                if (unique == 0 || snap->clients[unique - 1] != snap->clients[i])
+                    snap->clients[unique++] = snap->clients[i];
+            snap->count = unique;
+        }
+        snap->plain = snap->count;
+        snap->groupCount = 0;
+        snap->groups = NULL;
+    }
+
+    if (list.items != list.inlineItems)
+        free(list.items);
+
+    SUBSCRIBER_SNAPSHOT *old = atomic_exchange_explicit(&topic->resolved, snap, memory_order_acq_rel);
+    rcu_retire(old, freeSnapshot);
+
+    return snap->count ? snap : NULL;
+}
+
+size_t registry_foreach(REGISTRY *reg, void (*fn)(TOPIC *topic, void *arg), void *arg)
+{
+    size_t visited = 0;
+
+    for (size_t i = 0; i < reg->count; i++)
+    {
+        REGISTRY_SHARD *shard = &reg->shards[i];
+
+        shard_rdlock(shard);
+        for (TOPIC *t = shard->topics.firstNode; t != NULL; t = t->nextTopic)
+        {
+            fn(t, arg);
+            visited++;
+        }
+        shard_unlock(shard);
+    }
+
+    return visited;
+}
+
+typedef struct topTopics_st {
+    TOPIC **out;
+    size_t max;
+    size_t count;
+} TOP_TOPICS;
+
+// Keep out sorted by published messages, busiest first
+static void rank_topic(TOPIC *topic, void *arg)
+{
+    TOP_TOPICS *top = (TOP_TOPICS *)arg;
+    unsigned long long published = atomic_load_explicit(&topic->published, memory_order_relaxed);
+
+    if (topic->pattern || published == 0)
+        return;
+
+    size_t i = top->count < top->max ? top->count++ : top->max;
+    while (i > 0 && atomic_load_explicit(&top->out[i - 1]->published, memory_order_relaxed) < published)
+    {
+        if (i < top->max)
+            top->out[i] = top->out[i - 1];
+        i--;
+    }
+    if (i < top->max)
+        top->out[i] = topic;
+}
+
+size_t registry_top_topics(REGISTRY *reg, TOPIC **out, size_t max)
+{
+    TOP_TOPICS top = { out, max, 0 };
+    if (max > 0)
+        registry_foreach(reg, rank_topic, &top);
+    return top.count;
+}
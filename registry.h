@@ -0,0 +1,95 @@
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "list.h"
+#include "wildcard.h"
+
+// Topic registry split into shards by topic hash. Every shard has its own
+// lock and topic table, so publishes and subscriptions on unrelated topics
+// do not contend. Operations that span shards (listing, disconnect cleanup)
+// take one shard lock at a time and never nest them.
+//
+// Topics are never removed while the server runs, so a TOPIC pointer stays
+// valid after its shard lock is released.
+//
+// Wildcard patterns ("a/+/c", "a/#") are topics as well, kept in their
+// shard like any other and also indexed by the registry's wildcard trie.
+// A publish fans out to the topic's resolved subscriber set: its own
+// subscribers plus those of every matching pattern.
+
+#define DEFAULT_REGISTRY_SHARDS 16
+#define TOPIC_ID_TABLE_MIN      64
+
+// Topics by numeric ID. IDs are dense, from 1, and given out as the
+// registry creates topics. The table only grows: a larger copy replaces
+// it and the old one is retired through RCU, so lookups take no lock.
+typedef struct topicIdTable_st {
+    size_t size;
+    _Atomic(TOPIC *) topics[];
+} TOPIC_ID_TABLE;
+
+typedef struct registryShard_st {
+    pthread_rwlock_t lock;
+    TOPIC_HEAD topics;
+
+    // Lock acquisitions, and how many of them had to wait
+    atomic_ullong reads;
+    atomic_ullong readWaits;
+    atomic_ullong writes;
+    atomic_ullong writeWaits;
+} __attribute__((aligned(64))) REGISTRY_SHARD;
+
+typedef struct registry_st {
+    REGISTRY_SHARD *shards;
+    size_t count;               // power of two
+    WILDCARD_TRIE wildcards;
+
+    _Atomic(TOPIC_ID_TABLE *) ids;
+    pthread_mutex_t idLock;     // assigning IDs and growing the table
+    uint32_t lastId;
+} REGISTRY;
+
+int registry_init(REGISTRY *reg, size_t shards);
+void registry_destroy(REGISTRY *reg);
+
+REGISTRY_SHARD* registry_shard(REGISTRY *reg, uint64_t hash);
+void shard_rdlock(REGISTRY_SHARD *shard);
+void shard_wrlock(REGISTRY_SHARD *shard);
+void shard_unlock(REGISTRY_SHARD *shard);
+
+// Find a topic, creating it when create is set. Returns NULL if it does
+// not exist (or could not be created).
+TOPIC* registry_lookup(REGISTRY *reg, const char *name, uint64_t hash, int create);
+
+// Topic with the given ID, or NULL. Topics are never freed, so the
+// pointer stays valid; no lock or read section needed.
+TOPIC* registry_topic_by_id(REGISTRY *reg, uint32_t id);
+
+// Same results as addSubscriberToTopic() / removeSubscriberFromTopic().
+// Subscribing to a pattern creates it; an invalid pattern returns -2.
+// filter is the subscription's content filter, or NULL.
+int registry_subscribe(REGISTRY *reg, const char *name, SUBSCRIPTIONS *subs, struct filter_st *filter);
+int registry_unsubscribe(REGISTRY *reg, const char *name, SUBSCRIPTIONS *subs);
+
+// Drop every membership of a connection, one shard lock at a time
+void registry_unsubscribe_all(REGISTRY *reg, SUBSCRIPTIONS *subs);
+
+// Exact and wildcard subscribers of a concrete topic, each client once.
+// The set is cached per topic until a subscription of the topic or of any
+// pattern changes. Call inside rcu_read_lock(); the result stays valid
+// until rcu_read_unlock(). NULL when nobody is subscribed.
+SUBSCRIBER_SNAPSHOT* registry_subscribers(REGISTRY *reg, TOPIC *topic);
+
+// Call fn for every topic, one shard at a time under its read lock.
+// Returns the number of topics visited.
+size_t registry_foreach(REGISTRY *reg, void (*fn)(TOPIC *topic, void *arg), void *arg);
+
+// Up to max concrete topics with the most published messages, busiest
+// first. Topics are never freed, so the pointers stay valid.
+size_t registry_top_topics(REGISTRY *reg, TOPIC **out, size_t max);
+
+#endif // REGISTRY_H
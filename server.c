@@ -1,37 +1,53 @@
 #include <stdio.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <signal.h>
 #include <arpa/inet.h>
+#include <sys/un.h>
 #include <pthread.h>
 #include "list.h"
-
-#define PORT            12345
-#define DEFAULT_BUFLEN  512
-#define MAX_CLIENTS     20
+#include "server.h"
+#include "reactor.h"
+#include "rcu.h"
+#include "slab.h"
+#include "registry.h"
+#include "stats.h"
+#include "admin.h"
+#include "log.h"
+#include "history.h"
+#include "wal.h"
+#include "fanout.h"
+#include "shm.h"
+#include "filter.h"
 
 typedef enum 
 {
     CMD_NONE,
     CMD_SUBSCRIBE,
     CMD_UNSUBSCRIBE,
-    CMD_LIST_TOPICS
+    CMD_LIST_TOPICS,
+    CMD_LIST_QUEUES,
+    CMD_MEMORY,
+    CMD_SHARDS,
+    CMD_STATS,
+    CMD_DEBUG,
+    CMD_POLICY,
+    CMD_CONFLATE
 } server_cmd_t;
 
-typedef enum 
-{
-    SUBSCRIBER_TYPE,
-    PUBLISHER_TYPE
-} client_type_t;
-
-typedef struct client_st {
-    int socket;
-    client_type_t type;
-} CLIENT;
+server_mode_t server_mode = SERVER_MODE_EPOLL;
+int listen_backlog = DEFAULT_LISTEN_BACKLOG;
+unsigned handshake_ms = DEFAULT_HANDSHAKE_MS;
 
-// Registry of topcis
-pthread_mutex_t topicRegistry_mtx = PTHREAD_MUTEX_INITIALIZER;
-TOPIC_HEAD topicRegistry;  
+// Registry of topcis, sharded by topic hash (see registry.h).
+// A shard's lock guards its topic table and its topics' subscriber lists.
+// Publishes only take it shared to look a topic up; fan-out reads the
+// topic's subscriber snapshot without any lock (see publishSnapshot()).
+REGISTRY topicRegistry;
+size_t registry_shards = DEFAULT_REGISTRY_SHARDS;
 
 // Command parse
 server_cmd_t parse_server_command(char *msg, char **topics_start)
@@ -54,6 +70,48 @@ server_cmd_t parse_server_command(char *msg, char **topics_start)
         return CMD_LIST_TOPICS;
     }
 
+    if (strncmp(msg, "/queues", 7) == 0)
+    {
+        *topics_start = NULL;
+        return CMD_LIST_QUEUES;
+    }
+
+    if (strncmp(msg, "/memory", 7) == 0)
+    {
+        *topics_start = NULL;
+        return CMD_MEMORY;
+    }
+
+    if (strncmp(msg, "/shards", 7) == 0)
+    {
+        *topics_start = NULL;
+        return CMD_SHARDS;
+    }
+
+    if (strncmp(msg, "/stats", 6) == 0)
+    {
+        *topics_start = NULL;
+        return CMD_STATS;
+    }
+
+    if (strncmp(msg, "/debug", 6) == 0)
+    {
+        *topics_start = NULL;
+        return CMD_DEBUG;
+    }
+
+    if (strncmp(msg, "/policy", 7) == 0)
+    {
+        *topics_start = msg + 7;
+        return CMD_POLICY;
+    }
+
+    if (strncmp(msg, "/conflate", 9) == 0)
+    {
+        *topics_start = msg + 9;
+        return CMD_CONFLATE;
+    }
+
     return CMD_NONE;
 }
 
@@ -75,367 +133,1808 @@ static const char *next_quoted_topic(const char *p, char *out, size_t out_size)
     return end + 1;
 }
 
-// Send news to all subscribers of specific topic 
-void send_to_subscribers(TOPIC* topic, const char* msg)
+// One published message. It is encoded at most once per protocol into a
+// shared buffer: text subscribers get a "[topic] "payload"\n" line, binary
+// subscribers a FRAME_MESSAGE, by topic ID for those that asked for IDs.
+typedef struct publish_st {
+    const char *topic;
+    size_t topicLen;
+    const char *payload;
+    size_t payloadLen;
+
+    const char *line;       // original text line, if published as text
+    size_t lineLen;
+
+    MSGBUF *text;           // encodings, NULL until first needed
+    MSGBUF *frame;
+    MSGBUF *idFrame;
+
+    uint32_t topicId;       // the topic's ID, 0 if it has none
+
+    uint64_t received;      // stats_now() when the publish was read
+    uint64_t seq;           // message log sequence number, 0 without a log
+} PUBLISH;
+
+static MSGBUF *publish_text(PUBLISH *pub)
 {
-    if (!topic) return;
-    printf("[PUBLISH] Sending message on topic '%s': %s", topic->name, msg);
+    if (!pub->text)
+    {
+        if (pub->line)
+        {
+            pub->text = msgbuf_copy(pub->line, pub->lineLen);
+        }
+        else if ((pub->text = msgbuf_create(pub->topicLen + pub->payloadLen + 7)) != NULL)
+        {
+            pub->text->len = (size_t)sprintf(pub->text->data, "[%.*s] \"%.*s\"\n", (int)pub->topicLen, pub->topic, (int)pub->payloadLen, pub->payload);
+        }
+        if (pub->text)
+            pub->text->received = pub->received;
+    }
+    return pub->text;
+}
 
-    SUBSCRIBER* sub = topic->subscribers;
-    while(sub)
+static MSGBUF *publish_frame(PUBLISH *pub)
+{
+    if (!pub->frame)
     {
-        if(sub->socket != -1 && send(sub->socket, msg, strlen(msg), 0) < 0) 
-            perror("send to subscriber failed");
-    
-        sub = sub->next;
+        size_t header = FRAME_HEADER_LEN + (pub->seq ? FRAME_SEQ_LEN : 0);
+        pub->frame = msgbuf_create(header + pub->topicLen + pub->payloadLen);
+        if (pub->frame)
+        {
+            char *p = pub->frame->data;
+            frame_header((unsigned char *)p, FRAME_MESSAGE, pub->seq ? FRAME_FLAG_SEQ : 0, pub->topicLen, pub->payloadLen);
+            if (pub->seq)
+                frame_seq((unsigned char *)p + FRAME_HEADER_LEN, pub->seq);
+            memcpy(p + header, pub->topic, pub->topicLen);
+            memcpy(p + header + pub->topicLen, pub->payload, pub->payloadLen);
+            pub->frame->received = pub->received;
+        }
     }
+    return pub->frame;
 }
 
-void send_topics_to_subscribers(int socket)
+static MSGBUF *publish_frame_id(PUBLISH *pub)
 {
-    pthread_mutex_lock(&topicRegistry_mtx);
+    if (!pub->idFrame)
     {
-        char line[DEFAULT_BUFLEN];
-        TOPIC *t = topicRegistry.firstNode;
+        size_t header = FRAME_HEADER_LEN + (pub->seq ? FRAME_SEQ_LEN : 0);
+        uint8_t flags = FRAME_FLAG_TOPIC_ID | (pub->seq ? FRAME_FLAG_SEQ : 0);
+        pub->idFrame = msgbuf_create(header + FRAME_TOPIC_ID_LEN + pub->payloadLen);
+        if (pub->idFrame)
+        {
+            char *p = pub->idFrame->data;
+            frame_header((unsigned char *)p, FRAME_MESSAGE, flags, FRAME_TOPIC_ID_LEN, pub->payloadLen);
+            if (pub->seq)
+                frame_seq((unsigned char *)p + FRAME_HEADER_LEN, pub->seq);
+            frame_topic_id((unsigned char *)p + header, pub->topicId);
+            memcpy(p + header + FRAME_TOPIC_ID_LEN, pub->payload, pub->payloadLen);
+            pub->idFrame->received = pub->received;
+        }
+    }
+    return pub->idFrame;
+}
+
+// One fan-out: a publish and the subscriber snapshot it goes to
+typedef struct fanout_st {
+    SUBSCRIBER_SNAPSHOT *snap;
+    TOPIC *topic;
+    PUBLISH *pub;
+    int policy;
+    TOPIC *conflate;
+    const unsigned char *match;     // per filter group: does the message pass
+} FANOUT;
 
-        if (t == NULL) // Empty registry
+#define FANOUT_INLINE_GROUPS    64
+
+static void deliver_clients(FANOUT *f, size_t lo, size_t hi, unsigned long long *deliveries, unsigned long long *bytes, CLIENT_VEC *kick)
+{
+    for (size_t i = lo; i < hi; i++)
+    {
+        CLIENT *c = f->snap->clients[i];
+        MSGBUF *buf = NULL;
+        int res = -2;
+        if (atomic_load_explicit(&c->topicIds, memory_order_relaxed) && f->pub->topicId &&
+            (buf = publish_frame_id(f->pub)) != NULL)
+            res = client_enqueue_topic(c, buf, f->topic, f->policy, f->conflate, kick);
+
+        // By name, also when the ID could not be announced
+        if (res == -2)
         {
-            snprintf(line, DEFAULT_BUFLEN, "No topics available yet.\n");
-            send(socket, line, strlen(line), 0);
+            buf = c->binary ? publish_frame(f->pub) : publish_text(f->pub);
+            res = client_enqueue(c, buf, f->policy, f->conflate, kick);
         }
-        else
+        if (res >= 0)
+        {
+            (*deliveries)++;
+            *bytes += buf->len;
+        }
+    }
+}
+
+// Queue the message for the subscribers lo to hi - 1 of the snapshot:
+// the unfiltered ones and those whose filter group passed it
+static void deliver_range(FANOUT *f, size_t lo, size_t hi, CLIENT_VEC *kick)
+{
+    SUBSCRIBER_SNAPSHOT *snap = f->snap;
+    unsigned long long deliveries = 0;
+    unsigned long long bytes = 0;
+
+    if (lo < snap->plain)
+        deliver_clients(f, lo, hi < snap->plain ? hi : snap->plain, &deliveries, &bytes, kick);
+
+    for (size_t g = 0; g < snap->groupCount; g++)
+    {
+        SUBSCRIBER_GROUP *group = &snap->groups[g];
+        if (!f->match[g] || group->end <= lo || group->start >= hi)
+            continue;
+        deliver_clients(f, group->start > lo ? group->start : lo, group->end < hi ? group->end : hi, &deliveries, &bytes, kick);
+    }
+
+    stats_add(STAT_DELIVERIES, deliveries);
+    stats_add(STAT_DELIVERY_BYTES, bytes);
+}
+
+// One chunk of a parallel fan-out, on a fan-out worker or the publisher.
+// It kicks its own clients, still under the caller's history lock.
+static void deliver_chunk(void *arg, size_t lo, size_t hi)
+{
+    CLIENT_VEC kick;
+    initClientVec(&kick);
+    deliver_range((FANOUT *)arg, lo, hi, &kick);
+    kickClientVec(&kick);
+}
+
+// Queue news for all subscribers of specific topic, including those of
+// matching wildcard patterns.
+// Runs without the registry lock on the topic's resolved subscriber snapshot.
+// Every distinct content filter in it is evaluated once, up front.
+// Only enqueues: clients whose queue was empty are collected in kick and
+// must be kicked by the caller afterwards. A fan-out to more than
+// --fanout-threshold subscribers is split over the fan-out workers, which
+// kick their clients themselves; it is complete when this returns.
+void send_to_subscribers(TOPIC* topic, PUBLISH *pub, CLIENT_VEC *kick)
+{
+    if (!topic) return;
+    LOG_LIMITED(LOG_DEBUG, "[PUBLISH] Sending message on topic '%s': \"%.*s\"\n", topic->name, (int)pub->payloadLen, pub->payload);
+
+    FANOUT f;
+    f.topic = topic;
+    f.pub = pub;
+    f.policy = atomic_load_explicit(&topic->overflow, memory_order_relaxed);
+    f.conflate = atomic_load_explicit(&topic->conflate, memory_order_relaxed) ? topic : NULL;
+    f.match = NULL;
+
+    // A subscriber with the block policy can hold up this loop, and with it
+    // RCU reclamation, for up to block_ms. The read section also keeps the
+    // snapshot and its clients alive for the fan-out workers.
+    rcu_read_lock();
+    {
+        f.snap = registry_subscribers(&topicRegistry, topic);
+        size_t count = f.snap ? f.snap->count : 0;
+
+        unsigned char inlineMatch[FANOUT_INLINE_GROUPS];
+        unsigned char *match = inlineMatch;
+        if (count > 0 && f.snap->groupCount > 0)
         {
-            snprintf(line, DEFAULT_BUFLEN, "Currently available topics:\n");
-            send(socket, line, strlen(line), 0);
+            if (f.snap->groupCount > FANOUT_INLINE_GROUPS && (match = malloc(f.snap->groupCount)) == NULL)
+            {
+                perror("malloc filter matches");
+                count = 0;
+            }
 
-            while (t)
+            unsigned long long filtered = 0;
+            for (size_t g = 0; g < f.snap->groupCount && count > 0; g++)
             {
-                snprintf(line, DEFAULT_BUFLEN, "  - %s\n", t->name);
-                send(socket, line, strlen(line), 0);
-                t = t->nextTopic;
+                SUBSCRIBER_GROUP *group = &f.snap->groups[g];
+                match[g] = (unsigned char)filter_match(group->filter, pub->payload, pub->payloadLen);
+                if (!match[g])
+                    filtered += group->end - group->start;
             }
+            stats_add(STAT_FILTERED, filtered);
+            f.match = match;
 
-            snprintf(line, DEFAULT_BUFLEN, "Use /subscribe \"topic1\" \"topic2\" to subscribe.\n");
-            send(socket, line, strlen(line), 0);
+            // Every subscriber filtered it out
+            if (filtered == count)
+                count = 0;
         }
+
+        // The encodings are built up front: the workers share them, and
+        // would race to build any that is missing. If one cannot be built,
+        // this thread delivers alone.
+        if (fanout_parallel(count) && publish_text(pub) && publish_frame(pub) &&
+            (!pub->topicId || publish_frame_id(pub)))
+            fanout_run(deliver_chunk, &f, count);
+        else if (count > 0)
+            deliver_range(&f, 0, count, kick);
+
+        if (match != inlineMatch)
+            free(match);
     }
-    pthread_mutex_unlock(&topicRegistry_mtx);
+    rcu_read_unlock();
 }
 
+// Drop the ID announcement a topic keeps, at shutdown
+static void release_announcement(TOPIC *topic, void *arg)
+{
+    (void)arg;
+    msgbuf_release(atomic_exchange(&topic->announce, NULL));
+}
 
-// Publisher thread functions
-void *handle_publisher(void *arg)
+typedef struct topicListing_st {
+    CLIENT *client;
+    int any;
+} TOPIC_LISTING;
+
+static void queue_topic_line(TOPIC *topic, void *arg)
 {
-    CLIENT *client = (CLIENT *)arg;  
+    TOPIC_LISTING *listing = (TOPIC_LISTING *)arg;
+    char line[DEFAULT_BUFLEN];
 
-    char buffer[DEFAULT_BUFLEN];
-    int read_size;
-    char topicName[DEFAULT_BUFLEN];
+    // Wildcard patterns are subscriptions, not topics one can publish to
+    if (topic->pattern)
+        return;
 
-    while((read_size = recv(client->socket, buffer, DEFAULT_BUFLEN - 1, 0)) > 0)
+    if (!listing->any)
     {
-        buffer[read_size] = '\0';
-        memset(&topicName, '\0', DEFAULT_BUFLEN);
-        // Taking topic name out of received message
-        int j = 0;
-        for (int i = 1; i < read_size; i++)
-        {
-            if(buffer[i] == ']') break;
-                topicName[j++] = buffer[i]; 
-        }
-        topicName[j] = '\0'; 
+        snprintf(line, DEFAULT_BUFLEN, "Currently available topics:\n");
+        client_queue_reply(listing->client, line, strlen(line));
+        listing->any = 1;
+    }
 
-        // Send news to all subscribed clients 
-        // and add topic to the registry if it's not already there
-        pthread_mutex_lock(&topicRegistry_mtx);
-        {
-            TOPIC* topic = findTopic(&topicRegistry, topicName);
-            if(!topic)
-            {
-                // Adding new topis to registry
-                topic = createTopic(topicName);
-                addTopic(&topicRegistry, topic);
-            }
+    snprintf(line, DEFAULT_BUFLEN, "  - %s%s\n", topic->name,
+             atomic_load_explicit(&topic->conflate, memory_order_relaxed) ? " (conflated)" : "");
+    client_queue_reply(listing->client, line, strlen(line));
+}
 
-            // Multicast
-            send_to_subscribers(topic, buffer);
-        }
-        pthread_mutex_unlock(&topicRegistry_mtx);
+void send_topics_to_subscribers(CLIENT *client)
+{
+    // Queued one shard at a time under its lock, written once all are done
+    TOPIC_LISTING listing = { client, 0 };
+    registry_foreach(&topicRegistry, queue_topic_line, &listing);
+
+    char line[DEFAULT_BUFLEN];
+    if (!listing.any) // Empty registry
+        snprintf(line, DEFAULT_BUFLEN, "No topics available yet.\n");
+    else
+        snprintf(line, DEFAULT_BUFLEN, "Use /subscribe \"topic1\" \"topic2\" to subscribe.\n");
+    client_queue_reply(client, line, strlen(line));
+
+    client_kick(client);
+}
+
+// Send per-shard lock counters to a client
+void send_shard_report(CLIENT *client)
+{
+    char line[DEFAULT_BUFLEN];
+
+    snprintf(line, DEFAULT_BUFLEN, "Registry shards (%zu):\n", topicRegistry.count);
+    client_queue_reply(client, line, strlen(line));
+
+    for (size_t i = 0; i < topicRegistry.count; i++)
+    {
+        REGISTRY_SHARD *shard = &topicRegistry.shards[i];
+
+        shard_rdlock(shard);
+        size_t topics = shard->topics.count;
+        shard_unlock(shard);
+
+        snprintf(line, DEFAULT_BUFLEN, "  - shard %zu: topics %zu, read locks %llu (waited %llu), write locks %llu (waited %llu)\n",
+                 i, topics,
+                 atomic_load_explicit(&shard->reads, memory_order_relaxed),
+                 atomic_load_explicit(&shard->readWaits, memory_order_relaxed),
+                 atomic_load_explicit(&shard->writes, memory_order_relaxed),
+                 atomic_load_explicit(&shard->writeWaits, memory_order_relaxed));
+        client_queue_reply(client, line, strlen(line));
     }
-    
-    printf("[INFO] Publisher (socket = %d) disconnected.\n", client->socket);
 
-    if(client->socket != -1)
-        close(client->socket);
-    free(client);
+    client_kick(client);
+}
 
-    return NULL;
+// Send the node allocator counters to a client
+void send_memory_report(CLIENT *client)
+{
+    SLAB_STATS stats[SLAB_MAX_CACHES];
+    size_t n = slab_stats(stats, SLAB_MAX_CACHES);
+    char line[DEFAULT_BUFLEN];
+
+#ifdef PUBSUB_USE_MALLOC
+    snprintf(line, DEFAULT_BUFLEN, "Node allocations (malloc):\n");
+#else
+    snprintf(line, DEFAULT_BUFLEN, "Node allocations (slab caches):\n");
+#endif
+    client_queue_reply(client, line, strlen(line));
+
+    for (size_t i = 0; i < n; i++)
+    {
+        snprintf(line, DEFAULT_BUFLEN,
+                 "  - %s (%zu bytes): in use %llu, allocs %llu, frees %llu, refills %llu, spills %llu, slabs %zu, depot %zu\n",
+                 stats[i].name, stats[i].objSize, stats[i].allocs - stats[i].frees, stats[i].allocs, stats[i].frees,
+                 stats[i].refills, stats[i].spills, stats[i].slabs, stats[i].depotCount);
+        client_queue_reply(client, line, strlen(line));
+    }
+
+    client_kick(client);
 }
 
-// Function handling SUBSCRIBE and UNSUBSCRIBE commands 
-void subscriberCommand(char *topics_str, server_cmd_t cmd, int socket)
+// /policy: show the overflow policies
+// /policy NAME: set the subscriber's own policy, "default" to unset it
+// /policy NAME "topic1" "topic2": set the policy of existing topics
+static void set_overflow_policy(CLIENT *client, char *args)
 {
-    if(cmd == CMD_LIST_TOPICS)
+    char msg[DEFAULT_BUFLEN];
+
+    args += strspn(args, " \t\r\n");
+    if (*args == '\0')
     {
-        send_topics_to_subscribers(socket);
+        pthread_mutex_lock(&client->out_mtx);
+        int own = client->policy;
+        pthread_mutex_unlock(&client->out_mtx);
+
+        snprintf(msg, DEFAULT_BUFLEN, "[INFO] Overflow policy: server %s, yours %s (queue limit %zu messages / %zu bytes, block %u ms)\n",
+                 overflow_name(overflow_policy), overflow_name(own), queue_max_msgs, queue_max_bytes, block_ms);
+        client_send(client, msg, strlen(msg));
         return;
     }
 
-    if (topics_str == NULL || strlen(topics_str) == 0)
+    char name[32];
+    size_t len = strcspn(args, " \t\r\n");
+    snprintf(name, sizeof(name), "%.*s", (int)(len < sizeof(name) ? len : sizeof(name) - 1), args);
+    int policy = overflow_parse(name);
+    if (policy < 0)
     {
-        char msg[DEFAULT_BUFLEN];
-        if (cmd == CMD_UNSUBSCRIBE)
-            snprintf(msg, DEFAULT_BUFLEN, "[INFO] No topics specified. Use /unsubscribe \"topic1\" \"topic2\".\n");
-        else
-            snprintf(msg, DEFAULT_BUFLEN, "[INFO] No topics specified. Use /subscribe \"topic1\" \"topic2\".\n");
-        send(socket, msg, strlen(msg), 0);
+        snprintf(msg, DEFAULT_BUFLEN, "[INFO] Unknown overflow policy '%s'. Use drop-newest, drop-oldest, disconnect, block or default.\n", name);
+        client_send(client, msg, strlen(msg));
         return;
     }
 
-    int found_any = 0;
-    const char *p = topics_str;
+    const char *p = args + len;
     char topicName[DEFAULT_BUFLEN];
+    int found_any = 0;
 
     while ((p = next_quoted_topic(p, topicName, sizeof(topicName))) != NULL)
     {
         found_any = 1;
 
-        if (topicName[0] == '\0')
+        TOPIC *topic = NULL;
+        if (topicPattern(topicName) == 0)
+            topic = registry_lookup(&topicRegistry, topicName, topicHash(topicName), 0);
+
+        if (topicPattern(topicName) != 0)
+            snprintf(msg, DEFAULT_BUFLEN, "[INFO] Overflow policies are set on topics, not on patterns like '%.200s'.\n", topicName);
+        else if (topic)
         {
-            char msg[DEFAULT_BUFLEN];
-            snprintf(msg, DEFAULT_BUFLEN, "[INFO] Error: Topic name cannot be empty.\n");
-            send(socket, msg, strlen(msg), 0);
-            continue;
+            atomic_store_explicit(&topic->overflow, policy, memory_order_relaxed);
+            LOG(LOG_INFO, "[POLICY] Client %d set the overflow policy of topic '%s' to %s\n", client->socket, topicName, name);
+            snprintf(msg, DEFAULT_BUFLEN, "[INFO] Overflow policy of '%.200s' set to %s\n", topicName, name);
         }
+        else
+            snprintf(msg, DEFAULT_BUFLEN, "[INFO] Topic '%.200s' does not exist.\n", topicName);
+        client_send(client, msg, strlen(msg));
+    }
 
-        switch (cmd)
-        {
-            case CMD_SUBSCRIBE:
-                pthread_mutex_lock(&topicRegistry_mtx);
-                {
-                    int res = addSubscriberToTopic(&topicRegistry, topicName, socket);
-                    if(res == 0)
-                    {
-                        printf("[SUBSCRIBE] Client %d subscribed to topic '%s'\n", socket, topicName);
-                        char msg[DEFAULT_BUFLEN];
-                        snprintf(msg, DEFAULT_BUFLEN, "[INFO] Subscribed to '%.200s'\n", topicName);
-                        send(socket, msg, strlen(msg), 0);
-                    }
-                    else if(res == -1)
-                    {
-                        char msg[DEFAULT_BUFLEN];
-                        snprintf(msg, DEFAULT_BUFLEN, "[INFO] Topic '%.200s' does not exist.\n", topicName);
-                        send(socket, msg, strlen(msg), 0);
-                    }
-                    else if(res == 1)
-                    {
-                        char msg[DEFAULT_BUFLEN];
-                        snprintf(msg, DEFAULT_BUFLEN, "[INFO] Already subscribed to '%.200s'\n", topicName);
-                        send(socket, msg, strlen(msg), 0);
-                    }
-                }
-                pthread_mutex_unlock(&topicRegistry_mtx);  
-                break;
+    if (!found_any)
+    {
+        pthread_mutex_lock(&client->out_mtx);
+        client->policy = policy;
+        pthread_mutex_unlock(&client->out_mtx);
 
-            case CMD_UNSUBSCRIBE:
-                pthread_mutex_lock(&topicRegistry_mtx);
-                {
-                    TOPIC *topic = findTopic(&topicRegistry, topicName);   
-                    int res = removeSubscriberFromTopic(topic, socket);
-                    if(res == 0)
-                    {
-                        printf("[UNSUBSCRIBE] Client %d unsubscribed from topic '%s'\n", socket, topicName);
-                        char msg[DEFAULT_BUFLEN];
-                        snprintf(msg, DEFAULT_BUFLEN, "[INFO] Unsubscribed from '%.200s'\n", topicName);
-                        send(socket, msg, strlen(msg), 0);
-                    }
-                    else
-                    {
-                        char msg[DEFAULT_BUFLEN];
-                        snprintf(msg, DEFAULT_BUFLEN, "[INFO] Cannot unsubscribe from '%.200s' (not subscribed or topic does not exist)\n", topicName);
-                        send(socket, msg, strlen(msg), 0);
-                    }
-                }
-                pthread_mutex_unlock(&topicRegistry_mtx);
-                break;
+        LOG(LOG_INFO, "[POLICY] Client %d set its overflow policy to %s\n", client->socket, name);
+        snprintf(msg, DEFAULT_BUFLEN, "[INFO] Your overflow policy set to %s\n", name);
+        client_send(client, msg, strlen(msg));
+    }
+}
 
-            case CMD_LIST_TOPICS:
-                break;
+// /conflate "topic1" "topic2": subscribers only get the latest message
+// of these topics; /conflate --off "topic1" switches it off again
+static void set_conflation(CLIENT *client, char *args)
+{
+    char msg[DEFAULT_BUFLEN];
+    int on = 1;
 
-            case CMD_NONE:
-                break;
-        }
+    args += strspn(args, " \t\r\n");
+    if (strncmp(args, "--off", 5) == 0)
+    {
+        on = 0;
+        args += 5;
     }
 
-    if (!found_any)
+    const char *p = args;
+    char topicName[DEFAULT_BUFLEN];
+    int found_any = 0;
+
+    while ((p = next_quoted_topic(p, topicName, sizeof(topicName))) != NULL)
     {
-        char msg[DEFAULT_BUFLEN];
-        if (strchr(topics_str, '"') != NULL)
+        found_any = 1;
+
+        TOPIC *topic = NULL;
+        if (topicPattern(topicName) == 0)
+            topic = registry_lookup(&topicRegistry, topicName, topicHash(topicName), 0);
+
+        if (topicPattern(topicName) != 0)
+            snprintf(msg, DEFAULT_BUFLEN, "[INFO] Conflation is set on topics, not on patterns like '%.200s'.\n", topicName);
+        else if (topic)
         {
-            if (cmd == CMD_UNSUBSCRIBE)
-                snprintf(msg, DEFAULT_BUFLEN, "[INFO] Error: invalid format. Use /unsubscribe \"topic1\" \"topic2\".\n");
-            else
-                snprintf(msg, DEFAULT_BUFLEN, "[INFO] Error: invalid format. Use /subscribe \"topic1\" \"topic2\".\n");
+            atomic_store_explicit(&topic->conflate, on, memory_order_relaxed);
+            LOG(LOG_INFO, "[CONFLATE] Client %d switched conflation of topic '%s' %s\n", client->socket, topicName, on ? "on" : "off");
+            snprintf(msg, DEFAULT_BUFLEN, "[INFO] Conflation of '%.200s' switched %s\n", topicName, on ? "on" : "off");
         }
         else
-        {
-            if (cmd == CMD_UNSUBSCRIBE)
-                snprintf(msg, DEFAULT_BUFLEN, "[INFO] No topics specified. Use /unsubscribe \"topic1\" \"topic2\".\n");
-            else
-                snprintf(msg, DEFAULT_BUFLEN, "[INFO] No topics specified. Use /subscribe \"topic1\" \"topic2\".\n");
-        }
-        send(socket, msg, strlen(msg), 0);
-        return;
+            snprintf(msg, DEFAULT_BUFLEN, "[INFO] Topic '%.200s' does not exist.\n", topicName);
+        client_send(client, msg, strlen(msg));
     }
 
-    printTopicsAndSubscribers(&topicRegistry);
+    if (!found_any)
+    {
+        snprintf(msg, DEFAULT_BUFLEN, "[INFO] No topics specified. Use /conflate \"topic1\" \"topic2\" or /conflate --off \"topic1\".\n");
+        client_send(client, msg, strlen(msg));
+    }
 }
 
+#define STATS_TOP_TOPICS    20
 
-// Subscriber thread function
-void *handle_subscriber(void *arg)
+// Send the metrics (see stats.h) and the busiest topics to a client
+void send_stats_report(CLIENT *client)
 {
-    CLIENT *client = (CLIENT *)arg;  
-    int sock = client->socket;
-
-    int read_size = 0;
-    char buffer[DEFAULT_BUFLEN];
-    char *topics_start; 
-
-    memset(buffer, 0, DEFAULT_BUFLEN);
-    // Get command from a subscriber
-    while ((read_size = recv(sock, buffer, DEFAULT_BUFLEN - 1, 0)) > 0)
+    STATS_SNAPSHOT *stats = malloc(sizeof(STATS_SNAPSHOT));
+    if (stats == NULL)
     {
-        buffer[read_size] = '\0';
-
-        server_cmd_t cmd = parse_server_command(buffer, &topics_start);
-        if (cmd == CMD_NONE)
-        {
-            char msg[DEFAULT_BUFLEN];
-            snprintf(msg, DEFAULT_BUFLEN, "[INFO] Unknown command. Use /subscribe \"topic1\" \"topic2\", /unsubscribe \"topic1\" \"topic2\", or /topics.\n");
-            send(sock, msg, strlen(msg), 0);
-            memset(&buffer, '\0', DEFAULT_BUFLEN);
-            continue;
-        }
-        subscriberCommand(topics_start, cmd, sock);
-        memset(&buffer, '\0', DEFAULT_BUFLEN);
+        perror("malloc stats snapshot");
+        return;
     }
+    stats_collect(stats);
 
-    pthread_mutex_lock(&topicRegistry_mtx);
-    removeSubscriberFromAllTopics(&topicRegistry, sock);
-    printf("[INFO] Subscriber (socket = %d) disconnected.\n", client->socket);
-    pthread_mutex_unlock(&topicRegistry_mtx);
-    if(client->socket != -1)
-        close(client->socket);
-    free(client);
+    char line[DEFAULT_BUFLEN];
+    double uptime = stats->uptime > 0 ? stats->uptime : 1;
 
-    return NULL;
-}
+    snprintf(line, DEFAULT_BUFLEN, "Server stats (uptime %.1f s):\n", stats->uptime);
+    client_queue_reply(client, line, strlen(line));
 
-int main(void)
-{
-    // Topic registy initialization
-    initTopic(&topicRegistry);
+    for (int i = 0; i < STAT_COUNT; i++)
+    {
+        snprintf(line, DEFAULT_BUFLEN, "  - %-20s %llu (%.1f/s)\n", stats_name(i), stats->counters[i], stats->counters[i] / uptime);
+        client_queue_reply(client, line, strlen(line));
+    }
 
-    int server_socket;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t addr_len = sizeof(client_addr);
+    if (stats->samples)
+        snprintf(line, DEFAULT_BUFLEN,
+                 "Fan-out latency (%llu messages, publish to last write): mean %.1f us, p50 %.1f us, p90 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n",
+                 stats->samples, stats->latencySum / 1e3 / stats->samples,
+                 stats_percentile(stats, 50) / 1e3, stats_percentile(stats, 90) / 1e3, stats_percentile(stats, 99) / 1e3,
+                 stats_percentile(stats, 99.9) / 1e3, stats->latencyMax / 1e3);
+    else
+        snprintf(line, DEFAULT_BUFLEN, "Fan-out latency: no messages delivered yet.\n");
+    client_queue_reply(client, line, strlen(line));
+    free(stats);
+
+    if (history_max_msgs)
+    {
+        HISTORY_STATS history;
+        history_stats(&history);
+        snprintf(line, DEFAULT_BUFLEN, "History: %zu messages, %zu of %zu bytes in %zu topics, %llu evicted by the byte cap\n",
+                 history.messages, history.bytes, history_max_bytes, history.topics, history.evicted);
+        client_queue_reply(client, line, strlen(line));
+    }
 
-    server_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_socket < 0)
+    if (wal_enabled())
     {
-        perror("socket failed");
-        return 1;
+        WAL_STATS wal;
+        wal_stats(&wal);
+        snprintf(line, DEFAULT_BUFLEN, "Log: seq %llu to %llu, durable to %llu, %zu segments, %zu bytes, %llu syncs (mean %.1f us), %llu appends failed\n",
+                 (unsigned long long)wal.firstSeq, (unsigned long long)wal.nextSeq - 1, (unsigned long long)wal.durableSeq,
+                 wal.segments, wal.bytes, wal.syncs, wal.syncs ? wal.syncNs / 1e3 / wal.syncs : 0.0, wal.failed);
+        client_queue_reply(client, line, strlen(line));
     }
 
-    int optval = 1;
-    if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0)
+    size_t filters = filter_count();
+    if (filters)
     {
-        perror("setsockopt SO_REUSEADDR failed");
+        snprintf(line, DEFAULT_BUFLEN, "Filters: %zu distinct content filters in use\n", filters);
+        client_queue_reply(client, line, strlen(line));
     }
 
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(PORT);
+    TOPIC *top[STATS_TOP_TOPICS];
+    size_t n = registry_top_topics(&topicRegistry, top, STATS_TOP_TOPICS);
+    uint64_t now = stats_now();
 
-    if (bind(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+    snprintf(line, DEFAULT_BUFLEN, n ? "Busiest topics:\n" : "No messages published yet.\n");
+    client_queue_reply(client, line, strlen(line));
+
+    for (size_t i = 0; i < n; i++)
     {
-        perror("bind failed");
-        return 1;
+        unsigned long long msgs = atomic_load_explicit(&top[i]->published, memory_order_relaxed);
+        unsigned long long bytes = atomic_load_explicit(&top[i]->publishedBytes, memory_order_relaxed);
+        double age = (double)(now - top[i]->created) / 1e9;
+        if (age <= 0)
+            age = 1;
+
+        snprintf(line, DEFAULT_BUFLEN, "  - %.200s: %llu messages (%.1f/s), %llu bytes (%.1f/s)\n",
+                 top[i]->name, msgs, msgs / age, bytes, bytes / age);
+        client_queue_reply(client, line, strlen(line));
     }
 
-    listen(server_socket, MAX_CLIENTS);
-    printf("Topic-based server listening on port %d...\n", PORT);
+    client_kick(client);
+}
+
+// Queue one topic and its subscriber sockets. Called under the topic's
+// shard read lock, which guards the subscriber list.
+static void queue_topic_dump(TOPIC *topic, void *arg)
+{
+    TOPIC_LISTING *listing = (TOPIC_LISTING *)arg;
+    char line[DEFAULT_BUFLEN];
+    size_t len;
 
-    int read_size = 0;
-    char role_msg[DEFAULT_BUFLEN];
+    listing->any = 1;
+    snprintf(line, DEFAULT_BUFLEN, "  - %.200s%s\n", topic->name, topic->pattern ? " (pattern)" : "");
+    client_queue_reply(listing->client, line, strlen(line));
 
-    while (1)
+    if (!topic->subscribers)
     {
-        CLIENT* client = malloc(sizeof(CLIENT));
-        if (!client) 
-        {
-            perror("malloc client");
-            continue;
-        }
+        snprintf(line, DEFAULT_BUFLEN, "      Subscribers: none\n");
+        client_queue_reply(listing->client, line, strlen(line));
+        return;
+    }
 
-        if ((client->socket = accept(server_socket, (struct sockaddr *)&client_addr, &addr_len)) < 0)
+    len = (size_t)snprintf(line, DEFAULT_BUFLEN, "      Subscribers: ");
+    for (SUBSCRIBER *s = topic->subscribers; s != NULL; s = s->next)
+    {
+        // Long lists are sent in pieces of one line buffer
+        if (len > DEFAULT_BUFLEN - 96)
         {
-            perror("accept failed");
-            continue;
+            client_queue_reply(listing->client, line, len);
+            len = 0;
         }
+        if (s->filter)
+            len += (size_t)snprintf(line + len, DEFAULT_BUFLEN - len, "%d [%.64s]%s", s->socket, s->filter->spec, s->next ? ", " : "\n");
+        else
+            len += (size_t)snprintf(line + len, DEFAULT_BUFLEN - len, "%d%s", s->socket, s->next ? ", " : "\n");
+    }
+    client_queue_reply(listing->client, line, len);
+}
 
-        memset(&role_msg, '\0', DEFAULT_BUFLEN);
-        if((read_size = recv(client->socket, role_msg, DEFAULT_BUFLEN - 1, 0)) > 0)
-        {
-            role_msg[read_size] = '\0';
-            fflush(stdout);
-        }
+// Send every topic with its subscribers to a client (used to be printed
+// after every subscription)
+void send_registry_dump(CLIENT *client)
+{
+    TOPIC_LISTING listing = { client, 0 };
+    char line[DEFAULT_BUFLEN];
 
-        pthread_t tid;
+    snprintf(line, DEFAULT_BUFLEN, "[TOPICS] Current topics and subscribers:\n");
+    client_queue_reply(client, line, strlen(line));
 
-        if(strcmp(role_msg, "PUBLISHER") == 0)
-        {
-            client->type = PUBLISHER_TYPE;
-            printf("[INFO] New publisher (socket = %d) connected: %s:%d\n", client->socket, inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
-            
-            if (pthread_create(&tid, NULL, handle_publisher, (void*)client) != 0) 
-            {
-                perror("pthread_create handleSubscriber failed");
-                if(client->socket != -1) 
-                    close(client->socket );
-                free(client);
-                return EXIT_FAILURE;
-            }
+    registry_foreach(&topicRegistry, queue_topic_dump, &listing);
 
-            pthread_detach(tid);
-        }
-        else 
-        {
-            client->type = SUBSCRIBER_TYPE;
-            printf("[INFO] New subscriber (socket = %d) connected: %s:%d\n", client->socket, inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
+    if (!listing.any)
+    {
+        snprintf(line, DEFAULT_BUFLEN, "  No topics available.\n");
+        client_queue_reply(client, line, strlen(line));
+    }
 
-            if (pthread_create(&tid, NULL, handle_subscriber, (void*)client) != 0) 
-            {
-                perror("pthread_create handleSubscriber failed");
-                if(client->socket != -1) 
-                    close(client->socket );
-                free(client);
-                return EXIT_FAILURE;
-            }
+    client_kick(client);
+}
 
-            pthread_detach(tid);
-        }
+// Resolve the topic of a message published by name, creating it on first
+// use. Returns -1 if the message is to be ignored; *topic is NULL if the
+// topic could not be created.
+static int publisher_topic(CLIENT *client, PUBLISH *pub, TOPIC **topic)
+{
+    char topicName[FRAME_MAX_TOPIC + 1];
+
+    if (pub->topicLen > FRAME_MAX_TOPIC)
+    {
+        LOG_LIMITED(LOG_WARN, "[INFO] Publisher (socket = %d) sent a topic name longer than %d bytes, message ignored.\n", client->socket, FRAME_MAX_TOPIC);
+        return -1;
     }
+    memcpy(topicName, pub->topic, pub->topicLen);
+    topicName[pub->topicLen] = '\0';
 
-    close(server_socket);
-    
-    // Destroy topics
-    pthread_mutex_lock(&topicRegistry_mtx);
+    if (topicPattern(topicName) != 0)
+    {
+        LOG_LIMITED(LOG_WARN, "[INFO] Publisher (socket = %d) cannot publish to wildcard topic '%s', message ignored.\n", client->socket, topicName);
+        return -1;
+    }
+
+    // Add topic to the registry if it's not already there
+    *topic = registry_lookup(&topicRegistry, topicName, topicHash(topicName), 1);
+    return 0;
+}
+
+// Handle one message received from a publisher, on its resolved topic
+// (NULL if the topic could not be created)
+static void publisher_message(TOPIC *topic, PUBLISH *pub)
+{
+    stats_add(STAT_PUBLISHED, 1);
+    stats_add(STAT_PUBLISHED_BYTES, pub->payloadLen);
+    if (topic)
     {
-        destroyTopics(&topicRegistry);
+        atomic_fetch_add_explicit(&topic->published, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&topic->publishedBytes, pub->payloadLen, memory_order_relaxed);
+        pub->topicId = topic->id;
     }
-    pthread_mutex_unlock(&topicRegistry_mtx);
+
+    // Log it and keep it for replay. The history lock is held across the
+    // fan-out so a subscriber replaying the history or the log cannot also
+    // get it live.
+    TOPIC_HISTORY *history = topic ? history_lock(topic) : NULL;
+    if (topic && wal_enabled())
+        pub->seq = wal_append(pub->topic, pub->topicLen, pub->payload, pub->payloadLen);
+    if (history)
+        history_append(history, publish_text(pub), publish_frame(pub), pub->received);
+
+    // Multicast to all subscribed clients, then start writing
+    CLIENT_VEC kick;
+    initClientVec(&kick);
+    send_to_subscribers(topic, pub, &kick);
+
+    if (history)
+    {
+        history_unlock(history);
+        history_evict();
+    }
+    kickClientVec(&kick);
+
+    // The queues hold their own references now
+    msgbuf_release(pub->text);
+    msgbuf_release(pub->frame);
+    msgbuf_release(pub->idFrame);
+}
+
+// Text protocol publish: [topic] "text"\n
+// The line itself is what text subscribers receive.
+static void publisher_line(CLIENT *client, const char *line, size_t len)
+{
+    PUBLISH pub;
+    memset(&pub, 0, sizeof(pub));
+
+    // Taking topic name out of received message
+    size_t i = 1;
+    while (i < len && line[i] != ']')
+        i++;
+    pub.topic = line + (len > 0 ? 1 : 0);
+    pub.topicLen = i > 1 ? i - 1 : 0;
+
+    // The payload is what is between the quotes
+    size_t start = i + 1;
+    while (start < len && line[start] == ' ')
+        start++;
+    size_t end = len;
+    while (end > start && (line[end - 1] == '\n' || line[end - 1] == '\r' || line[end - 1] == ' ' || line[end - 1] == '\t'))
+        end--;
+    if (start < end && line[start] == '"')
+    {
+        start++;
+        if (end > start && line[end - 1] == '"')
+            end--;
+    }
+    pub.payload = line + start;
+    pub.payloadLen = end > start ? end - start : 0;
+
+    pub.line = line;
+    pub.lineLen = len;
+    pub.received = stats_now();
+
+    TOPIC *topic;
+    if (publisher_topic(client, &pub, &topic) == 0)
+        publisher_message(topic, &pub);
+}
+
+typedef struct loggedReplay_st {
+    CLIENT *client;
+    const FILTER *filter;       // only replay what it passes, if set
+    size_t queued;
+    size_t dropped;
+} LOGGED_REPLAY;
+
+// Queue one logged message for a /subscribe --from client. It is encoded
+// for this client only; received stays 0 so it is not timed as a fan-out.
+static void queue_logged(const WAL_ENTRY *entry, void *arg)
+{
+    LOGGED_REPLAY *replay = (LOGGED_REPLAY *)arg;
+    if (replay->filter && !filter_match(replay->filter, entry->payload, entry->payloadLen))
+        return;
+
+    PUBLISH pub;
+    memset(&pub, 0, sizeof(pub));
+    pub.topic = entry->topic;
+    pub.topicLen = entry->topicLen;
+    pub.payload = entry->payload;
+    pub.payloadLen = entry->payloadLen;
+    pub.seq = entry->seq;
+
+    MSGBUF *buf = replay->client->binary ? publish_frame(&pub) : publish_text(&pub);
+    if (buf && client_enqueue(replay->client, buf, OVERFLOW_UNSET, NULL, NULL) >= 0)
+        replay->queued++;
+    else
+        replay->dropped++;
+    msgbuf_release(buf);
+}
+
+// Function handling SUBSCRIBE and UNSUBSCRIBE commands 
+void subscriberCommand(char *topics_str, server_cmd_t cmd, CLIENT *client)
+{
+    if(cmd == CMD_LIST_TOPICS)
+    {
+        send_topics_to_subscribers(client);
+        return;
+    }
+
+    if(cmd == CMD_LIST_QUEUES)
+    {
+        client_queue_report(client);
+        return;
+    }
+
+    if(cmd == CMD_MEMORY)
+    {
+        send_memory_report(client);
+        return;
+    }
+
+    if(cmd == CMD_SHARDS)
+    {
+        send_shard_report(client);
+        return;
+    }
+
+    if(cmd == CMD_STATS)
+    {
+        send_stats_report(client);
+        return;
+    }
+
+    if(cmd == CMD_DEBUG)
+    {
+        send_registry_dump(client);
+        return;
+    }
+
+    if(cmd == CMD_POLICY)
+    {
+        set_overflow_policy(client, topics_str);
+        return;
+    }
+
+    if(cmd == CMD_CONFLATE)
+    {
+        set_conflation(client, topics_str);
+        return;
+    }
+
+    if (topics_str == NULL || strlen(topics_str) == 0)
+    {
+        char msg[DEFAULT_BUFLEN];
+        if (cmd == CMD_UNSUBSCRIBE)
+            snprintf(msg, DEFAULT_BUFLEN, "[INFO] No topics specified. Use /unsubscribe \"topic1\" \"topic2\".\n");
+        else
+            snprintf(msg, DEFAULT_BUFLEN, "[INFO] No topics specified. Use /subscribe \"topic1\" \"topic2\".\n");
+        client_send(client, msg, strlen(msg));
+        return;
+    }
+
+    // /subscribe --replay "topic": send the topic's history first
+    // /subscribe --from SEQ "topic": send its logged messages from SEQ on
+    // /subscribe --filter SPEC "topic": only messages whose payload passes
+    // the filter (see filter.h); combines with either of the above
+    int replay = 0;
+    unsigned long long from = 0;
+    FILTER *filter = NULL;
+    if (cmd == CMD_SUBSCRIBE)
+    {
+        for (;;)
+        {
+            char *opt = topics_str;
+            while (*opt == ' ')
+                opt++;
+            if (strncmp(opt, "--replay", 8) == 0 && !replay && !from)
+            {
+                replay = 1;
+                topics_str = opt + 8;
+            }
+            else if (strncmp(opt, "--from", 6) == 0 && !replay && !from)
+            {
+                char *end;
+                from = strtoull(opt + 6, &end, 10);
+                if (end == opt + 6 || from == 0)
+                {
+                    char msg[DEFAULT_BUFLEN];
+                    snprintf(msg, DEFAULT_BUFLEN, "[INFO] Error: invalid format. Use /subscribe --from SEQ \"topic1\" \"topic2\".\n");
+                    client_send(client, msg, strlen(msg));
+                    filter_release(filter);
+                    return;
+                }
+                topics_str = end;
+            }
+            else if (strncmp(opt, "--filter", 8) == 0 && !filter)
+            {
+                // The spec runs to the next space, or is in single quotes
+                char *spec = opt + 8;
+                while (*spec == ' ')
+                    spec++;
+                char *end;
+                if (*spec == '\'')
+                {
+                    spec++;
+                    end = strchr(spec, '\'');
+                }
+                else
+                    end = spec + strcspn(spec, " \"");
+
+                const char *error = "missing closing quote";
+                if (end)
+                    filter = filter_compile(spec, (size_t)(end - spec), &error);
+                if (filter == NULL)
+                {
+                    char msg[DEFAULT_BUFLEN];
+                    snprintf(msg, DEFAULT_BUFLEN, "[INFO] Error: invalid filter (%s). Use /subscribe --filter prefix:TEXT|contains:TEXT|KEY=VALUE \"topic1\" \"topic2\".\n", error);
+                    client_send(client, msg, strlen(msg));
+                    return;
+                }
+                topics_str = *end == '\'' ? end + 1 : end;
+            }
+            else
+                break;
+        }
+    }
+
+    int found_any = 0;
+    const char *p = topics_str;
+    char topicName[DEFAULT_BUFLEN];
+
+    while ((p = next_quoted_topic(p, topicName, sizeof(topicName))) != NULL)
+    {
+        found_any = 1;
+
+        if (topicName[0] == '\0')
+        {
+            char msg[DEFAULT_BUFLEN];
+            snprintf(msg, DEFAULT_BUFLEN, "[INFO] Error: Topic name cannot be empty.\n");
+            client_send(client, msg, strlen(msg));
+            continue;
+        }
+
+        switch (cmd)
+        {
+            case CMD_SUBSCRIBE:
+            {
+                // Holding the history lock keeps publishes to the topic out
+                // until the replay is queued, so nothing is missed or doubled
+                TOPIC_HISTORY *history = NULL;
+                if ((replay || (from && wal_enabled())) && topicPattern(topicName) == 0)
+                {
+                    // After a restart only the log knows the topic
+                    TOPIC *topic = registry_lookup(&topicRegistry, topicName, topicHash(topicName), from != 0);
+                    if (topic)
+                        history = history_lock(topic);
+                }
+
+                int res = registry_subscribe(&topicRegistry, topicName, &client->subs, filter);
+
+                char msg[DEFAULT_BUFLEN];
+                if(res == 0 && history && from)
+                {
+                    LOGGED_REPLAY logged = { client, filter, 0, 0 };
+                    wal_replay(from, topicName, strlen(topicName), queue_logged, &logged);
+                    history_unlock(history);
+
+                    WAL_STATS wal;
+                    wal_stats(&wal);
+                    LOG(LOG_INFO, "[SUBSCRIBE] Client %d subscribed to topic '%s' from sequence number %llu\n", client->socket, topicName, from);
+                    int len = snprintf(msg, DEFAULT_BUFLEN, "[INFO] Subscribed to '%.200s', replayed %zu logged messages from seq %llu",
+                                       topicName, logged.queued, from);
+                    if (logged.dropped)
+                        len += snprintf(msg + len, DEFAULT_BUFLEN - len, ", %zu dropped on a full queue", logged.dropped);
+                    if (from < wal.firstSeq)
+                        len += snprintf(msg + len, DEFAULT_BUFLEN - len, " (the log starts at seq %llu)", (unsigned long long)wal.firstSeq);
+                    snprintf(msg + len, DEFAULT_BUFLEN - len, "\n");
+                    client_queue_reply(client, msg, strlen(msg));
+                    client_kick(client);
+                    break;
+                }
+                if(res == 0 && history && replay)
+                {
+                    uint64_t now = stats_now();
+                    LOG(LOG_INFO, "[SUBSCRIBE] Client %d subscribed to topic '%s' with replay\n", client->socket, topicName);
+                    snprintf(msg, DEFAULT_BUFLEN, "[INFO] Subscribed to '%.200s', replaying %zu messages\n", topicName, history_count(history, now, filter));
+                    client_queue_reply(client, msg, strlen(msg));
+                    history_replay(history, client, now, filter);
+                    history_unlock(history);
+                    client_kick(client);
+                    break;
+                }
+                if (history)
+                    history_unlock(history);
+
+                if(res == 0)
+                {
+                    if (filter)
+                        LOG(LOG_INFO, "[SUBSCRIBE] Client %d subscribed to topic '%s' with filter '%s'\n", client->socket, topicName, filter->spec);
+                    else
+                        LOG(LOG_INFO, "[SUBSCRIBE] Client %d subscribed to topic '%s'\n", client->socket, topicName);
+                    if (replay)
+                        snprintf(msg, DEFAULT_BUFLEN, "[INFO] Subscribed to '%.200s' (no history to replay)\n", topicName);
+                    else if (from)
+                        snprintf(msg, DEFAULT_BUFLEN, "[INFO] Subscribed to '%.200s' (no message log to replay from)\n", topicName);
+                    else if (filter)
+                        snprintf(msg, DEFAULT_BUFLEN, "[INFO] Subscribed to '%.200s' with filter '%.200s'\n", topicName, filter->spec);
+                    else
+                        snprintf(msg, DEFAULT_BUFLEN, "[INFO] Subscribed to '%.200s'\n", topicName);
+                }
+                else if(res == 1)
+                {
+                    LOG(LOG_DEBUG, "[SUBSCRIBE] Client %d already subscribed to topic '%s'\n", client->socket, topicName);
+                    snprintf(msg, DEFAULT_BUFLEN, "[INFO] Already subscribed to '%.200s'\n", topicName);
+                }
+                else if(res == -2)
+                    snprintf(msg, DEFAULT_BUFLEN, "[INFO] Invalid wildcard '%.200s': '#' must be the last level.\n", topicName);
+                else
+                {
+                    LOG(LOG_DEBUG, "[SUBSCRIBE] Client %d wanted to subscribe to '%s', which is not in the registry\n", client->socket, topicName);
+                    snprintf(msg, DEFAULT_BUFLEN, "[INFO] Topic '%.200s' does not exist.\n", topicName);
+                }
+                client_send(client, msg, strlen(msg));
+                break;
+            }
+
+            case CMD_UNSUBSCRIBE:
+            {
+                int res = registry_unsubscribe(&topicRegistry, topicName, &client->subs);
+
+                char msg[DEFAULT_BUFLEN];
+                if(res == 0)
+                {
+                    LOG(LOG_INFO, "[UNSUBSCRIBE] Client %d unsubscribed from topic '%s'\n", client->socket, topicName);
+                    snprintf(msg, DEFAULT_BUFLEN, "[INFO] Unsubscribed from '%.200s'\n", topicName);
+                }
+                else
+                    snprintf(msg, DEFAULT_BUFLEN, "[INFO] Cannot unsubscribe from '%.200s' (not subscribed or topic does not exist)\n", topicName);
+                client_send(client, msg, strlen(msg));
+                break;
+            }
+
+            case CMD_LIST_TOPICS:
+            case CMD_LIST_QUEUES:
+            case CMD_MEMORY:
+            case CMD_SHARDS:
+            case CMD_STATS:
+            case CMD_DEBUG:
+            case CMD_POLICY:
+            case CMD_CONFLATE:
+            case CMD_NONE:
+                break;
+        }
+    }
+
+    // The subscriptions hold their own references
+    filter_release(filter);
+
+    if (!found_any)
+    {
+        char msg[DEFAULT_BUFLEN];
+        if (strchr(topics_str, '"') != NULL)
+        {
+            if (cmd == CMD_UNSUBSCRIBE)
+                snprintf(msg, DEFAULT_BUFLEN, "[INFO] Error: invalid format. Use /unsubscribe \"topic1\" \"topic2\".\n");
+            else
+                snprintf(msg, DEFAULT_BUFLEN, "[INFO] Error: invalid format. Use /subscribe \"topic1\" \"topic2\".\n");
+        }
+        else
+        {
+            if (cmd == CMD_UNSUBSCRIBE)
+                snprintf(msg, DEFAULT_BUFLEN, "[INFO] No topics specified. Use /unsubscribe \"topic1\" \"topic2\".\n");
+            else
+                snprintf(msg, DEFAULT_BUFLEN, "[INFO] No topics specified. Use /subscribe \"topic1\" \"topic2\".\n");
+        }
+        client_send(client, msg, strlen(msg));
+        return;
+    }
+}
+
+
+// Handle one command received from a subscriber
+static void subscriber_message(CLIENT *client, char *buffer)
+{
+    char *topics_start; 
+
+    server_cmd_t cmd = parse_server_command(buffer, &topics_start);
+    if (cmd == CMD_NONE)
+    {
+        char msg[DEFAULT_BUFLEN];
+        snprintf(msg, DEFAULT_BUFLEN, "[INFO] Unknown command. Use /subscribe \"topic1\" \"topic2\", /unsubscribe \"topic1\" \"topic2\", /topics, /queues, /memory, /shards, /stats, /debug, /policy or /conflate.\n");
+        client_send(client, msg, strlen(msg));
+        return;
+    }
+    subscriberCommand(topics_start, cmd, client);
+}
+
+// Commands arrive as text; hand them over NUL-terminated
+static void subscriber_command_text(CLIENT *client, const char *text, size_t len)
+{
+    char stackbuf[DEFAULT_BUFLEN];
+    char *buffer = stackbuf;
+
+    if (len >= DEFAULT_BUFLEN)
+    {
+        buffer = malloc(len + 1);
+        if (buffer == NULL)
+        {
+            perror("malloc command");
+            return;
+        }
+    }
+    memcpy(buffer, text, len);
+    buffer[len] = '\0';
+
+    subscriber_message(client, buffer);
+
+    if (buffer != stackbuf)
+        free(buffer);
+}
+
+// Decide the client type from the role sent right after connecting
+static void client_role(CLIENT *client, const char *role, size_t len)
+{
+    char peer[64];
+    const char *protocol = client->shm ? "shared memory" : client->binary ? "binary" : "text";
+
+    client->state = CLIENT_ACTIVE;
+
+    if(len == 9 && strncmp(role, "PUBLISHER", 9) == 0)
+    {
+        client->type = PUBLISHER_TYPE;
+        LOG(LOG_INFO, "[INFO] New publisher (socket = %d, %s) connected: %s\n", client->socket, protocol, client_peer(client, peer, sizeof(peer)));
+    }
+    else 
+    {
+        client->type = SUBSCRIBER_TYPE;
+        LOG(LOG_INFO, "[INFO] New subscriber (socket = %d, %s) connected: %s\n", client->socket, protocol, client_peer(client, peer, sizeof(peer)));
+    }
+}
+
+static int is_prefix(const char *data, size_t len, const char *word)
+{
+    return len <= strlen(word) && strncmp(data, word, len) == 0;
+}
+
+// Role handshake. Either a line "ROLE [VERSION]\n", or the bare role word
+// of the original protocol with no newline.
+// Returns the bytes consumed, 0 if more data is needed, -1 on failure.
+static ssize_t handshake_input(CLIENT *client, const char *data, size_t len)
+{
+    const char *nl = memchr(data, '\n', len < HANDSHAKE_MAX ? len : HANDSHAKE_MAX);
+
+    if (nl == NULL)
+    {
+        if ((len == 9 && strncmp(data, "PUBLISHER", 9) == 0) ||
+            (len == 10 && strncmp(data, "SUBSCRIBER", 10) == 0))
+        {
+            client_role(client, data, len);
+            return (ssize_t)len;
+        }
+
+        // Wait for the rest of a role line that has only partly arrived
+        if (len < HANDSHAKE_MAX &&
+            (is_prefix(data, len, "PUBLISHER") || is_prefix(data, len, "SUBSCRIBER") ||
+             strncmp(data, "PUBLISHER ", len < 10 ? len : 10) == 0 ||
+             strncmp(data, "SUBSCRIBER ", len < 11 ? len : 11) == 0))
+            return 0;
+
+        // Anything else is taken as the role, like the original server did
+        client_role(client, data, len);
+        return (ssize_t)len;
+    }
+
+    size_t lineLen = (size_t)(nl - data);
+    size_t roleLen = lineLen;
+    if (roleLen > 0 && data[roleLen - 1] == '\r')
+        roleLen--;
+
+    const char *space = memchr(data, ' ', roleLen);
+    if (space == NULL)
+    {
+        client_role(client, data, roleLen);
+        return (ssize_t)lineLen + 1;
+    }
+
+    const char *version = space + 1;
+    size_t versionLen = roleLen - (size_t)(version - data);
+
+    int binary = versionLen == strlen(HANDSHAKE_BINARY) && strncmp(version, HANDSHAKE_BINARY, versionLen) == 0;
+
+    // Shared memory is only offered on the --local socket; its answer
+    // carries the segment, and frames go through the rings from now on
+    if (client->local && versionLen == strlen(HANDSHAKE_SHM) && strncmp(version, HANDSHAKE_SHM, versionLen) == 0)
+    {
+        if (reactor_shm_attach(client) < 0)
+            return -1;
+        client->binary = 1;
+        client_role(client, data, (size_t)(space - data));
+        return (ssize_t)lineLen + 1;
+    }
+
+    // Tell the client which protocol it got; unknown versions fall back to
+    // text. The answer itself is always a plain line.
+    const char *ok = binary ? HANDSHAKE_OK_BINARY : HANDSHAKE_OK_TEXT;
+    client_send(client, ok, strlen(ok));
+
+    client->binary = binary;
+    client_role(client, data, (size_t)(space - data));
+
+    return (ssize_t)lineLen + 1;
+}
+
+// Binary protocol: one frame at a time.
+// Returns the bytes consumed, 0 if more data is needed, -1 on a bad frame.
+static ssize_t frame_input(CLIENT *client, const char *data, size_t len)
+{
+    FRAME frame;
+    ssize_t n = frame_parse(data, len, &frame);
+    if (n <= 0)
+    {
+        if (n < 0)
+            LOG_LIMITED(LOG_WARN, "[INFO] Client (socket = %d) sent a malformed frame.\n", client->socket);
+        return n;
+    }
+
+    if (client->type == PUBLISHER_TYPE && frame.type == FRAME_PUBLISH)
+    {
+        PUBLISH pub;
+        memset(&pub, 0, sizeof(pub));
+        pub.payload = frame.payload;
+        pub.payloadLen = frame.payloadLen;
+        pub.received = stats_now();
+
+        // By ID the topic is one array index away; its name is still what
+        // the log and the other encodings carry
+        TOPIC *topic = NULL;
+        if (frame.flags & FRAME_FLAG_TOPIC_ID)
+        {
+            topic = registry_topic_by_id(&topicRegistry, frame.topicId);
+            if (topic == NULL || topic->pattern)
+            {
+                LOG_LIMITED(LOG_WARN, "[INFO] Publisher (socket = %d) sent unknown topic ID %u, message ignored.\n", client->socket, frame.topicId);
+                return n;
+            }
+            pub.topic = topic->name;
+            pub.topicLen = topic->nameLen;
+        }
+        else
+        {
+            pub.topic = frame.topic;
+            pub.topicLen = frame.topicLen;
+            if (publisher_topic(client, &pub, &topic) < 0)
+                return n;
+
+            // Answered before the message is fanned out, so the publisher
+            // can switch to the ID right away
+            if ((frame.flags & FRAME_FLAG_WANT_ID) && topic && topic->id)
+                client_send_topic_id(client, topic);
+        }
+        publisher_message(topic, &pub);
+    }
+    else if (client->type == SUBSCRIBER_TYPE && frame.type == FRAME_COMMAND)
+    {
+        // From now on its messages come by topic ID
+        if (frame.flags & FRAME_FLAG_WANT_ID)
+            atomic_store_explicit(&client->topicIds, 1, memory_order_relaxed);
+        subscriber_command_text(client, frame.payload, frame.payloadLen);
+    }
+    else
+    {
+        LOG_LIMITED(LOG_WARN, "[INFO] Client (socket = %d) sent an unexpected frame type %d.\n", client->socket, frame.type);
+        return -1;
+    }
+
+    return n;
+}
+
+// Text protocol: one '\n' terminated line at a time.
+// Returns the bytes consumed, 0 if more data is needed, -1 on an overlong line.
+static ssize_t line_input(CLIENT *client, const char *data, size_t len)
+{
+    const char *nl = memchr(data, '\n', len);
+    if (nl == NULL)
+    {
+        if (len > TEXT_MAX_LINE)
+        {
+            LOG_LIMITED(LOG_WARN, "[INFO] Client (socket = %d) sent a line longer than %d bytes.\n", client->socket, TEXT_MAX_LINE);
+            return -1;
+        }
+        return 0;
+    }
+
+    size_t lineLen = (size_t)(nl - data) + 1;
+    if (client->type == PUBLISHER_TYPE)
+        publisher_line(client, data, lineLen);
+    else
+        subscriber_command_text(client, data, lineLen);
+
+    return (ssize_t)lineLen;
+}
+
+// Feed bytes received from a client. Whatever does not form a complete
+// handshake line, frame or text line yet is kept for the next call.
+// Returns -1 if the connection should be closed.
+int client_input(CLIENT *client, const char *data, size_t len)
+{
+    INBUF *in = &client->in;
+    if (inbuf_append(in, data, len) < 0)
+        return -1;
+
+    size_t off = 0;
+    int res = 0;
+    while (off < in->len)
+    {
+        ssize_t n;
+        if (client->state == CLIENT_HANDSHAKE)
+            n = handshake_input(client, in->data + off, in->len - off);
+        else if (client->binary)
+            n = frame_input(client, in->data + off, in->len - off);
+        else
+            n = line_input(client, in->data + off, in->len - off);
+
+        if (n < 0)
+            res = -1;
+        if (n <= 0)
+            break;
+        off += (size_t)n;
+    }
+
+    inbuf_consume(in, off);
+    return res;
+}
+
+// Count and log a connection that did not send its role within
+// --handshake-ms; its owner closes it
+void client_handshake_expired(CLIENT *client)
+{
+    stats_add(STAT_HANDSHAKE_TIMEOUTS, 1);
+    char peer[64];
+    LOG_LIMITED(LOG_WARN, "[INFO] Connection (socket = %d) from %s closed: no role within %u ms.\n", client->socket, client_peer(client, peer, sizeof(peer)), handshake_ms);
+}
+
+static void set_recv_timeout(int sock, unsigned ms)
+{
+    struct timeval tv = { (time_t)(ms / 1000), (suseconds_t)(ms % 1000) * 1000 };
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0)
+        perror("setsockopt SO_RCVTIMEO failed");
+}
+
+// Client thread function (thread-per-client mode). The role is read here,
+// not in the accept loop, so a client that connects and sends nothing only
+// holds up its own thread, and that for at most --handshake-ms.
+static void *handle_client(void *arg)
+{
+    CLIENT *client = (CLIENT *)arg;
+    char buffer[READ_CHUNK];
+    ssize_t read_size;
+
+    if (handshake_ms > 0)
+        set_recv_timeout(client->socket, handshake_ms);
+
+    // Read until the role is known; anything sent along with it is
+    // handled right away
+    while (client->state == CLIENT_HANDSHAKE)
+    {
+        read_size = recv(client->socket, buffer, READ_CHUNK, 0);
+        if (read_size <= 0 || client_input(client, buffer, (size_t)read_size) < 0)
+        {
+            if (read_size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                client_handshake_expired(client);
+            client_disconnected(client);
+            return NULL;
+        }
+    }
+
+    if (handshake_ms > 0)
+        set_recv_timeout(client->socket, 0);
+
+    // Subscribers get a writer thread that drains their outbound queue
+    if (client->type == SUBSCRIBER_TYPE && client_start_writer(client) < 0)
+    {
+        client_disconnected(client);
+        return NULL;
+    }
+
+    while ((read_size = recv(client->socket, buffer, READ_CHUNK, 0)) > 0)
+    {
+        if (client_input(client, buffer, (size_t)read_size) < 0)
+            break;
+    }
+
+    client_disconnected(client);
+
+    return NULL;
+}
+
+// Remove a closed connection from the registry and free it
+void client_disconnected(CLIENT *client)
+{
+    if (client->state == CLIENT_HANDSHAKE)
+    {
+        destroyClient(client);
+        return;
+    }
+
+    if (client->type == PUBLISHER_TYPE)
+    {
+        LOG(LOG_INFO, "[INFO] Publisher (socket = %d) disconnected.\n", client->socket);
+    }
+    else
+    {
+        registry_unsubscribe_all(&topicRegistry, &client->subs);
+        LOG(LOG_INFO, "[INFO] Subscriber (socket = %d) disconnected.\n", client->socket);
+    }
+
+    destroyClient(client);
+}
+
+// Accept loop of the thread-per-client mode
+static void run_thread_per_client(int server_socket)
+{
+    struct sockaddr_in client_addr;
+    socklen_t addr_len = sizeof(client_addr);
+
+    while (1)
+    {
+        int sock = accept(server_socket, (struct sockaddr *)&client_addr, &addr_len);
+        if (sock < 0)
+        {
+            perror("accept failed");
+            continue;
+        }
+
+        CLIENT* client = createClient(sock, &client_addr);
+        if (!client) 
+        {
+            close(sock);
+            continue;
+        }
+
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, handle_client, (void*)client) != 0) 
+        {
+            perror("pthread_create client handler failed");
+            destroyClient(client);
+            exit(EXIT_FAILURE);
+        }
+
+        pthread_detach(tid);
+    }
+}
+
+#define BIND_RETRIES        50
+#define BIND_RETRY_US       10000
+
+// Create a TCP socket listening on port. With reuseport several sockets
+// can be bound to the same port, one per event loop.
+int open_listen_socket(int port, int reuseport)
+{
+    struct sockaddr_in server_addr;
+
+    int server_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (server_socket < 0)
+    {
+        perror("socket failed");
+        return -1;
+    }
+
+    int optval = 1;
+    if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0)
+    {
+        perror("setsockopt SO_REUSEADDR failed");
+    }
+
+    if (reuseport && setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) < 0)
+    {
+        perror("setsockopt SO_REUSEPORT failed");
+        close(server_socket);
+        return -1;
+    }
+
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_port = htons(port);
+
+    // The kernel tears an io_uring down asynchronously, so right after a
+    // --mode uring server exits its listening socket can still hold the
+    // port for a few milliseconds
+    for (int tries = 0; bind(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0; tries++)
+    {
+        if (errno != EADDRINUSE || tries == BIND_RETRIES)
+        {
+            perror("bind failed");
+            close(server_socket);
+            return -1;
+        }
+        usleep(BIND_RETRY_US);
+    }
+
+    if (listen(server_socket, listen_backlog) < 0)
+    {
+        perror("listen failed");
+        close(server_socket);
+        return -1;
+    }
+
+    return server_socket;
+}
+
+// Create the unix socket local clients connect to (--local). They get
+// the shared-memory transport if they ask for it.
+int open_local_socket(const char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Local socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+    {
+        perror("socket local");
+        return -1;
+    }
+
+    // A stale socket file of an earlier run would make bind() fail
+    unlink(path);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock, listen_backlog) < 0)
+    {
+        perror("bind local socket");
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [--mode epoll|uring|threads] [--loops N] [--reuseport] [--pin] [--port PORT] [--local PATH] [--backlog N] [--handshake-ms MS] [--queue-msgs N] [--queue-bytes N] [--overflow POLICY] [--block-ms MS] [--shards N] [--fanout-workers N] [--fanout-threshold N] [--admin PATH] [--log-level LEVEL] [--history N] [--history-age SECONDS] [--history-bytes N] [--wal DIR] [--wal-segment-bytes N] [--wal-retain-bytes N] [--wal-retain-age SECONDS] [--wal-sync-ms MS]\n", prog);
+    fprintf(stderr, "  --mode   epoll: edge-triggered event loop (default), uring: io_uring event loop (epoll if the\n"
+                    "           kernel lacks support), threads: one thread per client\n");
+    fprintf(stderr, "  --loops  number of event loop threads in epoll and uring mode, 0 for one per CPU (default 1)\n");
+    fprintf(stderr, "  --reuseport    give every event loop its own SO_REUSEPORT listening socket\n");
+    fprintf(stderr, "  --pin          pin every event loop thread to its own CPU\n");
+    fprintf(stderr, "  --port   listening port (default %d)\n", PORT);
+    fprintf(stderr, "  --local PATH   also accept clients on a unix socket at PATH, with shared-memory rings if they ask\n");
+    fprintf(stderr, "  --backlog N    listen backlog, capped by net.core.somaxconn (default %d)\n", DEFAULT_LISTEN_BACKLOG);
+    fprintf(stderr, "  --handshake-ms MS  close connections that send no role within MS, 0 for no limit (default %d)\n", DEFAULT_HANDSHAKE_MS);
+    fprintf(stderr, "  --queue-msgs   max messages queued per subscriber before dropping (default %d)\n", DEFAULT_QUEUE_MAX_MSGS);
+    fprintf(stderr, "  --queue-bytes  max bytes queued per subscriber before dropping (default %d)\n", DEFAULT_QUEUE_MAX_BYTES);
+    fprintf(stderr, "  --overflow POLICY  what to do with a message for a full queue: drop-newest (default), drop-oldest,\n"
+                    "                     disconnect or block; /policy overrides it per topic or subscriber\n");
+    fprintf(stderr, "  --block-ms MS  longest a publish waits for a full queue under the block policy (default %d)\n", DEFAULT_BLOCK_MS);
+    fprintf(stderr, "  --shards N     topic registry shards, rounded up to a power of two (default %d)\n", DEFAULT_REGISTRY_SHARDS);
+    fprintf(stderr, "  --fanout-workers N     threads that share large fan-outs, 0 for none (default 0)\n");
+    fprintf(stderr, "  --fanout-threshold N   subscribers a fan-out needs to be shared (default %d)\n", DEFAULT_FANOUT_THRESHOLD);
+    fprintf(stderr, "  --admin PATH   serve Prometheus text metrics on a unix socket at PATH\n");
+    fprintf(stderr, "  --log-level    error, warn, info (default) or debug; debug logs every publish, rate limited\n");
+    fprintf(stderr, "  --history N    keep the last N messages of every topic for /subscribe --replay (default 0, off)\n");
+    fprintf(stderr, "  --history-age SECONDS  only keep messages younger than this (default 0, no limit)\n");
+    fprintf(stderr, "  --history-bytes N      memory cap of all histories together (default %d)\n", DEFAULT_HISTORY_MAX_BYTES);
+    fprintf(stderr, "  --wal DIR      log every message to segment files in DIR for /subscribe --from\n");
+    fprintf(stderr, "  --wal-segment-bytes N  size of one log segment file (default %d)\n", DEFAULT_WAL_SEGMENT_BYTES);
+    fprintf(stderr, "  --wal-retain-bytes N   delete the oldest segments beyond this size, 0 for no limit (default %lld);\n"
+                    "                         a /subscribe --from may read up to this much of the log\n", DEFAULT_WAL_RETAIN_BYTES);
+    fprintf(stderr, "  --wal-retain-age SECONDS  delete segments whose newest message is older (default 0, no limit)\n");
+    fprintf(stderr, "  --wal-sync-ms MS       least time between two syncs of the log to disk (default %d)\n", DEFAULT_WAL_SYNC_MS);
+}
+
+int main(int argc, char *argv[])
+{
+    int port = PORT;
+    const char *admin_path = NULL;
+    const char *local_path = NULL;
+    const char *wal_dir = NULL;
+    log_level_t level = LOG_INFO;
+    REACTOR_OPTIONS reactor = { .loops = 1, .port = PORT, .reuseport = 0, .pin = 0 };
+
+    static const struct option long_opts[] = {
+        { "mode",  required_argument, NULL, 'm' },
+        { "loops", required_argument, NULL, 'l' },
+        { "reuseport", no_argument,   NULL, 'R' },
+        { "pin",   no_argument,       NULL, 'P' },
+        { "port",  required_argument, NULL, 'p' },
+        { "local", required_argument, NULL, 'U' },
+        { "backlog", required_argument, NULL, 'b' },
+        { "handshake-ms", required_argument, NULL, 'S' },
+        { "queue-msgs",  required_argument, NULL, 'Q' },
+        { "queue-bytes", required_argument, NULL, 'B' },
+        { "overflow", required_argument, NULL, 'O' },
+        { "block-ms", required_argument, NULL, 'X' },
+        { "shards", required_argument, NULL, 's' },
+        { "fanout-workers", required_argument, NULL, 'F' },
+        { "fanout-threshold", required_argument, NULL, 'N' },
+        { "admin", required_argument, NULL, 'A' },
+        { "log-level", required_argument, NULL, 'L' },
+        { "history", required_argument, NULL, 'H' },
+        { "history-age", required_argument, NULL, 'T' },
+        { "history-bytes", required_argument, NULL, 'M' },
+        { "wal", required_argument, NULL, 'W' },
+        { "wal-segment-bytes", required_argument, NULL, 'G' },
+        { "wal-retain-bytes", required_argument, NULL, 'K' },
+        { "wal-retain-age", required_argument, NULL, 'E' },
+        { "wal-sync-ms", required_argument, NULL, 'Y' },
+        { "help",  no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "m:l:RPp:U:b:S:Q:B:O:X:s:F:N:A:L:H:T:M:W:G:K:E:Y:h", long_opts, NULL)) != -1)
+    {
+        switch (opt)
+        {
+            case 'm':
+                if (strcmp(optarg, "epoll") == 0)
+                    server_mode = SERVER_MODE_EPOLL;
+                else if (strcmp(optarg, "threads") == 0)
+                    server_mode = SERVER_MODE_THREADS;
+                else if (strcmp(optarg, "uring") == 0)
+                    server_mode = SERVER_MODE_URING;
+                else
+                {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+
+            case 'l':
+                reactor.loops = atoi(optarg);
+                if (reactor.loops < 0 || (reactor.loops == 0 && strcmp(optarg, "0") != 0))
+                {
+                    fprintf(stderr, "Invalid number of event loops.\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+
+            case 'R':
+                reactor.reuseport = 1;
+                break;
+
+            case 'P':
+                reactor.pin = 1;
+                break;
+
+            case 'p':
+                port = atoi(optarg);
+                if (port <= 0 || port > 65535)
+                {
+                    fprintf(stderr, "Invalid port number.\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+
+            case 'U':
+                local_path = optarg;
+                break;
+
+            case 'b':
+            {
+                long v = atol(optarg);
+                if (v < 1 || v > 65535)
+                {
+                    fprintf(stderr, "Invalid listen backlog.\n");
+                    return EXIT_FAILURE;
+                }
+                listen_backlog = (int)v;
+                break;
+            }
+
+            case 'S':
+            {
+                long v = atol(optarg);
+                if (v < 0 || (v == 0 && strcmp(optarg, "0") != 0))
+                {
+                    fprintf(stderr, "Invalid handshake timeout.\n");
+                    return EXIT_FAILURE;
+                }
+                handshake_ms = (unsigned)v;
+                break;
+            }
+
+            case 'Q':
+            case 'B':
+            {
+                long long v = atoll(optarg);
+                if (v <= 0)
+                {
+                    fprintf(stderr, "Invalid queue limit.\n");
+                    return EXIT_FAILURE;
+                }
+                if (opt == 'Q')
+                    queue_max_msgs = (size_t)v;
+                else
+                    queue_max_bytes = (size_t)v;
+                break;
+            }
+
+            case 'O':
+            {
+                int policy = overflow_parse(optarg);
+                if (policy <= OVERFLOW_UNSET)
+                {
+                    fprintf(stderr, "Invalid overflow policy.\n");
+                    return EXIT_FAILURE;
+                }
+                overflow_policy = (overflow_policy_t)policy;
+                break;
+            }
+
+            case 'X':
+            {
+                long v = atol(optarg);
+                if (v < 0 || (v == 0 && strcmp(optarg, "0") != 0))
+                {
+                    fprintf(stderr, "Invalid block time.\n");
+                    return EXIT_FAILURE;
+                }
+                block_ms = (unsigned)v;
+                break;
+            }
+
+            case 's':
+            {
+                long v = atol(optarg);
+                if (v < 1 || v > 65536)
+                {
+                    fprintf(stderr, "Invalid number of registry shards.\n");
+                    return EXIT_FAILURE;
+                }
+                registry_shards = (size_t)v;
+                break;
+            }
+
+            case 'A':
+                admin_path = optarg;
+                break;
+
+            case 'H':
+            case 'T':
+            case 'M':
+            {
+                long long v = atoll(optarg);
+                if (v < 0 || (v == 0 && opt == 'M'))
+                {
+                    fprintf(stderr, "Invalid history limit.\n");
+                    return EXIT_FAILURE;
+                }
+                if (opt == 'H')
+                    history_max_msgs = (size_t)v;
+                else if (opt == 'T')
+                    history_max_age = (unsigned)v;
+                else
+                    history_max_bytes = (size_t)v;
+                break;
+            }
+
+            case 'W':
+                wal_dir = optarg;
+                break;
+
+            case 'G':
+            case 'K':
+            case 'E':
+            case 'Y':
+            {
+                long long v = atoll(optarg);
+                // A segment must hold at least one message of the largest size
+                if (v < 0 || (opt == 'G' && v < 4 * FRAME_MAX_PAYLOAD))
+                {
+                    fprintf(stderr, "Invalid log limit.\n");
+                    return EXIT_FAILURE;
+                }
+                if (opt == 'G')
+                    wal_segment_bytes = (size_t)v;
+                else if (opt == 'K')
+                    wal_retain_bytes = v;
+                else if (opt == 'E')
+                    wal_retain_age = (unsigned)v;
+                else
+                    wal_sync_ms = (unsigned)v;
+                break;
+            }
+
+            case 'F':
+            {
+                long v = atol(optarg);
+                if (v < 0 || v > FANOUT_MAX_WORKERS || (v == 0 && strcmp(optarg, "0") != 0))
+                {
+                    fprintf(stderr, "Invalid number of fan-out workers.\n");
+                    return EXIT_FAILURE;
+                }
+                fanout_workers = (unsigned)v;
+                break;
+            }
+
+            case 'N':
+            {
+                long long v = atoll(optarg);
+                if (v < 1)
+                {
+                    fprintf(stderr, "Invalid fan-out threshold.\n");
+                    return EXIT_FAILURE;
+                }
+                fanout_threshold = (size_t)v;
+                break;
+            }
+
+            case 'L':
+                if (log_parse_level(optarg, &level) < 0)
+                {
+                    fprintf(stderr, "Invalid log level.\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+
+            case 'h':
+                usage(argv[0]);
+                return 0;
+
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    // A subscriber that disappears mid-send must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    stats_init();
+    if (log_init(level) < 0)
+        return EXIT_FAILURE;
+
+    // Topic registy initialization
+    if (registry_init(&topicRegistry, registry_shards) < 0)
+        return EXIT_FAILURE;
+
+    if (wal_dir && wal_open(wal_dir) < 0)
+        return EXIT_FAILURE;
+
+    if (fanout_start(fanout_workers) < 0)
+        return EXIT_FAILURE;
+
+    if (admin_path && admin_start(admin_path, &topicRegistry) < 0)
+        return EXIT_FAILURE;
+
+    int reuseport = server_mode != SERVER_MODE_THREADS && reactor.reuseport;
+    int server_socket = open_listen_socket(port, reuseport);
+    if (server_socket < 0)
+        return 1;
+
+    if (local_path)
+    {
+        int local_socket = open_local_socket(local_path);
+        if (local_socket < 0 || reactor_start_local(local_socket) < 0)
+            return 1;
+        LOG(LOG_INFO, "[INFO] Local clients accepted on %s\n", local_path);
+    }
+
+    if (server_mode != SERVER_MODE_THREADS)
+    {
+        LOG(LOG_INFO, "Topic-based server listening on port %d (%s)...\n", port, server_mode == SERVER_MODE_URING ? "io_uring" : "epoll");
+        reactor.port = port;
+        reactor.uring = server_mode == SERVER_MODE_URING;
+        reactor_run(server_socket, &reactor);
+    }
+    else
+    {
+        LOG(LOG_INFO, "Topic-based server listening on port %d (thread per client)...\n", port);
+        run_thread_per_client(server_socket);
+    }
+
+    close(server_socket);
+    
+    // Destroy topics
+    history_shutdown();
+    fanout_stop();
+    wal_close();
+    registry_foreach(&topicRegistry, release_announcement, NULL);
+    registry_destroy(&topicRegistry);
+    rcu_shutdown();
+    log_shutdown();
 
     return 0;
 }
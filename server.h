@@ -0,0 +1,231 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <netinet/in.h>
+#include <sys/uio.h>
+#include "frame.h"
+#include "list.h"
+
+#define PORT            12345
+#define DEFAULT_BUFLEN  512
+#define DEFAULT_LISTEN_BACKLOG  4096    // capped by net.core.somaxconn
+#define DEFAULT_HANDSHAKE_MS    5000    // time a new connection has to send its role
+#define READ_CHUNK      16384           // bytes read per recv()
+#define TEXT_MAX_LINE   (64 * 1024)     // longest text protocol line
+
+typedef enum
+{
+    SERVER_MODE_THREADS,    // one detached thread per client (blocking sockets)
+    SERVER_MODE_EPOLL,      // edge-triggered epoll event loop(s), non-blocking sockets
+    SERVER_MODE_URING       // io_uring event loop(s), epoll if the kernel lacks support
+} server_mode_t;
+
+typedef enum
+{
+    SUBSCRIBER_TYPE,
+    PUBLISHER_TYPE
+} client_type_t;
+
+typedef enum
+{
+    CLIENT_HANDSHAKE,       // waiting for the PUBLISHER / SUBSCRIBER role line
+    CLIENT_ACTIVE
+} client_state_t;
+
+#define DEFAULT_QUEUE_MAX_MSGS   1024
+#define DEFAULT_QUEUE_MAX_BYTES  (1024 * 1024)
+#define DEFAULT_BLOCK_MS         100
+
+// What happens to a message for a subscriber whose outbound queue is over
+// its limit. The subscriber's own policy (/policy NAME) wins over the
+// topic's (/policy NAME "topic"), which wins over the server's (--overflow).
+typedef enum
+{
+    OVERFLOW_UNBOUNDED = -1,    // never dropped: server replies
+    OVERFLOW_UNSET,             // use the next level's policy
+    OVERFLOW_DROP_NEWEST,       // drop the new message (default)
+    OVERFLOW_DROP_OLDEST,       // drop the oldest queued messages not being written
+    OVERFLOW_DISCONNECT,        // close the subscriber's connection
+    OVERFLOW_BLOCK              // publisher waits up to --block-ms, then drops the new one
+} overflow_policy_t;
+
+#define WRITE_BATCH     64      // queued messages handed to one sendmsg()
+
+// An encoded message. It is immutable once queued and shared by every
+// outbound queue it was appended to; the last writer frees it.
+// received/sent feed the fan-out latency histogram: when the last queue
+// is done with a message that was written at least once, its age is
+// recorded. References kept by the message history are not pending, so
+// they do not delay that.
+typedef struct msgbuf_st {
+    atomic_int refs;
+    atomic_int pending;     // references other than the history's
+    uint64_t received;      // stats_now() of the publish, 0 for replies
+    atomic_int sent;        // MSGBUF_SENT once written, MSGBUF_RECORDED after
+    size_t len;
+    char data[];
+} MSGBUF;
+
+#define MSGBUF_SENT     1
+#define MSGBUF_RECORDED 2
+
+// One message waiting in a client's outbound queue
+typedef struct outqItem_st {
+    struct outqItem_st *next;
+    MSGBUF *buf;
+    size_t off;             // bytes of this item already written
+    int bounded;            // counts against the limits, may be dropped
+    TOPIC *conflate;        // its topic if that is conflated, else NULL
+} OUTQ_ITEM;
+
+// Bounded outbound queue of a client, protected by the client's out_mtx
+typedef struct outq_st {
+    OUTQ_ITEM *head;
+    OUTQ_ITEM *tail;
+    size_t depth;           // queued messages
+    size_t bytes;           // queued bytes not written yet
+    size_t peakDepth;
+    size_t peakBytes;
+    unsigned long long sentMsgs;
+    unsigned long long sentBytes;
+    unsigned long long dropped;     // new messages not queued
+    unsigned long long evicted;     // queued messages dropped for newer ones
+    unsigned long long blocked;     // publishes that waited for room
+    unsigned long long blockedNs;
+    unsigned long long conflated;   // queued messages replaced by a newer one
+    size_t inflight;        // head items a writer thread is sending unlocked
+    int waiters;            // publishers waiting for room on out_cond
+
+    // Newest queued item of every conflated topic, open addressing on
+    // topic->hash, power of two
+    OUTQ_ITEM **pending;
+    size_t pendingSize;
+    size_t pendingCount;
+} OUTQ;
+
+struct reactor_loop_st;
+struct ring_client_st;
+struct shmConn_st;
+
+typedef struct client_st {
+    int socket;
+    client_type_t type;
+    client_state_t state;
+    struct sockaddr_in addr;
+
+    // Until the role arrives a connection sits in its loop's list of
+    // handshakes, oldest first, and is closed at handshakeDeadline
+    // (stats_now() ns)
+    uint64_t handshakeDeadline;
+    struct client_st *handshakePrev;
+    struct client_st *handshakeNext;
+    int handshakeListed;
+
+    // Protocol negotiated in the handshake: binary frames or text lines
+    int binary;
+    // Received bytes not parsed yet (partial frame or line)
+    INBUF in;
+
+    // Topics this connection is subscribed to (registry write lock)
+    SUBSCRIPTIONS subs;
+
+    // Set when the socket is non-blocking and owned by an event loop
+    int nonblocking;
+    // Owning event loop; other threads post the client to its inbox
+    // instead of writing the socket themselves
+    struct reactor_loop_st *loop;
+    // Set by the owning loop when it closes the connection, so the other
+    // events of the same epoll_wait() batch leave the client alone
+    int loopClosed;
+    struct client_st *inboxNext;
+    atomic_int inboxQueued;
+    // Send and receive state of a client of an io_uring loop, else NULL.
+    // Its socket is blocking and only the loop's ring writes it.
+    struct ring_client_st *ring;
+    // Connected through the --local unix socket (addr is unset)
+    int local;
+    // Shared-memory rings of a local client that asked for SHM/1, else
+    // NULL. Frames go through them and the socket only signals hangup.
+    struct shmConn_st *shm;
+    // Binary subscriber that asked for topic IDs (FRAME_FLAG_WANT_ID): its
+    // messages carry IDs, each announced once. The set of IDs announced so
+    // far is a bitmap guarded by out_mtx.
+    atomic_int topicIds;
+    uint64_t *knownIds;
+    size_t knownWords;
+
+    // Outbound queue. Fan-out only appends here; the bytes are written by
+    // the event loop (non-blocking) or by the client's writer thread.
+    pthread_mutex_t out_mtx;
+    pthread_cond_t out_cond;
+    OUTQ outq;
+    int policy;             // overflow policy set with /policy, or OVERFLOW_UNSET
+    int closed;
+    int hasWriter;
+    pthread_t writer;
+
+    // References held by the owner and by in-flight fan-outs
+    atomic_int refs;
+
+    struct client_st *prevClient;
+    struct client_st *nextClient;
+} CLIENT;
+
+// Clients collected during a fan-out, kicked once the fan-out is done
+typedef struct clientVec_st {
+    CLIENT **items;
+    size_t count;
+    size_t cap;
+    CLIENT *inlineItems[16];
+} CLIENT_VEC;
+
+extern server_mode_t server_mode;
+extern size_t queue_max_msgs;
+extern size_t queue_max_bytes;
+extern overflow_policy_t overflow_policy;
+extern unsigned block_ms;
+extern int listen_backlog;
+extern unsigned handshake_ms;
+
+// client.c
+MSGBUF* msgbuf_create(size_t len);
+MSGBUF* msgbuf_copy(const char *data, size_t len);
+void msgbuf_release(MSGBUF *buf);
+void msgbuf_retain(MSGBUF *buf);
+void msgbuf_release_retained(MSGBUF *buf);
+CLIENT* createClient(int socket, const struct sockaddr_in *addr);
+void destroyClient(CLIENT *client);
+void client_hold(CLIENT *client);
+void client_release(CLIENT *client);
+int client_start_writer(CLIENT *client);
+int client_enqueue(CLIENT *client, MSGBUF *buf, int policy, TOPIC *conflate, CLIENT_VEC *kick);
+int client_enqueue_topic(CLIENT *client, MSGBUF *buf, TOPIC *topic, int policy, TOPIC *conflate, CLIENT_VEC *kick);
+MSGBUF* topic_announcement(TOPIC *topic);
+int client_send_topic_id(CLIENT *client, TOPIC *topic);
+void client_kick(CLIENT *client);
+int client_queue_reply(CLIENT *client, const char *text, size_t len);
+int client_send(CLIENT *client, const char *text, size_t len);
+int client_flush(CLIENT *client);
+int client_fill_batch(CLIENT *client, struct iovec *iov);
+void client_batch_sent(CLIENT *client, size_t n);
+void client_queue_report(CLIENT *requester);
+const char* client_peer(const CLIENT *client, char *buf, size_t len);
+int overflow_parse(const char *name);
+const char* overflow_name(int policy);
+
+void initClientVec(CLIENT_VEC *vec);
+void clientVecPush(CLIENT_VEC *vec, CLIENT *client);
+void kickClientVec(CLIENT_VEC *vec);
+
+// server.c
+int open_listen_socket(int port, int reuseport);
+int open_local_socket(const char *path);
+int client_input(CLIENT *client, const char *data, size_t len);
+void client_disconnected(CLIENT *client);
+void client_handshake_expired(CLIENT *client);
+
+#endif // SERVER_H
@@ -0,0 +1,490 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "frame.h"
+#include "shm.h"
+
+// Header page(s) of the segment, rounded to the page size
+static size_t header_len(void)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    return (sizeof(SHM_HEADER) + page - 1) / page * page;
+}
+
+// Map the header once and each ring twice back to back, all in one
+// reserved range so nothing else can land between the two views
+static int map_segment(SHM_CONN *conn, size_t ringBytes)
+{
+    size_t hdr = header_len();
+
+    conn->mapLen = hdr + 4 * ringBytes;
+    char *base = mmap(NULL, conn->mapLen, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED)
+    {
+        perror("mmap shared memory reservation");
+        return -1;
+    }
+    conn->base = base;
+
+    if (mmap(base, hdr, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, conn->memfd, 0) == MAP_FAILED)
+        goto fail;
+
+    for (int r = 0; r < 2; r++)
+    {
+        char *view = base + hdr + (size_t)r * 2 * ringBytes;
+        off_t off = (off_t)(hdr + (size_t)r * ringBytes);
+
+        if (mmap(view, ringBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, conn->memfd, off) == MAP_FAILED ||
+            mmap(view + ringBytes, ringBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, conn->memfd, off) == MAP_FAILED)
+            goto fail;
+    }
+
+    SHM_HEADER *h = (SHM_HEADER *)base;
+    conn->up.ctl = &h->up;
+    conn->up.data = base + hdr;
+    conn->up.size = ringBytes;
+    conn->down.ctl = &h->down;
+    conn->down.data = base + hdr + 2 * ringBytes;
+    conn->down.size = ringBytes;
+    return 0;
+
+fail:
+    perror("mmap shared memory ring");
+    munmap(base, conn->mapLen);
+    conn->base = NULL;
+    return -1;
+}
+
+static SHM_CONN* conn_alloc(void)
+{
+    SHM_CONN *conn = calloc(1, sizeof(SHM_CONN));
+    if (conn == NULL)
+    {
+        perror("calloc shared memory connection");
+        return NULL;
+    }
+    conn->memfd = -1;
+    conn->up.dataFd = conn->up.spaceFd = -1;
+    conn->down.dataFd = conn->down.spaceFd = -1;
+    return conn;
+}
+
+SHM_CONN* shm_create(void)
+{
+    SHM_CONN *conn = conn_alloc();
+    if (conn == NULL)
+        return NULL;
+
+    conn->memfd = memfd_create("pubsub-shm", MFD_CLOEXEC);
+    if (conn->memfd < 0)
+    {
+        perror("memfd_create failed");
+        goto fail;
+    }
+    if (ftruncate(conn->memfd, (off_t)(header_len() + 2 * SHM_RING_BYTES)) < 0)
+    {
+        perror("ftruncate shared memory failed");
+        goto fail;
+    }
+
+    int *efds[4] = { &conn->up.dataFd, &conn->up.spaceFd, &conn->down.dataFd, &conn->down.spaceFd };
+    for (int i = 0; i < 4; i++)
+    {
+        *efds[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (*efds[i] < 0)
+        {
+            perror("eventfd failed");
+            goto fail;
+        }
+    }
+
+    if (map_segment(conn, SHM_RING_BYTES) < 0)
+        goto fail;
+
+    // A fresh memfd reads as zeros: both rings empty, nobody waiting
+    SHM_HEADER *h = (SHM_HEADER *)conn->base;
+    h->ringBytes = SHM_RING_BYTES;
+    h->magic = SHM_MAGIC;
+    return conn;
+
+fail:
+    shm_close(conn);
+    return NULL;
+}
+
+void shm_fds(const SHM_CONN *conn, int fds[SHM_FDS])
+{
+    fds[0] = conn->memfd;
+    fds[1] = conn->up.dataFd;
+    fds[2] = conn->up.spaceFd;
+    fds[3] = conn->down.dataFd;
+    fds[4] = conn->down.spaceFd;
+}
+
+SHM_CONN* shm_attach(const int fds[SHM_FDS])
+{
+    SHM_CONN *conn = conn_alloc();
+    if (conn == NULL)
+    {
+        for (int i = 0; i < SHM_FDS; i++)
+            close(fds[i]);
+        return NULL;
+    }
+
+    conn->memfd = fds[0];
+    conn->up.dataFd = fds[1];
+    conn->up.spaceFd = fds[2];
+    conn->down.dataFd = fds[3];
+    conn->down.spaceFd = fds[4];
+
+    // The ring size follows from the segment size
+    struct stat st;
+    if (fstat(conn->memfd, &st) < 0)
+    {
+        perror("fstat shared memory failed");
+        goto fail;
+    }
+    size_t hdr = header_len();
+    size_t ringBytes = st.st_size > (off_t)hdr ? ((size_t)st.st_size - hdr) / 2 : 0;
+    if (ringBytes == 0 || (ringBytes & (ringBytes - 1)) != 0 || ringBytes % (size_t)sysconf(_SC_PAGESIZE) != 0)
+    {
+        fprintf(stderr, "shared memory segment has an unexpected size\n");
+        goto fail;
+    }
+
+    if (map_segment(conn, ringBytes) < 0)
+        goto fail;
+
+    SHM_HEADER *h = (SHM_HEADER *)conn->base;
+    if (h->magic != SHM_MAGIC || h->ringBytes != ringBytes)
+    {
+        fprintf(stderr, "shared memory segment is not a pub/sub ring\n");
+        goto fail;
+    }
+    return conn;
+
+fail:
+    shm_close(conn);
+    return NULL;
+}
+
+void shm_close(SHM_CONN *conn)
+{
+    if (conn == NULL)
+        return;
+
+    if (conn->base)
+        munmap(conn->base, conn->mapLen);
+
+    int fds[SHM_FDS];
+    shm_fds(conn, fds);
+    for (int i = 0; i < SHM_FDS; i++)
+        if (fds[i] >= 0)
+            close(fds[i]);
+    free(conn);
+}
+
+static void wake(int fd)
+{
+    uint64_t one = 1;
+    if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        perror("write shared memory eventfd");
+}
+
+void shm_clear(int fd)
+{
+    uint64_t count;
+    if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        perror("read shared memory eventfd");
+}
+
+ssize_t shm_readable(SHM_RING *ring, const char **data)
+{
+    uint64_t head = atomic_load_explicit(&ring->ctl->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&ring->ctl->tail, memory_order_acquire);
+
+    // The other process may be buggy or hostile; never read past the ring
+    if (tail - head > ring->size)
+        return -1;
+
+    *data = ring->data + (head & (ring->size - 1));
+    return (ssize_t)(tail - head);
+}
+
+void shm_consume(SHM_RING *ring, size_t n)
+{
+    uint64_t head = atomic_load_explicit(&ring->ctl->head, memory_order_relaxed);
+    atomic_store_explicit(&ring->ctl->head, head + n, memory_order_release);
+
+    // Pairs with the fence in shm_producer_idle(): either the producer
+    // sees the new head, or this sees its flag
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ring->ctl->producerWaiting, memory_order_relaxed) &&
+        atomic_exchange(&ring->ctl->producerWaiting, 0))
+        wake(ring->spaceFd);
+}
+
+ssize_t shm_writable(SHM_RING *ring, char **data)
+{
+    uint64_t tail = atomic_load_explicit(&ring->ctl->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&ring->ctl->head, memory_order_acquire);
+
+    if (tail - head > ring->size)
+        return -1;
+
+    *data = ring->data + (tail & (ring->size - 1));
+    return (ssize_t)(ring->size - (tail - head));
+}
+
+void shm_produce(SHM_RING *ring, size_t n)
+{
+    uint64_t tail = atomic_load_explicit(&ring->ctl->tail, memory_order_relaxed);
+    atomic_store_explicit(&ring->ctl->tail, tail + n, memory_order_release);
+
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ring->ctl->consumerWaiting, memory_order_relaxed) &&
+        atomic_exchange(&ring->ctl->consumerWaiting, 0))
+        wake(ring->dataFd);
+}
+
+int shm_consumer_idle(SHM_RING *ring, size_t have)
+{
+    const char *data;
+
+    atomic_store(&ring->ctl->consumerWaiting, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    ssize_t n = shm_readable(ring, &data);
+    if (n >= 0 && (size_t)n <= have)
+        return 1;
+
+    atomic_store(&ring->ctl->consumerWaiting, 0);
+    return 0;
+}
+
+int shm_producer_idle(SHM_RING *ring, size_t room)
+{
+    char *data;
+
+    atomic_store(&ring->ctl->producerWaiting, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    ssize_t n = shm_writable(ring, &data);
+    if (n >= 0 && (size_t)n <= room)
+        return 1;
+
+    atomic_store(&ring->ctl->producerWaiting, 0);
+    return 0;
+}
+
+int shm_send_fds(int sock, const char *line, const int *fds, int count)
+{
+    union {
+        char buf[CMSG_SPACE(SHM_FDS * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+
+    if (count > SHM_FDS)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct iovec iov;
+    iov.iov_base = (void *)line;
+    iov.iov_len = strlen(line);
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE((size_t)count * sizeof(int));
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN((size_t)count * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, (size_t)count * sizeof(int));
+
+    // A short handshake line on a fresh socket goes out whole
+    ssize_t n;
+    do
+        n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    while (n < 0 && errno == EINTR);
+
+    return n == (ssize_t)iov.iov_len ? 0 : -1;
+}
+
+int shm_connect(const char *path)
+{
+    struct sockaddr_un addr;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "socket path too long: %s\n", path);
+        return -1;
+    }
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+    {
+        perror("socket creation failed");
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        perror("failed to connect");
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+int shm_handshake(int sock, const char *role, SHM_CONN **conn)
+{
+    char line[HANDSHAKE_MAX];
+    int len = snprintf(line, sizeof(line), "%s %s\n", role, HANDSHAKE_SHM);
+
+    if (send(sock, line, (size_t)len, MSG_NOSIGNAL) != len)
+        return -1;
+
+    union {
+        char buf[CMSG_SPACE(SHM_FDS * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    int fds[SHM_FDS];
+    int nfds = 0;
+
+    // The descriptors arrive with the first byte of the answer. Read it a
+    // byte at a time like frame_handshake(), nothing else follows anyway.
+    size_t n = 0;
+    while (n < sizeof(line) - 1)
+    {
+        struct iovec iov = { line + n, 1 };
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+        ssize_t r = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            goto fail;
+
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+                continue;
+
+            int count = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            int *passed = (int *)CMSG_DATA(cmsg);
+            for (int i = 0; i < count; i++)
+            {
+                if (nfds < SHM_FDS)
+                    fds[nfds++] = passed[i];
+                else
+                    close(passed[i]);
+            }
+        }
+
+        if (line[n++] == '\n')
+            break;
+    }
+    line[n] = '\0';
+
+    if (strcmp(line, HANDSHAKE_OK_SHM) != 0 || nfds != SHM_FDS)
+    {
+        fprintf(stderr, "server did not offer shared memory: %s", n ? line : "no answer\n");
+        goto fail;
+    }
+
+    *conn = shm_attach(fds);
+    return *conn ? 0 : -1;
+
+fail:
+    for (int i = 0; i < nfds; i++)
+        close(fds[i]);
+    return -1;
+}
+
+// Sleep until the eventfd is written. The server sends nothing on the
+// socket after the handshake, so the socket turning readable means it
+// closed the connection.
+static int wait_event(int efd, int sock)
+{
+    struct pollfd pfd[2] = { { efd, POLLIN, 0 }, { sock, POLLIN | POLLRDHUP, 0 } };
+
+    if (poll(pfd, 2, -1) < 0)
+        return errno == EINTR ? 0 : -1;
+    if (pfd[1].revents)
+        return -1;
+    if (pfd[0].revents & POLLIN)
+        shm_clear(efd);
+    return 0;
+}
+
+int shm_wait_readable(SHM_RING *ring, size_t have, int sock)
+{
+    const char *data;
+    ssize_t n;
+
+    while ((n = shm_readable(ring, &data)) >= 0 && (size_t)n <= have)
+    {
+        if (shm_consumer_idle(ring, have) && wait_event(ring->dataFd, sock) < 0)
+            return -1;
+    }
+    return n < 0 ? -1 : 0;
+}
+
+int shm_send_frame(SHM_RING *ring, int sock, uint8_t type, uint8_t flags, const char *topic, size_t topicLen, const char *payload, size_t payloadLen)
+{
+    size_t total = FRAME_HEADER_LEN + topicLen + payloadLen;
+    if (topicLen > FRAME_MAX_TOPIC || payloadLen > FRAME_MAX_PAYLOAD || total > ring->size)
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    // Wait until the whole frame fits, then build it in place
+    char *dst;
+    ssize_t room;
+    while ((room = shm_writable(ring, &dst)) >= 0 && (size_t)room < total)
+    {
+        if (shm_producer_idle(ring, total - 1) && wait_event(ring->spaceFd, sock) < 0)
+        {
+            errno = EPIPE;
+            return -1;
+        }
+    }
+    if (room < 0)
+    {
+        errno = EPROTO;
+        return -1;
+    }
+
+    frame_header((unsigned char *)dst, type, flags, topicLen, payloadLen);
+    if (topicLen)
+        memcpy(dst + FRAME_HEADER_LEN, topic, topicLen);
+    if (payloadLen)
+        memcpy(dst + FRAME_HEADER_LEN + topicLen, payload, payloadLen);
+    shm_produce(ring, total);
+    return 0;
+}
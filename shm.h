@@ -0,0 +1,114 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+
+// Shared-memory transport for clients on the server's host (--local PATH).
+//
+// A client connects to the server's unix socket and sends the role line
+// with version SHM/1 ("SUBSCRIBER SHM/1\n"). The server answers
+// "OK SHM/1\n" and passes along, as SCM_RIGHTS, a memfd holding two
+// single-producer single-consumer byte rings and the four eventfds the
+// two sides sleep on. From then on the binary frames of frame.h travel
+// through the rings instead of the socket: "up" carries the client's
+// frames to the server, "down" the server's frames to the client. The
+// socket stays open only so each side notices when the other goes away.
+//
+// Each ring's data is mapped twice back to back, so the bytes from any
+// position on are contiguous up to the ring's size: frames are written and
+// parsed in place even when they wrap around the end.
+//
+// Wakeups: a side that finds nothing to read (or no room to write) sets
+// its waiting flag, checks the ring once more and only then sleeps on its
+// eventfd. The other side writes the eventfd only if it sees that flag
+// after moving its own index, so a busy ring costs no system calls.
+
+#define HANDSHAKE_SHM       "SHM/1"
+#define HANDSHAKE_OK_SHM    "OK SHM/1\n"
+
+#define SHM_MAGIC           0x50534d31      // "PSM1"
+#define SHM_RING_BYTES      (2 * 1024 * 1024)   // per direction; holds the largest frame
+#define SHM_FDS             5               // memfd, then the eventfds
+
+typedef struct shmRingCtl_st {
+    // Consumer and producer indexes on separate cache lines. They count
+    // bytes and never wrap; the offset in the ring is index & (size - 1).
+    _Atomic uint64_t head __attribute__((aligned(64)));
+    atomic_uint producerWaiting;
+    _Atomic uint64_t tail __attribute__((aligned(64)));
+    atomic_uint consumerWaiting;
+} SHM_RING_CTL;
+
+// Start of the segment
+typedef struct shmHeader_st {
+    uint32_t magic;
+    uint32_t ringBytes;
+    SHM_RING_CTL up;        // client -> server
+    SHM_RING_CTL down;      // server -> client
+} SHM_HEADER;
+
+typedef struct shmRing_st {
+    SHM_RING_CTL *ctl;
+    char *data;             // size bytes, mapped twice in a row
+    size_t size;            // power of two
+    int dataFd;             // eventfd the consumer sleeps on
+    int spaceFd;            // eventfd the producer sleeps on
+} SHM_RING;
+
+typedef struct shmConn_st {
+    int memfd;
+    char *base;
+    size_t mapLen;
+    SHM_RING up;
+    SHM_RING down;
+} SHM_CONN;
+
+// Server: create the segment and eventfds of a new connection
+SHM_CONN* shm_create(void);
+
+// Client: map the segment from the descriptors the server passed;
+// takes them over
+SHM_CONN* shm_attach(const int fds[SHM_FDS]);
+
+void shm_close(SHM_CONN *conn);
+
+// The descriptors to pass to the client, in the order shm_attach() expects
+void shm_fds(const SHM_CONN *conn, int fds[SHM_FDS]);
+
+// Consumer: bytes ready to read and where they start. Returns -1 if the
+// indexes the peer shares are not consistent any more.
+ssize_t shm_readable(SHM_RING *ring, const char **data);
+
+// Consumer: drop n read bytes and wake a producer waiting for room
+void shm_consume(SHM_RING *ring, size_t n);
+
+// Producer: free bytes and where they start; -1 like shm_readable()
+ssize_t shm_writable(SHM_RING *ring, char **data);
+
+// Producer: publish n written bytes and wake a waiting consumer
+void shm_produce(SHM_RING *ring, size_t n);
+
+// Announce that the consumer is about to sleep because no more than have
+// bytes are readable. Returns 1 if it should sleep on dataFd, 0 if more
+// arrived meanwhile.
+int shm_consumer_idle(SHM_RING *ring, size_t have);
+
+// The same for a producer that needs more than room free bytes
+int shm_producer_idle(SHM_RING *ring, size_t room);
+
+// Reset an eventfd after a wakeup
+void shm_clear(int fd);
+
+// Client side, blocking. Each returns -1 once the server closed sock.
+int shm_connect(const char *path);
+int shm_handshake(int sock, const char *role, SHM_CONN **conn);
+int shm_wait_readable(SHM_RING *ring, size_t have, int sock);
+int shm_send_frame(SHM_RING *ring, int sock, uint8_t type, uint8_t flags, const char *topic, size_t topicLen, const char *payload, size_t payloadLen);
+
+// Server side of the handshake answer: text line plus descriptors
+int shm_send_fds(int sock, const char *line, const int *fds, int count);
+
+#endif // SHM_H
@@ -0,0 +1,354 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "slab.h"
+
+#define MAGAZINE_SIZE   32          // free objects a thread keeps per cache
+#define SLAB_BYTES      (64 * 1024) // bytes carved into objects per slab
+#define SLAB_MIN_OBJS   16
+
+// Per-thread state. Counters are written only by the owning thread and
+// summed by slab_stats(). Records are never freed; a record whose thread
+// exited is reused, like the RCU thread records.
+typedef struct slabMagazine_st {
+    size_t count;
+    void *objs[MAGAZINE_SIZE];
+} SLAB_MAGAZINE;
+
+typedef struct slabThread_st {
+    SLAB_MAGAZINE mags[SLAB_MAX_CACHES];
+    atomic_ullong allocs[SLAB_MAX_CACHES];
+    atomic_ullong frees[SLAB_MAX_CACHES];
+    atomic_ullong refills[SLAB_MAX_CACHES];
+    atomic_ullong spills[SLAB_MAX_CACHES];
+    atomic_int inUse;
+    struct slabThread_st *next;
+} SLAB_THREAD;
+
+static pthread_mutex_t registry_mtx = PTHREAD_MUTEX_INITIALIZER;
+static SLAB_CACHE *caches[SLAB_MAX_CACHES];
+static atomic_int cacheCount = 0;
+
+static _Atomic(SLAB_THREAD *) threadList = NULL;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_key;
+static __thread SLAB_THREAD *self = NULL;
+
+// Small-string size classes
+static SLAB_CACHE strCaches[] = {
+    SLAB_CACHE_INIT("str16", 16),
+    SLAB_CACHE_INIT("str32", 32),
+    SLAB_CACHE_INIT("str64", 64),
+    SLAB_CACHE_INIT("str128", 128),
+    SLAB_CACHE_INIT("str256", 256),
+};
+#define STR_CLASSES     (sizeof(strCaches) / sizeof(strCaches[0]))
+
+// Index of a cache in the registry, registering it on first use.
+// Returns -1 if the registry is full; such a cache falls back to malloc.
+static int cache_index(SLAB_CACHE *cache)
+{
+    int id = atomic_load_explicit(&cache->id, memory_order_acquire);
+    if (id > 0)
+        return id - 1;
+    if (id < 0)
+        return -1;
+
+    pthread_mutex_lock(&registry_mtx);
+    {
+        id = atomic_load(&cache->id);
+        if (id == 0)
+        {
+            int n = atomic_load(&cacheCount);
+            if (n < SLAB_MAX_CACHES)
+            {
+                caches[n] = cache;
+                atomic_store(&cacheCount, n + 1);
+                id = n + 1;
+            }
+            else
+            {
+                fprintf(stderr, "slab: too many caches, '%s' uses malloc\n", cache->name);
+                id = -1;
+            }
+            atomic_store_explicit(&cache->id, id, memory_order_release);
+        }
+    }
+    pthread_mutex_unlock(&registry_mtx);
+
+    return id > 0 ? id - 1 : -1;
+}
+
+// Push count objects to the depot. Caller holds cache->lock.
+static void depot_push(SLAB_CACHE *cache, void **objs, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        *(void **)objs[i] = cache->depot;
+        cache->depot = objs[i];
+    }
+    cache->depotCount += count;
+}
+
+// Thread exit: hand the magazines back to the depots and leave the record
+// for the next thread
+static void release_thread(void *arg)
+{
+    SLAB_THREAD *rec = (SLAB_THREAD *)arg;
+    int n = atomic_load(&cacheCount);
+
+    for (int i = 0; i < n; i++)
+    {
+        SLAB_MAGAZINE *mag = &rec->mags[i];
+        if (mag->count == 0)
+            continue;
+
+        pthread_mutex_lock(&caches[i]->lock);
+        depot_push(caches[i], mag->objs, mag->count);
+        pthread_mutex_unlock(&caches[i]->lock);
+        mag->count = 0;
+    }
+
+    atomic_store(&rec->inUse, 0);
+}
+
+static void make_key(void)
+{
+    pthread_key_create(&thread_key, release_thread);
+}
+
+static SLAB_THREAD* get_thread(void)
+{
+    if (self)
+        return self;
+
+    pthread_once(&key_once, make_key);
+
+    for (SLAB_THREAD *rec = atomic_load(&threadList); rec != NULL; rec = rec->next)
+    {
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&rec->inUse, &expected, 1))
+        {
+            self = rec;
+            break;
+        }
+    }
+
+    if (!self)
+    {
+        SLAB_THREAD *rec = calloc(1, sizeof(SLAB_THREAD));
+        if (rec == NULL)
+        {
+            perror("calloc slab thread");
+            return NULL;
+        }
+        atomic_init(&rec->inUse, 1);
+
+        SLAB_THREAD *head = atomic_load(&threadList);
+        do
+            rec->next = head;
+        while (!atomic_compare_exchange_weak(&threadList, &head, rec));
+
+        self = rec;
+    }
+
+    pthread_setspecific(thread_key, self);
+    return self;
+}
+
+static void count(atomic_ullong *counter)
+{
+    // Only the owning thread writes its counters
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
+#ifndef PUBSUB_USE_MALLOC
+
+// Refill an empty magazine with half a magazine from the depot, growing
+// the depot by one slab if it is empty. Returns -1 if out of memory.
+static int refill(SLAB_CACHE *cache, SLAB_MAGAZINE *mag)
+{
+    pthread_mutex_lock(&cache->lock);
+
+    if (cache->depot == NULL)
+    {
+        size_t objs = SLAB_BYTES / cache->objSize;
+        if (objs < SLAB_MIN_OBJS)
+            objs = SLAB_MIN_OBJS;
+
+        char *slab = malloc(objs * cache->objSize);
+        if (slab == NULL)
+        {
+            pthread_mutex_unlock(&cache->lock);
+            perror("malloc slab");
+            return -1;
+        }
+        cache->slabs++;
+
+        // Push in reverse so objects are handed out in address order
+        for (size_t i = objs; i > 0; i--)
+        {
+            void *obj = slab + (i - 1) * cache->objSize;
+            *(void **)obj = cache->depot;
+            cache->depot = obj;
+        }
+        cache->depotCount += objs;
+    }
+
+    while (mag->count < MAGAZINE_SIZE / 2 && cache->depot)
+    {
+        void *obj = cache->depot;
+        cache->depot = *(void **)obj;
+        cache->depotCount--;
+        mag->objs[mag->count++] = obj;
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+    return 0;
+}
+
+void* slab_alloc(SLAB_CACHE *cache)
+{
+    int id = cache_index(cache);
+    SLAB_THREAD *t = get_thread();
+    if (id < 0 || t == NULL)
+        return malloc(cache->objSize < sizeof(void *) ? sizeof(void *) : cache->objSize);
+
+    SLAB_MAGAZINE *mag = &t->mags[id];
+    if (mag->count == 0)
+    {
+        if (refill(cache, mag) < 0)
+            return NULL;
+        count(&t->refills[id]);
+    }
+
+    count(&t->allocs[id]);
+    return mag->objs[--mag->count];
+}
+
+void slab_free(SLAB_CACHE *cache, void *obj)
+{
+    if (obj == NULL)
+        return;
+
+    int id = cache_index(cache);
+    SLAB_THREAD *t = get_thread();
+    if (id < 0)
+    {
+        free(obj);
+        return;
+    }
+    if (t == NULL)
+    {
+        // No magazine for this thread; give the object straight to the depot
+        pthread_mutex_lock(&cache->lock);
+        depot_push(cache, &obj, 1);
+        pthread_mutex_unlock(&cache->lock);
+        return;
+    }
+
+    SLAB_MAGAZINE *mag = &t->mags[id];
+    if (mag->count == MAGAZINE_SIZE)
+    {
+        // Spill the older half so the next frees and allocs stay local
+        pthread_mutex_lock(&cache->lock);
+        depot_push(cache, mag->objs, MAGAZINE_SIZE / 2);
+        pthread_mutex_unlock(&cache->lock);
+
+        memmove(mag->objs, mag->objs + MAGAZINE_SIZE / 2, (MAGAZINE_SIZE / 2) * sizeof(void *));
+        mag->count -= MAGAZINE_SIZE / 2;
+        count(&t->spills[id]);
+    }
+
+    count(&t->frees[id]);
+    mag->objs[mag->count++] = obj;
+}
+
+#else // PUBSUB_USE_MALLOC
+
+void* slab_alloc(SLAB_CACHE *cache)
+{
+    int id = cache_index(cache);
+    SLAB_THREAD *t = get_thread();
+    if (id >= 0 && t != NULL)
+        count(&t->allocs[id]);
+    return malloc(cache->objSize);
+}
+
+void slab_free(SLAB_CACHE *cache, void *obj)
+{
+    if (obj == NULL)
+        return;
+
+    int id = cache_index(cache);
+    SLAB_THREAD *t = get_thread();
+    if (id >= 0 && t != NULL)
+        count(&t->frees[id]);
+    free(obj);
+}
+
+#endif // PUBSUB_USE_MALLOC
+
+static SLAB_CACHE* str_cache(size_t size)
+{
+    for (size_t i = 0; i < STR_CLASSES; i++)
+        if (size <= strCaches[i].objSize)
+            return &strCaches[i];
+    return NULL;
+}
+
+char* slab_strdup(const char *s)
+{
+    size_t size = strlen(s) + 1;
+    SLAB_CACHE *cache = str_cache(size);
+
+    char *copy = cache ? slab_alloc(cache) : malloc(size);
+    if (copy)
+        memcpy(copy, s, size);
+    return copy;
+}
+
+// The size class is found again from the length, so the string must not
+// have been shortened since slab_strdup()
+void slab_strfree(char *s)
+{
+    if (s == NULL)
+        return;
+
+    SLAB_CACHE *cache = str_cache(strlen(s) + 1);
+    if (cache)
+        slab_free(cache, s);
+    else
+        free(s);
+}
+
+size_t slab_stats(SLAB_STATS *stats, size_t max)
+{
+    size_t n = (size_t)atomic_load(&cacheCount);
+    if (n > max)
+        n = max;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        SLAB_CACHE *cache = caches[i];
+        SLAB_STATS *st = &stats[i];
+        memset(st, 0, sizeof(*st));
+
+        st->name = cache->name;
+        st->objSize = cache->objSize;
+        for (SLAB_THREAD *rec = atomic_load(&threadList); rec != NULL; rec = rec->next)
+        {
+            st->allocs += atomic_load_explicit(&rec->allocs[i], memory_order_relaxed);
+            st->frees += atomic_load_explicit(&rec->frees[i], memory_order_relaxed);
+            st->refills += atomic_load_explicit(&rec->refills[i], memory_order_relaxed);
+            st->spills += atomic_load_explicit(&rec->spills[i], memory_order_relaxed);
+        }
+
+        pthread_mutex_lock(&cache->lock);
+        st->slabs = cache->slabs;
+        st->depotCount = cache->depotCount;
+        pthread_mutex_unlock(&cache->lock);
+    }
+
+    return n;
+}
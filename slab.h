@@ -0,0 +1,57 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+// Fixed-size object caches for the nodes the server allocates on every
+// connect and subscribe (clients, topics, subscribers, queue items).
+//
+// Every thread keeps a small magazine of free objects per cache, so most
+// allocations and frees touch no shared state. Magazines are refilled from
+// and spilled to a per-cache depot under a mutex; the depot grows a slab
+// (one malloc carved into many objects) at a time. Memory is kept for reuse
+// and only released at exit.
+//
+// Building with -DPUBSUB_USE_MALLOC turns every cache into plain
+// malloc()/free() while keeping the counters, for comparison.
+
+#define SLAB_MAX_CACHES     16
+
+typedef struct slabCache_st {
+    const char *name;
+    size_t objSize;
+    atomic_int id;              // 0 until first use, then index + 1
+
+    pthread_mutex_t lock;       // guards the depot
+    void *depot;                // free objects, linked through their first word
+    size_t depotCount;
+    size_t slabs;               // chunks taken from malloc
+} SLAB_CACHE;
+
+#define SLAB_CACHE_INIT(cacheName, size) \
+    { .name = (cacheName), .objSize = (size), .lock = PTHREAD_MUTEX_INITIALIZER }
+
+typedef struct slabStats_st {
+    const char *name;
+    size_t objSize;
+    unsigned long long allocs;
+    unsigned long long frees;
+    unsigned long long refills;     // magazine refills from the depot
+    unsigned long long spills;      // magazine spills to the depot
+    size_t slabs;
+    size_t depotCount;
+} SLAB_STATS;
+
+void* slab_alloc(SLAB_CACHE *cache);
+void slab_free(SLAB_CACHE *cache, void *obj);
+
+// Topic names: small strings come from size-class caches, long ones from malloc
+char* slab_strdup(const char *s);
+void slab_strfree(char *s);
+
+// Fill stats for every cache used so far; returns the number filled
+size_t slab_stats(SLAB_STATS *stats, size_t max);
+
+#endif // SLAB_H
@@ -0,0 +1,209 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "stats.h"
+
+#define STATS_SUB   (1 << STATS_SUB_BITS)
+
+// Per-thread record. Only the owning thread writes it, with relaxed
+// stores, so recording is a plain add on a cache line nobody else writes.
+typedef struct statsThread_st {
+    atomic_ullong counters[STAT_COUNT];
+    atomic_ullong latency[STATS_BUCKETS];
+    atomic_ullong samples;
+    atomic_ullong latencyMax;
+    atomic_ullong latencySum;
+    atomic_int inUse;
+    struct statsThread_st *next;
+} STATS_THREAD;
+
+static const char *counterNames[STAT_COUNT] = {
+    [STAT_PUBLISHED]        = "published",
+    [STAT_PUBLISHED_BYTES]  = "published_bytes",
+    [STAT_DELIVERIES]       = "deliveries",
+    [STAT_DELIVERY_BYTES]   = "delivery_bytes",
+    [STAT_FILTERED]         = "filtered",
+    [STAT_DROPPED]          = "dropped",
+    [STAT_EVICTED]          = "evicted",
+    [STAT_BLOCKED]          = "blocked",
+    [STAT_BLOCKED_NS]       = "blocked_ns",
+    [STAT_OVERFLOW_DISCONNECTS] = "overflow_disconnects",
+    [STAT_CONFLATED]        = "conflated",
+    [STAT_PARALLEL_FANOUTS] = "parallel_fanouts",
+    [STAT_FANOUT_STEALS]    = "fanout_steals",
+    [STAT_SENT_MSGS]        = "sent_messages",
+    [STAT_SENT_BYTES]       = "sent_bytes",
+    [STAT_SEND_ERRORS]      = "send_errors",
+    [STAT_CONNECTIONS]      = "connections",
+    [STAT_DISCONNECTS]      = "disconnects",
+    [STAT_HANDSHAKE_TIMEOUTS] = "handshake_timeouts",
+    [STAT_LOCK_WAITS]       = "lock_waits",
+    [STAT_LOCK_WAIT_NS]     = "lock_wait_ns",
+};
+
+static uint64_t startTime;
+static _Atomic(STATS_THREAD *) threadList = NULL;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_key;
+static __thread STATS_THREAD *self = NULL;
+
+uint64_t stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+void stats_init(void)
+{
+    startTime = stats_now();
+}
+
+static void release_thread(void *arg)
+{
+    STATS_THREAD *rec = (STATS_THREAD *)arg;
+    atomic_store(&rec->inUse, 0);
+}
+
+static void make_key(void)
+{
+    pthread_key_create(&thread_key, release_thread);
+}
+
+static STATS_THREAD* get_thread(void)
+{
+    if (self)
+        return self;
+
+    pthread_once(&key_once, make_key);
+
+    for (STATS_THREAD *rec = atomic_load(&threadList); rec != NULL; rec = rec->next)
+    {
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&rec->inUse, &expected, 1))
+        {
+            self = rec;
+            break;
+        }
+    }
+
+    if (!self)
+    {
+        STATS_THREAD *rec = calloc(1, sizeof(STATS_THREAD));
+        if (rec == NULL)
+        {
+            perror("calloc stats thread");
+            return NULL;
+        }
+        atomic_init(&rec->inUse, 1);
+
+        STATS_THREAD *head = atomic_load(&threadList);
+        do
+            rec->next = head;
+        while (!atomic_compare_exchange_weak(&threadList, &head, rec));
+
+        self = rec;
+    }
+
+    pthread_setspecific(thread_key, self);
+    return self;
+}
+
+static void add(atomic_ullong *counter, unsigned long long value)
+{
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+void stats_add(stat_counter_t counter, unsigned long long value)
+{
+    STATS_THREAD *t = get_thread();
+    if (t)
+        add(&t->counters[counter], value);
+}
+
+static size_t bucket_index(uint64_t v)
+{
+    if (v < STATS_SUB)
+        return (size_t)v;
+
+    int shift = 63 - __builtin_clzll(v) - STATS_SUB_BITS;
+    return ((size_t)(shift + 1) << STATS_SUB_BITS) + (size_t)((v >> shift) & (STATS_SUB - 1));
+}
+
+uint64_t stats_bucket_value(size_t i)
+{
+    if (i < STATS_SUB)
+        return i;
+
+    int shift = (int)(i >> STATS_SUB_BITS) - 1;
+    uint64_t low = i & (STATS_SUB - 1);
+    return ((STATS_SUB + low + 1) << shift) - 1;
+}
+
+void stats_latency(uint64_t ns)
+{
+    STATS_THREAD *t = get_thread();
+    if (t == NULL)
+        return;
+
+    add(&t->latency[bucket_index(ns)], 1);
+    add(&t->samples, 1);
+    add(&t->latencySum, ns);
+    if (ns > atomic_load_explicit(&t->latencyMax, memory_order_relaxed))
+        atomic_store_explicit(&t->latencyMax, ns, memory_order_relaxed);
+}
+
+void stats_collect(STATS_SNAPSHOT *snap)
+{
+    memset(snap, 0, sizeof(*snap));
+    snap->uptime = (double)(stats_now() - startTime) / 1e9;
+
+    for (STATS_THREAD *rec = atomic_load(&threadList); rec != NULL; rec = rec->next)
+    {
+        for (int i = 0; i < STAT_COUNT; i++)
+            snap->counters[i] += atomic_load_explicit(&rec->counters[i], memory_order_relaxed);
+        for (size_t i = 0; i < STATS_BUCKETS; i++)
+            snap->latency[i] += atomic_load_explicit(&rec->latency[i], memory_order_relaxed);
+
+        snap->samples += atomic_load_explicit(&rec->samples, memory_order_relaxed);
+        snap->latencySum += atomic_load_explicit(&rec->latencySum, memory_order_relaxed);
+        unsigned long long max = atomic_load_explicit(&rec->latencyMax, memory_order_relaxed);
+        if (max > snap->latencyMax)
+            snap->latencyMax = max;
+    }
+}
+
+uint64_t stats_percentile(const STATS_SNAPSHOT *snap, double p)
+{
+    // Buckets and the sample count are read separately, so use the sum of
+    // the buckets actually seen
+    unsigned long long total = 0;
+    for (size_t i = 0; i < STATS_BUCKETS; i++)
+        total += snap->latency[i];
+    if (total == 0)
+        return 0;
+
+    unsigned long long rank = (unsigned long long)(p / 100.0 * (double)total + 0.5);
+    if (rank < 1)
+        rank = 1;
+
+    unsigned long long seen = 0;
+    for (size_t i = 0; i < STATS_BUCKETS; i++)
+    {
+        seen += snap->latency[i];
+        if (seen >= rank)
+        {
+            uint64_t v = stats_bucket_value(i);
+            return v < snap->latencyMax ? v : snap->latencyMax;
+        }
+    }
+    return snap->latencyMax;
+}
+
+const char* stats_name(stat_counter_t counter)
+{
+    return counterNames[counter];
+}
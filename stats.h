@@ -0,0 +1,70 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Server metrics: counters and a fan-out latency histogram.
+//
+// Every thread records into its own record without locks or shared cache
+// lines; readers sum all records on demand (/stats, the admin socket).
+// Records of exited threads are reused, so totals are never lost.
+//
+// The latency histogram is log-linear (HDR style): 32 linear sub-buckets
+// per power of two, so every bucket is within about 3% of its values.
+
+typedef enum
+{
+    STAT_PUBLISHED,         // messages received from publishers
+    STAT_PUBLISHED_BYTES,   // their payload bytes
+    STAT_DELIVERIES,        // messages queued for subscribers
+    STAT_DELIVERY_BYTES,
+    STAT_FILTERED,          // deliveries skipped by a subscription's content filter
+    STAT_DROPPED,           // new messages dropped on a full subscriber queue
+    STAT_EVICTED,           // queued messages dropped for newer ones
+    STAT_BLOCKED,           // publishes that waited for a full queue
+    STAT_BLOCKED_NS,        // time spent waiting
+    STAT_OVERFLOW_DISCONNECTS,  // subscribers closed for a full queue
+    STAT_CONFLATED,         // queued messages replaced by a newer one of their topic
+    STAT_PARALLEL_FANOUTS,  // publishes fanned out by the worker pool
+    STAT_FANOUT_STEALS,     // fan-out tasks a worker took from another
+    STAT_SENT_MSGS,         // messages completely written to sockets
+    STAT_SENT_BYTES,
+    STAT_SEND_ERRORS,       // failed socket writes
+    STAT_CONNECTIONS,       // accepted connections
+    STAT_DISCONNECTS,
+    STAT_HANDSHAKE_TIMEOUTS,    // connections closed before sending their role in time
+    STAT_LOCK_WAITS,        // registry shard locks that had to wait
+    STAT_LOCK_WAIT_NS,      // time spent waiting for them
+    STAT_COUNT
+} stat_counter_t;
+
+#define STATS_SUB_BITS      5
+#define STATS_BUCKETS       (64 << STATS_SUB_BITS)
+
+typedef struct statsSnapshot_st {
+    unsigned long long counters[STAT_COUNT];
+    unsigned long long latency[STATS_BUCKETS];     // fan-out latency, ns
+    unsigned long long samples;
+    unsigned long long latencyMax;
+    unsigned long long latencySum;
+    double uptime;                                  // seconds
+} STATS_SNAPSHOT;
+
+void stats_init(void);
+uint64_t stats_now(void);
+
+void stats_add(stat_counter_t counter, unsigned long long value);
+
+// One fan-out latency sample: publish received to last subscriber write
+void stats_latency(uint64_t ns);
+
+// Sum every thread's records
+void stats_collect(STATS_SNAPSHOT *snap);
+uint64_t stats_percentile(const STATS_SNAPSHOT *snap, double p);
+const char* stats_name(stat_counter_t counter);
+
+// Upper bound of latency bucket i, in ns
+uint64_t stats_bucket_value(size_t i);
+
+#endif // STATS_H
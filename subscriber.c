@@ -6,6 +6,9 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <errno.h>
+#include "frame.h"
+#include "shm.h"
 
 #define DEFAULT_BUFLEN 512
 
@@ -14,13 +17,27 @@
 #define CMD_SUBSCRIBE   "/subscribe "
 #define CMD_UNSUBSCRIBE "/unsubscribe "
 #define CMD_LIST_TOPICS "/topics"
+#define CMD_LIST_QUEUES "/queues"
+#define CMD_MEMORY      "/memory"
+#define CMD_SHARDS      "/shards"
+#define CMD_STATS       "/stats"
+#define CMD_DEBUG       "/debug"
+#define CMD_POLICY      "/policy"
+#define CMD_CONFLATE    "/conflate "
 
 typedef enum {
     CMD_INVALID,
     CMD_EXIT_TYPE,
     CMD_SUBSCRIBE_TYPE,
     CMD_UNSUBSCRIBE_TYPE,
-    CMD_LIST_TOPICS_TYPE
+    CMD_LIST_TOPICS_TYPE,
+    CMD_LIST_QUEUES_TYPE,
+    CMD_MEMORY_TYPE,
+    CMD_SHARDS_TYPE,
+    CMD_STATS_TYPE,
+    CMD_DEBUG_TYPE,
+    CMD_POLICY_TYPE,
+    CMD_CONFLATE_TYPE
 
 } command_type_t;
 
@@ -52,9 +69,88 @@ command_type_t parse_command(const char *msg)
         return CMD_LIST_TOPICS_TYPE;
     }
 
+    if (strncmp(msg, CMD_LIST_QUEUES, strlen(CMD_LIST_QUEUES)) == 0)
+    {
+        // Same rule as for '/topics'
+        const char *rest = msg + strlen(CMD_LIST_QUEUES);
+        while (*rest != '\0')
+        {
+            if (*rest != ' ' && *rest != '\t' && *rest != '\n')
+                return CMD_INVALID; 
+            rest++;
+        }
+        return CMD_LIST_QUEUES_TYPE;
+    }
+
+    if (strncmp(msg, CMD_MEMORY, strlen(CMD_MEMORY)) == 0)
+    {
+        // Same rule as for '/topics'
+        const char *rest = msg + strlen(CMD_MEMORY);
+        while (*rest != '\0')
+        {
+            if (*rest != ' ' && *rest != '\t' && *rest != '\n')
+                return CMD_INVALID; 
+            rest++;
+        }
+        return CMD_MEMORY_TYPE;
+    }
+
+    if (strncmp(msg, CMD_SHARDS, strlen(CMD_SHARDS)) == 0)
+    {
+        // Same rule as for '/topics'
+        const char *rest = msg + strlen(CMD_SHARDS);
+        while (*rest != '\0')
+        {
+            if (*rest != ' ' && *rest != '\t' && *rest != '\n')
+                return CMD_INVALID; 
+            rest++;
+        }
+        return CMD_SHARDS_TYPE;
+    }
+
+    if (strncmp(msg, CMD_STATS, strlen(CMD_STATS)) == 0)
+    {
+        // Same rule as for '/topics'
+        const char *rest = msg + strlen(CMD_STATS);
+        while (*rest != '\0')
+        {
+            if (*rest != ' ' && *rest != '\t' && *rest != '\n')
+                return CMD_INVALID; 
+            rest++;
+        }
+        return CMD_STATS_TYPE;
+    }
+
+    if (strncmp(msg, CMD_DEBUG, strlen(CMD_DEBUG)) == 0)
+    {
+        // Same rule as for '/topics'
+        const char *rest = msg + strlen(CMD_DEBUG);
+        while (*rest != '\0')
+        {
+            if (*rest != ' ' && *rest != '\t' && *rest != '\n')
+                return CMD_INVALID; 
+            rest++;
+        }
+        return CMD_DEBUG_TYPE;
+    }
+
+    // '/policy' alone or followed by a policy name and optional topics
+    if (strncmp(msg, CMD_POLICY, strlen(CMD_POLICY)) == 0 &&
+        (msg[strlen(CMD_POLICY)] == '\0' || msg[strlen(CMD_POLICY)] == ' ' || msg[strlen(CMD_POLICY)] == '\n'))
+        return CMD_POLICY_TYPE;
+
+    if (strncmp(msg, CMD_CONFLATE, strlen(CMD_CONFLATE)) == 0 &&
+        strlen(msg) > strlen(CMD_CONFLATE))
+        return CMD_CONFLATE_TYPE;
+
     return CMD_INVALID;
 }
 
+bool binary = false;
+
+// Rings shared with the server when connected with --shm, else NULL
+SHM_CONN *shm = NULL;
+
 bool exit_flag = false;
 pthread_mutex_t exit_mutex = PTHREAD_MUTEX_INITIALIZER;
 
@@ -74,19 +170,126 @@ bool should_exit(void)
     return val;
 }
 
+// Topic names by ID, as the server announced them (receive thread only).
+// Commands ask for IDs, so messages name their topic by ID.
+char **topic_names = NULL;
+size_t topic_names_size = 0;
+
+void remember_topic(uint32_t id, const char *name, size_t len)
+{
+    if (id >= topic_names_size)
+    {
+        size_t size = topic_names_size ? topic_names_size : 64;
+        while (size <= id)
+            size *= 2;
+        char **names = realloc(topic_names, size * sizeof(char *));
+        if (names == NULL)
+        {
+            perror("realloc topic names");
+            return;
+        }
+        memset(names + topic_names_size, 0, (size - topic_names_size) * sizeof(char *));
+        topic_names = names;
+        topic_names_size = size;
+    }
+
+    free(topic_names[id]);
+    topic_names[id] = strndup(name, len);
+}
+
+// Print every complete frame in data.
+// Returns the bytes printed, -1 if the server sent something that is not a frame.
+ssize_t print_frames(const char *data, size_t len)
+{
+    size_t off = 0;
+    FRAME frame;
+    ssize_t n;
+
+    while ((n = frame_parse(data + off, len - off, &frame)) > 0)
+    {
+        off += (size_t)n;
+        if (frame.type == FRAME_TOPIC_ID)
+        {
+            remember_topic(frame.topicId, frame.topic, frame.topicLen);
+            continue;
+        }
+
+        if (frame.type == FRAME_MESSAGE && (frame.flags & FRAME_FLAG_TOPIC_ID))
+        {
+            const char *name = frame.topicId < topic_names_size ? topic_names[frame.topicId] : NULL;
+            frame.topic = name ? name : "?";
+            frame.topicLen = strlen(frame.topic);
+        }
+
+        if (frame.type == FRAME_MESSAGE && frame.seq)
+            printf("#%llu [%.*s] \"%.*s\"\n", (unsigned long long)frame.seq, (int)frame.topicLen, frame.topic, (int)frame.payloadLen, frame.payload);
+        else if (frame.type == FRAME_MESSAGE)
+            printf("[%.*s] \"%.*s\"\n", (int)frame.topicLen, frame.topic, (int)frame.payloadLen, frame.payload);
+        else
+            fwrite(frame.payload, 1, frame.payloadLen, stdout);
+    }
+    fflush(stdout);
+
+    return n < 0 ? -1 : (ssize_t)off;
+}
+
+// Receive over shared memory: frames are printed straight from the ring
+// and only then handed back to the server. have is the part of a frame
+// that is already there; wait for more than that.
+int recv_shm(int sock)
+{
+    size_t have = 0;
+
+    while (!should_exit() && shm_wait_readable(&shm->down, have, sock) == 0)
+    {
+        const char *data;
+        ssize_t len = shm_readable(&shm->down, &data);
+        ssize_t n = len < 0 ? -1 : print_frames(data, (size_t)len);
+        if (n < 0)
+        {
+            fprintf(stderr, "invalid data from server\n");
+            errno = EPROTO;
+            return -1;
+        }
+
+        shm_consume(&shm->down, (size_t)n);
+        have = (size_t)(len - n);
+    }
+    return 0;
+}
+
 void *recv_thread(void *arg)
 {
     int client_socket_fd = *(int *)arg;  // get socket from argument
     char buffer[DEFAULT_BUFLEN];
     int read_size;
+    INBUF in;
 
-    while (!should_exit() && ((read_size = recv(client_socket_fd, buffer, DEFAULT_BUFLEN - 1, 0)) > 0))
+    inbuf_init(&in);
+    if (shm)
+        read_size = recv_shm(client_socket_fd);
+    while (!shm && !should_exit() && ((read_size = recv(client_socket_fd, buffer, DEFAULT_BUFLEN - 1, 0)) > 0))
     {
+        if (binary)
+        {
+            ssize_t n;
+            if (inbuf_append(&in, buffer, read_size) < 0 || (n = print_frames(in.data, in.len)) < 0)
+            {
+                fprintf(stderr, "invalid data from server\n");
+                errno = EPROTO;
+                read_size = -1;
+                break;
+            }
+            inbuf_consume(&in, (size_t)n);
+            continue;
+        }
+
         buffer[read_size] = '\0';
         fputs(buffer, stdout);
         fflush(stdout);
         memset(buffer, 0, DEFAULT_BUFLEN);
     }
+    inbuf_free(&in);
 
     if(read_size == 0) 
     {
@@ -110,6 +313,16 @@ void *recv_thread(void *arg)
     return NULL;
 }
 
+// Commands go out as text, or wrapped in a COMMAND frame
+ssize_t send_command(int sock, const char *message)
+{
+    if (shm)
+        return shm_send_frame(&shm->up, sock, FRAME_COMMAND, FRAME_FLAG_WANT_ID, NULL, 0, message, strlen(message));
+    if (binary)
+        return frame_send(sock, FRAME_COMMAND, FRAME_FLAG_WANT_ID, NULL, 0, message, strlen(message));
+    return send(sock, message, strlen(message), 0);
+}
+
 void *send_thread(void *arg)
 {
     int client_socket_fd = *(int *)arg;  // get socket from argument
@@ -151,20 +364,55 @@ void *send_thread(void *arg)
                     break;
 
                 case CMD_SUBSCRIBE_TYPE:
-                    if (send(client_socket_fd, message, strlen(message), 0) < 0) 
+                    if (send_command(client_socket_fd, message) < 0) 
                         perror("subscription failed");
                     break;
                 
                 case CMD_UNSUBSCRIBE_TYPE:
-                    if (send(client_socket_fd, message, strlen(message), 0) < 0) 
+                    if (send_command(client_socket_fd, message) < 0) 
                         perror("unsubscription failed");
                     break;
                 
                 case CMD_LIST_TOPICS_TYPE:
-                    if (send(client_socket_fd, message, strlen(message), 0) < 0)
+                    if (send_command(client_socket_fd, message) < 0)
                         perror("topic list request failed");
                     break;
 
+                case CMD_LIST_QUEUES_TYPE:
+                    if (send_command(client_socket_fd, message) < 0)
+                        perror("queue list request failed");
+                    break;
+
+                case CMD_MEMORY_TYPE:
+                    if (send_command(client_socket_fd, message) < 0)
+                        perror("memory report request failed");
+                    break;
+
+                case CMD_SHARDS_TYPE:
+                    if (send_command(client_socket_fd, message) < 0)
+                        perror("shard report request failed");
+                    break;
+
+                case CMD_STATS_TYPE:
+                    if (send_command(client_socket_fd, message) < 0)
+                        perror("stats request failed");
+                    break;
+
+                case CMD_DEBUG_TYPE:
+                    if (send_command(client_socket_fd, message) < 0)
+                        perror("registry dump request failed");
+                    break;
+
+                case CMD_POLICY_TYPE:
+                    if (send_command(client_socket_fd, message) < 0)
+                        perror("policy request failed");
+                    break;
+
+                case CMD_CONFLATE_TYPE:
+                    if (send_command(client_socket_fd, message) < 0)
+                        perror("conflate request failed");
+                    break;
+
                 case CMD_INVALID:
                 default:
                     printf("ERROR: Invalid command.\n");
@@ -173,6 +421,13 @@ void *send_thread(void *arg)
                     printf("  %s\"topic1\" \"topic2\" ...\n", CMD_SUBSCRIBE);
                     printf("  %s\"topic1\" \"topic2\" ...\n", CMD_UNSUBSCRIBE);
                     printf("  %s\n", CMD_LIST_TOPICS);
+                    printf("  %s\n", CMD_LIST_QUEUES);
+                    printf("  %s\n", CMD_MEMORY);
+                    printf("  %s\n", CMD_SHARDS);
+                    printf("  %s\n", CMD_STATS);
+                    printf("  %s\n", CMD_DEBUG);
+                    printf("  %s [POLICY [\"topic1\" ...]]\n", CMD_POLICY);
+                    printf("  %s[--off] \"topic1\" ...\n", CMD_CONFLATE);
                     break;
             }
         }
@@ -183,61 +438,121 @@ void *send_thread(void *arg)
 
 int main(int argc, char *argv[])
 {
-    if (argc != 3)  // Expect IP and port
+    // --text keeps the original line based protocol
+    bool text_protocol = false;
+    if (argc == 4 && strcmp(argv[1], "--text") == 0)
     {
-        fprintf(stderr, "Correct usage: %s <server_ip> <server_port>\n", argv[0]);
-        return EXIT_FAILURE;
+        text_protocol = true;
+        argv++;
+        argc--;
     }
 
-    const char *server_ip = argv[1];
-    int server_port = atoi(argv[2]);  // Convert string to int
+    // --shm connects to the server's --local socket and receives through
+    // shared memory
+    const char *shm_path = NULL;
+    if (argc == 3 && !text_protocol && strcmp(argv[1], "--shm") == 0)
+        shm_path = argv[2];
 
-    if (server_port <= 0 || server_port > 65535) 
+    if (argc != 3)  // Expect IP and port
     {
-        fprintf(stderr, "Invalid port number.\n");
+        fprintf(stderr, "Correct usage: %s [--text] <server_ip> <server_port>\n", argv[0]);
+        fprintf(stderr, "               %s --shm <socket_path>\n", argv[0]);
         return EXIT_FAILURE;
     }
 
     int client_socket_fd;
 
-    // Socket creation
-    client_socket_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (client_socket_fd < 0)
+    if (shm_path)
     {
-        perror("socket creation failed");
-        return EXIT_FAILURE;
+        client_socket_fd = shm_connect(shm_path);
+        if (client_socket_fd < 0)
+            return EXIT_FAILURE;
+        printf("Connected to server [%s]\n", shm_path);
     }
+    else
+    {
+        const char *server_ip = argv[1];
+        int server_port = atoi(argv[2]);  // Convert string to int
 
-    struct sockaddr_in server_address;
+        if (server_port <= 0 || server_port > 65535) 
+        {
+            fprintf(stderr, "Invalid port number.\n");
+            return EXIT_FAILURE;
+        }
 
-    // Set up the server address structure
-    server_address.sin_family = AF_INET;
-    server_address.sin_port = htons(server_port);
-    server_address.sin_addr.s_addr = inet_addr(server_ip);
+        // Socket creation
+        client_socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (client_socket_fd < 0)
+        {
+            perror("socket creation failed");
+            return EXIT_FAILURE;
+        }
 
-    // Connect to server
-    if (connect(client_socket_fd, (struct sockaddr *)&server_address, sizeof(server_address)) < 0)
-    {
-        perror("failed to connect");
-        if(client_socket_fd != -1)
-            close(client_socket_fd);
-        return EXIT_FAILURE;
+        struct sockaddr_in server_address;
+
+        // Set up the server address structure
+        server_address.sin_family = AF_INET;
+        server_address.sin_port = htons(server_port);
+        server_address.sin_addr.s_addr = inet_addr(server_ip);
+
+        // Connect to server
+        if (connect(client_socket_fd, (struct sockaddr *)&server_address, sizeof(server_address)) < 0)
+        {
+            perror("failed to connect");
+            if(client_socket_fd != -1)
+                close(client_socket_fd);
+            return EXIT_FAILURE;
+        }
+        printf("Connected to server [%s:%d]\n", server_ip, server_port);
     }
-    printf("Connected to server [%s:%d]\n", server_ip, server_port);
     printf("Commands:\n");
     printf("  %s - disconnect from server and unsubscribe from all topics\n", CMD_EXIT);
-    printf("  %s\"topic1\" \"topic2\" ... - subscribe to topics\n", CMD_SUBSCRIBE);
+    printf("  %s\"topic1\" \"topic2\" ... - subscribe to topics (\"a/+/c\" and \"a/#\" are wildcards)\n", CMD_SUBSCRIBE);
+    printf("  %s--replay \"topic1\" ... - subscribe and first receive the messages the server kept\n", CMD_SUBSCRIBE);
+    printf("  %s--from SEQ \"topic1\" ... - subscribe and first receive the logged messages from #SEQ on\n", CMD_SUBSCRIBE);
+    printf("  %s--filter prefix:TEXT|contains:TEXT|KEY=VALUE \"topic1\" ... - only receive messages whose payload matches\n", CMD_SUBSCRIBE);
     printf("  %s\"topic1\" \"topic2\" ... - unsubscribe from topics\n", CMD_UNSUBSCRIBE);
-    printf("  %s - list all current topics\n\n", CMD_LIST_TOPICS);
+    printf("  %s - list all current topics\n", CMD_LIST_TOPICS);
+    printf("  %s - show outbound queue depth of every subscriber\n", CMD_LIST_QUEUES);
+    printf("  %s - show server node allocation counters\n", CMD_MEMORY);
+    printf("  %s - show topic registry shard lock counters\n", CMD_SHARDS);
+    printf("  %s - show server message counters, fan-out latency and busiest topics\n", CMD_STATS);
+    printf("  %s - dump every topic with its subscriber sockets\n", CMD_DEBUG);
+    printf("  %s [POLICY [\"topic1\" ...]] - show or set what happens to messages for a full queue\n", CMD_POLICY);
+    printf("  %s[--off] \"topic1\" ... - only deliver the latest unsent message of these topics\n\n", CMD_CONFLATE);
 
     // Send a message to the server to indicate whether this client is a publisher or subscriber
-    const char *role_msg = "SUBSCRIBER";
-    if (send(client_socket_fd, role_msg, strlen(role_msg), 0) < 0) 
+    if (shm_path)
     {
-        perror("failed to send client role to server");
-        if(client_socket_fd != -1)
+        if (shm_handshake(client_socket_fd, "SUBSCRIBER", &shm) < 0)
+        {
+            fprintf(stderr, "handshake with server failed\n");
             close(client_socket_fd);
-        return EXIT_FAILURE;
+            return EXIT_FAILURE;
+        }
+        binary = true;
+    }
+    else if (text_protocol)
+    {
+        const char *role_msg = "SUBSCRIBER";
+        if (send(client_socket_fd, role_msg, strlen(role_msg), 0) < 0) 
+        {
+            perror("failed to send client role to server");
+            if(client_socket_fd != -1)
+                close(client_socket_fd);
+            return EXIT_FAILURE;
+        }
+    }
+    else
+    {
+        int res = frame_handshake(client_socket_fd, "SUBSCRIBER");
+        if (res < 0)
+        {
+            fprintf(stderr, "handshake with server failed\n");
+            close(client_socket_fd);
+            return EXIT_FAILURE;
+        }
+        binary = res == 1;
     }
 
     // Two separate threads are created to enable full-duplex TCP communication.
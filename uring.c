@@ -0,0 +1,311 @@
+#ifndef PUBSUB_NO_URING
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+// The rings are shared with the kernel as plain integers; the loads and
+// stores that publish or consume entries need acquire / release ordering.
+#define load_acquire(p)         __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_release(p, v)     __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+static int sys_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+static int sys_register(int fd, unsigned opcode, void *arg, unsigned nrArgs)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nrArgs);
+}
+
+int uring_init(URING *ring, unsigned entries)
+{
+    struct io_uring_params p;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&p, 0, sizeof(p));
+
+    // Multishot receives complete many times per SQE; a larger CQ keeps
+    // them from overflowing into the kernel's backlog
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 4;
+
+    ring->fd = sys_setup(entries, &p);
+    if (ring->fd < 0)
+        return -1;
+
+    ring->sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    // Since 5.4 both rings live in one mapping
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring->cqRingSize > ring->sqRingSize)
+            ring->sqRingSize = ring->cqRingSize;
+        ring->cqRingSize = ring->sqRingSize;
+    }
+
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sqRing == MAP_FAILED)
+        goto fail_fd;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        ring->cqRing = ring->sqRing;
+    else
+    {
+        ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cqRing == MAP_FAILED)
+            goto fail_sq;
+    }
+
+    ring->sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        goto fail_cq;
+
+    char *sq = ring->sqRing;
+    ring->sqHead = (unsigned *)(sq + p.sq_off.head);
+    ring->sqTail = (unsigned *)(sq + p.sq_off.tail);
+    ring->sqMask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    ring->sqArray = (unsigned *)(sq + p.sq_off.array);
+    ring->sqeTail = *ring->sqTail;
+
+    char *cq = ring->cqRing;
+    ring->cqHead = (unsigned *)(cq + p.cq_off.head);
+    ring->cqTail = (unsigned *)(cq + p.cq_off.tail);
+    ring->cqMask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    return 0;
+
+fail_cq:
+    if (ring->cqRing != ring->sqRing)
+        munmap(ring->cqRing, ring->cqRingSize);
+fail_sq:
+    munmap(ring->sqRing, ring->sqRingSize);
+fail_fd:
+    {
+        int err = errno;
+        close(ring->fd);
+        ring->fd = -1;
+        errno = err;
+    }
+    return -1;
+}
+
+void uring_free(URING *ring)
+{
+    if (ring->fd < 0)
+        return;
+
+    munmap(ring->sqes, ring->sqesSize);
+    if (ring->cqRing != ring->sqRing)
+        munmap(ring->cqRing, ring->cqRingSize);
+    munmap(ring->sqRing, ring->sqRingSize);
+    close(ring->fd);
+    ring->fd = -1;
+}
+
+struct io_uring_sqe* uring_get_sqe(URING *ring)
+{
+    unsigned head = load_acquire(ring->sqHead);
+    if (ring->sqeTail - head > ring->sqMask)
+        return NULL;
+
+    unsigned index = ring->sqeTail & ring->sqMask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sqArray[index] = index;
+    ring->sqeTail++;
+    ring->toSubmit++;
+    return sqe;
+}
+
+int uring_submit(URING *ring, unsigned wait)
+{
+    store_release(ring->sqTail, ring->sqeTail);
+
+    int n = sys_enter(ring->fd, ring->toSubmit, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+    if (n < 0)
+        return -errno;
+
+    ring->toSubmit -= (unsigned)n;
+    return n;
+}
+
+struct io_uring_cqe* uring_peek_cqe(URING *ring)
+{
+    unsigned head = *ring->cqHead;
+    if (head == load_acquire(ring->cqTail))
+        return NULL;
+    return &ring->cqes[head & ring->cqMask];
+}
+
+void uring_cqe_seen(URING *ring)
+{
+    store_release(ring->cqHead, *ring->cqHead + 1);
+}
+
+int uring_bufs_init(URING *ring, URING_BUFS *bufs, unsigned short bgid, unsigned entries, size_t bufSize)
+{
+    memset(bufs, 0, sizeof(*bufs));
+    bufs->bgid = bgid;
+    bufs->entries = entries;
+    bufs->bufSize = bufSize;
+
+    // The ring must be page aligned
+    bufs->brSize = entries * sizeof(struct io_uring_buf);
+    bufs->br = mmap(NULL, bufs->brSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (bufs->br == MAP_FAILED)
+    {
+        bufs->br = NULL;
+        return -1;
+    }
+
+    bufs->base = malloc(entries * bufSize);
+    if (bufs->base == NULL)
+    {
+        munmap(bufs->br, bufs->brSize);
+        bufs->br = NULL;
+        errno = ENOMEM;
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)bufs->br;
+    reg.ring_entries = entries;
+    reg.bgid = bgid;
+    if (sys_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        int err = errno;
+        free(bufs->base);
+        munmap(bufs->br, bufs->brSize);
+        bufs->br = NULL;
+        errno = err;
+        return -1;
+    }
+
+    for (unsigned i = 0; i < entries; i++)
+        uring_buf_recycle(bufs, (unsigned short)i);
+    return 0;
+}
+
+char* uring_buf(URING_BUFS *bufs, unsigned short bid)
+{
+    return bufs->base + (size_t)bid * bufs->bufSize;
+}
+
+// Hand a consumed buffer back to the kernel
+void uring_buf_recycle(URING_BUFS *bufs, unsigned short bid)
+{
+    unsigned short tail = bufs->br->tail;
+    struct io_uring_buf *buf = &bufs->br->bufs[tail & (bufs->entries - 1)];
+
+    buf->addr = (unsigned long)uring_buf(bufs, bid);
+    buf->len = (unsigned)bufs->bufSize;
+    buf->bid = bid;
+    store_release(&bufs->br->tail, (unsigned short)(tail + 1));
+}
+
+void uring_bufs_free(URING *ring, URING_BUFS *bufs)
+{
+    if (bufs->br == NULL)
+        return;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.bgid = bufs->bgid;
+    sys_register(ring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+
+    free(bufs->base);
+    munmap(bufs->br, bufs->brSize);
+    bufs->br = NULL;
+}
+
+int uring_probe(const char **why)
+{
+    URING ring;
+    if (uring_init(&ring, 8) < 0)
+    {
+        if (errno == ENOSYS)
+            *why = "io_uring_setup() not implemented";
+        else if (errno == EPERM)
+            *why = "io_uring disabled (kernel.io_uring_disabled)";
+        else
+            *why = "io_uring_setup() failed";
+        return -1;
+    }
+
+    URING_BUFS bufs;
+    if (uring_bufs_init(&ring, &bufs, 0, 2, 64) < 0)
+    {
+        *why = "no provided buffer rings (Linux 5.19 or later)";
+        uring_free(&ring);
+        return -1;
+    }
+
+    int res = -1;
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+    {
+        *why = "socketpair() failed";
+        goto out;
+    }
+
+    // A multishot receive of data that is already there must complete at
+    // once into a provided buffer and stay armed
+    if (write(sv[1], "x", 1) != 1)
+    {
+        *why = "socketpair write failed";
+        goto out_sockets;
+    }
+
+    struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = sv[0];
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+
+    struct io_uring_cqe *cqe = NULL;
+    if (uring_submit(&ring, 1) == 1)
+        cqe = uring_peek_cqe(&ring);
+
+    if (cqe && cqe->res == 1 && (cqe->flags & IORING_CQE_F_MORE) && (cqe->flags & IORING_CQE_F_BUFFER))
+    {
+        uring_cqe_seen(&ring);
+        res = 0;
+
+        // Closing the peer ends the receive before the buffers go away
+        close(sv[1]);
+        sv[1] = -1;
+        if (uring_submit(&ring, 1) >= 0 && uring_peek_cqe(&ring))
+            uring_cqe_seen(&ring);
+    }
+    else
+        *why = "no multishot receive (Linux 6.0 or later)";
+
+out_sockets:
+    close(sv[0]);
+    if (sv[1] >= 0)
+        close(sv[1]);
+out:
+    uring_bufs_free(&ring, &bufs);
+    uring_free(&ring);
+    return res;
+}
+
+#endif // PUBSUB_NO_URING
@@ -0,0 +1,74 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+// Minimal io_uring wrapper on the raw system calls, for the io_uring event
+// loop (--mode uring). Only what reactor.c needs: one ring per loop, SQEs
+// prepared by the loop thread only, completions reaped by the same thread,
+// and provided buffer rings for multishot receives.
+
+typedef struct uring_st {
+    int fd;
+
+    // Submission queue. sqeTail counts SQEs handed out by uring_get_sqe(),
+    // toSubmit those not passed to io_uring_enter() yet.
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned sqMask;
+    unsigned *sqArray;
+    struct io_uring_sqe *sqes;
+    unsigned sqeTail;
+    unsigned toSubmit;
+
+    // Completion queue
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned cqMask;
+    struct io_uring_cqe *cqes;
+
+    void *sqRing;
+    size_t sqRingSize;
+    void *cqRing;
+    size_t cqRingSize;
+    size_t sqesSize;
+} URING;
+
+// Provided buffers (IORING_REGISTER_PBUF_RING): the kernel picks a free
+// buffer for every receive completion and the loop hands it back once the
+// data is consumed.
+typedef struct uringBufs_st {
+    struct io_uring_buf_ring *br;
+    size_t brSize;
+    char *base;
+    size_t bufSize;
+    unsigned entries;
+    unsigned short bgid;
+} URING_BUFS;
+
+int uring_init(URING *ring, unsigned entries);
+void uring_free(URING *ring);
+
+// Next free SQE, zeroed, or NULL if the submission queue is full
+struct io_uring_sqe* uring_get_sqe(URING *ring);
+
+// Submit the prepared SQEs and wait for at least wait completions.
+// Returns the number submitted or -errno.
+int uring_submit(URING *ring, unsigned wait);
+
+// Oldest unseen completion, or NULL. uring_cqe_seen() releases it.
+struct io_uring_cqe* uring_peek_cqe(URING *ring);
+void uring_cqe_seen(URING *ring);
+
+int uring_bufs_init(URING *ring, URING_BUFS *bufs, unsigned short bgid, unsigned entries, size_t bufSize);
+char* uring_buf(URING_BUFS *bufs, unsigned short bid);
+void uring_buf_recycle(URING_BUFS *bufs, unsigned short bid);
+void uring_bufs_free(URING *ring, URING_BUFS *bufs);
+
+// Check that the kernel has everything the io_uring loop uses (multishot
+// receive into provided buffers). Returns 0 if so, otherwise -1 with why
+// set to a short description.
+int uring_probe(const char **why);
+
+#endif // URING_H
@@ -0,0 +1,694 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "wal.h"
+#include "log.h"
+
+typedef struct walSegment_st {
+    char *map;
+    size_t size;                // file size, all of it mapped
+    uint64_t firstSeq;
+    atomic_size_t written;      // bytes of complete records, header included
+    uint64_t lastTime;          // time of the newest record
+    size_t synced;              // sync thread only
+    char path[PATH_MAX];
+} WAL_SEGMENT;
+
+size_t wal_segment_bytes = DEFAULT_WAL_SEGMENT_BYTES;
+long long wal_retain_bytes = DEFAULT_WAL_RETAIN_BYTES;
+unsigned wal_retain_age = 0;
+unsigned wal_sync_ms = DEFAULT_WAL_SYNC_MS;
+
+static int enabled = 0;
+static int dir_fd = -1;
+static char wal_dir[PATH_MAX - 32];     // room for the segment names
+
+// Appends, the active segment and the sync thread's wake-up state
+static pthread_mutex_t wal_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wal_cond = PTHREAD_COND_INITIALIZER;
+static WAL_SEGMENT *active = NULL;
+static uint64_t nextSeq = 1;
+static int dirty = 0;
+static int waiting = 0;
+static int stopping = 0;
+
+// The segment list. Replays hold it shared while they read the mappings;
+// rolling to a new segment and deleting old ones take it exclusively.
+// Lock order: wal_mtx, then segs_lock.
+static pthread_rwlock_t segs_lock = PTHREAD_RWLOCK_INITIALIZER;
+static WAL_SEGMENT **segs = NULL;
+static size_t segCount = 0;
+static size_t segCap = 0;
+
+static pthread_t sync_thread;
+static atomic_ullong durableSeq = 0;
+static atomic_ullong syncs = 0;
+static atomic_ullong syncNs = 0;
+static atomic_ullong failed = 0;
+
+static uint32_t crcTable[256];
+static int crcHardware = 0;
+
+// CRC-32C (Castagnoli), which x86 computes in hardware with SSE4.2
+static void crc_init(void)
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = c & 1 ? 0x82F63B78U ^ (c >> 1) : c >> 1;
+        crcTable[i] = c;
+    }
+#if defined(__x86_64__)
+    crcHardware = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc_hardware(uint32_t crc, const unsigned char *p, size_t len)
+{
+    uint64_t c = crc;
+    for (; len >= 8; p += 8, len -= 8)
+    {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = __builtin_ia32_crc32di(c, v);
+    }
+    crc = (uint32_t)c;
+    while (len--)
+        crc = __builtin_ia32_crc32qi(crc, *p++);
+    return crc;
+}
+#endif
+
+static uint32_t crc_update(uint32_t crc, const void *data, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    crc = ~crc;
+#if defined(__x86_64__)
+    if (crcHardware)
+        return ~crc_hardware(crc, p, len);
+#endif
+    while (len--)
+        crc = crcTable[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+// The checksum covers the topic and the payload, then the header fields
+// after crc. The data part is summed before the append lock is taken.
+static uint32_t record_crc(uint32_t dataCrc, const WAL_RECORD *rec)
+{
+    return crc_update(dataCrc, &rec->seq, sizeof(WAL_RECORD) - offsetof(WAL_RECORD, seq));
+}
+
+static size_t record_size(size_t topicLen, size_t payloadLen)
+{
+    return (sizeof(WAL_RECORD) + topicLen + payloadLen + 7) & ~(size_t)7;
+}
+
+static uint64_t wall_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t mono_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void segment_free(WAL_SEGMENT *seg, int remove)
+{
+    munmap(seg->map, seg->size);
+    if (remove && unlink(seg->path) < 0)
+        perror("unlink log segment");
+    free(seg);
+}
+
+// Caller holds segs_lock exclusively
+static int segments_push(WAL_SEGMENT *seg)
+{
+    if (segCount == segCap)
+    {
+        size_t newCap = segCap ? segCap * 2 : 16;
+        WAL_SEGMENT **list = realloc(segs, newCap * sizeof(WAL_SEGMENT *));
+        if (list == NULL)
+        {
+            perror("realloc log segments");
+            return -1;
+        }
+        segs = list;
+        segCap = newCap;
+    }
+    segs[segCount++] = seg;
+    return 0;
+}
+
+static WAL_SEGMENT* segment_create(uint64_t firstSeq)
+{
+    WAL_SEGMENT *seg = calloc(1, sizeof(WAL_SEGMENT));
+    if (seg == NULL)
+    {
+        perror("calloc log segment");
+        return NULL;
+    }
+    snprintf(seg->path, sizeof(seg->path), "%s/%020llu.wal", wal_dir, (unsigned long long)firstSeq);
+
+    int fd = open(seg->path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        perror("open log segment");
+        free(seg);
+        return NULL;
+    }
+
+    // Allocate the blocks up front so syncing never has to; file systems
+    // without fallocate() get a sparse file
+    if (fallocate(fd, 0, 0, (off_t)wal_segment_bytes) < 0 && ftruncate(fd, (off_t)wal_segment_bytes) < 0)
+    {
+        perror("ftruncate log segment");
+        close(fd);
+        unlink(seg->path);
+        free(seg);
+        return NULL;
+    }
+
+    seg->map = mmap(NULL, wal_segment_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (seg->map == MAP_FAILED)
+    {
+        perror("mmap log segment");
+        unlink(seg->path);
+        free(seg);
+        return NULL;
+    }
+
+    seg->size = wal_segment_bytes;
+    seg->firstSeq = firstSeq;
+    seg->lastTime = wall_now();
+
+    WAL_SEGMENT_HEADER *hdr = (WAL_SEGMENT_HEADER *)seg->map;
+    memcpy(hdr->magic, WAL_MAGIC, sizeof(hdr->magic));
+    hdr->firstSeq = firstSeq;
+    hdr->created = seg->lastTime;
+    hdr->size = wal_segment_bytes;
+    atomic_init(&seg->written, sizeof(WAL_SEGMENT_HEADER));
+
+    return seg;
+}
+
+// Start a new segment. Caller holds wal_mtx.
+static WAL_SEGMENT* roll(void)
+{
+    WAL_SEGMENT *seg = segment_create(nextSeq);
+    if (seg == NULL)
+        return NULL;
+
+    pthread_rwlock_wrlock(&segs_lock);
+    if (segments_push(seg) < 0)
+    {
+        pthread_rwlock_unlock(&segs_lock);
+        segment_free(seg, 1);
+        return NULL;
+    }
+    active = seg;
+    pthread_rwlock_unlock(&segs_lock);
+
+    return seg;
+}
+
+// Map a segment left by an earlier run and find where its intact records
+// end. Returns NULL for files that hold no record.
+static WAL_SEGMENT* segment_recover(uint64_t firstSeq)
+{
+    WAL_SEGMENT *seg = calloc(1, sizeof(WAL_SEGMENT));
+    if (seg == NULL)
+    {
+        perror("calloc log segment");
+        return NULL;
+    }
+    snprintf(seg->path, sizeof(seg->path), "%s/%020llu.wal", wal_dir, (unsigned long long)firstSeq);
+
+    int fd = open(seg->path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || (size_t)st.st_size <= sizeof(WAL_SEGMENT_HEADER))
+    {
+        if (fd >= 0)
+            close(fd);
+        free(seg);
+        return NULL;
+    }
+
+    seg->size = (size_t)st.st_size;
+    seg->map = mmap(NULL, seg->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (seg->map == MAP_FAILED)
+    {
+        perror("mmap log segment");
+        free(seg);
+        return NULL;
+    }
+
+    const WAL_SEGMENT_HEADER *hdr = (const WAL_SEGMENT_HEADER *)seg->map;
+    if (memcmp(hdr->magic, WAL_MAGIC, sizeof(hdr->magic)) != 0 || hdr->firstSeq != firstSeq)
+    {
+        LOG(LOG_WARN, "[WAL] %s is not a log segment, ignored\n", seg->path);
+        munmap(seg->map, seg->size);
+        free(seg);
+        return NULL;
+    }
+
+    // A record cut short by a crash, or never written, ends the segment
+    size_t off = sizeof(WAL_SEGMENT_HEADER);
+    uint64_t seq = firstSeq;
+    while (off + sizeof(WAL_RECORD) <= seg->size)
+    {
+        const WAL_RECORD *rec = (const WAL_RECORD *)(seg->map + off);
+        if (rec->size < sizeof(WAL_RECORD) || rec->size > seg->size - off || rec->seq != seq ||
+            record_size(rec->topicLen, rec->payloadLen) != rec->size)
+            break;
+
+        const char *data = (const char *)(rec + 1);
+        if (record_crc(crc_update(0, data, rec->topicLen + rec->payloadLen), rec) != rec->crc)
+            break;
+
+        seg->lastTime = rec->time;
+        off += rec->size;
+        seq++;
+    }
+
+    if (seq == firstSeq)
+    {
+        munmap(seg->map, seg->size);
+        unlink(seg->path);
+        free(seg);
+        return NULL;
+    }
+
+    seg->firstSeq = firstSeq;
+    atomic_init(&seg->written, off);
+    seg->synced = off;
+    return seg;
+}
+
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+// Segment names are their zero-padded first sequence number, so sorting
+// the names sorts the log
+static int recover(void)
+{
+    DIR *d = opendir(wal_dir);
+    if (d == NULL)
+    {
+        perror("opendir log");
+        return -1;
+    }
+
+    char **names = NULL;
+    size_t count = 0, cap = 0;
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL)
+    {
+        size_t len = strlen(ent->d_name);
+        if (len != 24 || strcmp(ent->d_name + 20, ".wal") != 0 || strspn(ent->d_name, "0123456789") != 20)
+            continue;
+
+        if (count == cap)
+        {
+            cap = cap ? cap * 2 : 16;
+            char **list = realloc(names, cap * sizeof(char *));
+            if (list == NULL)
+            {
+                perror("realloc log names");
+                break;
+            }
+            names = list;
+        }
+        if ((names[count] = strdup(ent->d_name)) != NULL)
+            count++;
+    }
+    closedir(d);
+
+    if (count)
+        qsort(names, count, sizeof(char *), compare_names);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        uint64_t firstSeq = strtoull(names[i], NULL, 10);
+
+        // Its sequence numbers were given to the records of the segments
+        // before it, so it is left from a segment that ended early. It
+        // would never be retired with the others.
+        if (firstSeq < nextSeq)
+        {
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/%s", wal_dir, names[i]);
+            LOG(LOG_WARN, "[WAL] %s overlaps the log before it (next seq %llu), removed\n", path, (unsigned long long)nextSeq);
+            if (unlink(path) < 0)
+                perror("unlink log segment");
+            free(names[i]);
+            continue;
+        }
+
+        WAL_SEGMENT *seg = segment_recover(firstSeq);
+        if (seg && segments_push(seg) == 0)
+        {
+            // The next segment starts after the last intact record
+            const char *base = seg->map;
+            size_t off = sizeof(WAL_SEGMENT_HEADER), end = atomic_load(&seg->written);
+            uint64_t seq = seg->firstSeq;
+            while (off < end)
+            {
+                off += ((const WAL_RECORD *)(base + off))->size;
+                seq++;
+            }
+            nextSeq = seq;
+        }
+        else if (seg)
+            segment_free(seg, 0);
+        free(names[i]);
+    }
+    free(names);
+
+    atomic_store(&durableSeq, nextSeq - 1);
+    return 0;
+}
+
+// msync() whatever was appended since the last pass, oldest segment first
+static void sync_segments(void)
+{
+    pthread_rwlock_rdlock(&segs_lock);
+    for (size_t i = 0; i < segCount; i++)
+    {
+        WAL_SEGMENT *seg = segs[i];
+        size_t written = atomic_load_explicit(&seg->written, memory_order_acquire);
+        if (written == seg->synced)
+            continue;
+
+        size_t start = seg->synced & ~((size_t)sysconf(_SC_PAGESIZE) - 1);
+        uint64_t t0 = mono_now();
+        if (msync(seg->map + start, written - start, MS_SYNC) < 0)
+            perror("msync log segment");
+
+        // A new file is only durable once its directory entry is
+        if (seg->synced == 0 && fsync(dir_fd) < 0)
+            perror("fsync log directory");
+
+        atomic_fetch_add_explicit(&syncs, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&syncNs, mono_now() - t0, memory_order_relaxed);
+        seg->synced = written;
+    }
+    pthread_rwlock_unlock(&segs_lock);
+}
+
+// Delete the oldest segments while the log is over its limits. The active
+// segment is never deleted.
+static void retain(void)
+{
+    uint64_t now = wall_now();
+    size_t victims = 0;
+
+    pthread_rwlock_rdlock(&segs_lock);
+    {
+        long long total = 0;
+        for (size_t i = 0; i < segCount; i++)
+            total += (long long)segs[i]->size;
+
+        while (victims + 1 < segCount)
+        {
+            WAL_SEGMENT *seg = segs[victims];
+            int over = wal_retain_bytes > 0 && total > wal_retain_bytes;
+            int old = wal_retain_age > 0 && now - seg->lastTime > (uint64_t)wal_retain_age * 1000000000ULL;
+            if (!over && !old)
+                break;
+            total -= (long long)seg->size;
+            victims++;
+        }
+    }
+    pthread_rwlock_unlock(&segs_lock);
+
+    if (victims == 0)
+        return;
+
+    // Only this thread removes segments, so the victims are still first
+    pthread_rwlock_wrlock(&segs_lock);
+    for (size_t i = 0; i < victims; i++)
+    {
+        LOG(LOG_INFO, "[WAL] Deleting segment %s\n", segs[i]->path);
+        segment_free(segs[i], 1);
+    }
+    memmove(segs, segs + victims, (segCount - victims) * sizeof(WAL_SEGMENT *));
+    segCount -= victims;
+    pthread_rwlock_unlock(&segs_lock);
+}
+
+static void *sync_main(void *arg)
+{
+    (void)arg;
+
+    while (1)
+    {
+        pthread_mutex_lock(&wal_mtx);
+        if (!dirty && !stopping)
+        {
+            // Wake up once a second anyway to apply the age limit
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec++;
+            waiting = 1;
+            pthread_cond_timedwait(&wal_cond, &wal_mtx, &ts);
+            waiting = 0;
+        }
+        int stop = stopping;
+        uint64_t last = nextSeq - 1;
+        dirty = 0;
+        pthread_mutex_unlock(&wal_mtx);
+
+        // Everything appended up to last is in the mappings now, and one
+        // msync() per segment commits all of it
+        sync_segments();
+        atomic_store_explicit(&durableSeq, last, memory_order_release);
+        retain();
+
+        if (stop)
+            break;
+
+        // Appends arriving meanwhile are committed together by the next pass
+        if (wal_sync_ms)
+        {
+            struct timespec delay = { wal_sync_ms / 1000, (long)(wal_sync_ms % 1000) * 1000000L };
+            nanosleep(&delay, NULL);
+        }
+    }
+
+    return NULL;
+}
+
+int wal_open(const char *dir)
+{
+    if (strlen(dir) >= sizeof(wal_dir))
+    {
+        fprintf(stderr, "Log directory path too long: %s\n", dir);
+        return -1;
+    }
+    strcpy(wal_dir, dir);
+    crc_init();
+
+    if (mkdir(wal_dir, 0755) < 0 && errno != EEXIST)
+    {
+        perror("mkdir log");
+        return -1;
+    }
+    dir_fd = open(wal_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0)
+    {
+        perror("open log directory");
+        return -1;
+    }
+
+    stopping = 0;
+    if (recover() < 0)
+        return -1;
+    size_t recovered = segCount;
+
+    pthread_mutex_lock(&wal_mtx);
+    WAL_SEGMENT *seg = roll();
+    pthread_mutex_unlock(&wal_mtx);
+    if (seg == NULL)
+        return -1;
+
+    if (pthread_create(&sync_thread, NULL, sync_main, NULL) != 0)
+    {
+        perror("pthread_create log sync");
+        return -1;
+    }
+
+    enabled = 1;
+    LOG(LOG_INFO, "[INFO] Message log in %s: %zu segments recovered, next sequence number %llu\n",
+        wal_dir, recovered, (unsigned long long)nextSeq);
+    return 0;
+}
+
+int wal_enabled(void)
+{
+    return enabled;
+}
+
+uint64_t wal_append(const char *topic, size_t topicLen, const char *payload, size_t payloadLen)
+{
+    size_t size = record_size(topicLen, payloadLen);
+    if (size > wal_segment_bytes - sizeof(WAL_SEGMENT_HEADER))
+    {
+        atomic_fetch_add_explicit(&failed, 1, memory_order_relaxed);
+        return 0;
+    }
+
+    uint32_t dataCrc = crc_update(crc_update(0, topic, topicLen), payload, payloadLen);
+    uint64_t now = wall_now();
+
+    pthread_mutex_lock(&wal_mtx);
+
+    WAL_SEGMENT *seg = active;
+    size_t off = atomic_load_explicit(&seg->written, memory_order_relaxed);
+    if (off + size > seg->size)
+    {
+        // The zeroed rest of the full segment reads as its end
+        if ((seg = roll()) == NULL)
+        {
+            pthread_mutex_unlock(&wal_mtx);
+            atomic_fetch_add_explicit(&failed, 1, memory_order_relaxed);
+            return 0;
+        }
+        off = atomic_load_explicit(&seg->written, memory_order_relaxed);
+    }
+
+    uint64_t seq = nextSeq++;
+
+    WAL_RECORD *rec = (WAL_RECORD *)(seg->map + off);
+    char *data = (char *)(rec + 1);
+    memcpy(data, topic, topicLen);
+    memcpy(data + topicLen, payload, payloadLen);
+    rec->seq = seq;
+    rec->time = now;
+    rec->topicLen = (uint32_t)topicLen;
+    rec->payloadLen = (uint32_t)payloadLen;
+    rec->crc = record_crc(dataCrc, rec);
+    rec->size = (uint32_t)size;
+
+    seg->lastTime = now;
+    atomic_store_explicit(&seg->written, off + size, memory_order_release);
+
+    dirty = 1;
+    if (waiting)
+    {
+        waiting = 0;
+        pthread_cond_signal(&wal_cond);
+    }
+
+    pthread_mutex_unlock(&wal_mtx);
+    return seq;
+}
+
+size_t wal_replay(uint64_t from, const char *topic, size_t topicLen, void (*fn)(const WAL_ENTRY *entry, void *arg), void *arg)
+{
+    size_t n = 0;
+
+    pthread_rwlock_rdlock(&segs_lock);
+    for (size_t i = 0; i < segCount; i++)
+    {
+        // Skip segments that end before from
+        if (i + 1 < segCount && segs[i + 1]->firstSeq <= from)
+            continue;
+
+        WAL_SEGMENT *seg = segs[i];
+        size_t end = atomic_load_explicit(&seg->written, memory_order_acquire);
+        size_t off = sizeof(WAL_SEGMENT_HEADER);
+
+        while (off < end)
+        {
+            const WAL_RECORD *rec = (const WAL_RECORD *)(seg->map + off);
+            const char *data = (const char *)(rec + 1);
+
+            if (rec->seq >= from && rec->topicLen == topicLen && memcmp(data, topic, topicLen) == 0)
+            {
+                WAL_ENTRY e;
+                e.seq = rec->seq;
+                e.time = rec->time;
+                e.topic = data;
+                e.topicLen = rec->topicLen;
+                e.payload = data + rec->topicLen;
+                e.payloadLen = rec->payloadLen;
+                fn(&e, arg);
+                n++;
+            }
+            off += rec->size;
+        }
+    }
+    pthread_rwlock_unlock(&segs_lock);
+
+    return n;
+}
+
+void wal_stats(WAL_STATS *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+
+    pthread_mutex_lock(&wal_mtx);
+    stats->nextSeq = nextSeq;
+    pthread_mutex_unlock(&wal_mtx);
+
+    pthread_rwlock_rdlock(&segs_lock);
+    stats->segments = segCount;
+    for (size_t i = 0; i < segCount; i++)
+        stats->bytes += segs[i]->size;
+    stats->firstSeq = segCount ? segs[0]->firstSeq : stats->nextSeq;
+    pthread_rwlock_unlock(&segs_lock);
+
+    stats->durableSeq = atomic_load_explicit(&durableSeq, memory_order_acquire);
+    stats->syncs = atomic_load_explicit(&syncs, memory_order_relaxed);
+    stats->syncNs = atomic_load_explicit(&syncNs, memory_order_relaxed);
+    stats->failed = atomic_load_explicit(&failed, memory_order_relaxed);
+}
+
+void wal_close(void)
+{
+    if (!enabled)
+        return;
+    enabled = 0;
+
+    pthread_mutex_lock(&wal_mtx);
+    stopping = 1;
+    pthread_cond_signal(&wal_cond);
+    pthread_mutex_unlock(&wal_mtx);
+    pthread_join(sync_thread, NULL);
+
+    pthread_rwlock_wrlock(&segs_lock);
+    for (size_t i = 0; i < segCount; i++)
+        segment_free(segs[i], 0);
+    free(segs);
+    segs = NULL;
+    segCount = segCap = 0;
+    active = NULL;
+    pthread_rwlock_unlock(&segs_lock);
+
+    close(dir_fd);
+    dir_fd = -1;
+}
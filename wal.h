@@ -0,0 +1,95 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Durable message log (--wal DIR).
+//
+// Every published message gets a global sequence number and is appended to
+// the current segment, a fixed-size file in DIR named after the sequence
+// number of its first record. Segments are mapped with mmap(): appends are
+// a memcpy() into the mapping, so a message is in the page cache, and
+// survives a crash of the server process, as soon as wal_append() returns.
+// A background thread makes it durable against a machine crash: it waits
+// for appends, msync()s everything appended since its last pass in one go
+// (group commit) and then sleeps at least --wal-sync-ms before the next.
+//
+// Old segments are deleted once the log is over --wal-retain-bytes or their
+// newest record is older than --wal-retain-age seconds. On startup the
+// segments left in DIR are checked record by record (a torn record ends a
+// segment) and numbering resumes after the last intact one.
+//
+// Segment layout: a WAL_SEGMENT_HEADER, then records, each a WAL_RECORD
+// followed by the topic and the payload, padded to 8 bytes. A record size
+// of 0 ends the segment.
+
+#define WAL_MAGIC                   "PSWAL01"
+#define DEFAULT_WAL_SEGMENT_BYTES   (64 * 1024 * 1024)
+#define DEFAULT_WAL_RETAIN_BYTES    (1024LL * 1024 * 1024)
+#define DEFAULT_WAL_SYNC_MS         5
+
+typedef struct walSegmentHeader_st {
+    char magic[8];
+    uint64_t firstSeq;
+    uint64_t created;           // CLOCK_REALTIME ns
+    uint64_t size;              // file size when it was created
+} WAL_SEGMENT_HEADER;
+
+typedef struct walRecord_st {
+    uint32_t size;              // whole record including padding, 0 at the end
+    uint32_t crc;               // CRC-32C of the rest of the record
+    uint64_t seq;
+    uint64_t time;              // CLOCK_REALTIME ns of the append
+    uint32_t topicLen;
+    uint32_t payloadLen;
+} WAL_RECORD;
+
+// A logged message as handed to wal_replay() callbacks. The pointers are
+// only valid during the call.
+typedef struct walEntry_st {
+    uint64_t seq;
+    uint64_t time;
+    const char *topic;
+    size_t topicLen;
+    const char *payload;
+    size_t payloadLen;
+} WAL_ENTRY;
+
+typedef struct walStats_st {
+    size_t segments;
+    size_t bytes;               // on disk, all segments
+    uint64_t firstSeq;          // oldest retained record
+    uint64_t nextSeq;           // number the next append gets
+    uint64_t durableSeq;        // every record up to here is synced
+    unsigned long long syncs;
+    unsigned long long syncNs;  // total time spent in msync()
+    unsigned long long failed;  // appends that could not be logged
+} WAL_STATS;
+
+extern size_t wal_segment_bytes;
+extern long long wal_retain_bytes;
+extern unsigned wal_retain_age;     // seconds, 0 for no age limit
+extern unsigned wal_sync_ms;
+
+// Open (or create) the log in dir and start the sync thread
+int wal_open(const char *dir);
+int wal_enabled(void);
+
+// Log one message. Returns its sequence number, 0 if it could not be
+// logged. Sequence numbers start at 1 and grow by one per message.
+uint64_t wal_append(const char *topic, size_t topicLen, const char *payload, size_t payloadLen);
+
+// Call fn for every logged message of the topic numbered from or higher,
+// oldest first. Returns the number of messages visited.
+// Segments that end before from are skipped whole, but the rest is read
+// record by record, every topic's records, with the segment list locked
+// shared: a replay from far back costs up to --wal-retain-bytes of reading.
+size_t wal_replay(uint64_t from, const char *topic, size_t topicLen, void (*fn)(const WAL_ENTRY *entry, void *arg), void *arg);
+
+void wal_stats(WAL_STATS *stats);
+
+// Sync everything and stop the sync thread
+void wal_close(void);
+
+#endif // WAL_H
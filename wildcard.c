@@ -0,0 +1,244 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "wildcard.h"
+#include "slab.h"
+
+#define EDGE_TABLE_MIN  64
+
+static SLAB_CACHE nodeCache = SLAB_CACHE_INIT("wildcard node", sizeof(WILDCARD_NODE));
+
+// FNV-1a over one level, seeded with the parent node so the same level
+// under different parents lands in different slots
+static uint64_t edge_hash(const WILDCARD_NODE *parent, const char *level, size_t len)
+{
+    uint64_t h = 14695981039346656037ULL ^ ((uint64_t)(uintptr_t)parent * 0x9E3779B97F4A7C15ULL);
+    for (size_t i = 0; i < len; i++)
+    {
+        h ^= (unsigned char)level[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+int wildcard_init(WILDCARD_TRIE *trie)
+{
+    if (pthread_rwlock_init(&trie->lock, NULL) != 0)
+    {
+        perror("pthread_rwlock_init wildcard trie");
+        return -1;
+    }
+
+    memset(&trie->root, 0, sizeof(trie->root));
+    trie->nodes = NULL;
+    trie->edges = NULL;
+    trie->edgeCount = 0;
+    trie->edgeSize = 0;
+    atomic_init(&trie->patterns, 0);
+    atomic_init(&trie->generation, 1);
+    return 0;
+}
+
+static void free_node(WILDCARD_NODE *node)
+{
+    free(node->level);
+    slab_free(&nodeCache, node);
+}
+
+void wildcard_destroy(WILDCARD_TRIE *trie)
+{
+    while (trie->nodes)
+    {
+        WILDCARD_NODE *node = trie->nodes;
+        trie->nodes = node->nextNode;
+        free_node(node);
+    }
+
+    free(trie->edges);
+    trie->edges = NULL;
+    trie->edgeCount = 0;
+    trie->edgeSize = 0;
+    pthread_rwlock_destroy(&trie->lock);
+}
+
+static WILDCARD_NODE* edge_find(WILDCARD_TRIE *trie, const WILDCARD_NODE *parent, const char *level, size_t len)
+{
+    if (trie->edges == NULL)
+        return NULL;
+
+    uint64_t hash = edge_hash(parent, level, len);
+    size_t mask = trie->edgeSize - 1;
+
+    for (size_t i = (size_t)hash & mask; trie->edges[i] != NULL; i = (i + 1) & mask)
+    {
+        WILDCARD_NODE *node = trie->edges[i];
+        if (node->hash == hash && node->parent == parent && node->levelLen == len && memcmp(node->level, level, len) == 0)
+            return node;
+    }
+    return NULL;
+}
+
+static void edge_insert(WILDCARD_NODE **edges, size_t size, WILDCARD_NODE *node)
+{
+    size_t mask = size - 1;
+    size_t i = (size_t)node->hash & mask;
+
+    while (edges[i] != NULL)
+        i = (i + 1) & mask;
+
+    edges[i] = node;
+}
+
+// Make room for one more edge, keeping the load factor under 3/4.
+// Inserts are rare (one per new pattern level), so the table is rehashed
+// in one go.
+static int edge_reserve(WILDCARD_TRIE *trie)
+{
+    if ((trie->edgeCount + 1) * 4 <= trie->edgeSize * 3)
+        return 0;
+
+    size_t newSize = trie->edgeSize ? trie->edgeSize * 2 : EDGE_TABLE_MIN;
+    WILDCARD_NODE **newEdges = calloc(newSize, sizeof(WILDCARD_NODE *));
+    if (newEdges == NULL)
+    {
+        perror("calloc wildcard edge table");
+        return -1;
+    }
+
+    for (size_t i = 0; i < trie->edgeSize; i++)
+        if (trie->edges[i])
+            edge_insert(newEdges, newSize, trie->edges[i]);
+
+    free(trie->edges);
+    trie->edges = newEdges;
+    trie->edgeSize = newSize;
+    return 0;
+}
+
+static WILDCARD_NODE* create_node(WILDCARD_TRIE *trie, WILDCARD_NODE *parent, const char *level, size_t len)
+{
+    WILDCARD_NODE *node = slab_alloc(&nodeCache);
+    if (node == NULL)
+    {
+        perror("malloc WILDCARD_NODE");
+        return NULL;
+    }
+    memset(node, 0, sizeof(*node));
+    node->parent = parent;
+
+    if (level)
+    {
+        node->level = malloc(len + 1);
+        if (node->level == NULL)
+        {
+            perror("malloc wildcard level");
+            slab_free(&nodeCache, node);
+            return NULL;
+        }
+        memcpy(node->level, level, len);
+        node->level[len] = '\0';
+        node->levelLen = len;
+        node->hash = edge_hash(parent, level, len);
+    }
+
+    node->nextNode = trie->nodes;
+    trie->nodes = node;
+    return node;
+}
+
+// Child of parent for one pattern level, created if missing.
+// Caller holds the write lock.
+static WILDCARD_NODE* child_for(WILDCARD_TRIE *trie, WILDCARD_NODE *parent, const char *level, size_t len)
+{
+    WILDCARD_NODE **slot = NULL;
+    if (len == 1 && level[0] == '+')
+        slot = &parent->plus;
+    else if (len == 1 && level[0] == '#')
+        slot = &parent->multi;
+
+    if (slot)
+    {
+        if (*slot == NULL)
+            *slot = create_node(trie, parent, NULL, 0);
+        return *slot;
+    }
+
+    WILDCARD_NODE *node = edge_find(trie, parent, level, len);
+    if (node)
+        return node;
+
+    if (edge_reserve(trie) < 0)
+        return NULL;
+    node = create_node(trie, parent, level, len);
+    if (node == NULL)
+        return NULL;
+
+    edge_insert(trie->edges, trie->edgeSize, node);
+    trie->edgeCount++;
+    return node;
+}
+
+int wildcard_insert(WILDCARD_TRIE *trie, TOPIC *pattern)
+{
+    int res = 0;
+
+    pthread_rwlock_wrlock(&trie->lock);
+    {
+        WILDCARD_NODE *node = &trie->root;
+        const char *p = pattern->name;
+
+        while (node)
+        {
+            const char *end = strchr(p, '/');
+            size_t len = end ? (size_t)(end - p) : strlen(p);
+
+            node = child_for(trie, node, p, len);
+            if (end == NULL)
+                break;
+            p = end + 1;
+        }
+
+        if (node == NULL)
+            res = -1;
+        else if (node->pattern == NULL)
+        {
+            node->pattern = pattern;
+            atomic_fetch_add(&trie->patterns, 1);
+        }
+    }
+    pthread_rwlock_unlock(&trie->lock);
+
+    return res;
+}
+
+// Match the levels from p on below node. Caller holds the read lock.
+static void match_node(WILDCARD_TRIE *trie, const WILDCARD_NODE *node, const char *p, int atEnd, void (*fn)(TOPIC *pattern, void *arg), void *arg)
+{
+    // '#' also matches no level at all, so "a/#" matches "a"
+    if (node->multi && node->multi->pattern)
+        fn(node->multi->pattern, arg);
+
+    if (atEnd)
+    {
+        if (node->pattern)
+            fn(node->pattern, arg);
+        return;
+    }
+
+    const char *end = strchr(p, '/');
+    size_t len = end ? (size_t)(end - p) : strlen(p);
+    const char *next = end ? end + 1 : p + len;
+
+    WILDCARD_NODE *child = edge_find(trie, node, p, len);
+    if (child)
+        match_node(trie, child, next, end == NULL, fn, arg);
+    if (node->plus)
+        match_node(trie, node->plus, next, end == NULL, fn, arg);
+}
+
+void wildcard_match(WILDCARD_TRIE *trie, const char *name, void (*fn)(TOPIC *pattern, void *arg), void *arg)
+{
+    pthread_rwlock_rdlock(&trie->lock);
+    match_node(trie, &trie->root, name, 0, fn, arg);
+    pthread_rwlock_unlock(&trie->lock);
+}
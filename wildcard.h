@@ -0,0 +1,58 @@
+#ifndef WILDCARD_H
+#define WILDCARD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "list.h"
+
+// Trie of wildcard subscription patterns, one level per '/'-separated part
+// of the name. A concrete topic is matched against it by walking its levels
+// once, following at every node the child with the same literal level, the
+// '+' child and the '#' child, so the cost depends on the topic's depth and
+// not on how many patterns exist.
+//
+// Literal children are found through one hash table keyed by (parent,
+// level) shared by the whole trie. Like topics, nodes are never removed
+// while the server runs; a pattern nobody subscribes to any more simply
+// matches no subscriber.
+
+typedef struct wildcardNode_st {
+    struct wildcardNode_st *parent;
+    char *level;                    // literal level, NULL for '+', '#' and the root
+    size_t levelLen;
+    uint64_t hash;                  // of (parent, level), for the edge table
+
+    struct wildcardNode_st *plus;   // '+' child
+    struct wildcardNode_st *multi;  // '#' child, always a leaf
+    TOPIC *pattern;                 // pattern topic ending here, or NULL
+    struct wildcardNode_st *nextNode;   // every node, for destroy
+} WILDCARD_NODE;
+
+typedef struct wildcardTrie_st {
+    pthread_rwlock_t lock;          // inserts exclusive, matches shared
+    WILDCARD_NODE root;
+    WILDCARD_NODE *nodes;
+
+    WILDCARD_NODE **edges;          // literal children, open addressing
+    size_t edgeCount;
+    size_t edgeSize;                // power of two
+
+    atomic_size_t patterns;         // pattern topics in the trie
+
+    // Bumped after every subscription change of a pattern topic. Cached
+    // subscriber sets built under an older generation are stale.
+    atomic_ullong generation;
+} WILDCARD_TRIE;
+
+int wildcard_init(WILDCARD_TRIE *trie);
+void wildcard_destroy(WILDCARD_TRIE *trie);
+
+// Add a pattern topic. Adding the same pattern again is a no-op.
+int wildcard_insert(WILDCARD_TRIE *trie, TOPIC *pattern);
+
+// Call fn for every pattern topic matching the concrete topic name
+void wildcard_match(WILDCARD_TRIE *trie, const char *name, void (*fn)(TOPIC *pattern, void *arg), void *arg);
+
+#endif // WILDCARD_H